@@ -0,0 +1,109 @@
+/*
+ * Colour-aware frame kernels, for every format of the element's caps.
+ * Arguments are bound by name: format is one of the FORMAT_* codes below,
+ * offset1/stride1 and offset2/stride2 locate the second and third planes
+ * in bytes from frame (the interleaved UV plane of NV12 and P010, the U
+ * and V planes of I420). Work-items cover width x height pixels; with
+ * 4:2:0 chroma the item at the top left of each 2x2 block handles its
+ * chroma sample, the luma plane is left as is.
+ *
+ * A build specialized for the caps defines WIDTH, HEIGHT and STRIDE; the
+ * kernels then use the constants instead of their arguments.
+ */
+
+#define FORMAT_NV12 0
+#define FORMAT_I420 1
+#define FORMAT_P010 2 /* 10 bits in the high bits of 16 */
+#define FORMAT_RGBA 3
+#define FORMAT_BGRX 4
+
+/* Move the colour of pixel (x, y) towards its gray by s: 0 gray, 1 as is. */
+void color_scale(__global uchar *frame, int format, int x, int y, int stride,
+                 int offset1, int stride1, int offset2, int stride2, float s)
+{
+    if (format == FORMAT_RGBA || format == FORMAT_BGRX) {
+        __global uchar *p = frame + y * stride + x * 4;
+        float3 c = convert_float3(vload3(0, p));
+        float gray = dot(c, format == FORMAT_RGBA
+                            ? (float3)(0.299f, 0.587f, 0.114f)
+                            : (float3)(0.114f, 0.587f, 0.299f));
+
+        vstore3(convert_uchar3_sat_rte(gray + (c - gray) * s), 0, p);
+        return;
+    }
+
+    if ((x | y) & 1)
+        return;
+    x /= 2;
+    y /= 2;
+
+    if (format == FORMAT_P010) {
+        __global ushort *uv = (__global ushort *)(frame + offset1 + y * stride1) + x * 2;
+        float2 c = convert_float2(vload2(0, uv)) - 32768.0f;
+
+        vstore2(convert_ushort2_sat_rte(c * s + 32768.0f) & (ushort2)(0xffc0), 0, uv);
+    } else if (format == FORMAT_NV12) {
+        __global uchar *uv = frame + offset1 + y * stride1 + x * 2;
+        float2 c = convert_float2(vload2(0, uv)) - 128.0f;
+
+        vstore2(convert_uchar2_sat_rte(c * s + 128.0f), 0, uv);
+    } else {
+        __global uchar *u = frame + offset1 + y * stride1 + x;
+        __global uchar *v = frame + offset2 + y * stride2 + x;
+
+        *u = convert_uchar_sat_rte((*u - 128.0f) * s + 128.0f);
+        *v = convert_uchar_sat_rte((*v - 128.0f) * s + 128.0f);
+    }
+}
+
+__kernel void color_grayscale(__global uchar *frame,
+                              int format,
+                              int width,
+                              int height,
+                              int stride,
+                              int offset1,
+                              int stride1,
+                              int offset2,
+                              int stride2)
+{
+#ifdef WIDTH
+    width = WIDTH;
+    height = HEIGHT;
+    stride = STRIDE;
+#endif
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+
+    if (x >= width || y >= height)
+        return;
+
+    color_scale(frame, format, x, y, stride,
+                offset1, stride1, offset2, stride2, 0.0f);
+}
+
+/* saturation comes from kernel-args, e.g. kernel-args="args, saturation=1.5". */
+__kernel void color_saturation(__global uchar *frame,
+                               int format,
+                               int width,
+                               int height,
+                               int stride,
+                               int offset1,
+                               int stride1,
+                               int offset2,
+                               int stride2,
+                               float saturation)
+{
+#ifdef WIDTH
+    width = WIDTH;
+    height = HEIGHT;
+    stride = STRIDE;
+#endif
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+
+    if (x >= width || y >= height)
+        return;
+
+    color_scale(frame, format, x, y, stride,
+                offset1, stride1, offset2, stride2, saturation);
+}
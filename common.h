@@ -1,12 +1,43 @@
-__constant float2 OPTICAL_CENTER = {U0, V0};
-__constant float2 FOCAL_LENGTH = {FU, FV};
-__constant float2 MAX_SRC_COORDINATE = {(float)(SRC_COLS - 1), (float)(SRC_ROWS - 1)};
+/*
+ * Camera models for OpenCL kernels, prepended to their source. Build
+ * options describe the source camera: FU, FV, U0, V0, SRC_COLS, SRC_ROWS
+ * and DOUBLE_SPHERE (XI, ALPHA, ONE_MINUS_ALPHA, ONE_MINUS_ALPHA_TIMES_XI)
+ * or EXTENDED_UNIFIED (ALPHA, ONE_MINUS_ALPHA, SQRT_BETA). YUV selects the
+ * interpolate() of 2-byte interleaved pixels, else 8-bit grayscale.
+ *
+ * Without FU only the model is a build option and camera_project() takes
+ * the source camera as arguments: intrinsics (u0, v0, fu, fv) and model
+ * (ALPHA, ONE_MINUS_ALPHA, XI, ONE_MINUS_ALPHA_TIMES_XI) for DOUBLE_SPHERE,
+ * (ALPHA, ONE_MINUS_ALPHA, SQRT_BETA, 0) for EXTENDED_UNIFIED.
+ */
+
+#ifdef DOUBLE_SPHERE
+inline float camera_kappa(const float4 model, const float3 pcam) {
+  const float d1 = length(pcam);
+  const float3 p = (float3)(pcam.xy, pcam.z + model.z * d1);
+  return model.x * length(p) + model.w * d1 + model.y * pcam.z;
+}
+#elif defined EXTENDED_UNIFIED
+inline float camera_kappa(const float4 model, const float3 pcam) {
+  const float3 p = (float3)(pcam.xy * model.z, pcam.z);
+  return model.x * length(p) + model.y * pcam.z;
+}
+#endif
+
+inline float2 camera_project(const float4 intrinsics, const float4 model, const float3 pcam) {
+  return intrinsics.xy + intrinsics.zw * pcam.xy / camera_kappa(model, pcam);
+}
 
 inline float3 unproject(const float4 params, const float2 p_pix) {
   const float2 m = (p_pix - /*(U0, V0) = */ params.xy) / /*(FU, FV)*/ params.zw;
   return (float3)(m, 1.0f);
 }
 
+#ifdef FU
+__constant float2 OPTICAL_CENTER = {U0, V0};
+__constant float2 FOCAL_LENGTH = {FU, FV};
+__constant float2 MAX_SRC_COORDINATE = {(float)(SRC_COLS - 1), (float)(SRC_ROWS - 1)};
+
 #ifdef DOUBLE_SPHERE
 inline float d2_(const float d1, float3 pcam) {
   pcam.z += XI * d1;
@@ -84,11 +115,14 @@ inline float2 interpolate(__global uchar* image, __global float* weights_in, flo
   const float2 xy_floor = floor(xy);
   const int2 xy_floor_i = {(int)xy_floor.x, (int)xy_floor.y};
 
+  const int offset_t = xy_floor_i.y * SRC_COLS + xy_floor_i.x;
+  const int offset_b = offset_t + SRC_COLS;
+
   const float2 alpha_beta = xy - xy_floor;
 
   // Load top and bottom values (2 at once).
-  const uchar2 tu = vload2(0, image + xy_floor_i.y * SRC_COLS + xy_floor_i.x);
-  const uchar2 bu = vload2(0, image + (xy_floor_i.y + 1) * SRC_COLS + xy_floor_i.x);
+  const uchar2 tu = vload2(0, image + offset_t);
+  const uchar2 bu = vload2(0, image + offset_b);
 
   const float2 tw = vload2(0, weights_in + offset_t);
   const float2 bw = vload2(0, weights_in + offset_b);
@@ -102,8 +136,9 @@ inline float2 interpolate(__global uchar* image, __global float* weights_in, flo
     alpha_times_beta * (b.y - b.x - t.y + t.x) + alpha_beta.y * (b.x - t.x) +
         alpha_beta.x * (t.y - t.x) + t.x,
     alpha_times_beta * (bw.y - bw.x - tw.y + tw.x) + alpha_beta.y * (bw.x - tw.x) +
-        alpha_beta.x * (tw.y - tw.x) + tw.x;
+        alpha_beta.x * (tw.y - tw.x) + tw.x};
   return ret_val;
 }
 #endif
+#endif  // FU
 
@@ -0,0 +1,391 @@
+/*
+ * Neighbourhood filters as separable horizontal + vertical passes, for
+ * the NV12 luma plane (luma_*) and RGBA images (rgba_*).
+ *
+ * A filter K is the kernel pair K_h and K_v, both taking
+ *     (img, tmp, width, height, stride, radius, weights, tile, amount)
+ * K_h reads img and writes float sums to tmp, width * height elements of
+ * float2 (luma) or float4 (RGBA); K_v reads tmp and writes the result
+ * back into img. tmp is only ever touched by the two passes, so it stays
+ * on the device. stride is in bytes for luma and in pixels for RGBA.
+ *
+ * Each work-group first loads its tile plus radius columns (K_h) or rows
+ * (K_v) of apron into the __local tile, clamping at the image edges; tile
+ * must hold (local size + 2 * radius) * local size float4. weights are the
+ * 2 * radius + 1 normalised taps of the Gaussian filters.
+ */
+
+/* ---- Tile loading ---- */
+
+/* Row tile of luma: local width + 2 * radius floats per local row. */
+void conv_load_row_luma(__global const uchar *img, __local float *tile,
+                        int width, int height, int stride, int radius)
+{
+    int lw = get_local_size(0);
+    int tw = lw + 2 * radius;
+    int x0 = (int)get_group_id(0) * lw - radius;
+    int y = min((int)get_global_id(1), height - 1);
+    __local float *row = tile + get_local_id(1) * tw;
+
+    for (int i = get_local_id(0); i < tw; i += lw)
+        row[i] = img[y * stride + clamp(x0 + i, 0, width - 1)];
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+}
+
+/* Row tile of RGBA pixels as float4. */
+void conv_load_row_rgba(__global const uchar4 *img, __local float4 *tile,
+                        int width, int height, int stride, int radius)
+{
+    int lw = get_local_size(0);
+    int tw = lw + 2 * radius;
+    int x0 = (int)get_group_id(0) * lw - radius;
+    int y = min((int)get_global_id(1), height - 1);
+    __local float4 *row = tile + get_local_id(1) * tw;
+
+    for (int i = get_local_id(0); i < tw; i += lw)
+        row[i] = convert_float4(img[y * stride + clamp(x0 + i, 0, width - 1)]);
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+}
+
+/* Row tile of the luminance of RGBA pixels (Rec. 601 weights). */
+void conv_load_row_gray(__global const uchar4 *img, __local float *tile,
+                        int width, int height, int stride, int radius)
+{
+    int lw = get_local_size(0);
+    int tw = lw + 2 * radius;
+    int x0 = (int)get_group_id(0) * lw - radius;
+    int y = min((int)get_global_id(1), height - 1);
+    __local float *row = tile + get_local_id(1) * tw;
+
+    for (int i = get_local_id(0); i < tw; i += lw) {
+        float4 p = convert_float4(img[y * stride + clamp(x0 + i, 0, width - 1)]);
+
+        row[i] = dot(p.xyz, (float3)(0.299f, 0.587f, 0.114f));
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+}
+
+/*
+ * Column tiles of the intermediate: local height + 2 * radius rows of
+ * local width elements, one loader per element type.
+ */
+#define CONV_LOAD_COL(T)                                                   \
+void conv_load_col_##T(__global const T *tmp, __local T *tile,             \
+                       int width, int height, int radius)                  \
+{                                                                          \
+    int lw = get_local_size(0);                                            \
+    int lh = get_local_size(1);                                            \
+    int y0 = (int)get_group_id(1) * lh - radius;                           \
+    int x = min((int)get_global_id(0), width - 1);                         \
+                                                                           \
+    for (int i = get_local_id(1); i < lh + 2 * radius; i += lh)            \
+        tile[i * lw + get_local_id(0)] =                                   \
+            tmp[clamp(y0 + i, 0, height - 1) * width + x];                 \
+                                                                           \
+    barrier(CLK_LOCAL_MEM_FENCE);                                          \
+}
+
+CONV_LOAD_COL(float)
+CONV_LOAD_COL(float2)
+CONV_LOAD_COL(float4)
+
+/* Offset of the work-item's own element in a row or column tile. */
+int conv_row_center(int radius)
+{
+    return get_local_id(1) * (get_local_size(0) + 2 * radius) +
+           get_local_id(0) + radius;
+}
+
+int conv_col_center(int radius)
+{
+    return (get_local_id(1) + radius) * get_local_size(0) + get_local_id(0);
+}
+
+/* ---- Taps, step is 1 along a row tile and the local width along a column ---- */
+
+float conv_gauss(__local const float *p, int step, int radius,
+                 __constant float *weights)
+{
+    float sum = 0.0f;
+
+    for (int k = -radius; k <= radius; k++)
+        sum += weights[k + radius] * p[k * step];
+
+    return sum;
+}
+
+float4 conv_gauss4(__local const float4 *p, int step, int radius,
+                   __constant float *weights)
+{
+    float4 sum = 0.0f;
+
+    for (int k = -radius; k <= radius; k++)
+        sum += weights[k + radius] * p[k * step];
+
+    return sum;
+}
+
+float conv_box(__local const float *p, int step, int radius)
+{
+    float sum = 0.0f;
+
+    for (int k = -radius; k <= radius; k++)
+        sum += p[k * step];
+
+    return sum / (2 * radius + 1);
+}
+
+float4 conv_box4(__local const float4 *p, int step, int radius)
+{
+    float4 sum = 0.0f;
+
+    for (int k = -radius; k <= radius; k++)
+        sum += p[k * step];
+
+    return sum / (float)(2 * radius + 1);
+}
+
+/* Sobel first pass: (1 2 1 smoothing, -1 0 1 derivative) along a row. */
+float2 conv_sobel_row(__local const float *p)
+{
+    return (float2)(p[-1] + 2.0f * p[0] + p[1], p[1] - p[-1]);
+}
+
+/* Gradient magnitude from a column of first pass results. */
+float conv_sobel_col(__local const float2 *p, int step)
+{
+    float gx = p[-step].y + 2.0f * p[0].y + p[step].y;
+    float gy = p[step].x - p[-step].x;
+
+    return min(sqrt(gx * gx + gy * gy), 255.0f);
+}
+
+/* ---- NV12 luma ---- */
+
+#define CONV_ARGS                                                          \
+    int width, int height, int stride, int radius,                         \
+    __constant float *weights, __local float *tile, float amount
+
+__kernel void luma_gaussian_h(__global uchar *img, __global float *tmp, CONV_ARGS)
+{
+    int x = get_global_id(0), y = get_global_id(1);
+
+    conv_load_row_luma(img, tile, width, height, stride, radius);
+    if (x >= width || y >= height)
+        return;
+
+    tmp[y * width + x] = conv_gauss(tile + conv_row_center(radius), 1,
+                                    radius, weights);
+}
+
+__kernel void luma_gaussian_v(__global uchar *img, __global float *tmp, CONV_ARGS)
+{
+    int x = get_global_id(0), y = get_global_id(1);
+
+    conv_load_col_float(tmp, tile, width, height, radius);
+    if (x >= width || y >= height)
+        return;
+
+    img[y * stride + x] = convert_uchar_sat_rte(
+        conv_gauss(tile + conv_col_center(radius), get_local_size(0),
+                   radius, weights));
+}
+
+__kernel void luma_box_h(__global uchar *img, __global float *tmp, CONV_ARGS)
+{
+    int x = get_global_id(0), y = get_global_id(1);
+
+    conv_load_row_luma(img, tile, width, height, stride, radius);
+    if (x >= width || y >= height)
+        return;
+
+    tmp[y * width + x] = conv_box(tile + conv_row_center(radius), 1, radius);
+}
+
+__kernel void luma_box_v(__global uchar *img, __global float *tmp, CONV_ARGS)
+{
+    int x = get_global_id(0), y = get_global_id(1);
+
+    conv_load_col_float(tmp, tile, width, height, radius);
+    if (x >= width || y >= height)
+        return;
+
+    img[y * stride + x] = convert_uchar_sat_rte(
+        conv_box(tile + conv_col_center(radius), get_local_size(0), radius));
+}
+
+/* Unsharp mask: img + amount * (img - gaussian(img)). */
+__kernel void luma_unsharp_h(__global uchar *img, __global float *tmp, CONV_ARGS)
+{
+    int x = get_global_id(0), y = get_global_id(1);
+
+    conv_load_row_luma(img, tile, width, height, stride, radius);
+    if (x >= width || y >= height)
+        return;
+
+    tmp[y * width + x] = conv_gauss(tile + conv_row_center(radius), 1,
+                                    radius, weights);
+}
+
+__kernel void luma_unsharp_v(__global uchar *img, __global float *tmp, CONV_ARGS)
+{
+    int x = get_global_id(0), y = get_global_id(1);
+
+    conv_load_col_float(tmp, tile, width, height, radius);
+    if (x >= width || y >= height)
+        return;
+
+    float blur = conv_gauss(tile + conv_col_center(radius), get_local_size(0),
+                            radius, weights);
+    float v = img[y * stride + x];
+
+    img[y * stride + x] = convert_uchar_sat_rte(v + amount * (v - blur));
+}
+
+/* Sobel gradient magnitude; needs radius >= 1 for its apron. */
+__kernel void luma_sobel_h(__global uchar *img, __global float *tmp, CONV_ARGS)
+{
+    int x = get_global_id(0), y = get_global_id(1);
+
+    conv_load_row_luma(img, tile, width, height, stride, radius);
+    if (x >= width || y >= height)
+        return;
+
+    ((__global float2 *)tmp)[y * width + x] =
+        conv_sobel_row(tile + conv_row_center(radius));
+}
+
+__kernel void luma_sobel_v(__global uchar *img, __global float *tmp, CONV_ARGS)
+{
+    __local float2 *tile2 = (__local float2 *)tile;
+    int x = get_global_id(0), y = get_global_id(1);
+
+    conv_load_col_float2((__global const float2 *)tmp, tile2,
+                         width, height, radius);
+    if (x >= width || y >= height)
+        return;
+
+    img[y * stride + x] = convert_uchar_sat_rte(
+        conv_sobel_col(tile2 + conv_col_center(radius), get_local_size(0)));
+}
+
+/* ---- RGBA, alpha is filtered like the colour channels ---- */
+
+__kernel void rgba_gaussian_h(__global uchar4 *img, __global float *tmp, CONV_ARGS)
+{
+    __local float4 *tile4 = (__local float4 *)tile;
+    int x = get_global_id(0), y = get_global_id(1);
+
+    conv_load_row_rgba(img, tile4, width, height, stride, radius);
+    if (x >= width || y >= height)
+        return;
+
+    vstore4(conv_gauss4(tile4 + conv_row_center(radius), 1, radius, weights),
+            y * width + x, tmp);
+}
+
+__kernel void rgba_gaussian_v(__global uchar4 *img, __global float *tmp, CONV_ARGS)
+{
+    __local float4 *tile4 = (__local float4 *)tile;
+    int x = get_global_id(0), y = get_global_id(1);
+
+    conv_load_col_float4((__global const float4 *)tmp, tile4,
+                         width, height, radius);
+    if (x >= width || y >= height)
+        return;
+
+    img[y * stride + x] = convert_uchar4_sat_rte(
+        conv_gauss4(tile4 + conv_col_center(radius), get_local_size(0),
+                    radius, weights));
+}
+
+__kernel void rgba_box_h(__global uchar4 *img, __global float *tmp, CONV_ARGS)
+{
+    __local float4 *tile4 = (__local float4 *)tile;
+    int x = get_global_id(0), y = get_global_id(1);
+
+    conv_load_row_rgba(img, tile4, width, height, stride, radius);
+    if (x >= width || y >= height)
+        return;
+
+    vstore4(conv_box4(tile4 + conv_row_center(radius), 1, radius),
+            y * width + x, tmp);
+}
+
+__kernel void rgba_box_v(__global uchar4 *img, __global float *tmp, CONV_ARGS)
+{
+    __local float4 *tile4 = (__local float4 *)tile;
+    int x = get_global_id(0), y = get_global_id(1);
+
+    conv_load_col_float4((__global const float4 *)tmp, tile4,
+                         width, height, radius);
+    if (x >= width || y >= height)
+        return;
+
+    img[y * stride + x] = convert_uchar4_sat_rte(
+        conv_box4(tile4 + conv_col_center(radius), get_local_size(0), radius));
+}
+
+__kernel void rgba_unsharp_h(__global uchar4 *img, __global float *tmp, CONV_ARGS)
+{
+    __local float4 *tile4 = (__local float4 *)tile;
+    int x = get_global_id(0), y = get_global_id(1);
+
+    conv_load_row_rgba(img, tile4, width, height, stride, radius);
+    if (x >= width || y >= height)
+        return;
+
+    vstore4(conv_gauss4(tile4 + conv_row_center(radius), 1, radius, weights),
+            y * width + x, tmp);
+}
+
+__kernel void rgba_unsharp_v(__global uchar4 *img, __global float *tmp, CONV_ARGS)
+{
+    __local float4 *tile4 = (__local float4 *)tile;
+    int x = get_global_id(0), y = get_global_id(1);
+
+    conv_load_col_float4((__global const float4 *)tmp, tile4,
+                         width, height, radius);
+    if (x >= width || y >= height)
+        return;
+
+    float4 blur = conv_gauss4(tile4 + conv_col_center(radius), get_local_size(0),
+                              radius, weights);
+    float4 v = convert_float4(img[y * stride + x]);
+    uchar4 out = convert_uchar4_sat_rte(v + amount * (v - blur));
+
+    out.w = img[y * stride + x].w;
+    img[y * stride + x] = out;
+}
+
+/* Sobel on the luminance, written as gray with the alpha kept. */
+__kernel void rgba_sobel_h(__global uchar4 *img, __global float *tmp, CONV_ARGS)
+{
+    int x = get_global_id(0), y = get_global_id(1);
+
+    conv_load_row_gray(img, tile, width, height, stride, radius);
+    if (x >= width || y >= height)
+        return;
+
+    ((__global float2 *)tmp)[y * width + x] =
+        conv_sobel_row(tile + conv_row_center(radius));
+}
+
+__kernel void rgba_sobel_v(__global uchar4 *img, __global float *tmp, CONV_ARGS)
+{
+    __local float2 *tile2 = (__local float2 *)tile;
+    int x = get_global_id(0), y = get_global_id(1);
+
+    conv_load_col_float2((__global const float2 *)tmp, tile2,
+                         width, height, radius);
+    if (x >= width || y >= height)
+        return;
+
+    uchar m = convert_uchar_sat_rte(
+        conv_sobel_col(tile2 + conv_col_center(radius), get_local_size(0)));
+
+    img[y * stride + x] = (uchar4)(m, m, m, img[y * stride + x].w);
+}
@@ -1,3 +1,46 @@
+/*
+ * Point-wise RGBA ops. A kernel K with a matching
+ *     uchar4 K_px(uchar4 p, int x, int y, int width)
+ * can be applied while another kernel writes the pixel, e.g. fused into
+ * the YCbCr conversion of ycbcr.cl with -DFILTER_PX=K_px.
+ */
+
+uchar4 devide_by_two_px(uchar4 p, int x, int y, int width)
+{
+    if (x < width / 2)
+        p.xyz >>= (uchar3)(1);
+
+    return p;
+}
+
+uchar4 grayscale_px(uchar4 p, int x, int y, int width)
+{
+    uchar gray = (uchar)(
+        0.299f * p.x +
+        0.587f * p.y +
+        0.114f * p.z
+    );
+
+    p.xyz = (uchar3)(gray);
+
+    return p;
+}
+
+uchar4 invert_colors_px(uchar4 p, int x, int y, int width)
+{
+    p.xyz = (uchar3)(255) - p.xyz;
+
+    return p;
+}
+
+uchar4 left_half_grayscale_px(uchar4 p, int x, int y, int width)
+{
+    if (x < width / 2)
+        p.xyz = (uchar3)((p.x + p.y + p.z) / 3);
+
+    return p;
+}
+
 __kernel void devide_by_two(__global uchar4 *img,
                             int width,
                             int total_pixels)
@@ -93,4 +136,76 @@ __kernel void left_half_grayscale(__global uchar4 *img,
 
         img[id] = p;
     }
-}
\ No newline at end of file
+}
+
+/*
+ * Row-based variants: a work-item handles 4 RGBA pixels (16 bytes) of row
+ * get_global_id(1) with vload16/vstore16, so there is no id % width. Rows
+ * are width * 4 bytes apart; a partial group at the end of the half is
+ * done one pixel at a time. Launch on (ceil(width / 4), height).
+ */
+__kernel void devide_by_two_v16(__global uchar *img,
+                                int width,
+                                int height)
+{
+    int x = get_global_id(0) * 4;
+    int y = get_global_id(1);
+    int half = width / 2;
+
+    if (y >= height || x >= half)
+        return;
+
+    __global uchar *row = img + (size_t)y * width * 4;
+
+    if (x + 4 <= half) {
+        uchar16 p = vload16(0, row + x * 4);
+        uchar16 h = p >> (uchar16)(1);
+
+        h.s37bf = p.s37bf; /* alpha */
+        vstore16(h, 0, row + x * 4);
+        return;
+    }
+
+    for (; x < half; x++) {
+        uchar4 p = vload4(x, row);
+
+        p.xyz >>= (uchar3)(1);
+        vstore4(p, x, row);
+    }
+}
+
+__kernel void left_half_grayscale_v16(__global uchar *img,
+                                      int width,
+                                      int height)
+{
+    int x = get_global_id(0) * 4;
+    int y = get_global_id(1);
+    int half = width / 2;
+
+    if (y >= height || x >= half)
+        return;
+
+    __global uchar *row = img + (size_t)y * width * 4;
+
+    if (x + 4 <= half) {
+        uchar16 p = vload16(0, row + x * 4);
+        ushort4 sum = convert_ushort4(p.s048c) +
+                      convert_ushort4(p.s159d) +
+                      convert_ushort4(p.s26ae);
+        uchar4 gray = convert_uchar4(sum / (ushort4)(3));
+
+        p.s048c = gray;
+        p.s159d = gray;
+        p.s26ae = gray;
+        vstore16(p, 0, row + x * 4);
+        return;
+    }
+
+    for (; x < half; x++) {
+        uchar4 p = vload4(x, row);
+        uchar gray = (p.x + p.y + p.z) / 3;
+
+        p.xyz = (uchar3)(gray);
+        vstore4(p, x, row);
+    }
+}
@@ -0,0 +1,995 @@
+/*
+ * gst-oscaroclremap.c
+ *
+ * Fisheye undistortion GstVideoFilter on the camera models of common.h
+ * Accepts NV12 and I420 video/x-raw, output has the input size
+ *
+ * The source coordinate of every output pixel is computed once per caps
+ * (or camera change) into a LUT resident on the device; frames then only
+ * run the bilinear gather of remap.cl. Built into the oscaroclshader
+ * plugin, with gstoclcontext.c.
+ *
+ */
+
+#define CL_TARGET_OPENCL_VERSION 300 // Targets OpenCL 3.0
+
+#include <gst/gst.h>
+#include <gst/video/gstvideofilter.h>
+#include <gst/video/video.h>
+#include <CL/cl.h>
+#include <math.h>
+#include <string.h>
+
+#include "gst-oscaroclremap.h"
+#include "gstoclcontext.h"
+
+/* Debug category for GstOCLRemap logging. */
+GST_DEBUG_CATEGORY_STATIC(gst_ocl_remap_debug);
+#define GST_CAT_DEFAULT gst_ocl_remap_debug
+
+/* ================= OBJECT ================= */
+
+typedef struct _GstOCLRemap {
+    GstVideoFilter parent;
+
+    /* OpenCL objects */
+    GstOCLContext *ocl;
+    cl_command_queue queue;
+    cl_program program;
+    cl_kernel lut_kernel;
+    cl_kernel remap_kernel;
+    cl_mem lut; /* float2 source coordinate per output pixel */
+    cl_mem src; /* frames, laid out as the caps */
+    cl_mem dst;
+    gsize buf_size;
+
+    gboolean cl_ready;
+    gboolean dirty;  /* camera changed, LUT to recompute */
+    gboolean failed; /* setup failed, passthrough until a property changes */
+    guint64 frame_count;
+
+    /* Properties, under the object lock */
+    gchar *kernel_file;
+    gchar *cache_dir;
+    GstOCLRemapCamera camera;
+    GstOCLRemapIntrinsics output;
+} GstOCLRemap;
+
+/* Class structure */
+typedef struct _GstOCLRemapClass {
+    GstVideoFilterClass parent_class;
+} GstOCLRemapClass;
+
+/* Properties */
+enum {
+    PROP_0,
+    PROP_KERNEL_FILE,
+    PROP_CACHE_DIR,
+    PROP_OUT_FU,
+    PROP_OUT_FV,
+    PROP_OUT_U0,
+    PROP_OUT_V0,
+    PROP_CAMERA, /* GST_OCL_REMAP_CAMERA_N_PROPS camera properties */
+};
+
+#define DEFAULT_KERNEL_FILE "remap.cl"
+#define DEFAULT_MODEL GST_OCL_REMAP_MODEL_DOUBLE_SPHERE
+#define DEFAULT_XI 0.0
+#define DEFAULT_ALPHA 0.5
+#define DEFAULT_BETA 1.0
+
+GType
+gst_ocl_remap_model_get_type(void)
+{
+    static gsize type = 0;
+    static const GEnumValue values[] = {
+        { GST_OCL_REMAP_MODEL_DOUBLE_SPHERE,
+          "Double sphere (xi, alpha)", "double-sphere" },
+        { GST_OCL_REMAP_MODEL_EXTENDED_UNIFIED,
+          "Extended unified (alpha, beta)", "extended-unified" },
+        { 0, NULL, NULL },
+    };
+
+    if (g_once_init_enter(&type)) {
+        GType t = g_enum_register_static("GstOCLRemapModel", values);
+        g_once_init_leave(&type, t);
+    }
+
+    return type;
+}
+
+G_DEFINE_TYPE(GstOCLRemap, gst_ocl_remap, GST_TYPE_VIDEO_FILTER)
+
+/* 4:2:0 formats of remap_yuv420, in system memory */
+#define OCL_REMAP_CAPS \
+    "video/x-raw, " \
+    "format = (string) { NV12, I420 }, " \
+    "width = (int) [ 2, MAX ], " \
+    "height = (int) [ 2, MAX ], " \
+    "framerate = (fraction) [ 0/1, MAX ]"
+
+static GstStaticPadTemplate sink_template =
+GST_STATIC_PAD_TEMPLATE(
+    "sink",
+    GST_PAD_SINK,
+    GST_PAD_ALWAYS,
+    GST_STATIC_CAPS(OCL_REMAP_CAPS)
+);
+
+static GstStaticPadTemplate src_template =
+GST_STATIC_PAD_TEMPLATE(
+    "src",
+    GST_PAD_SRC,
+    GST_PAD_ALWAYS,
+    GST_STATIC_CAPS(OCL_REMAP_CAPS)
+);
+
+/* ================= HELPERS ================= */
+
+#define CHECK_CL(err, msg) \
+    if ((err) != CL_SUCCESS) { \
+        GST_ERROR_OBJECT(self, "%s failed (%d)", msg, err); \
+        goto error; \
+    }
+
+/* ================= CAMERA ================= */
+
+void
+gst_ocl_remap_camera_init(GstOCLRemapCamera *camera)
+{
+    memset(camera, 0, sizeof(*camera));
+    camera->model = DEFAULT_MODEL;
+    camera->xi = DEFAULT_XI;
+    camera->alpha = DEFAULT_ALPHA;
+    camera->beta = DEFAULT_BETA;
+}
+
+/* Install a double property, 0 meaning derived for the intrinsics. */
+static void
+gst_ocl_remap_install_double(GObjectClass *gclass, guint prop_id,
+                             const gchar *name, const gchar *nick,
+                             const gchar *blurb, gdouble min, gdouble max,
+                             gdouble def)
+{
+    g_object_class_install_property(
+        gclass,
+        prop_id,
+        g_param_spec_double(
+            name, nick, blurb, min, max, def,
+            G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+}
+
+void
+gst_ocl_remap_camera_install(GObjectClass *gclass, guint first_id)
+{
+    g_object_class_install_property(
+        gclass,
+        first_id + GST_OCL_REMAP_CAMERA_PROP_MODEL,
+        g_param_spec_enum(
+            "model",
+            "Camera model",
+            "Projection model of the source camera",
+            GST_TYPE_OCL_REMAP_MODEL,
+            DEFAULT_MODEL,
+            G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    gst_ocl_remap_install_double(gclass, first_id + GST_OCL_REMAP_CAMERA_PROP_FU,
+        "fu", "Focal length u",
+        "Horizontal focal length of the source in pixels (0: width / 4)",
+        0.0, G_MAXDOUBLE, 0.0);
+    gst_ocl_remap_install_double(gclass, first_id + GST_OCL_REMAP_CAMERA_PROP_FV,
+        "fv", "Focal length v",
+        "Vertical focal length of the source in pixels (0: fu)",
+        0.0, G_MAXDOUBLE, 0.0);
+    gst_ocl_remap_install_double(gclass, first_id + GST_OCL_REMAP_CAMERA_PROP_U0,
+        "u0", "Principal point u",
+        "Horizontal optical center of the source in pixels (0: center)",
+        0.0, G_MAXDOUBLE, 0.0);
+    gst_ocl_remap_install_double(gclass, first_id + GST_OCL_REMAP_CAMERA_PROP_V0,
+        "v0", "Principal point v",
+        "Vertical optical center of the source in pixels (0: center)",
+        0.0, G_MAXDOUBLE, 0.0);
+    gst_ocl_remap_install_double(gclass, first_id + GST_OCL_REMAP_CAMERA_PROP_XI,
+        "xi", "Xi",
+        "Distance between the two unit spheres (double-sphere)",
+        -G_MAXDOUBLE, G_MAXDOUBLE, DEFAULT_XI);
+    gst_ocl_remap_install_double(gclass, first_id + GST_OCL_REMAP_CAMERA_PROP_ALPHA,
+        "alpha", "Alpha",
+        "Alpha of the double-sphere or extended unified model",
+        0.0, 1.0, DEFAULT_ALPHA);
+    gst_ocl_remap_install_double(gclass, first_id + GST_OCL_REMAP_CAMERA_PROP_BETA,
+        "beta", "Beta",
+        "Beta of the extended unified model",
+        0.0, G_MAXDOUBLE, DEFAULT_BETA);
+}
+
+gboolean
+gst_ocl_remap_camera_set(GstOCLRemapCamera *camera, guint id,
+                         const GValue *value)
+{
+    switch (id) {
+        case GST_OCL_REMAP_CAMERA_PROP_MODEL:
+            camera->model = g_value_get_enum(value);
+            break;
+        case GST_OCL_REMAP_CAMERA_PROP_FU:
+            camera->k.fu = g_value_get_double(value);
+            break;
+        case GST_OCL_REMAP_CAMERA_PROP_FV:
+            camera->k.fv = g_value_get_double(value);
+            break;
+        case GST_OCL_REMAP_CAMERA_PROP_U0:
+            camera->k.u0 = g_value_get_double(value);
+            break;
+        case GST_OCL_REMAP_CAMERA_PROP_V0:
+            camera->k.v0 = g_value_get_double(value);
+            break;
+        case GST_OCL_REMAP_CAMERA_PROP_XI:
+            camera->xi = g_value_get_double(value);
+            break;
+        case GST_OCL_REMAP_CAMERA_PROP_ALPHA:
+            camera->alpha = g_value_get_double(value);
+            break;
+        case GST_OCL_REMAP_CAMERA_PROP_BETA:
+            camera->beta = g_value_get_double(value);
+            break;
+        default:
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+gboolean
+gst_ocl_remap_camera_get(const GstOCLRemapCamera *camera, guint id,
+                         GValue *value)
+{
+    switch (id) {
+        case GST_OCL_REMAP_CAMERA_PROP_MODEL:
+            g_value_set_enum(value, camera->model);
+            break;
+        case GST_OCL_REMAP_CAMERA_PROP_FU:
+            g_value_set_double(value, camera->k.fu);
+            break;
+        case GST_OCL_REMAP_CAMERA_PROP_FV:
+            g_value_set_double(value, camera->k.fv);
+            break;
+        case GST_OCL_REMAP_CAMERA_PROP_U0:
+            g_value_set_double(value, camera->k.u0);
+            break;
+        case GST_OCL_REMAP_CAMERA_PROP_V0:
+            g_value_set_double(value, camera->k.v0);
+            break;
+        case GST_OCL_REMAP_CAMERA_PROP_XI:
+            g_value_set_double(value, camera->xi);
+            break;
+        case GST_OCL_REMAP_CAMERA_PROP_ALPHA:
+            g_value_set_double(value, camera->alpha);
+            break;
+        case GST_OCL_REMAP_CAMERA_PROP_BETA:
+            g_value_set_double(value, camera->beta);
+            break;
+        default:
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+void
+gst_ocl_remap_derive(GstOCLRemapIntrinsics *k, const GstOCLRemapIntrinsics *from,
+                     gint width, gint height)
+{
+    if (k->u0 == 0.0)
+        k->u0 = from ? from->u0 : (width - 1) / 2.0;
+    if (k->v0 == 0.0)
+        k->v0 = from ? from->v0 : (height - 1) / 2.0;
+    if (k->fu == 0.0)
+        k->fu = from ? from->fu : width / 4.0;
+    if (k->fv == 0.0)
+        k->fv = from ? from->fv : k->fu;
+}
+
+/* Append -Dname=value with a float literal that does not depend on the locale. */
+static void
+gst_ocl_remap_define(GString *options, const gchar *name, gdouble value)
+{
+    gchar buf[G_ASCII_DTOSTR_BUF_SIZE];
+
+    g_ascii_formatd(buf, sizeof(buf), "%.9e", value);
+    g_string_append_printf(options, " -D%s=%sf", name, buf);
+}
+
+void
+gst_ocl_remap_camera_options(GString *options, GstOCLRemapCamera *camera,
+                             gint width, gint height)
+{
+    gst_ocl_remap_derive(&camera->k, NULL, width, height);
+
+    g_string_append_printf(options, " -DSRC_COLS=%d -DSRC_ROWS=%d",
+                           width, height);
+    gst_ocl_remap_define(options, "FU", camera->k.fu);
+    gst_ocl_remap_define(options, "FV", camera->k.fv);
+    gst_ocl_remap_define(options, "U0", camera->k.u0);
+    gst_ocl_remap_define(options, "V0", camera->k.v0);
+    gst_ocl_remap_define(options, "ALPHA", camera->alpha);
+    gst_ocl_remap_define(options, "ONE_MINUS_ALPHA", 1.0 - camera->alpha);
+    if (camera->model == GST_OCL_REMAP_MODEL_DOUBLE_SPHERE) {
+        g_string_append(options, " -DDOUBLE_SPHERE");
+        gst_ocl_remap_define(options, "XI", camera->xi);
+        gst_ocl_remap_define(options, "ONE_MINUS_ALPHA_TIMES_XI",
+                             (1.0 - camera->alpha) * camera->xi);
+    } else {
+        g_string_append(options, " -DEXTENDED_UNIFIED");
+        gst_ocl_remap_define(options, "SQRT_BETA", sqrt(camera->beta));
+    }
+}
+
+/*
+ * The remap_lut arguments of camera as the source of a width x height
+ * frame, see common.h, and its model build option. Derives the
+ * intrinsics of camera in place.
+ */
+static void
+gst_ocl_remap_camera_args(GString *options, GstOCLRemapCamera *camera,
+                          gint width, gint height,
+                          cl_float4 *intrinsics, cl_float4 *model)
+{
+    gst_ocl_remap_derive(&camera->k, NULL, width, height);
+
+    intrinsics->s[0] = camera->k.u0;
+    intrinsics->s[1] = camera->k.v0;
+    intrinsics->s[2] = camera->k.fu;
+    intrinsics->s[3] = camera->k.fv;
+
+    model->s[0] = camera->alpha;
+    model->s[1] = 1.0 - camera->alpha;
+    if (camera->model == GST_OCL_REMAP_MODEL_DOUBLE_SPHERE) {
+        g_string_append(options, " -DDOUBLE_SPHERE");
+        model->s[2] = camera->xi;
+        model->s[3] = (1.0 - camera->alpha) * camera->xi;
+    } else {
+        g_string_append(options, " -DEXTENDED_UNIFIED");
+        model->s[2] = sqrt(camera->beta);
+        model->s[3] = 0.0f;
+    }
+}
+
+gchar *
+gst_ocl_remap_load_source(const gchar *kernel_file, gchar **log)
+{
+    gchar *dir = g_path_get_dirname(kernel_file);
+    gchar *common_file = g_build_filename(dir, "common.h", NULL);
+    gchar *common = NULL, *src = NULL, *out = NULL;
+
+    if (!g_file_get_contents(common_file, &common, NULL, NULL))
+        *log = g_strdup_printf("Failed to load %s", common_file);
+    else if (!g_file_get_contents(kernel_file, &src, NULL, NULL))
+        *log = g_strdup_printf("Failed to load kernel file: %s", kernel_file);
+    else
+        out = g_strconcat(common, "\n", src, NULL);
+
+    g_free(common);
+    g_free(src);
+    g_free(common_file);
+    g_free(dir);
+
+    return out;
+}
+
+static void
+gst_ocl_remap_release(GstOCLRemap *self)
+{
+    if (self->lut_kernel) {
+        clReleaseKernel(self->lut_kernel);
+        self->lut_kernel = NULL;
+    }
+
+    if (self->remap_kernel) {
+        clReleaseKernel(self->remap_kernel);
+        self->remap_kernel = NULL;
+    }
+
+    if (self->program) {
+        clReleaseProgram(self->program);
+        self->program = NULL;
+    }
+
+    if (self->lut) {
+        clReleaseMemObject(self->lut);
+        self->lut = NULL;
+    }
+
+    if (self->src) {
+        clReleaseMemObject(self->src);
+        self->src = NULL;
+    }
+
+    if (self->dst) {
+        clReleaseMemObject(self->dst);
+        self->dst = NULL;
+    }
+    self->buf_size = 0;
+
+    self->cl_ready = FALSE;
+}
+
+/*
+ * Acquire the shared OpenCL context and this element's queue, kept until
+ * READY->NULL. The remap runs on any device type.
+ */
+static gboolean
+gst_ocl_remap_open(GstOCLRemap *self)
+{
+    cl_int err;
+
+    if (self->queue)
+        return TRUE;
+
+    if (!gst_ocl_context_ensure(GST_ELEMENT(self), CL_DEVICE_TYPE_ALL,
+                                &self->ocl)) {
+        GST_WARNING_OBJECT(self, "No OpenCL context available");
+        return FALSE;
+    }
+
+    GST_INFO_OBJECT(self, "Using OpenCL context %p on %s '%s'", self->ocl,
+                    gst_ocl_device_type_name(self->ocl->device_type),
+                    self->ocl->device_name);
+
+    self->queue = gst_ocl_context_create_queue(self->ocl, &err);
+    CHECK_CL(err, "clCreateCommandQueueWithProperties");
+
+    return TRUE;
+
+error:
+    return FALSE;
+}
+
+static void
+gst_ocl_remap_close(GstOCLRemap *self)
+{
+    gst_ocl_remap_release(self);
+
+    if (self->queue) {
+        clReleaseCommandQueue(self->queue);
+        self->queue = NULL;
+    }
+
+    if (self->ocl) {
+        gst_ocl_context_unref(self->ocl);
+        self->ocl = NULL;
+    }
+}
+
+/* ================= SETUP ================= */
+
+/*
+ * Build remap.cl for the source camera model of the properties and fill
+ * the LUT of info's size for the output camera. Only the model is a build
+ * option, camera changes reuse the program of the context.
+ */
+static gboolean
+gst_ocl_remap_setup(GstOCLRemap *self, const GstVideoInfo *info)
+{
+    gint width = GST_VIDEO_INFO_WIDTH(info);
+    gint height = GST_VIDEO_INFO_HEIGHT(info);
+    GString *options = g_string_new("-cl-mad-enable");
+    GstOCLRemapCamera camera;
+    GstOCLRemapIntrinsics output;
+    gchar *kernel_file, *cache_dir, *source = NULL;
+    gchar *log = NULL, *build_log = NULL;
+    gchar default_dir[4096];
+    cl_float4 out_params, intrinsics, model;
+    cl_int err;
+
+    gst_ocl_remap_release(self);
+
+    if (!gst_ocl_remap_open(self))
+        goto error;
+
+    GST_OBJECT_LOCK(self);
+    kernel_file = g_strdup(self->kernel_file);
+    /* NULL cache-dir means the default location, "" disables the cache */
+    cache_dir = g_strdup(self->cache_dir
+                         ? self->cache_dir
+                         : ocl_cache_default_dir(default_dir,
+                                                 sizeof(default_dir)));
+    camera = self->camera;
+    output = self->output;
+    self->dirty = FALSE;
+    GST_OBJECT_UNLOCK(self);
+
+    gst_ocl_remap_camera_args(options, &camera, width, height,
+                              &intrinsics, &model);
+    gst_ocl_remap_derive(&output, &camera.k, width, height);
+
+    source = kernel_file ? gst_ocl_remap_load_source(kernel_file, &log) : NULL;
+    if (!source) {
+        GST_ELEMENT_WARNING(self, RESOURCE, NOT_FOUND,
+                            ("Cannot load the remap kernels"),
+                            ("%s", log ? log : "kernel-file not set"));
+        goto error;
+    }
+
+    self->program = gst_ocl_context_get_program(self->ocl, source, options->str,
+                                                cache_dir, &build_log, &err);
+    if (!self->program) {
+        GST_ELEMENT_WARNING(self, LIBRARY, INIT, ("OpenCL build failed"),
+                            ("error %d (%s):\n%s", err, options->str,
+                             build_log ? build_log : ""));
+        goto error;
+    }
+
+    self->lut_kernel = clCreateKernel(self->program, "remap_lut", &err);
+    CHECK_CL(err, "clCreateKernel(remap_lut)");
+    self->remap_kernel = clCreateKernel(self->program, "remap_yuv420", &err);
+    CHECK_CL(err, "clCreateKernel(remap_yuv420)");
+
+    self->lut = clCreateBuffer(self->ocl->context, CL_MEM_READ_WRITE,
+                               (size_t)width * height * sizeof(cl_float2),
+                               NULL, &err);
+    CHECK_CL(err, "clCreateBuffer(lut)");
+
+    self->buf_size = GST_VIDEO_INFO_SIZE(info);
+    self->src = clCreateBuffer(self->ocl->context, CL_MEM_READ_ONLY,
+                               self->buf_size, NULL, &err);
+    CHECK_CL(err, "clCreateBuffer(src)");
+    self->dst = clCreateBuffer(self->ocl->context, CL_MEM_WRITE_ONLY,
+                               self->buf_size, NULL, &err);
+    CHECK_CL(err, "clCreateBuffer(dst)");
+
+    /* (u0, v0, fu, fv), the params of common.h's unproject() */
+    out_params.s[0] = output.u0;
+    out_params.s[1] = output.v0;
+    out_params.s[2] = output.fu;
+    out_params.s[3] = output.fv;
+
+    /* The driver picks a work-group size the device supports */
+    size_t global[2] = { (size_t)width, (size_t)height };
+
+    err = clSetKernelArg(self->lut_kernel, 0, sizeof(cl_mem), &self->lut);
+    if (err == CL_SUCCESS)
+        err = clSetKernelArg(self->lut_kernel, 1, sizeof(int), &width);
+    if (err == CL_SUCCESS)
+        err = clSetKernelArg(self->lut_kernel, 2, sizeof(int), &height);
+    if (err == CL_SUCCESS)
+        err = clSetKernelArg(self->lut_kernel, 3, sizeof(cl_float4),
+                             &out_params);
+    if (err == CL_SUCCESS)
+        err = clSetKernelArg(self->lut_kernel, 4, sizeof(cl_float4),
+                             &intrinsics);
+    if (err == CL_SUCCESS)
+        err = clSetKernelArg(self->lut_kernel, 5, sizeof(cl_float4), &model);
+    CHECK_CL(err, "clSetKernelArg(remap_lut)");
+
+    err = clEnqueueNDRangeKernel(self->queue, self->lut_kernel, 2, NULL,
+                                 global, NULL, 0, NULL, NULL);
+    CHECK_CL(err, "clEnqueueNDRangeKernel(remap_lut)");
+
+    err = clFinish(self->queue);
+    CHECK_CL(err, "clFinish(remap_lut)");
+
+    GST_INFO_OBJECT(self, "Remap %dx%d ready: %s camera fu=%.2f fv=%.2f "
+                    "u0=%.2f v0=%.2f, output fu=%.2f fv=%.2f u0=%.2f v0=%.2f",
+                    width, height,
+                    camera.model == GST_OCL_REMAP_MODEL_DOUBLE_SPHERE
+                        ? "double-sphere" : "extended-unified",
+                    camera.k.fu, camera.k.fv, camera.k.u0, camera.k.v0,
+                    output.fu, output.fv, output.u0, output.v0);
+
+    self->cl_ready = TRUE;
+
+    g_string_free(options, TRUE);
+    g_free(build_log);
+    g_free(source);
+    g_free(log);
+    g_free(kernel_file);
+    g_free(cache_dir);
+
+    return TRUE;
+
+error:
+    gst_ocl_remap_release(self);
+    g_string_free(options, TRUE);
+    g_free(build_log);
+    g_free(source);
+    g_free(log);
+    g_free(kernel_file);
+    g_free(cache_dir);
+
+    return FALSE;
+}
+
+static gboolean
+gst_ocl_remap_set_info(GstVideoFilter *filter,
+                       GstCaps *incaps, GstVideoInfo *in_info,
+                       GstCaps *outcaps, GstVideoInfo *out_info)
+{
+    GstOCLRemap *self = (GstOCLRemap *)filter;
+    gboolean ok = gst_ocl_remap_setup(self, in_info);
+
+    /* Without OpenCL the frames pass through undistorted */
+    if (!ok)
+        GST_WARNING_OBJECT(self, "Remap unavailable, passing frames through");
+    GST_OBJECT_LOCK(self);
+    self->failed = !ok;
+    GST_OBJECT_UNLOCK(self);
+    gst_base_transform_set_passthrough(GST_BASE_TRANSFORM(self), !ok);
+
+    return TRUE;
+}
+
+/* ================= TRANSFORM ================= */
+
+/*
+ * Copy every plane of a mapped frame into (upload) or out of the device
+ * buffer laid out as info, only the bytes of each row.
+ */
+static cl_int
+gst_ocl_remap_transfer(GstOCLRemap *self, cl_mem buffer,
+                       const GstVideoInfo *info, GstVideoFrame *frame,
+                       gboolean upload)
+{
+    cl_int err = CL_SUCCESS;
+
+    for (guint n = 0; n < GST_VIDEO_FRAME_N_PLANES(frame) && !err; n++) {
+        gint comp[GST_VIDEO_MAX_COMPONENTS];
+        size_t buffer_origin[3] = { GST_VIDEO_INFO_PLANE_OFFSET(info, n), 0, 0 };
+        size_t host_origin[3] = { 0, 0, 0 };
+        size_t region[3] = { 0, 0, 1 };
+        size_t device_pitch = GST_VIDEO_INFO_PLANE_STRIDE(info, n);
+        size_t host_pitch = GST_VIDEO_FRAME_PLANE_STRIDE(frame, n);
+        gpointer data = GST_VIDEO_FRAME_PLANE_DATA(frame, n);
+
+        gst_video_format_info_component(info->finfo, n, comp);
+        region[0] = (size_t)GST_VIDEO_INFO_COMP_WIDTH(info, comp[0]) *
+                    GST_VIDEO_INFO_COMP_PSTRIDE(info, comp[0]);
+        region[1] = GST_VIDEO_INFO_COMP_HEIGHT(info, comp[0]);
+
+        if (upload)
+            err = clEnqueueWriteBufferRect(self->queue, buffer, CL_FALSE,
+                                           buffer_origin, host_origin, region,
+                                           device_pitch, 0, host_pitch, 0,
+                                           data, 0, NULL, NULL);
+        else
+            err = clEnqueueReadBufferRect(self->queue, buffer, CL_FALSE,
+                                          buffer_origin, host_origin, region,
+                                          device_pitch, 0, host_pitch, 0,
+                                          data, 0, NULL, NULL);
+    }
+
+    return err;
+}
+
+/* Arguments of remap_yuv420 for the planes of info. */
+static cl_int
+gst_ocl_remap_set_args(GstOCLRemap *self, const GstVideoInfo *info)
+{
+    gboolean nv12 = GST_VIDEO_INFO_FORMAT(info) == GST_VIDEO_FORMAT_NV12;
+    cl_int args[8] = {
+        GST_VIDEO_INFO_WIDTH(info),
+        GST_VIDEO_INFO_HEIGHT(info),
+        GST_VIDEO_INFO_PLANE_STRIDE(info, 0),
+        GST_VIDEO_INFO_PLANE_OFFSET(info, 1),
+        GST_VIDEO_INFO_PLANE_STRIDE(info, 1),
+        /* V follows U in the interleaved plane of NV12 */
+        nv12 ? GST_VIDEO_INFO_PLANE_OFFSET(info, 1) + 1
+             : GST_VIDEO_INFO_PLANE_OFFSET(info, 2),
+        nv12 ? GST_VIDEO_INFO_PLANE_STRIDE(info, 1)
+             : GST_VIDEO_INFO_PLANE_STRIDE(info, 2),
+        nv12 ? 2 : 1,
+    };
+    cl_int err;
+
+    err = clSetKernelArg(self->remap_kernel, 0, sizeof(cl_mem), &self->src);
+    if (err == CL_SUCCESS)
+        err = clSetKernelArg(self->remap_kernel, 1, sizeof(cl_mem), &self->dst);
+    if (err == CL_SUCCESS)
+        err = clSetKernelArg(self->remap_kernel, 2, sizeof(cl_mem), &self->lut);
+
+    for (guint i = 0; i < G_N_ELEMENTS(args) && err == CL_SUCCESS; i++)
+        err = clSetKernelArg(self->remap_kernel, 3 + i, sizeof(cl_int),
+                             &args[i]);
+
+    return err;
+}
+
+static GstFlowReturn
+gst_ocl_remap_transform_frame(GstVideoFilter *filter,
+                              GstVideoFrame *in, GstVideoFrame *out)
+{
+    GstOCLRemap *self = (GstOCLRemap *)filter;
+    const GstVideoInfo *info = &filter->in_info;
+    gboolean dirty, failed;
+    cl_int err;
+
+    GST_OBJECT_LOCK(self);
+    dirty = self->dirty;
+    GST_OBJECT_UNLOCK(self);
+
+    /* A camera property changed: new program and LUT */
+    if ((dirty || !self->cl_ready) && !gst_ocl_remap_setup(self, info)) {
+        /* Pass through until a property changes, not rebuild every frame */
+        GST_OBJECT_LOCK(self);
+        failed = self->failed = !self->dirty;
+        GST_OBJECT_UNLOCK(self);
+        if (failed) {
+            GST_WARNING_OBJECT(self, "Remap unavailable, passing frames through");
+            gst_base_transform_set_passthrough(GST_BASE_TRANSFORM(self), TRUE);
+        }
+        gst_video_frame_copy(out, in);
+        return GST_FLOW_OK;
+    }
+
+    /* Work-items handle the 2x2 luma block of a chroma sample */
+    size_t global[2] = {
+        (size_t)(GST_VIDEO_INFO_WIDTH(info) + 1) / 2,
+        (size_t)(GST_VIDEO_INFO_HEIGHT(info) + 1) / 2,
+    };
+
+    err = gst_ocl_remap_transfer(self, self->src, info, in, TRUE);
+    CHECK_CL(err, "clEnqueueWriteBufferRect");
+
+    err = gst_ocl_remap_set_args(self, info);
+    CHECK_CL(err, "clSetKernelArg(remap_yuv420)");
+
+    err = clEnqueueNDRangeKernel(self->queue, self->remap_kernel, 2, NULL,
+                                 global, NULL, 0, NULL, NULL);
+    CHECK_CL(err, "clEnqueueNDRangeKernel(remap_yuv420)");
+
+    err = gst_ocl_remap_transfer(self, self->dst, info, out, FALSE);
+    CHECK_CL(err, "clEnqueueReadBufferRect");
+
+    /* The frames are unmapped on return */
+    err = clFinish(self->queue);
+    CHECK_CL(err, "clFinish");
+
+    self->frame_count++;
+
+    return GST_FLOW_OK;
+
+error:
+    clFinish(self->queue);
+    return GST_FLOW_ERROR;
+}
+
+/* ================= GOBJECT ================= */
+
+static void
+gst_ocl_remap_set_property(GObject *object,
+                           guint prop_id,
+                           const GValue *value,
+                           GParamSpec *pspec)
+{
+    GstOCLRemap *self = (GstOCLRemap *)object;
+    gboolean retry;
+
+    GST_OBJECT_LOCK(self);
+    switch (prop_id) {
+        case PROP_KERNEL_FILE:
+            g_free(self->kernel_file);
+            self->kernel_file = g_value_dup_string(value);
+            break;
+        case PROP_CACHE_DIR:
+            g_free(self->cache_dir);
+            self->cache_dir = g_value_dup_string(value);
+            break;
+        case PROP_OUT_FU:
+            self->output.fu = g_value_get_double(value);
+            break;
+        case PROP_OUT_FV:
+            self->output.fv = g_value_get_double(value);
+            break;
+        case PROP_OUT_U0:
+            self->output.u0 = g_value_get_double(value);
+            break;
+        case PROP_OUT_V0:
+            self->output.v0 = g_value_get_double(value);
+            break;
+        default:
+            if (prop_id >= PROP_CAMERA &&
+                gst_ocl_remap_camera_set(&self->camera, prop_id - PROP_CAMERA,
+                                         value))
+                break;
+            GST_OBJECT_UNLOCK(self);
+            G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
+            return;
+    }
+    /* Rebuilt with the next frame, also after a failed setup */
+    self->dirty = TRUE;
+    retry = self->failed;
+    self->failed = FALSE;
+    GST_OBJECT_UNLOCK(self);
+
+    if (retry)
+        gst_base_transform_set_passthrough(GST_BASE_TRANSFORM(self), FALSE);
+}
+
+static void
+gst_ocl_remap_get_property(GObject *object,
+                           guint prop_id,
+                           GValue *value,
+                           GParamSpec *pspec)
+{
+    GstOCLRemap *self = (GstOCLRemap *)object;
+
+    GST_OBJECT_LOCK(self);
+    switch (prop_id) {
+        case PROP_KERNEL_FILE:
+            g_value_set_string(value, self->kernel_file);
+            break;
+        case PROP_CACHE_DIR:
+            g_value_set_string(value, self->cache_dir);
+            break;
+        case PROP_OUT_FU:
+            g_value_set_double(value, self->output.fu);
+            break;
+        case PROP_OUT_FV:
+            g_value_set_double(value, self->output.fv);
+            break;
+        case PROP_OUT_U0:
+            g_value_set_double(value, self->output.u0);
+            break;
+        case PROP_OUT_V0:
+            g_value_set_double(value, self->output.v0);
+            break;
+        default:
+            if (prop_id >= PROP_CAMERA &&
+                gst_ocl_remap_camera_get(&self->camera, prop_id - PROP_CAMERA,
+                                         value))
+                break;
+            G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
+            break;
+    }
+    GST_OBJECT_UNLOCK(self);
+}
+
+static GstStateChangeReturn
+gst_ocl_remap_change_state(GstElement *element, GstStateChange transition)
+{
+    GstOCLRemap *self = (GstOCLRemap *)element;
+    GstStateChangeReturn ret;
+
+    ret = GST_ELEMENT_CLASS(gst_ocl_remap_parent_class)->
+              change_state(element, transition);
+    if (ret == GST_STATE_CHANGE_FAILURE)
+        return ret;
+
+    switch (transition) {
+    case GST_STATE_CHANGE_READY_TO_NULL:
+        gst_ocl_remap_close(self);
+        break;
+    default:
+        break;
+    }
+
+    return ret;
+}
+
+static void
+gst_ocl_remap_set_context(GstElement *element, GstContext *context)
+{
+    GstOCLRemap *self = (GstOCLRemap *)element;
+
+    gst_ocl_context_handle_set_context(element, context, &self->ocl);
+
+    GST_ELEMENT_CLASS(gst_ocl_remap_parent_class)->
+        set_context(element, context);
+}
+
+static gboolean
+gst_ocl_remap_query(GstBaseTransform *trans, GstPadDirection direction,
+                    GstQuery *query)
+{
+    GstOCLRemap *self = (GstOCLRemap *)trans;
+
+    if (gst_ocl_context_handle_query(GST_ELEMENT(self), query, self->ocl))
+        return TRUE;
+
+    return GST_BASE_TRANSFORM_CLASS(gst_ocl_remap_parent_class)->
+               query(trans, direction, query);
+}
+
+static void
+gst_ocl_remap_finalize(GObject *object)
+{
+    GstOCLRemap *self = (GstOCLRemap *)object;
+
+    GST_DEBUG_OBJECT(self, "Finalizing after %" G_GUINT64_FORMAT " frames",
+                     self->frame_count);
+
+    gst_ocl_remap_close(self);
+
+    g_clear_pointer(&self->kernel_file, g_free);
+    g_clear_pointer(&self->cache_dir, g_free);
+
+    G_OBJECT_CLASS(gst_ocl_remap_parent_class)->finalize(object);
+}
+
+/* Instance initialization */
+static void
+gst_ocl_remap_init(GstOCLRemap *self)
+{
+    self->kernel_file = g_strdup(DEFAULT_KERNEL_FILE);
+    self->cache_dir = NULL;
+    gst_ocl_remap_camera_init(&self->camera);
+    memset(&self->output, 0, sizeof(self->output));
+    self->cl_ready = FALSE;
+    self->dirty = FALSE;
+    self->frame_count = 0;
+}
+
+/* Class initialization */
+static void
+gst_ocl_remap_class_init(GstOCLRemapClass *klass)
+{
+    GstElementClass *eclass = GST_ELEMENT_CLASS(klass);
+    GstBaseTransformClass *bclass = GST_BASE_TRANSFORM_CLASS(klass);
+    GstVideoFilterClass *vclass = GST_VIDEO_FILTER_CLASS(klass);
+    GObjectClass *gclass = G_OBJECT_CLASS(klass);
+
+    GST_DEBUG_CATEGORY_INIT(gst_ocl_remap_debug,
+                            "oscaroclremap", 0,
+                            "OpenCL fisheye remap");
+
+    gclass->set_property = gst_ocl_remap_set_property;
+    gclass->get_property = gst_ocl_remap_get_property;
+    gclass->finalize = gst_ocl_remap_finalize;
+    eclass->change_state = GST_DEBUG_FUNCPTR(gst_ocl_remap_change_state);
+    eclass->set_context = GST_DEBUG_FUNCPTR(gst_ocl_remap_set_context);
+    bclass->query = GST_DEBUG_FUNCPTR(gst_ocl_remap_query);
+    vclass->set_info = GST_DEBUG_FUNCPTR(gst_ocl_remap_set_info);
+    vclass->transform_frame = GST_DEBUG_FUNCPTR(gst_ocl_remap_transform_frame);
+
+    gst_element_class_add_pad_template(
+        eclass, gst_static_pad_template_get(&sink_template));
+    gst_element_class_add_pad_template(
+        eclass, gst_static_pad_template_get(&src_template));
+
+    gst_element_class_set_static_metadata(
+        eclass,
+        "OpenCL fisheye remap",
+        "Filter/Effect/Video",
+        "Undistorts double-sphere or extended unified fisheye NV12/I420 "
+        "video into a pinhole view with OpenCL",
+        "eInfochips-Leica");
+
+    g_object_class_install_property(
+        gclass,
+        PROP_KERNEL_FILE,
+        g_param_spec_string(
+            "kernel-file",
+            "OpenCL kernel file",
+            "Path to remap.cl; common.h is read from the same directory.",
+            DEFAULT_KERNEL_FILE,
+            G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property(
+        gclass,
+        PROP_CACHE_DIR,
+        g_param_spec_string(
+            "cache-dir",
+            "Program binary cache directory",
+            "Directory of the OpenCL program binary cache. NULL uses the "
+            "default location, an empty string disables the cache.",
+            NULL,
+            G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    gst_ocl_remap_camera_install(gclass, PROP_CAMERA);
+
+    gst_ocl_remap_install_double(gclass, PROP_OUT_FU, "out-fu",
+        "Output focal length u",
+        "Horizontal focal length of the pinhole output (0: fu)",
+        0.0, G_MAXDOUBLE, 0.0);
+    gst_ocl_remap_install_double(gclass, PROP_OUT_FV, "out-fv",
+        "Output focal length v",
+        "Vertical focal length of the pinhole output (0: fv)",
+        0.0, G_MAXDOUBLE, 0.0);
+    gst_ocl_remap_install_double(gclass, PROP_OUT_U0, "out-u0",
+        "Output principal point u",
+        "Horizontal optical center of the pinhole output (0: u0)",
+        0.0, G_MAXDOUBLE, 0.0);
+    gst_ocl_remap_install_double(gclass, PROP_OUT_V0, "out-v0",
+        "Output principal point v",
+        "Vertical optical center of the pinhole output (0: v0)",
+        0.0, G_MAXDOUBLE, 0.0);
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+/*
+ * oscaroclremap: undistorts a fisheye camera (double-sphere or extended
+ * unified model of common.h) into a pinhole view with OpenCL. Registered
+ * by the oscaroclshader plugin.
+ */
+#define GST_TYPE_OCL_REMAP (gst_ocl_remap_get_type())
+
+GType gst_ocl_remap_get_type(void);
+
+/* ================= CAMERA ================= */
+
+/*
+ * The fisheye camera helpers are shared with oscaroclstitch, whose pads
+ * each describe a camera with the same properties.
+ */
+
+/* Camera model of a fisheye source, selects the common.h implementation. */
+typedef enum {
+    GST_OCL_REMAP_MODEL_DOUBLE_SPHERE,
+    GST_OCL_REMAP_MODEL_EXTENDED_UNIFIED,
+} GstOCLRemapModel;
+
+#define GST_TYPE_OCL_REMAP_MODEL (gst_ocl_remap_model_get_type())
+
+GType gst_ocl_remap_model_get_type(void);
+
+/* Pinhole or fisheye intrinsics in pixels; 0 means derived from the size. */
+typedef struct {
+    gdouble fu, fv, u0, v0;
+} GstOCLRemapIntrinsics;
+
+/* A fisheye camera of common.h. */
+typedef struct {
+    GstOCLRemapModel model;
+    GstOCLRemapIntrinsics k;
+    gdouble xi;
+    gdouble alpha;
+    gdouble beta;
+} GstOCLRemapCamera;
+
+/* Properties of a camera, installed from an id of the owner's choice. */
+enum {
+    GST_OCL_REMAP_CAMERA_PROP_MODEL,
+    GST_OCL_REMAP_CAMERA_PROP_FU,
+    GST_OCL_REMAP_CAMERA_PROP_FV,
+    GST_OCL_REMAP_CAMERA_PROP_U0,
+    GST_OCL_REMAP_CAMERA_PROP_V0,
+    GST_OCL_REMAP_CAMERA_PROP_XI,
+    GST_OCL_REMAP_CAMERA_PROP_ALPHA,
+    GST_OCL_REMAP_CAMERA_PROP_BETA,
+    GST_OCL_REMAP_CAMERA_N_PROPS,
+};
+
+void gst_ocl_remap_camera_init(GstOCLRemapCamera *camera);
+
+/* Install "model", "fu", ... "beta" as first_id + GST_OCL_REMAP_CAMERA_PROP_*. */
+void gst_ocl_remap_camera_install(GObjectClass *gclass, guint first_id);
+
+/* Set or get property id (relative to first_id); FALSE if not a camera one. */
+gboolean gst_ocl_remap_camera_set(GstOCLRemapCamera *camera, guint id,
+                                  const GValue *value);
+gboolean gst_ocl_remap_camera_get(const GstOCLRemapCamera *camera, guint id,
+                                  GValue *value);
+
+/* Fill the unset (0) intrinsics of k, from from when given, else from the size. */
+void gst_ocl_remap_derive(GstOCLRemapIntrinsics *k,
+                          const GstOCLRemapIntrinsics *from,
+                          gint width, gint height);
+
+/*
+ * Append the common.h build options of camera as the source of a width x
+ * height frame. Derives the intrinsics of camera in place.
+ */
+void gst_ocl_remap_camera_options(GString *options, GstOCLRemapCamera *camera,
+                                  gint width, gint height);
+
+/* common.h from the directory of kernel_file, then kernel_file. */
+gchar *gst_ocl_remap_load_source(const gchar *kernel_file, gchar **log);
+
+G_END_DECLS
@@ -2,7 +2,14 @@
  * gst-oscaroclshader.c
  *
  * A minimal GstBaseTransform video filter
- * Accepts NV12 video/x-raw
+ * Accepts NV12, I420, P010, RGBA and BGRx video/x-raw
+ *
+ * Build together with gstoclcontext.c (shared OpenCL context) and
+ * gstoclmemory.c (OpenCL buffer pool, caps feature memory:OpenCL), and
+ * link gio-2.0 (kernel file monitoring for hot-reload) and pthread (host
+ * engine of ocl_host.h, used when no OpenCL device qualifies). The plugin
+ * also registers oscaroclremap (gst-oscaroclremap.c) and oscaroclstitch
+ * (gst-oscaroclstitch.c, links gstbase).
  *
  */
 
@@ -11,8 +18,20 @@
 #include <gst/gst.h>
 #include <gst/video/gstvideofilter.h>
 #include <gst/video/video.h>
+#include <gst/gsttracerrecord.h>
+#include <gio/gio.h>
 #include <CL/cl.h>
 #include <stdio.h>
+#include <string.h>
+
+#include "gst-oscaroclremap.h"
+#include "gst-oscaroclstitch.h"
+#include "gstoclcontext.h"
+#include "gstoclmemory.h"
+#include "ocl_convolve.h"
+#include "ocl_host.h"
+#include "ocl_stats.h"
+#include "ocl_worksize.h"
 
 #ifndef PACKAGE
 #define PACKAGE "oscaroclshader"
@@ -22,44 +41,325 @@
 #define VERSION "1.0"
 #endif
 
-#define NUM_BUFFERS 2
+#define MAX_IN_FLIGHT 8
+
+/* Worker lanes; more could never all hold a frame of the ring */
+#define MAX_LANES (MAX_IN_FLIGHT - 1)
 
 /* Debug category for GstOCLShader logging. */
 GST_DEBUG_CATEGORY_STATIC(gst_ocl_shader_debug);
 #define GST_CAT_DEFAULT gst_ocl_shader_debug
 
 /* ================= OBJECT ================= */
+
+/*
+ * One frame slot of the in-flight ring: device memory, the events of the
+ * upload/kernel/readback stages and, in asynchronous mode, the mapped
+ * buffers those stages read from and write to.
+ */
+typedef struct {
+    cl_mem ybuf; /* all planes, laid out as the frame */
+
+    cl_event write_start_evt; /* first plane copy */
+    cl_event write_evt;
+    cl_event start_evt; /* first kernel of the chain */
+    cl_event kernel_evt;
+    cl_event read_start_evt;
+    cl_event read_evt;
+
+    GstBuffer *inbuf;
+    GstBuffer *outbuf;
+    GstVideoFrame in_frame;
+    GstVideoFrame out_frame;
+
+    guint lane; /* 0: the element's own queues, else lanes[lane - 1] */
+} GstOCLShaderSlot;
+
+/* Where the value of a kernel argument comes from, matched by its name. */
+typedef enum {
+    GST_OCL_SHADER_ARG_FRAME,  /* first __global pointer: the frame, plane 0 first */
+    GST_OCL_SHADER_ARG_WIDTH,
+    GST_OCL_SHADER_ARG_HEIGHT,
+    GST_OCL_SHADER_ARG_STRIDE,
+    GST_OCL_SHADER_ARG_PIXELS, /* elements of the frame pointer type */
+    GST_OCL_SHADER_ARG_FORMAT, /* GstOCLShaderFormat */
+    GST_OCL_SHADER_ARG_OFFSET, /* offsetN: bytes from the frame to plane N */
+    GST_OCL_SHADER_ARG_PLANE_STRIDE, /* strideN */
+    GST_OCL_SHADER_ARG_USER,   /* scalar field of kernel-args */
+} GstOCLShaderArgRole;
+
+/* Frame formats as passed in the format argument, see color.cl. */
+typedef enum {
+    GST_OCL_SHADER_FORMAT_NV12,
+    GST_OCL_SHADER_FORMAT_I420,
+    GST_OCL_SHADER_FORMAT_P010,
+    GST_OCL_SHADER_FORMAT_RGBA,
+    GST_OCL_SHADER_FORMAT_BGRX,
+} GstOCLShaderFormat;
+
+/* A kernel argument and, for user scalars, the value last resolved. */
+typedef struct {
+    GstOCLShaderArgRole role;
+    gchar *name;
+    gchar *type;
+    size_t size;
+    guint plane; /* of offsetN and strideN */
+    guint64 value; /* bytes of a scalar of size size */
+} GstOCLShaderArg;
+
+/*
+ * One kernel launch of the chain: a kernel of the file or a generated
+ * kernel fusing n_ops consecutive point-wise kernels. Stages of
+ * vectorizable ops also get a generated row kernel handling vec_bytes
+ * bytes per work-item with vload16/vstore16. Separable neighbourhood
+ * filters (convolve.cl) run kernel, the horizontal pass, then v_kernel,
+ * which on the luma plane may be generated to also apply the point-wise
+ * kernels following the filter.
+ */
+typedef struct {
+    cl_kernel kernel;
+    gchar *name;
+    gchar *ops; /* kernel-chain entries run by this stage, '+' separated */
+    guint n_ops;
+    size_t local[2]; /* work-group size, {0, 0} leaves it to the driver */
+    cl_kernel vec_kernel;
+    gchar *vec_name;
+    guint vec_bytes;
+    cl_kernel v_kernel;
+    gchar *v_name;
+    size_t conv_local; /* work-group side of the passes, see ocl_conv_local */
+    GArray *args; /* GstOCLShaderArg of kernel, NULL for (buf, width, height, stride) */
+    guint args_cookie; /* kernel-args version the user values come from */
+    guint elem_size; /* bytes per element of the frame pointer */
+    gboolean linear; /* takes total_pixels and no height: 1D launch */
+    gboolean any_format; /* takes format, else works on an 8-bit luma plane */
+} GstOCLShaderStage;
+
+/*
+ * A built program and its stages. spec holds the -D options of the
+ * geometry it is specialized for, NULL for any geometry; cookie the
+ * build_cookie of the properties it was built from.
+ */
+typedef struct {
+    cl_program program;
+    GArray *stages;
+    gchar *spec;
+    guint cookie;
+    gchar *source; /* what program was built from, for the lanes */
+    gchar *options;
+} GstOCLShaderVariant;
+
+/* Taps and intermediate of the separable passes, in one context. */
+typedef struct {
+    cl_mem weights;
+    guint radius;  /* of weights */
+    gdouble sigma;
+    cl_mem tmp;
+    size_t tmp_size;
+} GstOCLShaderConv;
+
+/*
+ * A worker lane: another device, CPU sub-device or queue set running
+ * whole frames of the asynchronous copy path beside the element's own
+ * queues, with its own kernels of the running program (see LANES).
+ */
+typedef struct {
+    GstOCLContext *ocl;
+    cl_command_queue queue;
+    cl_command_queue upload_queue;
+    cl_command_queue download_queue;
+    cl_program program;
+    GArray *stages;
+    guint generation; /* program_generation the kernels are of */
+    GstOCLShaderConv conv;
+    cl_mem bufs[MAX_IN_FLIGHT]; /* buffer of each slot in this context */
+    size_t buf_size;
+} GstOCLShaderLane;
+
+/* Frames run by a lane, lane 0 being the element's own queues. */
+typedef struct {
+    guint64 frames;
+    gdouble busy_us; /* upload, kernel and download time, summed */
+    gdouble avg_us;  /* moving average of the same, for the scheduler */
+} GstOCLShaderLoad;
+
+/* Device phases of a frame, timed from profiling events. */
+typedef enum {
+    GST_OCL_SHADER_PHASE_UPLOAD,
+    GST_OCL_SHADER_PHASE_KERNEL,
+    GST_OCL_SHADER_PHASE_DOWNLOAD,
+    GST_OCL_SHADER_N_PHASES
+} GstOCLShaderPhase;
+
+/* Reported statistics: the phases, then derived timings. */
+typedef enum {
+    GST_OCL_SHADER_STAT_UPLOAD = GST_OCL_SHADER_PHASE_UPLOAD,
+    GST_OCL_SHADER_STAT_KERNEL = GST_OCL_SHADER_PHASE_KERNEL,
+    GST_OCL_SHADER_STAT_DOWNLOAD = GST_OCL_SHADER_PHASE_DOWNLOAD,
+    GST_OCL_SHADER_STAT_QUEUE_WAIT,
+    GST_OCL_SHADER_STAT_TOTAL,
+    GST_OCL_SHADER_N_STATS
+} GstOCLShaderStat;
+
+/* What frames do while OpenCL is still starting. */
+typedef enum {
+    GST_OCL_SHADER_STARTUP_POLICY_BLOCK,  /* wait for it on the first frame */
+    GST_OCL_SHADER_STARTUP_POLICY_BYPASS, /* pass through until it is ready */
+} GstOCLShaderStartupPolicy;
+
+/* OpenCL device the element runs on; the host engine is used without one. */
+typedef enum {
+    GST_OCL_SHADER_DEVICE_TYPE_GPU,
+    GST_OCL_SHADER_DEVICE_TYPE_CPU,
+    GST_OCL_SHADER_DEVICE_TYPE_ANY, /* a GPU first, then any other */
+} GstOCLShaderDeviceType;
+
+/* State of the background startup when the streaming thread needs it. */
+typedef enum {
+    GST_OCL_SHADER_STARTUP_NONE,    /* nothing usable, build synchronously */
+    GST_OCL_SHADER_STARTUP_PENDING, /* still running */
+    GST_OCL_SHADER_STARTUP_READY,   /* program and stages installed */
+} GstOCLShaderStartup;
+
+static const gchar *stat_names[GST_OCL_SHADER_N_STATS] = {
+    "upload", "kernel", "download", "queue-wait", "total"
+};
+
+/* First and last command of each phase of a frame; any may be NULL. */
+typedef struct {
+    cl_event evts[GST_OCL_SHADER_N_PHASES][2];
+    guint lane;
+} GstOCLShaderTiming;
+
 typedef struct _GstOCLShader {
     GstVideoFilter parent;
 
-    /* OpenCL */
-    cl_platform_id platform;
-    cl_device_id device;
-    cl_context context;
+    /* OpenCL, the context is shared with the other OpenCL elements */
+    GstOCLContext *ocl;
+    gboolean ocl_ready; /* ocl is open, under the object lock; see get_context */
     cl_command_queue queue;
+    cl_command_queue upload_queue;
+    cl_command_queue download_queue;
     cl_program program;
-    cl_kernel kernel;
 
-    /* Double-buffered GPU memory */
-    cl_mem ybuf[NUM_BUFFERS];
+    /* Kernels run in order on every frame */
+    GArray *stages;
+    gboolean luma_only; /* a stage needs an 8-bit luma plane, object lock */
+
+    /* Ring of frame slots, ring_depth of them in use */
+    GstOCLShaderSlot slots[MAX_IN_FLIGHT];
+    guint ring_depth; /* in-flight-depth when the element started */
     size_t buf_size;
 
-    /* Events per buffer */
-    cl_event write_evt[NUM_BUFFERS];
-    cl_event kernel_evt[NUM_BUFFERS];
-    cl_event read_evt[NUM_BUFFERS];
+    /* Slots with frames still on the device, oldest first */
+    GQueue pending;
+
+    /* Negotiated memory:OpenCL on the sink/src side */
+    gboolean in_ocl;
+    gboolean out_ocl;
+
+    /* Kernel target when device memory leaves the OpenCL section */
+    cl_mem scratch;
+    size_t scratch_size;
+
+    /* Taps and intermediate of the separable passes, never leaves the device */
+    GstOCLShaderConv conv;
+
+    /* GPU timings, from the profiling info of the frame events */
+    ocl_stat stats[GST_OCL_SHADER_N_STATS];
+    guint64 stats_frames;
+    GQueue timings; /* frames whose events are not read yet */
 
     /* Video info */
+    GstVideoFormat format;
     gint width;
     gint height;
     gint stride;
 
     gboolean cl_ready;
-    guint64 frame_count;
+    guint64 frame_count; /* frames submitted, picks the ring slot */
+    /* Frames each path processed successfully */
+    guint64 host_frames;
+    guint64 zero_copy_frames;
+    guint64 copy_frames;
+    guint64 device_frames;
 
     /* OpenCL Property */
     gchar *kernel_file;
     gchar *kernel_func;
+    gchar *kernel_chain;
+    gboolean fuse;
+    guint vector_bytes;
+    gchar *chain_report;
+    gchar *cache_dir;
+    gboolean in_place;
+    gboolean zero_copy;
+    guint in_flight_depth;
+    guint stats_interval;
+    gboolean autotune;
+    gboolean tune_pending;
+    guint radius;
+    gdouble sigma;
+    gdouble amount;
+    GstStructure *kernel_args;
+    guint args_cookie;
+    gboolean hot_reload;
+    GstOCLShaderStartupPolicy startup_policy;
+    guint build_cookie; /* bumped by the properties the program depends on */
+
+    /* Asynchronous startup: context and program prepared from NULL->READY */
+    GThread *startup_thread;
+    GMutex startup_lock;
+    GCond startup_cond;
+    gboolean startup_done;
+    GstOCLShaderVariant *startup_variant;
+    gchar *startup_log;
+    gint64 startup_time;
+    gboolean startup_pending; /* caps set, bypassing until the build is ready */
+    GThread *warmup_thread; /* warm-up at the caps, startup-policy=bypass */
+    gboolean warmup_done;   /* under startup_lock */
+    GstVideoInfo warmup_info;
+
+    /* Hot reload: watcher thread, and a rebuilt program for the next frame */
+    GThread *reload_thread;
+    GMainContext *reload_ctx;
+    GMainLoop *reload_loop;
+    GFileMonitor *reload_monitor;
+    gchar *reload_path;
+    GSource *reload_timer;
+    GMutex reload_lock;
+    GstOCLShaderVariant *reload_variant;
+
+    /* Per-caps specialization */
+    gchar *build_options;
+    gboolean specialize;
+    gchar *spec;          /* -D options of the negotiated geometry, object lock */
+    gchar *program_spec;  /* spec of the running program */
+    guint program_cookie;
+    gint spec_width;      /* geometry of program_spec, 0 when generic */
+    gint spec_height;
+    gint spec_stride;
+    GQueue variants;      /* GstOCLShaderVariant, most recently used first */
+
+    /* Host engine, runs the chain when OpenCL is unavailable */
+    GstOCLShaderDeviceType device_type;
+    ocl_host_pool host_pool;
+    gboolean host_running;  /* host_pool started */
+    ocl_host_chain host_chain;
+    guint host_args_cookie; /* kernel-args version of the host values */
+    gboolean host_ready;    /* frames go through host_chain */
+
+    /* Worker lanes, more devices and queue sets for the copy path */
+    gboolean multi_device;
+    guint cpu_split;
+    guint queue_sets;
+    GstOCLShaderLane lanes[MAX_LANES];
+    guint n_lanes;
+    gchar *program_source;     /* source and options of the running program */
+    gchar *program_options;
+    guint program_generation;  /* bumped whenever the running program changes */
+    GstOCLShaderLoad loads[MAX_LANES + 1]; /* object lock */
+    gint64 loads_start;        /* first frame of the loads */
 
 } GstOCLShader;
 
@@ -73,41 +373,165 @@ enum {
     PROP_0,
     PROP_KERNEL_FILE,
     PROP_KERNEL_FUNC,
+    PROP_KERNEL_CHAIN,
+    PROP_FUSE,
+    PROP_VECTOR_BYTES,
+    PROP_CHAIN_REPORT,
+    PROP_IN_PLACE,
+    PROP_ZERO_COPY,
+    PROP_ZERO_COPY_FRAMES,
+    PROP_COPY_FRAMES,
+    PROP_DEVICE_FRAMES,
+    PROP_IN_FLIGHT_DEPTH,
+    PROP_CACHE_DIR,
+    PROP_CACHE_HITS,
+    PROP_CACHE_MISSES,
+    PROP_STATS,
+    PROP_STATS_INTERVAL,
+    PROP_AUTOTUNE,
+    PROP_RADIUS,
+    PROP_SIGMA,
+    PROP_AMOUNT,
+    PROP_KERNEL_ARGS,
+    PROP_HOT_RELOAD,
+    PROP_STARTUP_POLICY,
+    PROP_BUILD_OPTIONS,
+    PROP_SPECIALIZE,
+    PROP_DEVICE_TYPE,
+    PROP_HOST_FRAMES,
+    PROP_MULTI_DEVICE,
+    PROP_CPU_SPLIT,
+    PROP_QUEUES,
 };
 
+/* Transfer path taken by a processed frame. */
+typedef enum {
+    GST_OCL_SHADER_PATH_COPY,
+    GST_OCL_SHADER_PATH_ZERO_COPY,
+    GST_OCL_SHADER_PATH_DEVICE,
+} GstOCLShaderPath;
+
+#define DEFAULT_IN_PLACE  TRUE
+#define DEFAULT_ZERO_COPY TRUE
+#define DEFAULT_IN_FLIGHT_DEPTH 1
+#define DEFAULT_FUSE TRUE
+#define DEFAULT_VECTOR_BYTES 32
+#define DEFAULT_STATS_INTERVAL 0
+#define DEFAULT_AUTOTUNE FALSE
+#define DEFAULT_RADIUS 2
+#define DEFAULT_SIGMA 0.0
+#define DEFAULT_AMOUNT 1.0
+#define DEFAULT_HOT_RELOAD FALSE
+#define DEFAULT_STARTUP_POLICY GST_OCL_SHADER_STARTUP_POLICY_BLOCK
+#define DEFAULT_SPECIALIZE TRUE
+#define DEFAULT_DEVICE_TYPE GST_OCL_SHADER_DEVICE_TYPE_GPU
+#define DEFAULT_MULTI_DEVICE FALSE
+#define DEFAULT_CPU_SPLIT 0
+#define DEFAULT_QUEUES 1
+
+#define STARTUP_WARMUP_LAUNCHES 2
+
+#define GST_TYPE_OCL_SHADER_STARTUP_POLICY \
+    (gst_ocl_shader_startup_policy_get_type())
+
+static GType
+gst_ocl_shader_startup_policy_get_type(void)
+{
+    static gsize type = 0;
+    static const GEnumValue values[] = {
+        { GST_OCL_SHADER_STARTUP_POLICY_BLOCK,
+          "Wait for OpenCL before the first frame", "block" },
+        { GST_OCL_SHADER_STARTUP_POLICY_BYPASS,
+          "Pass frames through until OpenCL is ready", "bypass" },
+        { 0, NULL, NULL },
+    };
+
+    if (g_once_init_enter(&type)) {
+        GType t = g_enum_register_static("GstOCLShaderStartupPolicy", values);
+        g_once_init_leave(&type, t);
+    }
+
+    return type;
+}
+
+#define GST_TYPE_OCL_SHADER_DEVICE_TYPE \
+    (gst_ocl_shader_device_type_get_type())
+
+static GType
+gst_ocl_shader_device_type_get_type(void)
+{
+    static gsize type = 0;
+    static const GEnumValue values[] = {
+        { GST_OCL_SHADER_DEVICE_TYPE_GPU, "GPU", "gpu" },
+        { GST_OCL_SHADER_DEVICE_TYPE_CPU, "CPU", "cpu" },
+        { GST_OCL_SHADER_DEVICE_TYPE_ANY, "Any device, a GPU first", "any" },
+        { 0, NULL, NULL },
+    };
+
+    if (g_once_init_enter(&type)) {
+        GType t = g_enum_register_static("GstOCLShaderDeviceType", values);
+        g_once_init_leave(&type, t);
+    }
+
+    return type;
+}
+
+static cl_device_type
+gst_ocl_shader_cl_device_type(GstOCLShaderDeviceType type)
+{
+    switch (type) {
+    case GST_OCL_SHADER_DEVICE_TYPE_CPU:
+        return CL_DEVICE_TYPE_CPU;
+    case GST_OCL_SHADER_DEVICE_TYPE_ANY:
+        return CL_DEVICE_TYPE_ALL;
+    default:
+        return CL_DEVICE_TYPE_GPU;
+    }
+}
+
+/* Per-frame GPU timings for tracers, logged as "ocl-frame" records. */
+static GstTracerRecord *tr_frame;
+
 /* GObject type macro for the GstOCLShader element. */
 #define GST_TYPE_OCL_SHADER (gst_ocl_shader_get_type())
 /* Register GstOCLShader as a GstVideoFilter subclass with the type system. */
 G_DEFINE_TYPE(GstOCLShader, gst_ocl_shader, GST_TYPE_VIDEO_FILTER)
 
-/* Sink Pad supports NV12 */
+/* Formats of color.cl; kernels without a format argument need 8-bit luma */
+#define OCL_SHADER_FORMATS "{ NV12, I420, P010_10LE, RGBA, BGRx }"
+
+/* The 8-bit luma formats, in any memory, for chains without format */
+#define OCL_SHADER_LUMA8_CAPS "video/x-raw(ANY), format = (string) { NV12, I420 }"
+
+/* Any of the formats in OpenCL device memory (preferred) or system memory */
+#define OCL_SHADER_CAPS \
+    "video/x-raw(" GST_CAPS_FEATURE_MEMORY_OPENCL "), " \
+    "format = (string) " OCL_SHADER_FORMATS ", " \
+    "width = (int) [ 1, MAX ], " \
+    "height = (int) [ 1, MAX ], " \
+    "framerate = (fraction) [ 0/1, MAX ]; " \
+    "video/x-raw, " \
+    "format = (string) " OCL_SHADER_FORMATS ", " \
+    "width = (int) [ 1, MAX ], " \
+    "height = (int) [ 1, MAX ], " \
+    "framerate = (fraction) [ 0/1, MAX ]"
+
+/* Sink Pad supports the formats above */
 static GstStaticPadTemplate sink_template =
 GST_STATIC_PAD_TEMPLATE(
     "sink",
     GST_PAD_SINK,
     GST_PAD_ALWAYS,
-    GST_STATIC_CAPS(
-        "video/x-raw, "
-        "format = (string) NV12, "
-        "width = (int) [ 1, MAX ], "
-        "height = (int) [ 1, MAX ], "
-        "framerate = (fraction) [ 0/1, MAX ]"
-    )
+    GST_STATIC_CAPS(OCL_SHADER_CAPS)
 );
 
-/* Source Pad supports NV12 */
+/* Source Pad supports the formats above */
 static GstStaticPadTemplate src_template =
 GST_STATIC_PAD_TEMPLATE(
     "src",
     GST_PAD_SRC,
     GST_PAD_ALWAYS,
-    GST_STATIC_CAPS(
-        "video/x-raw, "
-        "format = (string) NV12, "
-        "width = (int) [ 1, MAX ], "
-        "height = (int) [ 1, MAX ], "
-        "framerate = (fraction) [ 0/1, MAX ]"
-    )
+    GST_STATIC_CAPS(OCL_SHADER_CAPS)
 );
 
 /* ================= HELPERS ================= */
@@ -118,6 +542,31 @@ GST_STATIC_PAD_TEMPLATE(
         goto error; \
     }
 
+/* Code of format for the format kernel argument. */
+static GstOCLShaderFormat
+gst_ocl_shader_format_code(GstVideoFormat format)
+{
+    switch (format) {
+    case GST_VIDEO_FORMAT_I420:
+        return GST_OCL_SHADER_FORMAT_I420;
+    case GST_VIDEO_FORMAT_P010_10LE:
+        return GST_OCL_SHADER_FORMAT_P010;
+    case GST_VIDEO_FORMAT_RGBA:
+        return GST_OCL_SHADER_FORMAT_RGBA;
+    case GST_VIDEO_FORMAT_BGRx:
+        return GST_OCL_SHADER_FORMAT_BGRX;
+    default:
+        return GST_OCL_SHADER_FORMAT_NV12;
+    }
+}
+
+/* TRUE if plane 0 of format is 8-bit luma, what plain kernels work on. */
+static gboolean
+gst_ocl_shader_has_luma8(GstVideoFormat format)
+{
+    return format == GST_VIDEO_FORMAT_NV12 || format == GST_VIDEO_FORMAT_I420;
+}
+
 /* Load entire OpenCL kernel source file into a memory buffer. */
 static gchar *
 load_kernel_file(const gchar *path)
@@ -131,319 +580,4480 @@ load_kernel_file(const gchar *path)
     return data;
 }
 
-/* OpenCL queue with profiling enabled. */
-cl_queue_properties props[] = {
-    CL_QUEUE_PROPERTIES,
-    CL_QUEUE_PROFILING_ENABLE,
-    0
-};
+/* Release the resources of a chain stage. */
+static void
+gst_ocl_shader_stage_clear(GstOCLShaderStage *stage)
+{
+    if (stage->kernel)
+        clReleaseKernel(stage->kernel);
+    if (stage->vec_kernel)
+        clReleaseKernel(stage->vec_kernel);
+    if (stage->v_kernel)
+        clReleaseKernel(stage->v_kernel);
+    g_free(stage->name);
+    g_free(stage->ops);
+    g_free(stage->vec_name);
+    g_free(stage->v_name);
+    if (stage->args)
+        g_array_unref(stage->args);
+}
 
-/* ================= OPENCL INITIALIZATION =================*/
+/* Release the events of a frame slot. */
+static void
+gst_ocl_shader_release_events(GstOCLShaderSlot *slot)
+{
+    if (slot->write_start_evt) {
+        clReleaseEvent(slot->write_start_evt);
+        slot->write_start_evt = NULL;
+    }
+    if (slot->read_start_evt) {
+        clReleaseEvent(slot->read_start_evt);
+        slot->read_start_evt = NULL;
+    }
+    if (slot->write_evt) {
+        clReleaseEvent(slot->write_evt);
+        slot->write_evt = NULL;
+    }
+    if (slot->start_evt) {
+        clReleaseEvent(slot->start_evt);
+        slot->start_evt = NULL;
+    }
+    if (slot->kernel_evt) {
+        clReleaseEvent(slot->kernel_evt);
+        slot->kernel_evt = NULL;
+    }
+    if (slot->read_evt) {
+        clReleaseEvent(slot->read_evt);
+        slot->read_evt = NULL;
+    }
+}
+
+/* ================= GPU TIMING ================= */
+
+/* TRUE when evt has finished executing. */
 static gboolean
-gst_ocl_shader_set_info(GstVideoFilter *filter,
-                           GstCaps *incaps, GstVideoInfo *ininfo,
-                           GstCaps *outcaps, GstVideoInfo *outinfo)
+gst_ocl_shader_event_done(cl_event evt)
 {
-    GstOCLShader *self = (GstOCLShader *)filter;
+    cl_int status = -1;
 
-    if (!self->kernel_file || !g_file_test(self->kernel_file, G_FILE_TEST_EXISTS) || !self->kernel_func) {
-        GST_ERROR_OBJECT(self,
-            "kernel-file or kernel-func not set, running in bypass mode");
-        goto error;
-    }
+    clGetEventInfo(evt, CL_EVENT_COMMAND_EXECUTION_STATUS,
+                   sizeof(status), &status, NULL);
+    return status == CL_COMPLETE;
+}
 
-    cl_int err;
+/* Keep references to the events of a frame until its timings are read. */
+static void
+gst_ocl_shader_timing_set(GstOCLShaderTiming *t, GstOCLShaderPhase phase,
+                          cl_event first, cl_event last)
+{
+    if (first)
+        clRetainEvent(first);
+    if (last)
+        clRetainEvent(last);
+    t->evts[phase][0] = first;
+    t->evts[phase][1] = last;
+}
 
-    GST_INFO_OBJECT(self, "Initializing OpenCL");
+static void
+gst_ocl_shader_timing_free(GstOCLShaderTiming *t)
+{
+    for (guint p = 0; p < GST_OCL_SHADER_N_PHASES; p++) {
+        if (t->evts[p][0])
+            clReleaseEvent(t->evts[p][0]);
+        if (t->evts[p][1])
+            clReleaseEvent(t->evts[p][1]);
+    }
+    g_free(t);
+}
+
+/* Last command of a frame, the one finishing it. */
+static cl_event
+gst_ocl_shader_timing_last(GstOCLShaderTiming *t)
+{
+    for (gint p = GST_OCL_SHADER_N_PHASES - 1; p >= 0; p--) {
+        if (t->evts[p][1])
+            return t->evts[p][1];
+    }
+    return NULL;
+}
 
-    err = clGetPlatformIDs(1, &self->platform, NULL);
-    CHECK_CL(err, "clGetPlatformIDs");
+/* Snapshot of the statistics as an "ocl-stats" structure. */
+static GstStructure *
+gst_ocl_shader_get_stats(GstOCLShader *self)
+{
+    GstStructure *s = gst_structure_new_empty("ocl-stats");
+    GValue devices = G_VALUE_INIT;
+    gdouble transfer, kernel;
+    gint64 elapsed;
 
-    err = clGetDeviceIDs(self->platform, CL_DEVICE_TYPE_GPU,
-                          1, &self->device, NULL);
-    CHECK_CL(err, "clGetDeviceIDs");
+    GST_OBJECT_LOCK(self);
 
-    self->context = clCreateContext(NULL, 1,
-                                    &self->device,
-                                    NULL, NULL, &err);
-    CHECK_CL(err, "clCreateContext");
+    gst_structure_set(s, "frames", G_TYPE_UINT64, self->stats_frames, NULL);
 
-    self->queue = clCreateCommandQueueWithProperties(
-                    self->context, self->device, props, &err);
-    CHECK_CL(err, "clCreateCommandQueueWithProperties");
+    for (guint i = 0; i < GST_OCL_SHADER_N_STATS; i++) {
+        const ocl_stat *stat = &self->stats[i];
+        gchar *min = g_strdup_printf("%s-min", stat_names[i]);
+        gchar *avg = g_strdup_printf("%s-avg", stat_names[i]);
+        gchar *p99 = g_strdup_printf("%s-p99", stat_names[i]);
 
-    gchar *kernel_src = load_kernel_file(self->kernel_file);
-    if (!kernel_src) {
-        GST_ERROR_OBJECT(self,
-            "Failed to load kernel file: %s", self->kernel_file);
-        goto error;
+        gst_structure_set(s,
+                          min, G_TYPE_DOUBLE, ocl_stat_min(stat),
+                          avg, G_TYPE_DOUBLE, ocl_stat_avg(stat),
+                          p99, G_TYPE_DOUBLE, ocl_stat_percentile(stat, 99.0),
+                          NULL);
+        g_free(min);
+        g_free(avg);
+        g_free(p99);
     }
 
-    self->program = clCreateProgramWithSource(
-                        self->context, 1,
-                        (const char **)&kernel_src, NULL, &err);
-    CHECK_CL(err, "clCreateProgramWithSource");
+    transfer = ocl_stat_avg(&self->stats[GST_OCL_SHADER_STAT_UPLOAD]) +
+               ocl_stat_avg(&self->stats[GST_OCL_SHADER_STAT_DOWNLOAD]);
+    kernel = ocl_stat_avg(&self->stats[GST_OCL_SHADER_STAT_KERNEL]);
 
-    g_free(kernel_src);
+    /* Throughput of every lane since the first frame */
+    elapsed = self->loads_start ? g_get_monotonic_time() - self->loads_start : 0;
+    g_value_init(&devices, GST_TYPE_ARRAY);
+    for (guint i = 0; i <= self->n_lanes; i++) {
+        const GstOCLShaderLoad *load = &self->loads[i];
+        GstOCLContext *ocl = i > 0 ? self->lanes[i - 1].ocl
+                                   : self->ocl_ready ? self->ocl : NULL;
+        GValue device = G_VALUE_INIT;
 
-    err = clBuildProgram(self->program, 1,
-                         &self->device, NULL, NULL, NULL);
-    if (err != CL_SUCCESS) {
-        char log[4096];
-        clGetProgramBuildInfo(self->program, self->device,
-                              CL_PROGRAM_BUILD_LOG,
-                              sizeof(log), log, NULL);
-        GST_ERROR_OBJECT(self, "OpenCL build error:\n%s", log);
-        goto error;
+        g_value_init(&device, GST_TYPE_STRUCTURE);
+        g_value_take_boxed(&device, gst_structure_new("ocl-device",
+            "lane", G_TYPE_UINT, i,
+            "name", G_TYPE_STRING, ocl ? ocl->device_name : "none",
+            "frames", G_TYPE_UINT64, load->frames,
+            "frame-avg", G_TYPE_DOUBLE,
+            load->frames ? load->busy_us / load->frames : 0.0,
+            "fps", G_TYPE_DOUBLE,
+            elapsed > 0 ? load->frames * 1e6 / elapsed : 0.0,
+            NULL));
+        gst_value_array_append_value(&devices, &device);
+        g_value_unset(&device);
     }
 
-    self->kernel = clCreateKernel(
-                        self->program, self->kernel_func, &err);
-    CHECK_CL(err, "clCreateKernel");
+    GST_OBJECT_UNLOCK(self);
 
-    self->cl_ready = TRUE;
-    return TRUE;
+    gst_structure_take_value(s, "devices", &devices);
 
-error:
-    GST_ERROR_OBJECT(self,
-        "OpenCL unavailable, running in bypass mode");
-    self->cl_ready = FALSE;
-    return TRUE; /* Allow pipeline to continue */
+    gst_structure_set(s, "bound", G_TYPE_STRING,
+                      self->stats_frames == 0 ? "unknown" :
+                      transfer > kernel ? "transfer" : "compute", NULL);
+
+    return s;
 }
 
-/* ================= FRAME PROCESS ================= */
-static GstFlowReturn
-gst_ocl_shader_transform_frame(GstVideoFilter *filter,
-                                  GstVideoFrame *in,
-                                  GstVideoFrame *out)
+static void
+gst_ocl_shader_reset_stats(GstOCLShader *self)
 {
-    GstOCLShader *self = (GstOCLShader *)filter;
-    cl_int err;
-
-    gst_video_frame_copy(out, in);
-    self->frame_count++;
+    GST_OBJECT_LOCK(self);
+    for (guint i = 0; i < GST_OCL_SHADER_N_STATS; i++)
+        ocl_stat_reset(&self->stats[i]);
+    self->stats_frames = 0;
+    /* The averages stay, the scheduler goes on using them */
+    for (guint i = 0; i <= MAX_LANES; i++) {
+        self->loads[i].frames = 0;
+        self->loads[i].busy_us = 0;
+    }
+    self->loads_start = 0;
+    GST_OBJECT_UNLOCK(self);
+}
 
-    GST_LOG_OBJECT(self, "transform_frame(): frame=%" G_GUINT64_FORMAT " pts=%" GST_TIME_FORMAT, self->frame_count, GST_TIME_ARGS(GST_BUFFER_PTS(in->buffer)));
+/* Read the profiling info of a finished frame into the statistics. */
+static void
+gst_ocl_shader_record_timing(GstOCLShader *self, GstOCLShaderTiming *t)
+{
+    cl_ulong start[GST_OCL_SHADER_N_PHASES], end[GST_OCL_SHADER_N_PHASES];
+    gdouble us[GST_OCL_SHADER_N_STATS], busy = 0;
+    GstOCLShaderLoad *load = &self->loads[t->lane];
+    gboolean post;
 
-    if (!self->cl_ready) {
-        GST_WARNING_OBJECT(self, "OpenCL not ready, bypassing");
-        return GST_FLOW_OK;
+    for (guint p = 0; p < GST_OCL_SHADER_N_PHASES; p++) {
+        start[p] = ocl_event_time(t->evts[p][0], CL_PROFILING_COMMAND_START);
+        end[p] = ocl_event_time(t->evts[p][1], CL_PROFILING_COMMAND_END);
+        us[p] = ocl_event_interval_us(start[p], end[p]);
+        busy += MAX(us[p], 0.0);
     }
-    guint8 *y = GST_VIDEO_FRAME_PLANE_DATA(out, 0);
-    gint width  = GST_VIDEO_FRAME_WIDTH(out);
-    gint height = GST_VIDEO_FRAME_HEIGHT(out);
-    gint stride = GST_VIDEO_FRAME_PLANE_STRIDE(out, 0);
 
-    size_t size = stride * height;
-    int idx = self->frame_count % NUM_BUFFERS;
+    /* Time the frame sat on the device before its first kernel started */
+    us[GST_OCL_SHADER_STAT_QUEUE_WAIT] = ocl_event_interval_us(
+        end[GST_OCL_SHADER_PHASE_UPLOAD] ? end[GST_OCL_SHADER_PHASE_UPLOAD] :
+        ocl_event_time(t->evts[GST_OCL_SHADER_PHASE_KERNEL][0],
+                       CL_PROFILING_COMMAND_SUBMIT),
+        start[GST_OCL_SHADER_PHASE_KERNEL]);
 
-    /* Reallocate buffers on caps change */
-    if (size != self->buf_size) {
-        for (int i = 0; i < NUM_BUFFERS; i++) {
-            if (self->ybuf[i]) {
-                clReleaseMemObject(self->ybuf[i]);
-                self->ybuf[i] = NULL;
-            }
-        }
+    us[GST_OCL_SHADER_STAT_TOTAL] = ocl_event_interval_us(
+        start[GST_OCL_SHADER_PHASE_UPLOAD] ? start[GST_OCL_SHADER_PHASE_UPLOAD]
+                                           : start[GST_OCL_SHADER_PHASE_KERNEL],
+        end[GST_OCL_SHADER_PHASE_DOWNLOAD] ? end[GST_OCL_SHADER_PHASE_DOWNLOAD]
+                                           : end[GST_OCL_SHADER_PHASE_KERNEL]);
 
-        for (int i = 0; i < NUM_BUFFERS; i++) {
-            self->ybuf[i] = clCreateBuffer(
-                self->context,
-                CL_MEM_READ_WRITE,
-                size, NULL, &err);
-            CHECK_CL(err, "clCreateBuffer");
-        }
-
-        self->buf_size = size;
-        self->width = width;
-        self->height = height;
-        self->stride = stride;
+    GST_OBJECT_LOCK(self);
+    for (guint i = 0; i < GST_OCL_SHADER_N_STATS; i++) {
+        if (us[i] >= 0)
+            ocl_stat_add(&self->stats[i], us[i]);
     }
+    self->stats_frames++;
+    load->frames++;
+    load->busy_us += busy;
+    load->avg_us = load->frames == 1 ? busy
+                                     : load->avg_us + (busy - load->avg_us) / 8;
+    if (!self->loads_start)
+        self->loads_start = g_get_monotonic_time();
+    post = self->stats_interval > 0 &&
+           self->stats_frames % self->stats_interval == 0;
+    GST_OBJECT_UNLOCK(self);
 
-    /* Release previous events for this slot */
-    if (self->write_evt[idx]) {
-        clReleaseEvent(self->write_evt[idx]);
-        self->write_evt[idx] = NULL;
-    }
-    if (self->kernel_evt[idx]) {
-        clReleaseEvent(self->kernel_evt[idx]);
-        self->kernel_evt[idx] = NULL;
-    }
-    if (self->read_evt[idx]) {
-        clReleaseEvent(self->read_evt[idx]);
-        self->read_evt[idx] = NULL;
-    }
+    GST_LOG_OBJECT(self, "upload=%.1f kernel=%.1f download=%.1f "
+                   "queue-wait=%.1f total=%.1f us",
+                   us[GST_OCL_SHADER_STAT_UPLOAD], us[GST_OCL_SHADER_STAT_KERNEL],
+                   us[GST_OCL_SHADER_STAT_DOWNLOAD],
+                   us[GST_OCL_SHADER_STAT_QUEUE_WAIT],
+                   us[GST_OCL_SHADER_STAT_TOTAL]);
 
-    /* Async write */
-    err = clEnqueueWriteBuffer(self->queue,
-                               self->ybuf[idx], CL_FALSE,
-                               0, size, y,
-                               0, NULL, &self->write_evt[idx]);
-    CHECK_CL(err, "clEnqueueWriteBuffer");
-
-    /* OpenCL Kernel Argument, Modify this code if you are adding new arguments into OpenCL kernel function. */
-    err = clSetKernelArg(self->kernel, 0, sizeof(cl_mem), &self->ybuf[idx]);
-    CHECK_CL(err, "clSetKernelArg(0)");
-    err = clSetKernelArg(self->kernel, 1, sizeof(int), &width);
-    CHECK_CL(err, "clSetKernelArg(1)");
-    err = clSetKernelArg(self->kernel, 2, sizeof(int), &height);
-    CHECK_CL(err, "clSetKernelArg(2)");
-    err = clSetKernelArg(self->kernel, 3, sizeof(int), &stride);
-    CHECK_CL(err, "clSetKernelArg(3)");
-
-    size_t global[2] = { width, height };
-
-    GST_DEBUG_OBJECT(self, "Enqueue kernel global=(%zu x %zu)", global[0], global[1]);
+    gst_tracer_record_log(tr_frame, GST_OBJECT_NAME(self),
+                          MAX(us[GST_OCL_SHADER_STAT_UPLOAD], 0.0),
+                          MAX(us[GST_OCL_SHADER_STAT_KERNEL], 0.0),
+                          MAX(us[GST_OCL_SHADER_STAT_DOWNLOAD], 0.0),
+                          MAX(us[GST_OCL_SHADER_STAT_QUEUE_WAIT], 0.0),
+                          MAX(us[GST_OCL_SHADER_STAT_TOTAL], 0.0));
 
-    /* Kernel waits for write */
-    err = clEnqueueNDRangeKernel(self->queue,
-                                 self->kernel,
-                                 2, NULL,
-                                 global, NULL,
-                                 1, &self->write_evt[idx],
-                                 &self->kernel_evt[idx]);
-    CHECK_CL(err, "clEnqueueNDRangeKernel");
+    if (post)
+        gst_element_post_message(GST_ELEMENT(self),
+            gst_message_new_element(GST_OBJECT(self),
+                                    gst_ocl_shader_get_stats(self)));
+}
 
+/* Record the frames whose commands have finished, all of them if wait. */
+static void
+gst_ocl_shader_collect_timings(GstOCLShader *self, gboolean wait)
+{
+    GstOCLShaderTiming *t;
 
-    /* Read waits for kernel */
-    err = clEnqueueReadBuffer(self->queue,
-                              self->ybuf[idx], CL_FALSE,
-                              0, size, y,
-                              1, &self->kernel_evt[idx],
-                                &self->read_evt[idx]);
-    CHECK_CL(err, "clEnqueueReadBuffer");
+    while ((t = g_queue_peek_head(&self->timings))) {
+        cl_event last = gst_ocl_shader_timing_last(t);
 
-    /* Wait ONLY for this frame to complete */
-    clWaitForEvents(1, &self->read_evt[idx]);
+        if (last) {
+            if (wait)
+                clWaitForEvents(1, &last);
+            else if (!gst_ocl_shader_event_done(last))
+                break;
+            gst_ocl_shader_record_timing(self, t);
+        }
 
-    /* Cleanup events (mandatory) */
-    clReleaseEvent(self->write_evt[idx]);  self->write_evt[idx]  = NULL;
-    clReleaseEvent(self->kernel_evt[idx]); self->kernel_evt[idx] = NULL;
-    clReleaseEvent(self->read_evt[idx]);   self->read_evt[idx]   = NULL;
+        g_queue_pop_head(&self->timings);
+        gst_ocl_shader_timing_free(t);
+    }
+}
 
-    return GST_FLOW_OK;
-error:
-    GST_ERROR_OBJECT(self, "OpenCL execution failed");
-    return GST_FLOW_ERROR;
+/*
+ * Queue the timings of a frame; they are read once its commands are done
+ * so recording never blocks the streaming thread.
+ */
+static void
+gst_ocl_shader_add_timing(GstOCLShader *self, GstOCLShaderTiming *t)
+{
+    g_queue_push_tail(&self->timings, t);
+
+    /* Device-resident frames are never waited for, bound the backlog */
+    while (g_queue_get_length(&self->timings) > 4 * MAX_IN_FLIGHT) {
+        t = g_queue_pop_head(&self->timings);
+        gst_ocl_shader_timing_free(t);
+    }
+
+    gst_ocl_shader_collect_timings(self, FALSE);
 }
 
+/* Timings of a slot that went through upload, kernel and readback. */
 static void
-gst_ocl_shader_set_property(GObject *object,
-                               guint prop_id,
-                               const GValue *value,
-                               GParamSpec *pspec)
+gst_ocl_shader_add_slot_timing(GstOCLShader *self, GstOCLShaderSlot *slot)
 {
-    GstOCLShader *self = (GstOCLShader *)object;
+    GstOCLShaderTiming *t = g_new0(GstOCLShaderTiming, 1);
 
-    switch (prop_id) {
-        case PROP_KERNEL_FILE:
-            g_free(self->kernel_file);
-            self->kernel_file = g_value_dup_string(value);
+    gst_ocl_shader_timing_set(t, GST_OCL_SHADER_PHASE_UPLOAD,
+                              slot->write_start_evt, slot->write_evt);
+    gst_ocl_shader_timing_set(t, GST_OCL_SHADER_PHASE_KERNEL,
+                              slot->start_evt, slot->kernel_evt);
+    gst_ocl_shader_timing_set(t, GST_OCL_SHADER_PHASE_DOWNLOAD,
+                              slot->read_start_evt, slot->read_evt);
+    t->lane = slot->lane;
+    gst_ocl_shader_add_timing(self, t);
+}
 
-            GST_INFO_OBJECT(self,
-                "kernel-file set to: %s",
-                self->kernel_file ? self->kernel_file : "(null)");
+/* ================= KERNEL CHAIN ================= */
 
-            /* Force re-init on next set_info */
-            self->cl_ready = FALSE;
-            break;
+/* TRUE if kernel-chain or kernel-func names a kernel to run. */
+static gboolean
+gst_ocl_shader_has_chain(const gchar *kernel_chain, const gchar *kernel_func)
+{
+    return (kernel_chain && *kernel_chain) || (kernel_func && *kernel_func);
+}
 
-        case PROP_KERNEL_FUNC:
-            g_free(self->kernel_func);
-            self->kernel_func = g_value_dup_string(value);
+/*
+ * Kernel names of the chain: kernel-chain, else kernel-func. Empty when
+ * neither is set.
+ */
+static gchar **
+gst_ocl_shader_chain_names(const gchar *kernel_chain, const gchar *kernel_func)
+{
+    const gchar *chain = kernel_chain && *kernel_chain ? kernel_chain : kernel_func;
+    gchar **names;
+    guint n = 0;
 
-            GST_INFO_OBJECT(self,
-                "kernel-func set to: %s",
-                self->kernel_func ? self->kernel_func : "(null)");
+    if (!chain)
+        return g_new0(gchar *, 1);
 
-            /* Force re-init on next set_info */
-            self->cl_ready = FALSE;
-            break;
+    names = g_strsplit(chain, ",", -1);
 
-        default:
-            G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
-            break;
+    /* Drop empty entries such as in "a,,b" */
+    for (guint i = 0; names[i]; i++) {
+        g_strstrip(names[i]);
+        if (*names[i])
+            names[n++] = names[i];
+        else
+            g_free(names[i]);
     }
+    names[n] = NULL;
+
+    return names;
 }
 
-static void
-gst_ocl_shader_get_property(GObject *object,
-                               guint prop_id,
-                               GValue *value,
-                               GParamSpec *pspec)
+/* TRUE if source defines a function "<type> <name><suffix>(". */
+static gboolean
+gst_ocl_shader_defines(const gchar *source, const gchar *type,
+                       const gchar *name, const gchar *suffix)
 {
-    GstOCLShader *self = (GstOCLShader *)object;
+    gchar *escaped = g_regex_escape_string(name, -1);
+    gchar *pattern = g_strdup_printf("\\b%s\\s+%s%s\\s*\\(", type, escaped, suffix);
+    gboolean found = g_regex_match_simple(pattern, source, 0, 0);
 
-    switch (prop_id) {
-    case PROP_KERNEL_FILE:
-        g_value_set_string(value, self->kernel_file);
-        break;
+    g_free(pattern);
+    g_free(escaped);
 
-    case PROP_KERNEL_FUNC:
-        g_value_set_string(value, self->kernel_func);
-        break;
+    return found;
+}
 
-    default:
-        G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
-        break;
-    }
+/* TRUE if source defines the point-wise form name_px() of kernel name. */
+static gboolean
+gst_ocl_shader_is_pointwise(const gchar *source, const gchar *name)
+{
+    return gst_ocl_shader_defines(source, "uchar", name, "_px");
 }
 
-static void
-gst_ocl_shader_finalize(GObject *object)
+/* TRUE if name is a separable filter, a pair of kernels name_h and name_v. */
+static gboolean
+gst_ocl_shader_is_separable(const gchar *source, const gchar *name)
 {
-    GstOCLShader *self = (GstOCLShader *)object;
+    return gst_ocl_shader_defines(source, "void", name, "_h") &&
+           gst_ocl_shader_defines(source, "void", name, "_v");
+}
 
-    GST_DEBUG_OBJECT(self, "Finalizing OpenCL filter");
+/* TRUE if the vertical pass of separable filter name works on the luma plane. */
+static gboolean
+gst_ocl_shader_is_luma_separable(const gchar *source, const gchar *name)
+{
+    gchar *escaped = g_regex_escape_string(name, -1);
+    gchar *pattern = g_strdup_printf("\\bvoid\\s+%s_v\\s*\\(\\s*"
+                                     "__global\\s+uchar\\s*\\*", escaped);
+    gboolean found = g_regex_match_simple(pattern, source, 0, 0);
 
-    /* Release OpenCL events */
-    for (int i = 0; i < NUM_BUFFERS; i++) {
-        if (self->write_evt[i]) {
-            clReleaseEvent(self->write_evt[i]);
-            self->write_evt[i] = NULL;
-        }
-        if (self->kernel_evt[i]) {
-            clReleaseEvent(self->kernel_evt[i]);
-            self->kernel_evt[i] = NULL;
-        }
-        if (self->read_evt[i]) {
-            clReleaseEvent(self->read_evt[i]);
-            self->read_evt[i] = NULL;
-        }
-    }
+    g_free(pattern);
+    g_free(escaped);
 
-    /* Release OpenCL buffers */
-    for (int i = 0; i < NUM_BUFFERS; i++) {
-        if (self->ybuf[i]) {
-            clReleaseMemObject(self->ybuf[i]);
-            self->ybuf[i] = NULL;
-        }
-    }
+    return found;
+}
 
-    /* Release OpenCL kernel/program/queue/context */
-    if (self->kernel) {
-        clReleaseKernel(self->kernel);
-        self->kernel = NULL;
+/* TRUE if every op of names[0..n) has both name_px() and name_px16(). */
+static gboolean
+gst_ocl_shader_is_vectorizable(const gchar *source, gchar **names, guint n)
+{
+    for (guint i = 0; i < n; i++) {
+        if (!gst_ocl_shader_is_pointwise(source, names[i]) ||
+            !gst_ocl_shader_defines(source, "uchar16", names[i], "_px16"))
+            return FALSE;
     }
 
-    if (self->program) {
-        clReleaseProgram(self->program);
+    return TRUE;
+}
+
+/* Geometry arguments replaced by the constants of a specialized build. */
+static const gchar *specialized_geometry =
+    "#ifdef WIDTH\n"
+    "    width = WIDTH;\n"
+    "    height = HEIGHT;\n"
+    "    stride = STRIDE;\n"
+    "#endif\n";
+
+/* Append a kernel applying the point-wise ops names[0..n) in one pass. */
+static void
+gst_ocl_shader_generate_fused(GString *out, const gchar *kernel_name,
+                              gchar **names, guint n)
+{
+    g_string_append_printf(out,
+        "\n__kernel void %s(__global uchar *y,\n"
+        "                  int width,\n"
+        "                  int height,\n"
+        "                  int stride)\n"
+        "{\n"
+        "%s"
+        "    int x   = get_global_id(0);\n"
+        "    int yid = get_global_id(1);\n"
+        "\n"
+        "    if (x >= width || yid >= height)\n"
+        "        return;\n"
+        "\n"
+        "    int off = yid * stride + x;\n"
+        "    uchar v = y[off];\n"
+        "\n", kernel_name, specialized_geometry);
+
+    for (guint i = 0; i < n; i++)
+        g_string_append_printf(out,
+            "    v = %s_px(v, x, yid, width, height);\n", names[i]);
+
+    g_string_append(out,
+        "\n"
+        "    y[off] = v;\n"
+        "}\n");
+}
+
+/*
+ * Append a vertical pass running the luma pass v_name, then names[0..n)
+ * on the pixel it wrote while that is still in cache, instead of one more
+ * pass over the plane. Takes the arguments of v_name (convolve.cl).
+ */
+static void
+gst_ocl_shader_generate_epilogue(GString *out, const gchar *kernel_name,
+                                 const gchar *v_name, gchar **names, guint n)
+{
+    g_string_append_printf(out,
+        "\n__kernel void %s(__global uchar *img,\n"
+        "                  __global float *tmp,\n"
+        "                  int width,\n"
+        "                  int height,\n"
+        "                  int stride,\n"
+        "                  int radius,\n"
+        "                  __constant float *weights,\n"
+        "                  __local float *tile,\n"
+        "                  float amount)\n"
+        "{\n"
+        "    %s(img, tmp, width, height, stride, radius, weights, tile, amount);\n"
+        "\n"
+        "    int x   = get_global_id(0);\n"
+        "    int yid = get_global_id(1);\n"
+        "\n"
+        "    if (x >= width || yid >= height)\n"
+        "        return;\n"
+        "\n"
+        "    int off = yid * stride + x;\n"
+        "    uchar v = img[off];\n"
+        "\n", kernel_name, v_name);
+
+    for (guint i = 0; i < n; i++)
+        g_string_append_printf(out,
+            "    v = %s_px(v, x, yid, width, height);\n", names[i]);
+
+    g_string_append(out,
+        "\n"
+        "    img[off] = v;\n"
+        "}\n");
+}
+
+/*
+ * Append a row kernel applying names[0..n) to bytes bytes of a row per
+ * work-item: whole vectors with the _px16 forms, then the scalar tail at
+ * the end of the row with the _px forms. Launched on
+ * (ceil(width / bytes), height), no division per byte.
+ */
+static void
+gst_ocl_shader_generate_vector(GString *out, const gchar *kernel_name,
+                               gchar **names, guint n, guint bytes)
+{
+    g_string_append_printf(out,
+        "\n__kernel void %s(__global uchar *y,\n"
+        "                  int width,\n"
+        "                  int height,\n"
+        "                  int stride)\n"
+        "{\n"
+        "%s"
+        "    int x   = get_global_id(0) * %u;\n"
+        "    int yid = get_global_id(1);\n"
+        "\n"
+        "    if (yid >= height)\n"
+        "        return;\n"
+        "\n"
+        "    __global uchar *row = y + yid * stride;\n"
+        "    int end = min(x + %u, width);\n"
+        "\n"
+        "    for (; x + 16 <= end; x += 16) {\n"
+        "        uchar16 v = vload16(0, row + x);\n"
+        "\n", kernel_name, specialized_geometry, bytes, bytes);
+
+    for (guint i = 0; i < n; i++)
+        g_string_append_printf(out,
+            "        v = %s_px16(v, x, yid, width, height);\n", names[i]);
+
+    g_string_append(out,
+        "\n"
+        "        vstore16(v, 0, row + x);\n"
+        "    }\n"
+        "\n"
+        "    for (; x < end; x++) {\n"
+        "        uchar v = row[x];\n"
+        "\n");
+
+    for (guint i = 0; i < n; i++)
+        g_string_append_printf(out,
+            "        v = %s_px(v, x, yid, width, height);\n", names[i]);
+
+    g_string_append(out,
+        "\n"
+        "        row[x] = v;\n"
+        "    }\n"
+        "}\n");
+}
+
+/*
+ * Split the chain into stages. With fusion on, each run of point-wise
+ * kernels becomes one generated kernel appended to fused_src, or the end
+ * of the vertical pass of a luma separable filter right before it; any
+ * other kernel is a stage of its own, a separable filter a two-pass
+ * stage. Stages of vectorizable ops also get a generated row kernel when
+ * vector-bytes is set.
+ */
+static void
+gst_ocl_shader_plan_chain(GstOCLShader *self, GArray *stages, gchar **names,
+                          const gchar *source, GString *fused_src)
+{
+    guint i = 0;
+
+    while (names[i]) {
+        GstOCLShaderStage stage = { NULL, NULL, NULL, 1 };
+        guint j = i + 1;
+
+        if (gst_ocl_shader_is_separable(source, names[i])) {
+            stage.name = g_strdup_printf("%s_h", names[i]);
+            stage.v_name = g_strdup_printf("%s_v", names[i]);
+
+            if (self->fuse && gst_ocl_shader_is_luma_separable(source, names[i])) {
+                while (names[j] && gst_ocl_shader_is_pointwise(source, names[j]))
+                    j++;
+            }
+
+            stage.n_ops = j - i;
+
+            if (stage.n_ops > 1) {
+                gchar *saved = names[j];
+                gchar *v_name = stage.v_name;
+
+                stage.v_name = g_strdup_printf("ocl_fused_%u_v", stages->len);
+                gst_ocl_shader_generate_epilogue(fused_src, stage.v_name, v_name,
+                                                 &names[i + 1], stage.n_ops - 1);
+                g_free(v_name);
+
+                names[j] = NULL;
+                stage.ops = g_strjoinv("+", &names[i]);
+                names[j] = saved;
+            } else {
+                stage.ops = g_strdup(names[i]);
+            }
+
+            g_array_append_val(stages, stage);
+            i = j;
+            continue;
+        }
+
+        if (self->fuse && gst_ocl_shader_is_pointwise(source, names[i])) {
+            while (names[j] && gst_ocl_shader_is_pointwise(source, names[j]))
+                j++;
+        }
+
+        stage.n_ops = j - i;
+
+        if (stage.n_ops > 1) {
+            gchar *saved = names[j];
+
+            stage.name = g_strdup_printf("ocl_fused_%u", stages->len);
+            gst_ocl_shader_generate_fused(fused_src, stage.name,
+                                          &names[i], stage.n_ops);
+
+            /* Join names[i..j) */
+            names[j] = NULL;
+            stage.ops = g_strjoinv("+", &names[i]);
+            names[j] = saved;
+        } else {
+            stage.name = g_strdup(names[i]);
+            stage.ops = g_strdup(names[i]);
+        }
+
+        if (self->vector_bytes >= 16 &&
+            gst_ocl_shader_is_vectorizable(source, &names[i], stage.n_ops)) {
+            stage.vec_bytes = self->vector_bytes;
+            stage.vec_name = g_strdup_printf("ocl_vec_%u", stages->len);
+            gst_ocl_shader_generate_vector(fused_src, stage.vec_name,
+                                           &names[i], stage.n_ops,
+                                           stage.vec_bytes);
+        }
+
+        g_array_append_val(stages, stage);
+        i = j;
+    }
+}
+
+/*
+ * Describe the stages and the memory traffic fusion saves: every fused
+ * stage is one pass reading and writing the luma plane.
+ */
+static void
+gst_ocl_shader_report_chain(GstOCLShader *self, const GstVideoInfo *info)
+{
+    GString *report = g_string_new(NULL);
+    guint64 pass_bytes = 2 * (guint64)GST_VIDEO_INFO_PLANE_STRIDE(info, 0) *
+                         GST_VIDEO_INFO_HEIGHT(info);
+    guint n_ops = 0;
+    guint64 saved;
+
+    for (guint i = 0; i < self->stages->len; i++) {
+        GstOCLShaderStage *stage =
+            &g_array_index(self->stages, GstOCLShaderStage, i);
+
+        g_string_append_printf(report, stage->n_ops > 1 ? "%sfused(%s)" : "%s%s",
+                               i ? ", " : "", stage->ops);
+        if (stage->vec_kernel)
+            g_string_append_printf(report, "[v%u]", stage->vec_bytes);
+        n_ops += stage->n_ops;
+    }
+
+    saved = (n_ops - self->stages->len) * pass_bytes;
+
+    g_string_append_printf(report, "; %u ops in %u passes, %" G_GUINT64_FORMAT
+                           " bytes/frame saved", n_ops, self->stages->len, saved);
+
+    if (saved && GST_VIDEO_INFO_FPS_N(info) > 0)
+        g_string_append_printf(report, " (%.1f MB/s)",
+                               saved * GST_VIDEO_INFO_FPS_N(info) /
+                               (1e6 * GST_VIDEO_INFO_FPS_D(info)));
+
+    GST_INFO_OBJECT(self, "Kernel chain: %s", report->str);
+
+    GST_OBJECT_LOCK(self);
+    g_free(self->chain_report);
+    self->chain_report = g_string_free(report, FALSE);
+    GST_OBJECT_UNLOCK(self);
+}
+
+/* ================= KERNEL ARGUMENTS ================= */
+
+/* Bytes of an OpenCL C scalar type, or of the element a pointer type points to. */
+static size_t
+gst_ocl_shader_type_size(const gchar *type)
+{
+    static const struct { const gchar *name; size_t size; } scalars[] = {
+        { "char", 1 }, { "uchar", 1 }, { "bool", 1 },
+        { "short", 2 }, { "ushort", 2 }, { "half", 2 },
+        { "int", 4 }, { "uint", 4 }, { "float", 4 },
+        { "long", 8 }, { "ulong", 8 }, { "double", 8 },
+    };
+    gchar *base = g_strdup(type);
+    size_t size = 0;
+    gsize len;
+    guint lanes = 1;
+
+    /* "uchar4*" -> uchar x 4 */
+    g_strdelimit(base, "*", ' ');
+    g_strstrip(base);
+    len = strlen(base);
+    while (len > 0 && g_ascii_isdigit(base[len - 1]))
+        len--;
+    if (base[len])
+        lanes = atoi(base + len);
+    base[len] = '\0';
+
+    for (guint i = 0; i < G_N_ELEMENTS(scalars); i++) {
+        if (strcmp(base, scalars[i].name) == 0)
+            size = scalars[i].size * lanes;
+    }
+
+    g_free(base);
+    return size;
+}
+
+/* Free the strings of an argument, clear function of the args arrays. */
+static void
+gst_ocl_shader_arg_clear(GstOCLShaderArg *arg)
+{
+    g_free(arg->name);
+    g_free(arg->type);
+}
+
+/*
+ * Bind the arguments of the kernel of stage by name: the first __global
+ * pointer gets the frame, width/height/stride/total_pixels the frame
+ * geometry and any other scalar the field of that name in kernel-args.
+ * Without argument info (the program cache never hands out binaries that
+ * lost it, see ocl_cache_build_program) the stage keeps the (buf, width,
+ * height, stride) layout. Returns FALSE if an
+ * argument cannot be bound.
+ */
+static gboolean
+gst_ocl_shader_introspect(GstOCLShader *self, GstOCLShaderStage *stage)
+{
+    cl_uint n_args = 0;
+    gboolean has_frame = FALSE, has_height = FALSE, has_pixels = FALSE;
+    GArray *args;
+
+    if (clGetKernelInfo(stage->kernel, CL_KERNEL_NUM_ARGS,
+                        sizeof(n_args), &n_args, NULL) != CL_SUCCESS)
+        return TRUE;
+
+    args = g_array_sized_new(FALSE, TRUE, sizeof(GstOCLShaderArg), n_args);
+    g_array_set_clear_func(args, (GDestroyNotify)gst_ocl_shader_arg_clear);
+
+    for (cl_uint i = 0; i < n_args; i++) {
+        cl_kernel_arg_address_qualifier address;
+        gchar name[256], type[256];
+        GstOCLShaderArg arg = { GST_OCL_SHADER_ARG_USER };
+
+        if (clGetKernelArgInfo(stage->kernel, i, CL_KERNEL_ARG_ADDRESS_QUALIFIER,
+                               sizeof(address), &address, NULL) != CL_SUCCESS ||
+            clGetKernelArgInfo(stage->kernel, i, CL_KERNEL_ARG_NAME,
+                               sizeof(name), name, NULL) != CL_SUCCESS ||
+            clGetKernelArgInfo(stage->kernel, i, CL_KERNEL_ARG_TYPE_NAME,
+                               sizeof(type), type, NULL) != CL_SUCCESS) {
+            GST_DEBUG_OBJECT(self, "%s: no argument info, using "
+                             "(buf, width, height, stride)", stage->name);
+            g_array_unref(args);
+            return TRUE;
+        }
+
+        arg.name = g_strdup(name);
+        arg.type = g_strdup(type);
+        arg.size = gst_ocl_shader_type_size(type);
+
+        if (address == CL_KERNEL_ARG_ADDRESS_GLOBAL && !has_frame) {
+            arg.role = GST_OCL_SHADER_ARG_FRAME;
+            stage->elem_size = arg.size ? arg.size : 1;
+            has_frame = TRUE;
+        } else if (address != CL_KERNEL_ARG_ADDRESS_PRIVATE || arg.size == 0 ||
+                   arg.size > sizeof(arg.value)) {
+            GST_ERROR_OBJECT(self, "%s: cannot bind argument %u '%s %s'",
+                             stage->name, i, type, name);
+            gst_ocl_shader_arg_clear(&arg);
+            g_array_unref(args);
+            return FALSE;
+        } else if (strcmp(name, "width") == 0) {
+            arg.role = GST_OCL_SHADER_ARG_WIDTH;
+        } else if (strcmp(name, "height") == 0) {
+            arg.role = GST_OCL_SHADER_ARG_HEIGHT;
+            has_height = TRUE;
+        } else if (strcmp(name, "stride") == 0) {
+            arg.role = GST_OCL_SHADER_ARG_STRIDE;
+        } else if (strcmp(name, "total_pixels") == 0 || strcmp(name, "pixels") == 0) {
+            arg.role = GST_OCL_SHADER_ARG_PIXELS;
+            has_pixels = TRUE;
+        } else if (strcmp(name, "format") == 0) {
+            arg.role = GST_OCL_SHADER_ARG_FORMAT;
+            stage->any_format = TRUE;
+        } else if (sscanf(name, "offset%u", &arg.plane) == 1 &&
+                   arg.plane < GST_VIDEO_MAX_PLANES) {
+            arg.role = GST_OCL_SHADER_ARG_OFFSET;
+        } else if (sscanf(name, "stride%u", &arg.plane) == 1 &&
+                   arg.plane < GST_VIDEO_MAX_PLANES) {
+            arg.role = GST_OCL_SHADER_ARG_PLANE_STRIDE;
+        }
+
+        GST_DEBUG_OBJECT(self, "%s: arg %u %s %s (%s)", stage->name, i, type,
+                         name, arg.role == GST_OCL_SHADER_ARG_USER ? "kernel-args"
+                                                                   : "frame");
+        g_array_append_val(args, arg);
+    }
+
+    if (!has_frame) {
+        GST_ERROR_OBJECT(self, "%s: no __global argument for the frame",
+                         stage->name);
+        g_array_unref(args);
+        return FALSE;
+    }
+
+    stage->args = args;
+    stage->linear = has_pixels && !has_height;
+    stage->args_cookie = 0; /* user values resolved on the first frame */
+
+    return TRUE;
+}
+
+/* Convert a numeric GValue to the OpenCL scalar type into out. */
+static gboolean
+gst_ocl_shader_arg_convert(const GValue *value, const gchar *type, guint64 *out)
+{
+    GValue d = G_VALUE_INIT;
+    gdouble v;
+
+    g_value_init(&d, G_TYPE_DOUBLE);
+    if (!g_value_transform(value, &d))
+        return FALSE;
+    v = g_value_get_double(&d);
+
+    *out = 0;
+    if (strcmp(type, "float") == 0)
+        *(gfloat *)out = v;
+    else if (strcmp(type, "double") == 0)
+        *(gdouble *)out = v;
+    else if (strcmp(type, "char") == 0)
+        *(gint8 *)out = v;
+    else if (strcmp(type, "uchar") == 0 || strcmp(type, "bool") == 0)
+        *(guint8 *)out = v;
+    else if (strcmp(type, "short") == 0)
+        *(gint16 *)out = v;
+    else if (strcmp(type, "ushort") == 0)
+        *(guint16 *)out = v;
+    else if (strcmp(type, "int") == 0)
+        *(gint32 *)out = v;
+    else if (strcmp(type, "uint") == 0)
+        *(guint32 *)out = v;
+    else if (strcmp(type, "long") == 0)
+        *(gint64 *)out = v;
+    else if (strcmp(type, "ulong") == 0)
+        *out = v;
+    else
+        return FALSE;
+
+    return TRUE;
+}
+
+/*
+ * Refresh the user scalars of stage from kernel-args if it changed since
+ * they were resolved. Missing fields are 0.
+ */
+static void
+gst_ocl_shader_resolve_args(GstOCLShader *self, GstOCLShaderStage *stage)
+{
+    GST_OBJECT_LOCK(self);
+
+    if (stage->args_cookie == self->args_cookie) {
+        GST_OBJECT_UNLOCK(self);
+        return;
+    }
+
+    for (guint i = 0; i < stage->args->len; i++) {
+        GstOCLShaderArg *arg = &g_array_index(stage->args, GstOCLShaderArg, i);
+        const GValue *value;
+
+        if (arg->role != GST_OCL_SHADER_ARG_USER)
+            continue;
+
+        value = self->kernel_args
+                ? gst_structure_get_value(self->kernel_args, arg->name) : NULL;
+        if (!value) {
+            GST_WARNING_OBJECT(self, "%s: '%s' not in kernel-args, using 0",
+                               stage->name, arg->name);
+            arg->value = 0;
+        } else if (!gst_ocl_shader_arg_convert(value, arg->type, &arg->value)) {
+            GST_WARNING_OBJECT(self, "%s: kernel-args '%s' is not a %s, using 0",
+                               stage->name, arg->name, arg->type);
+            arg->value = 0;
+        }
+    }
+
+    stage->args_cookie = self->args_cookie;
+    GST_OBJECT_UNLOCK(self);
+}
+
+/*
+ * FALSE if a stage only works on an 8-bit luma plane, no format argument,
+ * and format has none.
+ */
+static gboolean
+gst_ocl_shader_stages_support(GstOCLShader *self, GArray *stages,
+                              GstVideoFormat format)
+{
+    if (gst_ocl_shader_has_luma8(format))
+        return TRUE;
+
+    for (guint i = 0; i < stages->len; i++) {
+        GstOCLShaderStage *stage = &g_array_index(stages, GstOCLShaderStage, i);
+
+        if (!stage->any_format) {
+            GST_ERROR_OBJECT(self, "%s works on 8-bit luma, not on %s",
+                             stage->ops, gst_video_format_to_string(format));
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+/* ================= OPENCL INITIALIZATION =================*/
+
+static void
+gst_ocl_shader_conv_clear(GstOCLShaderConv *conv)
+{
+    if (conv->tmp) {
+        clReleaseMemObject(conv->tmp);
+        conv->tmp = NULL;
+        conv->tmp_size = 0;
+    }
+
+    if (conv->weights) {
+        clReleaseMemObject(conv->weights);
+        conv->weights = NULL;
+    }
+}
+
+static void gst_ocl_shader_lane_release_program(GstOCLShaderLane *lane);
+
+/* Release the program, kernel and per-frame device resources. */
+static void
+gst_ocl_shader_release_program(GstOCLShader *self)
+{
+    for (int i = 0; i < MAX_IN_FLIGHT; i++) {
+        gst_ocl_shader_release_events(&self->slots[i]);
+        if (self->slots[i].ybuf) {
+            clReleaseMemObject(self->slots[i].ybuf);
+            self->slots[i].ybuf = NULL;
+        }
+    }
+    self->buf_size = 0;
+
+    if (self->scratch) {
+        clReleaseMemObject(self->scratch);
+        self->scratch = NULL;
+        self->scratch_size = 0;
+    }
+
+    gst_ocl_shader_conv_clear(&self->conv);
+
+    g_array_set_size(self->stages, 0);
+
+    if (self->program) {
+        clReleaseProgram(self->program);
         self->program = NULL;
     }
+    g_clear_pointer(&self->program_spec, g_free);
+    g_clear_pointer(&self->program_source, g_free);
+    g_clear_pointer(&self->program_options, g_free);
+    self->program_generation++;
+    self->spec_width = self->spec_height = self->spec_stride = 0;
+
+    for (guint i = 0; i < self->n_lanes; i++)
+        gst_ocl_shader_lane_release_program(&self->lanes[i]);
+}
+
+static void gst_ocl_shader_lanes_open(GstOCLShader *self);
+static void gst_ocl_shader_lanes_close(GstOCLShader *self);
+
+static void
+gst_ocl_shader_release_queues(GstOCLShader *self)
+{
+    if (self->queue) {
+        clReleaseCommandQueue(self->queue);
+        self->queue = NULL;
+    }
+
+    if (self->upload_queue) {
+        clReleaseCommandQueue(self->upload_queue);
+        self->upload_queue = NULL;
+    }
+
+    if (self->download_queue) {
+        clReleaseCommandQueue(self->download_queue);
+        self->download_queue = NULL;
+    }
+}
+
+/*
+ * Acquire the shared OpenCL context and create this element's queues.
+ * Both are kept until READY->NULL, so caps changes reuse them.
+ */
+static gboolean
+gst_ocl_shader_open(GstOCLShader *self)
+{
+    GstOCLShaderDeviceType device_type;
+    cl_int err;
+
+    if (self->queue)
+        return TRUE;
+
+    GST_OBJECT_LOCK(self);
+    device_type = self->device_type;
+    GST_OBJECT_UNLOCK(self);
+
+    if (!gst_ocl_context_ensure(GST_ELEMENT(self),
+            gst_ocl_shader_cl_device_type(device_type), &self->ocl)) {
+        GST_WARNING_OBJECT(self, "No OpenCL context available");
+        return FALSE;
+    }
+
+    GST_INFO_OBJECT(self, "Using OpenCL context %p on %s '%s'", self->ocl,
+                    gst_ocl_device_type_name(self->ocl->device_type),
+                    self->ocl->device_name);
+
+    self->queue = gst_ocl_context_create_queue(self->ocl, &err);
+    CHECK_CL(err, "clCreateCommandQueueWithProperties");
+
+    /* Separate in-order queues so uploads and readbacks of neighbouring
+     * frames can overlap with the kernel of the current one. */
+    self->upload_queue = gst_ocl_context_create_queue(self->ocl, &err);
+    CHECK_CL(err, "clCreateCommandQueueWithProperties(upload)");
+
+    self->download_queue = gst_ocl_context_create_queue(self->ocl, &err);
+    CHECK_CL(err, "clCreateCommandQueueWithProperties(download)");
+
+    gst_ocl_shader_lanes_open(self);
+
+    /* Other threads only use the context from here on */
+    GST_OBJECT_LOCK(self);
+    self->ocl_ready = TRUE;
+    GST_OBJECT_UNLOCK(self);
+
+    return TRUE;
+
+error:
+    /* No half-open state, the next call starts over */
+    gst_ocl_shader_release_queues(self);
+    return FALSE;
+}
+
+/*
+ * The context with a reference once gst_ocl_shader_open() is done with
+ * it, else NULL. Threads other than the one opening, such as caps and
+ * allocation queries with startup-policy=bypass, go through this.
+ */
+static GstOCLContext *
+gst_ocl_shader_get_context(GstOCLShader *self)
+{
+    GstOCLContext *ocl = NULL;
+
+    GST_OBJECT_LOCK(self);
+    if (self->ocl_ready)
+        ocl = gst_ocl_context_ref(self->ocl);
+    GST_OBJECT_UNLOCK(self);
+
+    return ocl;
+}
+
+static void gst_ocl_shader_stop_reload(GstOCLShader *self);
+static void gst_ocl_shader_spec_clear(GstOCLShader *self);
+static void gst_ocl_shader_host_stop(GstOCLShader *self);
+static GstOCLShaderStartup gst_ocl_shader_take_startup(GstOCLShader *self,
+                                                       gboolean wait);
+static gboolean gst_ocl_shader_take_warmup(GstOCLShader *self, gboolean wait);
+
+/* Release everything created on the shared context, and the context. */
+static void
+gst_ocl_shader_close(GstOCLShader *self)
+{
+    /* Builds run on the shared context; a startup program is released
+     * with the rest below */
+    gst_ocl_shader_take_startup(self, TRUE);
+    gst_ocl_shader_take_warmup(self, TRUE);
+
+    GST_OBJECT_LOCK(self);
+    self->ocl_ready = FALSE;
+    GST_OBJECT_UNLOCK(self);
+
+    gst_ocl_shader_stop_reload(self);
+    gst_ocl_shader_collect_timings(self, TRUE);
+    gst_ocl_shader_release_program(self);
+    gst_ocl_shader_spec_clear(self);
+    gst_ocl_shader_host_stop(self);
+    gst_ocl_shader_lanes_close(self);
+
+    gst_ocl_shader_release_queues(self);
+
+    if (self->ocl) {
+        gst_ocl_context_unref(self->ocl);
+        self->ocl = NULL;
+    }
+
+    self->cl_ready = FALSE;
+}
+
+/* Empty stage array, stages are released with it. */
+static GArray *
+gst_ocl_shader_stages_new(void)
+{
+    GArray *stages = g_array_new(FALSE, TRUE, sizeof(GstOCLShaderStage));
+
+    g_array_set_clear_func(stages, (GDestroyNotify)gst_ocl_shader_stage_clear);
+
+    return stages;
+}
+
+/*
+ * Create the kernels of the planned stages in program and find how to bind
+ * their arguments. On failure *log says why; what names the source.
+ */
+static void
+gst_ocl_shader_create_kernels(GstOCLShader *self, cl_program program,
+                              GArray *stages, const gchar *what, gchar **log)
+{
+    cl_int err;
+
+    for (guint i = 0; i < stages->len && !*log; i++) {
+        GstOCLShaderStage *stage = &g_array_index(stages, GstOCLShaderStage, i);
+
+        stage->kernel = clCreateKernel(program, stage->name, &err);
+        if (err != CL_SUCCESS) {
+            gchar names[4096] = "";
+
+            clGetProgramInfo(program, CL_PROGRAM_KERNEL_NAMES,
+                             sizeof(names) - 1, names, NULL);
+            *log = g_strdup_printf("No kernel '%s' in %s (kernels: %s)",
+                                   stage->name, what, names);
+            break;
+        }
+
+        /* Separable passes have the convolve.cl layout */
+        if (!stage->v_name && !gst_ocl_shader_introspect(self, stage))
+            *log = g_strdup_printf("Cannot bind the arguments of %s",
+                                   stage->name);
+
+        if (stage->vec_name) {
+            stage->vec_kernel = clCreateKernel(program, stage->vec_name, &err);
+            if (err != CL_SUCCESS && !*log)
+                *log = g_strdup_printf("clCreateKernel(%s) failed (%d)",
+                                       stage->vec_name, err);
+        }
+
+        if (stage->v_name) {
+            stage->v_kernel = clCreateKernel(program, stage->v_name, &err);
+            if (err != CL_SUCCESS && !*log)
+                *log = g_strdup_printf("No kernel '%s' in %s", stage->v_name,
+                                       what);
+            else if (err == CL_SUCCESS)
+                stage->conv_local = ocl_conv_local(stage->kernel,
+                                                   stage->v_kernel);
+        }
+    }
+}
+
+/*
+ * Build the kernel chain of the current properties: plan the stages, build
+ * the program (from the cache when possible) and create the kernels. Only
+ * reads the properties and the shared context, so it also runs on the
+ * startup and hot-reload threads. Returns the program, also set in
+ * variant with the stages, or NULL with a message in *log.
+ */
+static cl_program
+gst_ocl_shader_build(GstOCLShader *self, GstOCLShaderVariant *variant,
+                     gchar **log)
+{
+    gchar *kernel_file, *kernel_func, *kernel_chain, *cache_dir;
+    gchar *kernel_src = NULL, *build_log = NULL, *spec;
+    gchar default_dir[4096];
+    GArray *stages = gst_ocl_shader_stages_new();
+    /* Argument names are needed to bind kernel arguments */
+    GString *options = g_string_new("-cl-kernel-arg-info");
+    cl_program program = NULL;
+    guint cookie;
+    cl_int err;
+
+    GST_OBJECT_LOCK(self);
+    kernel_file = g_strdup(self->kernel_file);
+    kernel_func = g_strdup(self->kernel_func);
+    kernel_chain = g_strdup(self->kernel_chain);
+    /* NULL cache-dir means the default location, "" disables the cache */
+    cache_dir = g_strdup(self->cache_dir
+                         ? self->cache_dir
+                         : ocl_cache_default_dir(default_dir,
+                                                 sizeof(default_dir)));
+    if (self->build_options)
+        g_string_append_printf(options, " %s", self->build_options);
+    spec = g_strdup(self->spec);
+    cookie = self->build_cookie;
+    GST_OBJECT_UNLOCK(self);
+
+    /* -D options of the geometry set_info specialized for */
+    if (spec)
+        g_string_append_printf(options, " %s", spec);
+
+    gchar *file_src = kernel_file ? load_kernel_file(kernel_file) : NULL;
+    if (!file_src) {
+        *log = g_strdup_printf("Failed to load kernel file: %s",
+                               kernel_file ? kernel_file : "(null)");
+        goto out;
+    }
+
+    /* Fused stages are generated kernels appended to the file */
+    gchar **names = gst_ocl_shader_chain_names(kernel_chain, kernel_func);
+    GString *fused_src = g_string_new(file_src);
+
+    gst_ocl_shader_plan_chain(self, stages, names, file_src, fused_src);
+    g_strfreev(names);
+    g_free(file_src);
+    kernel_src = g_string_free(fused_src, FALSE);
+
+    if (stages->len == 0) {
+        *log = g_strdup("Empty kernel chain");
+        goto out;
+    }
+
+    gint64 build_start = g_get_monotonic_time();
+
+    program = gst_ocl_context_get_program(self->ocl, kernel_src, options->str,
+                                          cache_dir, &build_log, &err);
+    if (!program) {
+        *log = g_strdup_printf("OpenCL build error (%d):\n%s", err,
+                               build_log ? build_log : "");
+        goto out;
+    }
+
+    GST_INFO_OBJECT(self, "Program (%s) ready in %" G_GINT64_FORMAT " us "
+                    "(cache %s: hits=%lu misses=%lu stores=%lu invalidated=%lu "
+                    "reused=%" G_GUINT64_FORMAT ")", options->str,
+                    g_get_monotonic_time() - build_start,
+                    cache_dir && *cache_dir ? cache_dir : "disabled",
+                    self->ocl->cache_stats.hits, self->ocl->cache_stats.misses,
+                    self->ocl->cache_stats.stores,
+                    self->ocl->cache_stats.invalidations,
+                    self->ocl->program_reuses);
+
+    gst_ocl_shader_create_kernels(self, program, stages, kernel_file, log);
+
+    /* The lanes' contexts build it here too, off the streaming thread; the
+     * lanes take it from their program table when it starts running */
+    for (guint i = 0; i < self->n_lanes && !*log; i++) {
+        GstOCLContext *ocl = self->lanes[i].ocl;
+        cl_program built;
+
+        if (ocl == self->ocl)
+            continue;
+
+        built = gst_ocl_context_get_program(ocl, kernel_src, options->str,
+                                            cache_dir, NULL, &err);
+        if (built)
+            clReleaseProgram(built);
+        else
+            GST_WARNING_OBJECT(self, "Build on '%s' failed (%d), the lane "
+                               "will sit out", ocl->device_name, err);
+    }
+
+out:
+    if (*log && program) {
+        clReleaseProgram(program);
+        program = NULL;
+    }
+    if (program) {
+        variant->program = program;
+        variant->stages = stages;
+        variant->spec = spec;
+        variant->cookie = cookie;
+        variant->source = kernel_src;
+        variant->options = g_strdup(options->str);
+        kernel_src = NULL;
+    } else {
+        g_array_unref(stages);
+        g_free(spec);
+    }
+
+    g_string_free(options, TRUE);
+    g_free(build_log);
+    g_free(kernel_src);
+    g_free(kernel_file);
+    g_free(kernel_func);
+    g_free(kernel_chain);
+    g_free(cache_dir);
+
+    return program;
+}
+
+/* ================= SPECIALIZATION ================= */
+
+/*
+ * With specialize on, the chain is rebuilt for the negotiated geometry
+ * with -DWIDTH, -DHEIGHT and -DSTRIDE, so kernels testing #ifdef WIDTH
+ * (the generated fused and vector kernels do) get constants the compiler
+ * can fold into the bounds checks and index math. Meanwhile the generic
+ * program keeps running. Programs of the last SPECIALIZE_CACHE_SIZE
+ * geometries stay built, so switching back to a known resolution only
+ * swaps kernels.
+ */
+
+#define SPECIALIZE_FLAGS "-cl-mad-enable -cl-no-signed-zeros"
+#define SPECIALIZE_CACHE_SIZE 4
+
+static void gst_ocl_shader_start_startup(GstOCLShader *self);
+static gboolean gst_ocl_shader_build_now(GstOCLShader *self);
+
+static gchar *
+gst_ocl_shader_spec_new(gint width, gint height, gint stride)
+{
+    return g_strdup_printf("-DWIDTH=%d -DHEIGHT=%d -DSTRIDE=%d "
+                           SPECIALIZE_FLAGS, width, height, stride);
+}
+
+static void
+gst_ocl_shader_variant_free(GstOCLShaderVariant *variant)
+{
+    clReleaseProgram(variant->program);
+    g_array_unref(variant->stages);
+    g_free(variant->spec);
+    g_free(variant->source);
+    g_free(variant->options);
+    g_free(variant);
+}
+
+static void
+gst_ocl_shader_spec_clear(GstOCLShader *self)
+{
+    GstOCLShaderVariant *variant;
+
+    while ((variant = g_queue_pop_head(&self->variants)))
+        gst_ocl_shader_variant_free(variant);
+}
+
+/* Move the running program to the cache of variants. */
+static void
+gst_ocl_shader_spec_store(GstOCLShader *self)
+{
+    GstOCLShaderVariant *variant;
+
+    if (!self->program)
+        return;
+
+    variant = g_new0(GstOCLShaderVariant, 1);
+    variant->program = self->program;
+    variant->stages = self->stages;
+    variant->spec = self->program_spec;
+    variant->cookie = self->program_cookie;
+    variant->source = self->program_source;
+    variant->options = self->program_options;
+    g_queue_push_head(&self->variants, variant);
+
+    while (g_queue_get_length(&self->variants) > SPECIALIZE_CACHE_SIZE)
+        gst_ocl_shader_variant_free(g_queue_pop_tail(&self->variants));
+
+    self->program = NULL;
+    self->program_spec = NULL;
+    self->program_source = NULL;
+    self->program_options = NULL;
+    self->program_generation++;
+    self->stages = gst_ocl_shader_stages_new();
+}
+
+/* Take the cached variant of spec built from the current properties. */
+static GstOCLShaderVariant *
+gst_ocl_shader_spec_lookup(GstOCLShader *self, const gchar *spec)
+{
+    guint cookie;
+
+    GST_OBJECT_LOCK(self);
+    cookie = self->build_cookie;
+    GST_OBJECT_UNLOCK(self);
+
+    for (GList *l = self->variants.head; l; l = l->next) {
+        GstOCLShaderVariant *variant = l->data;
+
+        if (variant->cookie == cookie && g_strcmp0(variant->spec, spec) == 0) {
+            g_queue_delete_link(&self->variants, l);
+            return variant;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Run variant from the next launch, the running program goes to the
+ * cache. Commands already enqueued keep the kernels they use alive.
+ */
+static void
+gst_ocl_shader_install(GstOCLShader *self, GstOCLShaderVariant *variant)
+{
+    gboolean luma_only = FALSE, changed;
+
+    gst_ocl_shader_spec_store(self);
+
+    g_array_unref(self->stages);
+    self->program = variant->program;
+    self->stages = variant->stages;
+    self->program_spec = variant->spec;
+    self->program_cookie = variant->cookie;
+    self->program_source = variant->source;
+    self->program_options = variant->options;
+    self->program_generation++;
+    g_free(variant);
+
+    for (guint i = 0; i < self->stages->len; i++)
+        if (!g_array_index(self->stages, GstOCLShaderStage, i).any_format)
+            luma_only = TRUE;
+
+    /* Renegotiate when the formats the chain takes changed */
+    GST_OBJECT_LOCK(self);
+    changed = self->luma_only != luma_only;
+    self->luma_only = luma_only;
+    GST_OBJECT_UNLOCK(self);
+    if (changed)
+        gst_base_transform_reconfigure_src(GST_BASE_TRANSFORM(self));
+
+    self->spec_width = self->spec_height = self->spec_stride = 0;
+    if (self->program_spec)
+        sscanf(self->program_spec, "-DWIDTH=%d -DHEIGHT=%d -DSTRIDE=%d",
+               &self->spec_width, &self->spec_height, &self->spec_stride);
+}
+
+/*
+ * Run the program of the current spec: a cached one, else the running
+ * program until one is built in the background, else one built here
+ * (the generic program meanwhile when it is cached). Returns FALSE when
+ * nothing can run.
+ */
+static gboolean
+gst_ocl_shader_specialize(GstOCLShader *self)
+{
+    GstOCLShaderVariant *variant;
+    gboolean ret = TRUE;
+    gchar *spec;
+
+    GST_OBJECT_LOCK(self);
+    spec = g_strdup(self->spec);
+    GST_OBJECT_UNLOCK(self);
+
+    if (self->program && g_strcmp0(self->program_spec, spec) == 0)
+        goto out;
+
+    if ((variant = gst_ocl_shader_spec_lookup(self, spec))) {
+        GST_INFO_OBJECT(self, "Using the built program for %s",
+                        spec ? spec : "any geometry");
+        gst_ocl_shader_install(self, variant);
+        goto out;
+    }
+
+    if (!self->program && spec &&
+        (variant = gst_ocl_shader_spec_lookup(self, NULL)))
+        gst_ocl_shader_install(self, variant);
+
+    if (self->program) {
+        GST_INFO_OBJECT(self, "Building for %s in the background",
+                        spec ? spec : "any geometry");
+        gst_ocl_shader_start_startup(self);
+        self->startup_pending = TRUE;
+    } else {
+        ret = gst_ocl_shader_build_now(self);
+    }
+
+out:
+    g_free(spec);
+    return ret;
+}
+
+/* ================= HOT RELOAD ================= */
+
+/*
+ * With hot-reload on, a thread with its own main context watches the
+ * kernel file. A change (or a new kernel-file/func/chain) is rebuilt
+ * there after RELOAD_SETTLE_MS without new events, while frames keep
+ * running the current kernels; the next frame then switches to the new
+ * program. A failed build is reported and the current kernels stay.
+ */
+
+#define RELOAD_SETTLE_MS 200 /* editors save in several writes */
+
+static gboolean gst_ocl_shader_reload_build(gpointer data);
+
+/* Restart the settle timer, on the reload thread. */
+static gboolean
+gst_ocl_shader_reload_arm(gpointer data)
+{
+    GstOCLShader *self = data;
+
+    if (self->reload_timer) {
+        g_source_destroy(self->reload_timer);
+        g_source_unref(self->reload_timer);
+    }
+
+    self->reload_timer = g_timeout_source_new(RELOAD_SETTLE_MS);
+    g_source_set_callback(self->reload_timer, gst_ocl_shader_reload_build,
+                          self, NULL);
+    g_source_attach(self->reload_timer, self->reload_ctx);
+
+    return G_SOURCE_REMOVE;
+}
+
+static void
+gst_ocl_shader_file_changed(GFileMonitor *monitor, GFile *file, GFile *other,
+                            GFileMonitorEvent event, gpointer data)
+{
+    /* Saved in place, or replaced by a rename */
+    if (event == G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT ||
+        event == G_FILE_MONITOR_EVENT_CREATED)
+        gst_ocl_shader_reload_arm(data);
+}
+
+/* Monitor the current kernel-file, on the reload thread. */
+static void
+gst_ocl_shader_reload_watch(GstOCLShader *self)
+{
+    GError *error = NULL;
+    GFile *file;
+    gchar *path;
+
+    GST_OBJECT_LOCK(self);
+    path = g_strdup(self->kernel_file);
+    GST_OBJECT_UNLOCK(self);
+
+    if (!path || g_strcmp0(path, self->reload_path) == 0) {
+        g_free(path);
+        return;
+    }
+
+    g_clear_object(&self->reload_monitor);
+    g_free(self->reload_path);
+    self->reload_path = path;
+
+    file = g_file_new_for_path(path);
+    self->reload_monitor = g_file_monitor_file(file, G_FILE_MONITOR_NONE,
+                                               NULL, &error);
+    g_object_unref(file);
+
+    if (!self->reload_monitor) {
+        GST_WARNING_OBJECT(self, "Cannot watch %s: %s", path, error->message);
+        g_error_free(error);
+        return;
+    }
+
+    g_signal_connect(self->reload_monitor, "changed",
+                     G_CALLBACK(gst_ocl_shader_file_changed), self);
+    GST_INFO_OBJECT(self, "Watching %s for changes", path);
+}
+
+/* Rebuild and hand the result to the streaming thread. */
+static gboolean
+gst_ocl_shader_reload_build(gpointer data)
+{
+    GstOCLShader *self = data;
+    GstOCLShaderVariant *variant = g_new0(GstOCLShaderVariant, 1);
+    gchar *log = NULL;
+    gint64 start = g_get_monotonic_time();
+
+    g_source_unref(self->reload_timer);
+    self->reload_timer = NULL;
+
+    /* kernel-file may have changed */
+    gst_ocl_shader_reload_watch(self);
+
+    GST_INFO_OBJECT(self, "Rebuilding the kernels in the background");
+
+    if (!gst_ocl_shader_build(self, variant, &log)) {
+        GST_ELEMENT_WARNING(self, LIBRARY, INIT,
+                            ("Kernel reload failed, keeping the running kernels"),
+                            ("%s", log));
+        g_free(log);
+        g_free(variant);
+        return G_SOURCE_REMOVE;
+    }
+
+    /* A newer build replaces one no frame has picked up yet */
+    g_mutex_lock(&self->reload_lock);
+    if (self->reload_variant)
+        gst_ocl_shader_variant_free(self->reload_variant);
+    self->reload_variant = variant;
+    g_mutex_unlock(&self->reload_lock);
+
+    GST_INFO_OBJECT(self, "Reloaded kernels ready in %" G_GINT64_FORMAT " us",
+                    g_get_monotonic_time() - start);
+
+    return G_SOURCE_REMOVE;
+}
+
+static gpointer
+gst_ocl_shader_reload_thread(gpointer data)
+{
+    GstOCLShader *self = data;
+
+    g_main_context_push_thread_default(self->reload_ctx);
+
+    gst_ocl_shader_reload_watch(self);
+    g_main_loop_run(self->reload_loop);
+
+    if (self->reload_timer) {
+        g_source_destroy(self->reload_timer);
+        g_source_unref(self->reload_timer);
+        self->reload_timer = NULL;
+    }
+    g_clear_object(&self->reload_monitor);
+    g_clear_pointer(&self->reload_path, g_free);
+
+    g_main_context_pop_thread_default(self->reload_ctx);
+
+    return NULL;
+}
+
+static gboolean
+gst_ocl_shader_reload_quit(gpointer data)
+{
+    g_main_loop_quit(data);
+    return G_SOURCE_REMOVE;
+}
+
+static void
+gst_ocl_shader_start_reload(GstOCLShader *self)
+{
+    g_mutex_lock(&self->reload_lock);
+    if (!self->reload_thread) {
+        self->reload_ctx = g_main_context_new();
+        self->reload_loop = g_main_loop_new(self->reload_ctx, FALSE);
+        self->reload_thread = g_thread_new("ocl-reload",
+                                           gst_ocl_shader_reload_thread, self);
+    }
+    g_mutex_unlock(&self->reload_lock);
+}
+
+/* Stop watching and drop a build not picked up yet. */
+static void
+gst_ocl_shader_stop_reload(GstOCLShader *self)
+{
+    GThread *thread;
+    GMainContext *ctx;
+    GMainLoop *loop;
+
+    g_mutex_lock(&self->reload_lock);
+    thread = self->reload_thread;
+    ctx = self->reload_ctx;
+    loop = self->reload_loop;
+    self->reload_thread = NULL;
+    g_mutex_unlock(&self->reload_lock);
+
+    if (thread) {
+        /* As a source, so a loop not running yet still sees it */
+        g_main_context_invoke(ctx, gst_ocl_shader_reload_quit, loop);
+        g_thread_join(thread);
+        g_main_loop_unref(loop);
+        g_main_context_unref(ctx);
+        self->reload_ctx = NULL;
+        self->reload_loop = NULL;
+    }
+
+    g_mutex_lock(&self->reload_lock);
+    g_clear_pointer(&self->reload_variant, gst_ocl_shader_variant_free);
+    g_mutex_unlock(&self->reload_lock);
+}
+
+/* Rebuild with the current properties, if hot reload is running. */
+static gboolean
+gst_ocl_shader_schedule_reload(GstOCLShader *self)
+{
+    gboolean running;
+
+    g_mutex_lock(&self->reload_lock);
+    running = self->reload_thread != NULL;
+    if (running)
+        g_main_context_invoke(self->reload_ctx, gst_ocl_shader_reload_arm, self);
+    g_mutex_unlock(&self->reload_lock);
+
+    return running;
+}
+
+/* Switch to a program rebuilt in the background, between two frames. */
+static void
+gst_ocl_shader_apply_reload(GstOCLShader *self)
+{
+    GstOCLShaderVariant *variant;
+
+    g_mutex_lock(&self->reload_lock);
+    variant = self->reload_variant;
+    self->reload_variant = NULL;
+    g_mutex_unlock(&self->reload_lock);
+
+    if (!variant)
+        return;
+
+    if (!gst_ocl_shader_stages_support(self, variant->stages, self->format)) {
+        GST_ELEMENT_WARNING(self, LIBRARY, INIT,
+                            ("Reloaded kernels do not support the format, "
+                             "keeping the running kernels"), (NULL));
+        gst_ocl_shader_variant_free(variant);
+        return;
+    }
+
+    /* Built variants are of the previous source */
+    gst_ocl_shader_install(self, variant);
+    gst_ocl_shader_spec_clear(self);
+
+    gst_ocl_shader_report_chain(self, &GST_VIDEO_FILTER(self)->out_info);
+    self->tune_pending = self->autotune;
+
+    GST_INFO_OBJECT(self, "Switched to the reloaded kernels at frame %"
+                    G_GUINT64_FORMAT, self->frame_count);
+}
+
+/* ================= ASYNCHRONOUS STARTUP ================= */
+
+/*
+ * NULL->READY starts a thread that acquires the context, creates the
+ * queues and builds the program of the current properties, so none of it
+ * runs on the streaming thread. set_info then only picks the result up:
+ * startup-policy=block waits for it, bypass passes frames through and
+ * switches to OpenCL on the first frame after it is ready. The
+ * caps-dependent part, buffers and warm-up launches at the negotiated
+ * resolution, is done when the program is installed, on a warm-up thread
+ * with bypass. Programs specialized for the caps are built on the startup
+ * thread. Other threads see the context through gst_ocl_shader_get_context()
+ * only once it is open.
+ */
+
+static cl_int gst_ocl_shader_launch(GstOCLShader *self, cl_mem buf,
+                                    const GstVideoInfo *layout,
+                                    cl_uint n_wait, const cl_event *wait,
+                                    cl_event *start_evt, cl_event *evt);
+static GstFlowReturn gst_ocl_shader_ensure_buffers(GstOCLShader *self,
+                                                   size_t size);
+
+static gpointer
+gst_ocl_shader_startup_thread(gpointer data)
+{
+    GstOCLShader *self = data;
+    GstOCLShaderVariant *variant = g_new0(GstOCLShaderVariant, 1);
+    gchar *log = NULL;
+    gboolean configured;
+
+    GST_OBJECT_LOCK(self);
+    configured = self->kernel_file &&
+                 gst_ocl_shader_has_chain(self->kernel_chain, self->kernel_func);
+    GST_OBJECT_UNLOCK(self);
+
+    if (!gst_ocl_shader_open(self))
+        log = g_strdup("No OpenCL context available");
+    else if (configured)
+        gst_ocl_shader_build(self, variant, &log);
+
+    if (!variant->program)
+        g_clear_pointer(&variant, g_free);
+
+    GST_INFO_OBJECT(self, "Background build %s after %" G_GINT64_FORMAT " us",
+                    variant ? "done" : log ? "failed" : "skipped",
+                    g_get_monotonic_time() - self->startup_time);
+
+    g_mutex_lock(&self->startup_lock);
+    self->startup_variant = variant;
+    self->startup_log = log;
+    self->startup_done = TRUE;
+    g_cond_broadcast(&self->startup_cond);
+    g_mutex_unlock(&self->startup_lock);
+
+    return NULL;
+}
+
+static void
+gst_ocl_shader_start_startup(GstOCLShader *self)
+{
+    if (self->startup_thread)
+        return;
+
+    self->startup_done = FALSE;
+    self->startup_thread = g_thread_new("ocl-startup",
+                                        gst_ocl_shader_startup_thread, self);
+}
+
+/* Wait until the startup thread, if any, is done. */
+static void
+gst_ocl_shader_wait_startup(GstOCLShader *self)
+{
+    g_mutex_lock(&self->startup_lock);
+    while (self->startup_thread && !self->startup_done)
+        g_cond_wait(&self->startup_cond, &self->startup_lock);
+    g_mutex_unlock(&self->startup_lock);
+}
+
+/*
+ * Join the startup thread, waiting for it when wait is set, and install
+ * its program if it was built from the current properties.
+ */
+static GstOCLShaderStartup
+gst_ocl_shader_take_startup(GstOCLShader *self, gboolean wait)
+{
+    GstOCLShaderVariant *variant;
+    GThread *thread;
+    gboolean stale;
+    gchar *log;
+
+    g_mutex_lock(&self->startup_lock);
+    if (!self->startup_thread) {
+        g_mutex_unlock(&self->startup_lock);
+        return GST_OCL_SHADER_STARTUP_NONE;
+    }
+    if (!self->startup_done && !wait) {
+        g_mutex_unlock(&self->startup_lock);
+        return GST_OCL_SHADER_STARTUP_PENDING;
+    }
+    while (!self->startup_done)
+        g_cond_wait(&self->startup_cond, &self->startup_lock);
+
+    thread = self->startup_thread;
+    variant = self->startup_variant;
+    log = self->startup_log;
+    self->startup_thread = NULL;
+    self->startup_variant = NULL;
+    self->startup_log = NULL;
+    g_mutex_unlock(&self->startup_lock);
+
+    g_thread_join(thread);
+
+    if (log)
+        GST_WARNING_OBJECT(self, "Background build failed: %s", log);
+    g_free(log);
+
+    if (!variant)
+        return GST_OCL_SHADER_STARTUP_NONE;
+
+    GST_OBJECT_LOCK(self);
+    stale = variant->cookie != self->build_cookie;
+    GST_OBJECT_UNLOCK(self);
+
+    if (stale) {
+        GST_INFO_OBJECT(self, "Kernel properties changed during the build");
+        gst_ocl_shader_variant_free(variant);
+        return GST_OCL_SHADER_STARTUP_NONE;
+    }
+
+    gst_ocl_shader_install(self, variant);
+
+    return GST_OCL_SHADER_STARTUP_READY;
+}
+
+/*
+ * Allocate the device buffers of the negotiated resolution and run the
+ * chain, so the first real frame does not pay for the allocation, the
+ * driver's first-launch work, the autotune benchmark or the taps and
+ * intermediate of separable stages. The launches use a buffer of their
+ * own, slots may hold frames in flight.
+ */
+static void
+gst_ocl_shader_prewarm(GstOCLShader *self, const GstVideoInfo *info)
+{
+    size_t size = GST_VIDEO_INFO_SIZE(info);
+    gint64 start = g_get_monotonic_time();
+    cl_int err = CL_SUCCESS;
+    cl_mem buf;
+
+    /* The copy path has a buffer per in-flight slot */
+    if (!self->in_ocl && !(self->zero_copy && self->ocl->host_unified) &&
+        gst_ocl_shader_ensure_buffers(self, size) != GST_FLOW_OK)
+        return;
+
+    buf = clCreateBuffer(self->ocl->context, CL_MEM_READ_WRITE,
+                         size, NULL, &err);
+    if (err != CL_SUCCESS) {
+        GST_WARNING_OBJECT(self, "No warm-up buffer (%d)", err);
+        return;
+    }
+
+    for (int i = 0; i < STARTUP_WARMUP_LAUNCHES && err == CL_SUCCESS; i++)
+        err = gst_ocl_shader_launch(self, buf, info, 0, NULL, NULL, NULL);
+    clFinish(self->queue);
+    clReleaseMemObject(buf);
+
+    if (err != CL_SUCCESS)
+        GST_WARNING_OBJECT(self, "Warm-up launch failed (%d)", err);
+    else
+        GST_INFO_OBJECT(self, "Warmed up at %dx%d in %" G_GINT64_FORMAT " us",
+                        GST_VIDEO_INFO_WIDTH(info), GST_VIDEO_INFO_HEIGHT(info),
+                        g_get_monotonic_time() - start);
+}
+
+/* Open and build on the streaming thread, when nothing was prepared. */
+static gboolean
+gst_ocl_shader_build_now(GstOCLShader *self)
+{
+    GstOCLShaderVariant *variant;
+    gchar *log = NULL;
+
+    GST_INFO_OBJECT(self, "Initializing OpenCL");
+
+    if (!gst_ocl_shader_open(self))
+        return FALSE;
+
+    variant = g_new0(GstOCLShaderVariant, 1);
+    if (!gst_ocl_shader_build(self, variant, &log)) {
+        GST_ERROR_OBJECT(self, "%s", log);
+        g_free(log);
+        g_free(variant);
+        return FALSE;
+    }
+
+    gst_ocl_shader_install(self, variant);
+
+    return TRUE;
+}
+
+static void gst_ocl_shader_lanes_prewarm(GstOCLShader *self,
+                                         const GstVideoInfo *info);
+
+/* Process frames with the installed, warmed up program. */
+static void
+gst_ocl_shader_go_live(GstOCLShader *self)
+{
+    if (self->hot_reload)
+        gst_ocl_shader_start_reload(self);
+
+    if (!self->cl_ready)
+        GST_INFO_OBJECT(self, "OpenCL ready %" G_GINT64_FORMAT " us after READY",
+                        g_get_monotonic_time() - self->startup_time);
+
+    self->cl_ready = TRUE;
+    gst_base_transform_set_passthrough(GST_BASE_TRANSFORM(self), FALSE);
+}
+
+static gpointer
+gst_ocl_shader_warmup_thread(gpointer data)
+{
+    GstOCLShader *self = data;
+
+    gst_ocl_shader_prewarm(self, &self->warmup_info);
+    gst_ocl_shader_lanes_prewarm(self, &self->warmup_info);
+
+    g_mutex_lock(&self->startup_lock);
+    self->warmup_done = TRUE;
+    g_cond_broadcast(&self->startup_cond);
+    g_mutex_unlock(&self->startup_lock);
+
+    return NULL;
+}
+
+/*
+ * Join the warm-up thread, waiting for it when wait is set. TRUE if a
+ * finished warm-up was joined, FALSE if there is none or it still runs.
+ */
+static gboolean
+gst_ocl_shader_take_warmup(GstOCLShader *self, gboolean wait)
+{
+    GThread *thread;
+
+    g_mutex_lock(&self->startup_lock);
+    if (!self->warmup_thread || (!self->warmup_done && !wait)) {
+        g_mutex_unlock(&self->startup_lock);
+        return FALSE;
+    }
+    while (!self->warmup_done)
+        g_cond_wait(&self->startup_cond, &self->startup_lock);
+
+    thread = self->warmup_thread;
+    self->warmup_thread = NULL;
+    g_mutex_unlock(&self->startup_lock);
+
+    g_thread_join(thread);
+
+    return TRUE;
+}
+
+/*
+ * Caps-dependent setup once the program is installed, then process
+ * frames. FALSE, and bypass, if the chain cannot handle the format.
+ * With startup-policy=bypass the first warm-up, and the autotuning it
+ * runs, is done on a thread of its own while frames pass through, and
+ * the first frame after it goes live.
+ */
+static gboolean
+gst_ocl_shader_finish_setup(GstOCLShader *self, const GstVideoInfo *info)
+{
+    if (!gst_ocl_shader_stages_support(self, self->stages,
+                                       GST_VIDEO_INFO_FORMAT(info))) {
+        self->cl_ready = FALSE;
+        gst_base_transform_set_passthrough(GST_BASE_TRANSFORM(self), TRUE);
+        return FALSE;
+    }
+
+    gst_ocl_shader_report_chain(self, info);
+
+    /* Work-group sizes are picked by the warm-up at this resolution */
+    self->tune_pending = self->autotune;
+
+    if (!self->cl_ready &&
+        self->startup_policy == GST_OCL_SHADER_STARTUP_POLICY_BYPASS) {
+        gst_base_transform_set_passthrough(GST_BASE_TRANSFORM(self), TRUE);
+
+        g_mutex_lock(&self->startup_lock);
+        self->warmup_info = *info;
+        self->warmup_done = FALSE;
+        self->warmup_thread = g_thread_new("ocl-warmup",
+                                           gst_ocl_shader_warmup_thread, self);
+        g_mutex_unlock(&self->startup_lock);
+        return TRUE;
+    }
+
+    gst_ocl_shader_prewarm(self, info);
+    gst_ocl_shader_lanes_prewarm(self, info);
+    gst_ocl_shader_go_live(self);
+    return TRUE;
+}
+
+/* ================= HOST ENGINE ================= */
+
+/* Stop the host threads; frames are bypassed again until the next setup. */
+static void
+gst_ocl_shader_host_stop(GstOCLShader *self)
+{
+    self->host_ready = FALSE;
+
+    if (!self->host_running)
+        return;
+
+    ocl_host_pool_stop(&self->host_pool);
+    self->host_running = FALSE;
+}
+
+/*
+ * Run the chain on the host engine instead of bypassing when OpenCL is
+ * unavailable. Only chains of the built-in luma ops qualify; a "value"
+ * field of kernel-args is the value argument of the ops that have one.
+ */
+static gboolean
+gst_ocl_shader_host_setup(GstOCLShader *self)
+{
+    gchar **names;
+    gint value = 0;
+    gboolean ok = TRUE;
+
+    if (!gst_ocl_shader_has_chain(self->kernel_chain, self->kernel_func) ||
+        !gst_ocl_shader_has_luma8(self->format))
+        return FALSE;
+
+    GST_OBJECT_LOCK(self);
+    if (self->kernel_args)
+        gst_structure_get_int(self->kernel_args, "value", &value);
+    self->host_args_cookie = self->args_cookie;
+    GST_OBJECT_UNLOCK(self);
+
+    ocl_host_chain_init(&self->host_chain);
+    names = gst_ocl_shader_chain_names(self->kernel_chain, self->kernel_func);
+    for (guint i = 0; names[i] && ok; i++) {
+        if (ocl_host_chain_add(&self->host_chain, names[i], value) != 0) {
+            GST_INFO_OBJECT(self, "No host op for kernel '%s'", names[i]);
+            ok = FALSE;
+        }
+    }
+    g_strfreev(names);
+
+    /* The element processes the luma plane */
+    if (!ok || self->host_chain.n_ops == 0 || self->host_chain.bpp != 1)
+        return FALSE;
+
+    if (!self->host_running) {
+        ocl_host_pool_start(&self->host_pool, g_get_num_processors());
+        self->host_running = TRUE;
+    }
+
+    GST_WARNING_OBJECT(self, "OpenCL unavailable, running %d kernels on the "
+                       "host (%s, %d threads)", self->host_chain.n_ops,
+                       self->host_pool.isa, self->host_pool.n_threads + 1);
+
+    self->host_ready = TRUE;
+    gst_base_transform_set_passthrough(GST_BASE_TRANSFORM(self), FALSE);
+    return TRUE;
+}
+
+/*
+ * Pick up a background build between two frames: the startup with
+ * startup-policy=bypass, or the program specialized for the caps.
+ */
+static void
+gst_ocl_shader_before_transform(GstBaseTransform *trans, GstBuffer *buffer)
+{
+    GstOCLShader *self = (GstOCLShader *)trans;
+    const GstVideoInfo *info = &GST_VIDEO_FILTER(self)->out_info;
+    GstOCLShaderStartup startup;
+
+    /* Frames pass through until the warm-up is done */
+    if (self->warmup_thread) {
+        if (gst_ocl_shader_take_warmup(self, FALSE))
+            gst_ocl_shader_go_live(self);
+        return;
+    }
+
+    if (!self->startup_pending)
+        return;
+
+    startup = gst_ocl_shader_take_startup(self, FALSE);
+    if (startup == GST_OCL_SHADER_STARTUP_PENDING)
+        return;
+
+    self->startup_pending = FALSE;
+
+    /* Specialized: keep the running program if the build failed */
+    if (self->cl_ready) {
+        if (startup == GST_OCL_SHADER_STARTUP_READY &&
+            gst_ocl_shader_specialize(self))
+            gst_ocl_shader_finish_setup(self, info);
+        return;
+    }
+
+    if ((startup == GST_OCL_SHADER_STARTUP_READY ||
+         gst_ocl_shader_build_now(self)) && gst_ocl_shader_specialize(self) &&
+        gst_ocl_shader_finish_setup(self, info))
+        return;
+
+    if (!gst_ocl_shader_host_setup(self))
+        GST_ERROR_OBJECT(self, "OpenCL unavailable, running in bypass mode");
+}
+
+static gboolean
+gst_ocl_shader_set_info(GstVideoFilter *filter,
+                           GstCaps *incaps, GstVideoInfo *ininfo,
+                           GstCaps *outcaps, GstVideoInfo *outinfo)
+{
+    GstOCLShader *self = (GstOCLShader *)filter;
+    gchar *spec = NULL;
+
+    /* A renegotiation keeps the context and queues; the program is kept
+     * built for a later switch back */
+    gst_ocl_shader_take_warmup(self, TRUE);
+    gst_ocl_shader_spec_store(self);
+    gst_ocl_shader_release_program(self);
+    self->startup_pending = FALSE;
+    self->host_ready = FALSE;
+    self->format = GST_VIDEO_INFO_FORMAT(outinfo);
+
+    if (self->specialize)
+        spec = gst_ocl_shader_spec_new(GST_VIDEO_INFO_WIDTH(outinfo),
+                                       GST_VIDEO_INFO_HEIGHT(outinfo),
+                                       GST_VIDEO_INFO_PLANE_STRIDE(outinfo, 0));
+    GST_OBJECT_LOCK(self);
+    g_free(self->spec);
+    self->spec = spec;
+    GST_OBJECT_UNLOCK(self);
+
+    /* Moving between system and OpenCL memory needs a separate output buffer */
+    self->in_ocl = gst_ocl_caps_has_feature(incaps);
+    self->out_ocl = gst_ocl_caps_has_feature(outcaps);
+    gst_base_transform_set_in_place(GST_BASE_TRANSFORM(filter),
+                                    self->in_place &&
+                                    self->in_ocl == self->out_ocl);
+
+    GST_INFO_OBJECT(self, "Memory in=%s out=%s",
+                    self->in_ocl ? "OpenCL" : "system",
+                    self->out_ocl ? "OpenCL" : "system");
+
+    if (!self->kernel_file || !g_file_test(self->kernel_file, G_FILE_TEST_EXISTS) ||
+        !gst_ocl_shader_has_chain(self->kernel_chain, self->kernel_func)) {
+        GST_ERROR_OBJECT(self,
+            "kernel-file or kernel-func/kernel-chain not set, running in bypass mode");
+        goto error;
+    }
+
+    switch (gst_ocl_shader_take_startup(self, self->startup_policy ==
+                                        GST_OCL_SHADER_STARTUP_POLICY_BLOCK)) {
+    case GST_OCL_SHADER_STARTUP_PENDING:
+        GST_INFO_OBJECT(self, "OpenCL still starting, bypassing until ready");
+        self->startup_pending = TRUE;
+        self->cl_ready = FALSE;
+        gst_base_transform_set_passthrough(GST_BASE_TRANSFORM(filter), TRUE);
+        return TRUE;
+    default:
+        break;
+    }
+
+    if (!gst_ocl_shader_specialize(self)) {
+        self->cl_ready = FALSE;
+        if (gst_ocl_shader_host_setup(self))
+            return TRUE;
+        goto error;
+    }
+
+    if (!gst_ocl_shader_finish_setup(self, outinfo))
+        goto error;
+    return TRUE;
+
+error:
+    GST_ERROR_OBJECT(self,
+        "OpenCL unavailable, running in bypass mode");
+    self->cl_ready = FALSE;
+    gst_base_transform_set_passthrough(GST_BASE_TRANSFORM(filter), TRUE);
+    return TRUE; /* Allow pipeline to continue */
+}
+
+/* ================= FRAME PROCESS ================= */
+
+/* Set the (buf, width, height, stride) arguments for a frame living in buf. */
+static cl_int
+gst_ocl_shader_set_args(cl_kernel kernel, cl_mem *buf,
+                        gint width, gint height, gint stride)
+{
+    cl_int err;
+
+    err = clSetKernelArg(kernel, 0, sizeof(cl_mem), buf);
+    if (err != CL_SUCCESS)
+        return err;
+    err = clSetKernelArg(kernel, 1, sizeof(int), &width);
+    if (err != CL_SUCCESS)
+        return err;
+    err = clSetKernelArg(kernel, 2, sizeof(int), &height);
+    if (err != CL_SUCCESS)
+        return err;
+    return clSetKernelArg(kernel, 3, sizeof(int), &stride);
+}
+
+/*
+ * Set the arguments of kernel, one of stage's, for a frame in buf laid out
+ * as layout: by the names found by gst_ocl_shader_introspect() for the
+ * file kernel, with the current kernel-args values, else the fixed layout.
+ */
+static cl_int
+gst_ocl_shader_bind_args(GstOCLShader *self, GstOCLShaderStage *stage,
+                         cl_kernel kernel, cl_mem *buf,
+                         const GstVideoInfo *layout)
+{
+    gint width = GST_VIDEO_INFO_WIDTH(layout);
+    gint height = GST_VIDEO_INFO_HEIGHT(layout);
+    gint stride = GST_VIDEO_INFO_PLANE_STRIDE(layout, 0);
+    gint pixels = (gint)((size_t)stride * height / MAX(stage->elem_size, 1));
+    gint format = gst_ocl_shader_format_code(GST_VIDEO_INFO_FORMAT(layout));
+    gint plane_value;
+    cl_int err = CL_SUCCESS;
+
+    if (kernel != stage->kernel || !stage->args)
+        return gst_ocl_shader_set_args(kernel, buf, width, height, stride);
+
+    gst_ocl_shader_resolve_args(self, stage);
+
+    for (guint i = 0; i < stage->args->len && err == CL_SUCCESS; i++) {
+        GstOCLShaderArg *arg = &g_array_index(stage->args, GstOCLShaderArg, i);
+        const gint *geometry = NULL;
+        GValue v = G_VALUE_INIT;
+
+        switch (arg->role) {
+        case GST_OCL_SHADER_ARG_FRAME:
+            err = clSetKernelArg(kernel, i, sizeof(cl_mem), buf);
+            continue;
+        case GST_OCL_SHADER_ARG_WIDTH:
+            geometry = &width;
+            break;
+        case GST_OCL_SHADER_ARG_HEIGHT:
+            geometry = &height;
+            break;
+        case GST_OCL_SHADER_ARG_STRIDE:
+            geometry = &stride;
+            break;
+        case GST_OCL_SHADER_ARG_PIXELS:
+            geometry = &pixels;
+            break;
+        case GST_OCL_SHADER_ARG_FORMAT:
+            geometry = &format;
+            break;
+        case GST_OCL_SHADER_ARG_OFFSET:
+        case GST_OCL_SHADER_ARG_PLANE_STRIDE:
+            /* Planes the format does not have are 0 */
+            plane_value = 0;
+            if (arg->plane < GST_VIDEO_INFO_N_PLANES(layout))
+                plane_value = arg->role == GST_OCL_SHADER_ARG_OFFSET
+                    ? (gint)GST_VIDEO_INFO_PLANE_OFFSET(layout, arg->plane)
+                    : GST_VIDEO_INFO_PLANE_STRIDE(layout, arg->plane);
+            geometry = &plane_value;
+            break;
+        case GST_OCL_SHADER_ARG_USER:
+            err = clSetKernelArg(kernel, i, arg->size, &arg->value);
+            continue;
+        }
+
+        /* Geometry in the declared type, int, uint, float... */
+        g_value_init(&v, G_TYPE_INT);
+        g_value_set_int(&v, *geometry);
+        if (gst_ocl_shader_arg_convert(&v, arg->type, &arg->value))
+            err = clSetKernelArg(kernel, i, arg->size, &arg->value);
+        else
+            err = CL_INVALID_ARG_VALUE;
+        g_value_unset(&v);
+    }
+
+    return err;
+}
+
+/*
+ * Kernel of stage for a frame and its global size: the vload16 row
+ * variant when there is one and rows start 16-byte aligned, else the
+ * scalar kernel with a work-item per byte, or per element of the plane
+ * (a single row) for kernels indexed by total_pixels.
+ */
+static cl_kernel
+gst_ocl_shader_stage_variant(GstOCLShaderStage *stage,
+                             gint width, gint height, gint stride,
+                             size_t global[2])
+{
+    global[1] = height;
+
+    if (stage->vec_kernel && stride % 16 == 0 && width >= 16) {
+        global[0] = (width + stage->vec_bytes - 1) / stage->vec_bytes;
+        return stage->vec_kernel;
+    }
+
+    if (stage->linear) {
+        global[0] = (size_t)stride * height / MAX(stage->elem_size, 1);
+        global[1] = 1;
+        return stage->kernel;
+    }
+
+    global[0] = width;
+    return stage->kernel;
+}
+
+/*
+ * Pick the work-group size of every stage at width x height: from the
+ * persistent table, else by benchmarking the candidates on a scratch
+ * frame and recording the fastest in the table.
+ */
+static void
+gst_ocl_shader_autotune(GstOCLShader *self, const GstVideoInfo *layout)
+{
+    gint width = GST_VIDEO_INFO_WIDTH(layout);
+    gint height = GST_VIDEO_INFO_HEIGHT(layout);
+    gint stride = GST_VIDEO_INFO_PLANE_STRIDE(layout, 0);
+    gchar default_dir[4096];
+    gchar *cache_dir;
+    cl_mem frame = NULL;
+    cl_int err;
+
+    self->tune_pending = FALSE;
+
+    GST_OBJECT_LOCK(self);
+    cache_dir = g_strdup(self->cache_dir
+                         ? self->cache_dir
+                         : ocl_cache_default_dir(default_dir,
+                                                 sizeof(default_dir)));
+    GST_OBJECT_UNLOCK(self);
+
+    for (guint i = 0; i < self->stages->len; i++) {
+        GstOCLShaderStage *stage =
+            &g_array_index(self->stages, GstOCLShaderStage, i);
+        size_t global[2];
+        cl_kernel kernel = gst_ocl_shader_stage_variant(stage, width, height,
+                                                        stride, global);
+        gchar *id = kernel == stage->vec_kernel
+                    ? g_strdup_printf("%s@v%u", stage->ops, stage->vec_bytes)
+                    : g_strdup(stage->ops);
+        unsigned long long key = ocl_ws_key(self->ocl->device,
+                                            self->program_source, id, 2, global);
+        gchar *desc;
+        double us;
+
+        /* Separable passes run on the work-group their tile is sized for */
+        if (stage->v_kernel) {
+            g_free(id);
+            continue;
+        }
+
+        if (ocl_ws_lookup(cache_dir, key, stage->local) == 0) {
+            GST_INFO_OBJECT(self, "%s: work-group %zux%zu from table",
+                            id, stage->local[0], stage->local[1]);
+            g_free(id);
+            continue;
+        }
+
+        if (!frame) {
+            frame = clCreateBuffer(self->ocl->context, CL_MEM_READ_WRITE,
+                                   GST_VIDEO_INFO_SIZE(layout), NULL, &err);
+            if (err != CL_SUCCESS) {
+                GST_WARNING_OBJECT(self, "No scratch frame for autotuning (%d)", err);
+                g_free(id);
+                break;
+            }
+        }
+
+        err = gst_ocl_shader_bind_args(self, stage, kernel, &frame, layout);
+        if (err != CL_SUCCESS ||
+            ocl_ws_tune(self->queue, kernel, self->ocl->device,
+                        2, global, stage->local, &us) == 0) {
+            GST_WARNING_OBJECT(self, "%s: autotuning failed, driver picks "
+                               "the work-group size", id);
+            stage->local[0] = stage->local[1] = 0;
+            g_free(id);
+            continue;
+        }
+
+        desc = g_strdup_printf("%s|%s|%dx%d", self->ocl->device_name,
+                               id, width, height);
+        if (ocl_ws_store(cache_dir, key, stage->local, us, desc) != 0)
+            GST_DEBUG_OBJECT(self, "Work-group size not persisted");
+        g_free(desc);
+
+        GST_INFO_OBJECT(self, "%s: tuned work-group %zux%zu (%.1f us) at %dx%d",
+                        id, stage->local[0], stage->local[1], us,
+                        width, height);
+        g_free(id);
+    }
+
+    if (frame)
+        clReleaseMemObject(frame);
+    g_free(cache_dir);
+}
+
+/*
+ * Enqueue both passes of a separable stage on the luma plane in buf on
+ * queue, through the intermediate buffer of conv, in the context of ocl.
+ * h_evt and v_evt are optional.
+ */
+static cl_int
+gst_ocl_shader_launch_separable(GstOCLShader *self, GstOCLShaderStage *stage,
+                                GstOCLContext *ocl, cl_command_queue queue,
+                                GstOCLShaderConv *conv,
+                                cl_mem buf, gint width, gint height, gint stride,
+                                cl_uint n_wait, const cl_event *wait,
+                                cl_event *h_evt, cl_event *v_evt)
+{
+    size_t size = (size_t)width * height * sizeof(cl_float2);
+    guint radius;
+    gdouble sigma;
+    float amount;
+    cl_int err = CL_SUCCESS;
+
+    GST_OBJECT_LOCK(self);
+    radius = self->radius;
+    sigma = self->sigma;
+    amount = self->amount;
+    GST_OBJECT_UNLOCK(self);
+
+    /* The kernels read 2 * radius + 1 taps: rebuild them on a change */
+    if (conv->weights && (conv->radius != radius || conv->sigma != sigma)) {
+        clReleaseMemObject(conv->weights);
+        conv->weights = NULL;
+    }
+
+    if (!conv->weights) {
+        conv->weights = ocl_conv_create_weights(ocl->context, radius, sigma,
+                                                &err);
+        if (err != CL_SUCCESS) {
+            conv->weights = NULL;
+            return err;
+        }
+        conv->radius = radius;
+        conv->sigma = sigma;
+    }
+
+    if (!conv->tmp || conv->tmp_size < size) {
+        if (conv->tmp)
+            clReleaseMemObject(conv->tmp);
+        conv->tmp = clCreateBuffer(ocl->context, CL_MEM_READ_WRITE,
+                                   size, NULL, &err);
+        conv->tmp_size = err == CL_SUCCESS ? size : 0;
+        if (err != CL_SUCCESS) {
+            conv->tmp = NULL;
+            return err;
+        }
+    }
+
+    GST_LOG_OBJECT(self, "Enqueue %s (separable, radius %u, %" G_GSIZE_FORMAT
+                   "x%" G_GSIZE_FORMAT " work-groups)", stage->ops, radius,
+                   stage->conv_local, stage->conv_local);
+
+    err = ocl_conv_set_args(stage->kernel, &buf, &conv->tmp, width, height,
+                            stride, radius, &conv->weights, amount,
+                            stage->conv_local);
+    if (err != CL_SUCCESS)
+        return err;
+    err = ocl_conv_set_args(stage->v_kernel, &buf, &conv->tmp, width, height,
+                            stride, radius, &conv->weights, amount,
+                            stage->conv_local);
+    if (err != CL_SUCCESS)
+        return err;
+
+    return ocl_conv_enqueue(queue, stage->kernel, stage->v_kernel,
+                            stage->conv_local, width, height,
+                            n_wait, wait, h_evt, v_evt);
+}
+
+/*
+ * Enqueue stages, kernels of a program of ocl, on queue for the frame in
+ * buf, its planes laid out as layout. The first stage waits on wait;
+ * start_evt (optional) is the event of that stage and evt completes with
+ * the last one.
+ */
+static cl_int
+gst_ocl_shader_run_stages(GstOCLShader *self, GstOCLContext *ocl,
+                          cl_command_queue queue, GArray *stages,
+                          GstOCLShaderConv *conv, cl_mem buf,
+                          const GstVideoInfo *layout,
+                          cl_uint n_wait, const cl_event *wait,
+                          cl_event *start_evt, cl_event *evt)
+{
+    gint width = GST_VIDEO_INFO_WIDTH(layout);
+    gint height = GST_VIDEO_INFO_HEIGHT(layout);
+    gint stride = GST_VIDEO_INFO_PLANE_STRIDE(layout, 0);
+    cl_int err = CL_SUCCESS;
+
+    for (guint i = 0; i < stages->len; i++) {
+        GstOCLShaderStage *stage = &g_array_index(stages, GstOCLShaderStage, i);
+        gboolean last = i + 1 == stages->len;
+        size_t global[2], padded[2];
+        cl_kernel kernel = gst_ocl_shader_stage_variant(stage, width, height,
+                                                        stride, global);
+
+        if (stage->v_kernel) {
+            err = gst_ocl_shader_launch_separable(self, stage, ocl, queue, conv,
+                                                  buf, width, height, stride,
+                                                  i == 0 ? n_wait : 0,
+                                                  i == 0 ? wait : NULL,
+                                                  i == 0 ? start_evt : NULL,
+                                                  last ? evt : NULL);
+            if (err != CL_SUCCESS)
+                return err;
+            continue;
+        }
+
+        GST_LOG_OBJECT(self, "Enqueue %s%s global=(%zu x %zu)", stage->ops,
+                       kernel == stage->vec_kernel ? " (vector)" : "",
+                       global[0], global[1]);
+
+        err = gst_ocl_shader_bind_args(self, stage, kernel, &buf, layout);
+        if (err != CL_SUCCESS)
+            return err;
+
+        /* Kernels bounds-check, the padding is idle work-items */
+        ocl_ws_pad_global(2, global, stage->local, padded);
+
+        /* The queue is in order, later stages follow the first */
+        err = clEnqueueNDRangeKernel(queue,
+                                     kernel,
+                                     2, NULL,
+                                     padded,
+                                     stage->local[0] ? stage->local : NULL,
+                                     i == 0 ? n_wait : 0,
+                                     i == 0 ? wait : NULL,
+                                     last ? evt : i == 0 ? start_evt : NULL);
+        if (err != CL_SUCCESS)
+            return err;
+    }
+
+    /* A single kernel is its own start */
+    if (start_evt && stages->len == 1 && *evt &&
+        !g_array_index(stages, GstOCLShaderStage, 0).v_kernel) {
+        clRetainEvent(*evt);
+        *start_evt = *evt;
+    }
+
+    return err;
+}
+
+/*
+ * Enqueue the kernel chain on the element's queue for the frame in buf,
+ * as gst_ocl_shader_run_stages(). Frame boundary of the running program:
+ * reloads, specialization fallbacks and autotuning happen here.
+ */
+static cl_int
+gst_ocl_shader_launch(GstOCLShader *self, cl_mem buf,
+                      const GstVideoInfo *layout,
+                      cl_uint n_wait, const cl_event *wait,
+                      cl_event *start_evt, cl_event *evt)
+{
+    gint width = GST_VIDEO_INFO_WIDTH(layout);
+    gint height = GST_VIDEO_INFO_HEIGHT(layout);
+    gint stride = GST_VIDEO_INFO_PLANE_STRIDE(layout, 0);
+
+    /* Frame boundary: a background rebuild takes over here */
+    gst_ocl_shader_apply_reload(self);
+
+    /* A frame layout other than the caps' (e.g. a padded video meta) */
+    if (self->spec_width && (width != self->spec_width ||
+        height != self->spec_height || stride != self->spec_stride)) {
+        GST_WARNING_OBJECT(self, "Frame %dx%d stride %d does not match the "
+                           "specialized program, using the generic one",
+                           width, height, stride);
+        GST_OBJECT_LOCK(self);
+        g_clear_pointer(&self->spec, g_free);
+        GST_OBJECT_UNLOCK(self);
+
+        gst_ocl_shader_spec_store(self);
+        if (!gst_ocl_shader_specialize(self))
+            return CL_BUILD_PROGRAM_FAILURE;
+    }
+
+    if (self->tune_pending)
+        gst_ocl_shader_autotune(self, layout);
+
+    return gst_ocl_shader_run_stages(self, self->ocl, self->queue,
+                                     self->stages, &self->conv, buf, layout,
+                                     n_wait, wait, start_evt, evt);
+}
+
+/* Slot the next frame goes to. */
+static GstOCLShaderSlot *
+gst_ocl_shader_next_slot(GstOCLShader *self)
+{
+    return &self->slots[self->frame_count % self->ring_depth];
+}
+
+/* Start of the planes of frame in memory, NULL if they are not contiguous. */
+static guint8 *
+gst_ocl_shader_frame_base(GstVideoFrame *frame)
+{
+    guint8 *base = (guint8 *)GST_VIDEO_FRAME_PLANE_DATA(frame, 0) -
+                   GST_VIDEO_FRAME_PLANE_OFFSET(frame, 0);
+
+    for (guint p = 1; p < GST_VIDEO_FRAME_N_PLANES(frame); p++) {
+        if ((guint8 *)GST_VIDEO_FRAME_PLANE_DATA(frame, p) !=
+            base + GST_VIDEO_FRAME_PLANE_OFFSET(frame, p))
+            return NULL;
+    }
+
+    return base;
+}
+
+/*
+ * Check whether the planes of frame can be wrapped with
+ * CL_MEM_USE_HOST_PTR without the runtime falling back to a hidden copy.
+ */
+static gboolean
+gst_ocl_shader_can_zero_copy(GstOCLShader *self, GstVideoFrame *frame)
+{
+    guint8 *y = gst_ocl_shader_frame_base(frame);
+    size_t size = GST_VIDEO_FRAME_SIZE(frame);
+
+    if (!self->zero_copy || !self->ocl->host_unified)
+        return FALSE;
+
+    if (!y) {
+        GST_LOG_OBJECT(self, "planes not contiguous");
+        return FALSE;
+    }
+
+    if (((guintptr)y) % self->ocl->mem_align != 0) {
+        GST_LOG_OBJECT(self, "frame %p not aligned to %u bytes", y,
+                       self->ocl->mem_align);
+        return FALSE;
+    }
+
+    if (size % ZERO_COPY_SIZE_ALIGN != 0) {
+        GST_LOG_OBJECT(self, "frame size %zu not a multiple of %d",
+                       size, ZERO_COPY_SIZE_ALIGN);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* Run the kernel directly on the frame memory, no host<->device copies. */
+static GstFlowReturn
+gst_ocl_shader_run_zero_copy(GstOCLShader *self, GstVideoFrame *frame)
+{
+    cl_int err;
+    cl_mem hostbuf;
+    size_t size = GST_VIDEO_FRAME_SIZE(frame);
+    GstOCLShaderSlot *slot = gst_ocl_shader_next_slot(self);
+    void *mapped;
+
+    hostbuf = clCreateBuffer(self->ocl->context,
+                             CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR,
+                             size, gst_ocl_shader_frame_base(frame), &err);
+    CHECK_CL(err, "clCreateBuffer(USE_HOST_PTR)");
+
+    gst_ocl_shader_release_events(slot);
+
+    err = gst_ocl_shader_launch(self, hostbuf, &frame->info,
+                                0, NULL, &slot->start_evt, &slot->kernel_evt);
+    CHECK_CL(err, "clEnqueueNDRangeKernel");
+
+    /* Mapping synchronizes the host pointer with the kernel result */
+    mapped = clEnqueueMapBuffer(self->queue, hostbuf, CL_TRUE,
+                                CL_MAP_READ, 0, size,
+                                1, &slot->kernel_evt, NULL, &err);
+    CHECK_CL(err, "clEnqueueMapBuffer");
+
+    err = clEnqueueUnmapMemObject(self->queue, hostbuf, mapped, 0, NULL, NULL);
+    CHECK_CL(err, "clEnqueueUnmapMemObject");
+
+    gst_ocl_shader_add_slot_timing(self, slot);
+    gst_ocl_shader_release_events(slot);
+    clReleaseMemObject(hostbuf);
+
+    return GST_FLOW_OK;
+error:
+    if (hostbuf)
+        clReleaseMemObject(hostbuf);
+    return GST_FLOW_ERROR;
+}
+
+/* Make sure the slots in use have device buffers of the given size. */
+static GstFlowReturn
+gst_ocl_shader_ensure_buffers(GstOCLShader *self, size_t size)
+{
+    cl_int err;
+
+    /* Reallocate buffers on caps change */
+    if (size != self->buf_size) {
+        for (int i = 0; i < MAX_IN_FLIGHT; i++) {
+            if (self->slots[i].ybuf) {
+                clReleaseMemObject(self->slots[i].ybuf);
+                self->slots[i].ybuf = NULL;
+            }
+        }
+        self->buf_size = size;
+    }
+
+    for (guint i = 0; i < self->ring_depth; i++) {
+        if (self->slots[i].ybuf)
+            continue;
+
+        self->slots[i].ybuf = clCreateBuffer(
+            self->ocl->context,
+            CL_MEM_READ_WRITE,
+            size, NULL, &err);
+        CHECK_CL(err, "clCreateBuffer");
+    }
+
+    return GST_FLOW_OK;
+error:
+    return GST_FLOW_ERROR;
+}
+
+static cl_int gst_ocl_shader_transfer(GstOCLShader *self,
+                                      cl_command_queue queue, cl_mem buffer,
+                                      const GstVideoInfo *info,
+                                      GstVideoFrame *frame, gboolean upload,
+                                      cl_uint n_wait, const cl_event *wait,
+                                      cl_event *first, cl_event *done);
+
+/*
+ * Enqueue upload of src, the kernel and readback into dst for one slot,
+ * on the queues of its lane. The slot buffer is laid out as src; all
+ * planes move as rectangles of their rows, the stride padding stays on
+ * the host. Nothing is waited for; slot->read_evt completes when dst
+ * holds the result.
+ */
+static cl_int
+gst_ocl_shader_enqueue(GstOCLShader *self, GstOCLShaderSlot *slot,
+                       GstVideoFrame *src, GstVideoFrame *dst)
+{
+    GstOCLShaderLane *lane = slot->lane ? &self->lanes[slot->lane - 1] : NULL;
+    cl_mem buf = lane ? lane->bufs[slot - self->slots] : slot->ybuf;
+    cl_int err;
+
+    /* Release previous events for this slot */
+    gst_ocl_shader_release_events(slot);
+
+    /* Async write */
+    err = gst_ocl_shader_transfer(self,
+                                  lane ? lane->upload_queue : self->upload_queue,
+                                  buf, &src->info, src, TRUE, 0, NULL,
+                                  &slot->write_start_evt, &slot->write_evt);
+    if (err != CL_SUCCESS)
+        return err;
+
+    /* Kernel waits for write */
+    if (lane)
+        err = gst_ocl_shader_run_stages(self, lane->ocl, lane->queue,
+                                        lane->stages, &lane->conv, buf,
+                                        &src->info, 1, &slot->write_evt,
+                                        &slot->start_evt, &slot->kernel_evt);
+    else
+        err = gst_ocl_shader_launch(self, buf, &src->info,
+                                    1, &slot->write_evt,
+                                    &slot->start_evt, &slot->kernel_evt);
+    if (err != CL_SUCCESS)
+        return err;
+
+    /* Read waits for kernel, into dst's own strides */
+    err = gst_ocl_shader_transfer(self,
+                                  lane ? lane->download_queue
+                                       : self->download_queue,
+                                  buf, &src->info, dst, FALSE,
+                                  1, &slot->kernel_evt,
+                                  &slot->read_start_evt, &slot->read_evt);
+    if (err != CL_SUCCESS)
+        return err;
+
+    /* Submit the kernels now so they can overlap other frames; the
+     * transfers flush their own queues */
+    clFlush(lane ? lane->queue : self->queue);
+
+    return CL_SUCCESS;
+}
+
+/* Upload in into a slot buffer, run the kernel and read it back into out. */
+static GstFlowReturn
+gst_ocl_shader_run_copy(GstOCLShader *self, GstVideoFrame *in,
+                        GstVideoFrame *out)
+{
+    cl_int err;
+    GstOCLShaderSlot *slot = gst_ocl_shader_next_slot(self);
+
+    if (gst_ocl_shader_ensure_buffers(self, GST_VIDEO_FRAME_SIZE(in)) != GST_FLOW_OK)
+        return GST_FLOW_ERROR;
+
+    err = gst_ocl_shader_enqueue(self, slot, in, out);
+    CHECK_CL(err, "enqueue frame");
+
+    /* Wait ONLY for this frame to complete */
+    clWaitForEvents(1, &slot->read_evt);
+
+    gst_ocl_shader_add_slot_timing(self, slot);
+
+    /* Cleanup events (mandatory) */
+    gst_ocl_shader_release_events(slot);
+
+    return GST_FLOW_OK;
+error:
+    gst_ocl_shader_release_events(slot);
+    return GST_FLOW_ERROR;
+}
+
+/*
+ * Refresh the value argument of the host ops from kernel-args if it
+ * changed, as gst_ocl_shader_resolve_args() does for the kernels.
+ */
+static void
+gst_ocl_shader_host_resolve_args(GstOCLShader *self)
+{
+    gint value = 0;
+
+    GST_OBJECT_LOCK(self);
+    if (self->host_args_cookie == self->args_cookie) {
+        GST_OBJECT_UNLOCK(self);
+        return;
+    }
+    if (self->kernel_args)
+        gst_structure_get_int(self->kernel_args, "value", &value);
+    self->host_args_cookie = self->args_cookie;
+    GST_OBJECT_UNLOCK(self);
+
+    ocl_host_chain_set_value(&self->host_chain, value);
+}
+
+/*
+ * Process in into out, which may be the same frame. The copy path reads
+ * the result straight into out; the others work on out in place.
+ */
+static GstFlowReturn
+gst_ocl_shader_process(GstOCLShader *self, GstVideoFrame *in,
+                       GstVideoFrame *frame)
+{
+    GstOCLShaderPath path;
+    GstFlowReturn ret;
+
+    self->frame_count++;
+
+    GST_LOG_OBJECT(self, "transform_frame(): frame=%" G_GUINT64_FORMAT " pts=%" GST_TIME_FORMAT, self->frame_count, GST_TIME_ARGS(GST_BUFFER_PTS(frame->buffer)));
+
+    if (in != frame && (!self->cl_ready || gst_ocl_shader_can_zero_copy(self, frame)))
+        gst_video_frame_copy(frame, in);
+
+    if (!self->cl_ready && self->host_ready) {
+        gst_ocl_shader_host_resolve_args(self);
+        ocl_host_run(&self->host_pool, &self->host_chain,
+                     GST_VIDEO_FRAME_PLANE_DATA(frame, 0),
+                     GST_VIDEO_FRAME_WIDTH(frame), GST_VIDEO_FRAME_HEIGHT(frame),
+                     GST_VIDEO_FRAME_PLANE_STRIDE(frame, 0));
+        self->host_frames++;
+        return GST_FLOW_OK;
+    }
+
+    if (!self->cl_ready) {
+        GST_WARNING_OBJECT(self, "OpenCL not ready, bypassing");
+        return GST_FLOW_OK;
+    }
+
+    if (gst_ocl_shader_can_zero_copy(self, frame)) {
+        path = GST_OCL_SHADER_PATH_ZERO_COPY;
+        ret = gst_ocl_shader_run_zero_copy(self, frame);
+    } else {
+        path = GST_OCL_SHADER_PATH_COPY;
+        ret = gst_ocl_shader_run_copy(self, in, frame);
+    }
+
+    if (ret != GST_FLOW_OK) {
+        GST_ERROR_OBJECT(self, "OpenCL execution failed");
+        return ret;
+    }
+
+    /* Only frames that made it through count for their path */
+    if (path == GST_OCL_SHADER_PATH_ZERO_COPY)
+        self->zero_copy_frames++;
+    else
+        self->copy_frames++;
+
+    GST_LOG_OBJECT(self, "frame=%" G_GUINT64_FORMAT " path=%s",
+                   self->frame_count,
+                   path == GST_OCL_SHADER_PATH_ZERO_COPY ? "zero-copy" : "copy");
+
+    return ret;
+}
+
+static GstFlowReturn
+gst_ocl_shader_transform_frame(GstVideoFilter *filter,
+                                  GstVideoFrame *in,
+                                  GstVideoFrame *out)
+{
+    GstOCLShader *self = (GstOCLShader *)filter;
+
+    return gst_ocl_shader_process(self, in, out);
+}
+
+static GstFlowReturn
+gst_ocl_shader_transform_frame_ip(GstVideoFilter *filter,
+                                     GstVideoFrame *frame)
+{
+    GstOCLShader *self = (GstOCLShader *)filter;
+
+    return gst_ocl_shader_process(self, frame, frame);
+}
+
+/* ================= DEVICE MEMORY ================= */
+
+/* OpenCL memory of buf the kernel can work on directly, else NULL. */
+static GstOCLMemory *
+gst_ocl_shader_peek_memory(GstOCLShader *self, GstBuffer *buf)
+{
+    GstOCLMemory *mem = gst_ocl_buffer_peek_memory(buf, self->ocl);
+
+    /* The kernel addresses the planes from the start of the cl_mem */
+    if (mem && mem->mem.offset != 0)
+        return NULL;
+
+    return mem;
+}
+
+/* Make sure the scratch buffer holds at least size bytes. */
+static cl_int
+gst_ocl_shader_ensure_scratch(GstOCLShader *self, size_t size)
+{
+    cl_int err = CL_SUCCESS;
+
+    if (self->scratch && self->scratch_size >= size)
+        return CL_SUCCESS;
+
+    if (self->scratch)
+        clReleaseMemObject(self->scratch);
+
+    self->scratch = clCreateBuffer(self->ocl->context, CL_MEM_READ_WRITE,
+                                   size, NULL, &err);
+    if (err != CL_SUCCESS) {
+        self->scratch = NULL;
+        size = 0;
+    }
+    self->scratch_size = size;
+
+    return err;
+}
+
+/* Bytes per row and number of rows of a plane. */
+static size_t
+gst_ocl_shader_plane_row_bytes(const GstVideoInfo *info, guint plane,
+                               size_t *rows)
+{
+    gint comp[GST_VIDEO_MAX_COMPONENTS];
+
+    gst_video_format_info_component(info->finfo, plane, comp);
+    *rows = GST_VIDEO_INFO_COMP_HEIGHT(info, comp[0]);
+
+    return (size_t)GST_VIDEO_INFO_COMP_WIDTH(info, comp[0]) *
+           GST_VIDEO_INFO_COMP_PSTRIDE(info, comp[0]);
+}
+
+/*
+ * Copy every plane of a mapped host frame into (upload) or out of the
+ * device buffer laid out as info. done completes once the host memory of
+ * the frame is no longer used; first (optional) is the first plane copy.
+ */
+static cl_int
+gst_ocl_shader_transfer(GstOCLShader *self, cl_command_queue queue,
+                        cl_mem buffer, const GstVideoInfo *info,
+                        GstVideoFrame *frame, gboolean upload,
+                        cl_uint n_wait, const cl_event *wait,
+                        cl_event *first, cl_event *done)
+{
+    cl_event evts[GST_VIDEO_MAX_PLANES];
+    guint n_planes = GST_VIDEO_FRAME_N_PLANES(frame);
+    guint n = 0;
+    cl_int err = CL_SUCCESS;
+
+    for (n = 0; n < n_planes; n++) {
+        size_t buffer_origin[3] = { GST_VIDEO_INFO_PLANE_OFFSET(info, n), 0, 0 };
+        size_t host_origin[3] = { 0, 0, 0 };
+        size_t region[3] = { 0, 0, 1 };
+        size_t device_pitch = GST_VIDEO_INFO_PLANE_STRIDE(info, n);
+        size_t host_pitch = GST_VIDEO_FRAME_PLANE_STRIDE(frame, n);
+        gpointer data = GST_VIDEO_FRAME_PLANE_DATA(frame, n);
+
+        region[0] = gst_ocl_shader_plane_row_bytes(info, n, &region[1]);
+
+        if (upload)
+            err = clEnqueueWriteBufferRect(queue, buffer, CL_FALSE,
+                                           buffer_origin, host_origin, region,
+                                           device_pitch, 0, host_pitch, 0,
+                                           data, n_wait, wait, &evts[n]);
+        else
+            err = clEnqueueReadBufferRect(queue, buffer, CL_FALSE,
+                                          buffer_origin, host_origin, region,
+                                          device_pitch, 0, host_pitch, 0,
+                                          data, n_wait, wait, &evts[n]);
+        if (err != CL_SUCCESS)
+            break;
+    }
+
+    if (err == CL_SUCCESS)
+        err = clEnqueueMarkerWithWaitList(queue, n, evts, done);
+
+    if (err == CL_SUCCESS && first) {
+        clRetainEvent(evts[0]);
+        *first = evts[0];
+    }
+
+    /* The caller releases the frame on error, nothing may still use it */
+    if (err != CL_SUCCESS && n > 0)
+        clWaitForEvents(n, evts);
+
+    for (guint i = 0; i < n; i++)
+        clReleaseEvent(evts[i]);
+
+    clFlush(queue);
+
+    return err;
+}
+
+/*
+ * Process a frame when inbuf and/or outbuf hold OpenCL memory of our
+ * context. Device to device the kernel runs without any host copy; frames
+ * are only uploaded or read back at the edge of the OpenCL section.
+ */
+static GstFlowReturn
+gst_ocl_shader_process_device(GstOCLShader *self,
+                              GstBuffer *inbuf, GstOCLMemory *in_mem,
+                              GstBuffer *outbuf, GstOCLMemory *out_mem)
+{
+    GstVideoFilter *filter = GST_VIDEO_FILTER(self);
+    const GstVideoInfo *info;
+    GstVideoFrame frame;
+    gboolean mapped = FALSE;
+    cl_event wait[2];
+    cl_uint n_wait = 0;
+    cl_event ready = NULL, kernel_evt = NULL, done = NULL;
+    cl_event upload_evt = NULL, start_evt = NULL, download_evt = NULL;
+    cl_event *owned[] = { &ready, &kernel_evt, &done,
+                          &upload_evt, &start_evt, &download_evt };
+    GstOCLShaderTiming *timing;
+    cl_mem target;
+    cl_int err;
+
+    self->frame_count++;
+
+    /* Order after every earlier device user of the memories */
+    if (in_mem && (wait[n_wait] = gst_ocl_memory_get_event(in_mem)))
+        n_wait++;
+    if (out_mem && out_mem != in_mem &&
+        (wait[n_wait] = gst_ocl_memory_get_event(out_mem)))
+        n_wait++;
+
+    if (out_mem) {
+        info = &filter->out_info;
+        target = out_mem->buffer;
+
+        if (in_mem && in_mem != out_mem) {
+            err = clEnqueueCopyBuffer(self->queue, in_mem->buffer, target, 0, 0,
+                                      MIN(in_mem->mem.size, out_mem->mem.size),
+                                      n_wait, wait, &ready);
+            CHECK_CL(err, "clEnqueueCopyBuffer");
+            gst_ocl_memory_set_event(in_mem, ready);
+        } else if (!in_mem) {
+            /* Entering the OpenCL section */
+            if (!gst_video_frame_map(&frame, &filter->in_info, inbuf, GST_MAP_READ))
+                goto map_failed;
+            mapped = TRUE;
+
+            err = gst_ocl_shader_transfer(self, self->upload_queue, target, info,
+                                          &frame, TRUE, n_wait, wait,
+                                          &upload_evt, &ready);
+            CHECK_CL(err, "upload frame");
+        }
+    } else {
+        /* Leaving the OpenCL section: the input memory stays untouched */
+        info = &filter->in_info;
+
+        err = gst_ocl_shader_ensure_scratch(self, in_mem->mem.size);
+        CHECK_CL(err, "clCreateBuffer(scratch)");
+        target = self->scratch;
+
+        err = clEnqueueCopyBuffer(self->queue, in_mem->buffer, target, 0, 0,
+                                  in_mem->mem.size, n_wait, wait, &ready);
+        CHECK_CL(err, "clEnqueueCopyBuffer");
+        gst_ocl_memory_set_event(in_mem, ready);
+    }
+
+    err = gst_ocl_shader_launch(self, target, info,
+                                ready ? 1 : n_wait, ready ? &ready : wait,
+                                &start_evt, &kernel_evt);
+    CHECK_CL(err, "clEnqueueNDRangeKernel");
+
+    if (out_mem) {
+        gst_ocl_memory_set_event(out_mem, kernel_evt);
+        clFlush(self->queue);
+    } else {
+        if (!gst_video_frame_map(&frame, &filter->out_info, outbuf, GST_MAP_WRITE))
+            goto map_failed;
+        mapped = TRUE;
+
+        err = gst_ocl_shader_transfer(self, self->download_queue, target, info,
+                                      &frame, FALSE, 1, &kernel_evt,
+                                      &download_evt, &done);
+        CHECK_CL(err, "read back frame");
+        clWaitForEvents(1, &done);
+    }
+
+    if (mapped) {
+        /* The upload reads from the mapped input frame */
+        if (out_mem)
+            clWaitForEvents(1, &ready);
+        gst_video_frame_unmap(&frame);
+    }
+
+    self->device_frames++;
+
+    GST_LOG_OBJECT(self, "frame=%" G_GUINT64_FORMAT " path=device in=%s out=%s",
+                   self->frame_count, in_mem ? "OpenCL" : "system",
+                   out_mem ? "OpenCL" : "system");
+
+    /* Device-to-device frames are still running, read them later */
+    timing = g_new0(GstOCLShaderTiming, 1);
+    gst_ocl_shader_timing_set(timing, GST_OCL_SHADER_PHASE_UPLOAD,
+                              upload_evt, mapped && out_mem ? ready : NULL);
+    gst_ocl_shader_timing_set(timing, GST_OCL_SHADER_PHASE_KERNEL,
+                              start_evt, kernel_evt);
+    gst_ocl_shader_timing_set(timing, GST_OCL_SHADER_PHASE_DOWNLOAD,
+                              download_evt, done);
+    gst_ocl_shader_add_timing(self, timing);
+
+    for (guint i = 0; i < n_wait; i++)
+        clReleaseEvent(wait[i]);
+    for (guint i = 0; i < G_N_ELEMENTS(owned); i++) {
+        if (*owned[i])
+            clReleaseEvent(*owned[i]);
+    }
+
+    return GST_FLOW_OK;
+
+map_failed:
+    GST_ERROR_OBJECT(self, "Failed to map frame");
+    goto cleanup;
+
+error:
+    GST_ERROR_OBJECT(self, "OpenCL execution failed");
+
+cleanup:
+    /* Nothing may touch the mapped frame once it is released */
+    clFinish(self->upload_queue);
+    clFinish(self->queue);
+    clFinish(self->download_queue);
+    if (mapped)
+        gst_video_frame_unmap(&frame);
+
+    for (guint i = 0; i < n_wait; i++)
+        clReleaseEvent(wait[i]);
+    for (guint i = 0; i < G_N_ELEMENTS(owned); i++) {
+        if (*owned[i])
+            clReleaseEvent(*owned[i]);
+    }
+
+    return GST_FLOW_ERROR;
+}
+
+static GstFlowReturn
+gst_ocl_shader_transform(GstBaseTransform *trans,
+                         GstBuffer *inbuf, GstBuffer *outbuf)
+{
+    GstOCLShader *self = (GstOCLShader *)trans;
+
+    if (self->cl_ready) {
+        GstOCLMemory *in_mem = gst_ocl_shader_peek_memory(self, inbuf);
+        GstOCLMemory *out_mem = gst_ocl_shader_peek_memory(self, outbuf);
+
+        if (in_mem || out_mem)
+            return gst_ocl_shader_process_device(self, inbuf, in_mem,
+                                                 outbuf, out_mem);
+    }
+
+    /* System memory: GstVideoFilter maps the frames for transform_frame */
+    return GST_BASE_TRANSFORM_CLASS(gst_ocl_shader_parent_class)->
+        transform(trans, inbuf, outbuf);
+}
+
+static GstFlowReturn
+gst_ocl_shader_transform_ip(GstBaseTransform *trans, GstBuffer *buf)
+{
+    GstOCLShader *self = (GstOCLShader *)trans;
+    GstOCLMemory *mem;
+
+    if (self->cl_ready && (mem = gst_ocl_shader_peek_memory(self, buf)))
+        return gst_ocl_shader_process_device(self, buf, mem, buf, mem);
+
+    return GST_BASE_TRANSFORM_CLASS(gst_ocl_shader_parent_class)->
+        transform_ip(trans, buf);
+}
+
+/* ================= NEGOTIATION ================= */
+
+/* Either side can be in system or, with a context, OpenCL memory. */
+static GstCaps *
+gst_ocl_shader_transform_caps(GstBaseTransform *trans,
+                              GstPadDirection direction,
+                              GstCaps *caps, GstCaps *filter)
+{
+    GstOCLShader *self = (GstOCLShader *)trans;
+    GstOCLContext *ocl;
+    GstCaps *res, *tmp;
+    gboolean luma_only;
+
+    res = gst_caps_copy(caps);
+    gst_caps_set_features_simple(res,
+        gst_caps_features_new(GST_CAPS_FEATURE_MEMORY_SYSTEM_MEMORY, NULL));
+
+    /* memory:OpenCL needs the context, bypass does not wait for it */
+    if (self->startup_policy == GST_OCL_SHADER_STARTUP_POLICY_BLOCK)
+        gst_ocl_shader_wait_startup(self);
+
+    ocl = gst_ocl_shader_get_context(self);
+    if (ocl) {
+        tmp = gst_caps_copy(caps);
+        gst_caps_set_features_simple(tmp,
+            gst_caps_features_new(GST_CAPS_FEATURE_MEMORY_OPENCL, NULL));
+        res = gst_caps_merge(tmp, res);
+        gst_ocl_context_unref(ocl);
+    }
+
+    /* Only offer what the chain can process, see stages_support */
+    GST_OBJECT_LOCK(self);
+    luma_only = self->luma_only;
+    GST_OBJECT_UNLOCK(self);
+    if (luma_only) {
+        GstCaps *luma = gst_caps_from_string(OCL_SHADER_LUMA8_CAPS);
+
+        tmp = gst_caps_intersect_full(res, luma, GST_CAPS_INTERSECT_FIRST);
+        gst_caps_unref(luma);
+        gst_caps_unref(res);
+        res = tmp;
+    }
+
+    if (filter) {
+        tmp = gst_caps_intersect_full(filter, res, GST_CAPS_INTERSECT_FIRST);
+        gst_caps_unref(res);
+        res = tmp;
+    }
+
+    GST_DEBUG_OBJECT(self, "Transformed %" GST_PTR_FORMAT " into %" GST_PTR_FORMAT,
+                     caps, res);
+
+    return res;
+}
+
+/* Output in OpenCL memory always comes from our own pool. */
+static gboolean
+gst_ocl_shader_decide_allocation(GstBaseTransform *trans, GstQuery *query)
+{
+    GstOCLShader *self = (GstOCLShader *)trans;
+    GstOCLContext *ocl = NULL;
+    GstBufferPool *pool;
+    GstVideoInfo info;
+    GstCaps *caps;
+    guint size, min = 0, max = 0;
+
+    gst_query_parse_allocation(query, &caps, NULL);
+
+    if (!caps || !gst_ocl_caps_has_feature(caps) ||
+        !(ocl = gst_ocl_shader_get_context(self)))
+        return GST_BASE_TRANSFORM_CLASS(gst_ocl_shader_parent_class)->
+            decide_allocation(trans, query);
+
+    if (!gst_video_info_from_caps(&info, caps)) {
+        gst_ocl_context_unref(ocl);
+        return FALSE;
+    }
+
+    size = GST_VIDEO_INFO_SIZE(&info);
+
+    /* Keep the buffer count downstream asked for */
+    if (gst_query_get_n_allocation_pools(query) > 0)
+        gst_query_parse_nth_allocation_pool(query, 0, NULL, NULL, &min, &max);
+
+    pool = gst_ocl_buffer_pool_new(ocl, caps, size, min, max);
+    gst_ocl_context_unref(ocl);
+    if (!pool) {
+        GST_ERROR_OBJECT(self, "Failed to create OpenCL buffer pool");
+        return FALSE;
+    }
+
+    if (gst_query_get_n_allocation_pools(query) > 0)
+        gst_query_set_nth_allocation_pool(query, 0, pool, size, min, max);
+    else
+        gst_query_add_allocation_pool(query, pool, size, min, max);
+
+    GST_DEBUG_OBJECT(self, "Using OpenCL buffer pool %" GST_PTR_FORMAT, pool);
+
+    gst_object_unref(pool);
+    return TRUE;
+}
+
+/* Offer upstream an OpenCL pool when it produces memory:OpenCL. */
+static gboolean
+gst_ocl_shader_propose_allocation(GstBaseTransform *trans,
+                                  GstQuery *decide_query, GstQuery *query)
+{
+    GstOCLShader *self = (GstOCLShader *)trans;
+    GstOCLContext *ocl = NULL;
+    GstAllocator *allocator;
+    GstBufferPool *pool;
+    GstVideoInfo info;
+    GstCaps *caps;
+    gboolean need_pool;
+    guint size;
+
+    gst_query_parse_allocation(query, &caps, &need_pool);
+
+    if (!caps || !gst_ocl_caps_has_feature(caps) ||
+        !(ocl = gst_ocl_shader_get_context(self)))
+        return GST_BASE_TRANSFORM_CLASS(gst_ocl_shader_parent_class)->
+            propose_allocation(trans, decide_query, query);
+
+    if (!gst_video_info_from_caps(&info, caps)) {
+        gst_ocl_context_unref(ocl);
+        return FALSE;
+    }
+
+    size = GST_VIDEO_INFO_SIZE(&info);
+
+    if (need_pool) {
+        pool = gst_ocl_buffer_pool_new(ocl, caps, size, 0, 0);
+        if (!pool) {
+            gst_ocl_context_unref(ocl);
+            return FALSE;
+        }
+        gst_query_add_allocation_pool(query, pool, size, 0, 0);
+        gst_object_unref(pool);
+    }
+
+    allocator = gst_ocl_allocator_new(ocl);
+    gst_ocl_context_unref(ocl);
+    if (allocator) {
+        gst_query_add_allocation_param(query, allocator, NULL);
+        gst_object_unref(allocator);
+    }
+
+    gst_query_add_allocation_meta(query, GST_VIDEO_META_API_TYPE, NULL);
+
+    return TRUE;
+}
+
+/* ================= LANES ================= */
+
+/*
+ * With multi-device, cpu-split or queues, frames of the asynchronous copy
+ * path are spread over worker lanes besides the element's own queues:
+ * every other device of device-type on any platform, CPU sub-devices, and
+ * more queue sets on the element's device. A frame runs whole on one lane;
+ * the ring still retires frames oldest first, so the output order does
+ * not depend on which lane finishes first. Every lane gets kernels of the
+ * running program, built in its context by the same build that made the
+ * program (see gst_ocl_shader_build), so hot reload and specialization
+ * reach the lanes without compiling on the streaming thread.
+ */
+
+/* Release the kernels of lane and what they used. */
+static void
+gst_ocl_shader_lane_release_program(GstOCLShaderLane *lane)
+{
+    gst_ocl_shader_conv_clear(&lane->conv);
+
+    if (lane->stages)
+        g_array_set_size(lane->stages, 0);
+
+    if (lane->program) {
+        clReleaseProgram(lane->program);
+        lane->program = NULL;
+    }
+}
+
+static void
+gst_ocl_shader_lane_release_buffers(GstOCLShaderLane *lane)
+{
+    for (int i = 0; i < MAX_IN_FLIGHT; i++) {
+        if (lane->bufs[i]) {
+            clReleaseMemObject(lane->bufs[i]);
+            lane->bufs[i] = NULL;
+        }
+    }
+    lane->buf_size = 0;
+}
+
+static void
+gst_ocl_shader_lane_close(GstOCLShaderLane *lane)
+{
+    gst_ocl_shader_lane_release_program(lane);
+    gst_ocl_shader_lane_release_buffers(lane);
+
+    if (lane->stages)
+        g_array_unref(lane->stages);
+    if (lane->queue)
+        clReleaseCommandQueue(lane->queue);
+    if (lane->upload_queue)
+        clReleaseCommandQueue(lane->upload_queue);
+    if (lane->download_queue)
+        clReleaseCommandQueue(lane->download_queue);
+    if (lane->ocl)
+        gst_ocl_context_unref(lane->ocl);
+
+    memset(lane, 0, sizeof(*lane));
+}
+
+/* Add a lane with queues of its own on ocl. */
+static void
+gst_ocl_shader_lane_open(GstOCLShader *self, GstOCLContext *ocl)
+{
+    GstOCLShaderLane *lane = &self->lanes[self->n_lanes];
+    cl_int err;
+
+    memset(lane, 0, sizeof(*lane));
+
+    lane->queue = gst_ocl_context_create_queue(ocl, &err);
+    if (err == CL_SUCCESS)
+        lane->upload_queue = gst_ocl_context_create_queue(ocl, &err);
+    if (err == CL_SUCCESS)
+        lane->download_queue = gst_ocl_context_create_queue(ocl, &err);
+    if (err != CL_SUCCESS) {
+        GST_WARNING_OBJECT(self, "No queues on '%s' (%d), not using it",
+                           ocl->device_name, err);
+        gst_ocl_shader_lane_close(lane);
+        return;
+    }
+
+    lane->ocl = gst_ocl_context_ref(ocl);
+    lane->stages = gst_ocl_shader_stages_new();
+
+    /* get_stats reads the lanes up to n_lanes */
+    GST_OBJECT_LOCK(self);
+    self->n_lanes++;
+    GST_OBJECT_UNLOCK(self);
+
+    GST_INFO_OBJECT(self, "Lane %u on %s '%s'", self->n_lanes,
+                    gst_ocl_device_type_name(ocl->device_type),
+                    ocl->device_name);
+}
+
+/*
+ * Open the lanes of the properties, MAX_LANES at most: queues - 1 more
+ * queue sets on the element's context, then contexts of their own on the
+ * other devices of device-type.
+ */
+static void
+gst_ocl_shader_lanes_open(GstOCLShader *self)
+{
+    GstOCLShaderDeviceType device_type;
+    gboolean multi_device;
+    guint cpu_split, queue_sets, depth;
+
+    GST_OBJECT_LOCK(self);
+    device_type = self->device_type;
+    multi_device = self->multi_device;
+    cpu_split = self->cpu_split;
+    queue_sets = self->queue_sets;
+    depth = self->in_flight_depth;
+    GST_OBJECT_UNLOCK(self);
+
+    for (guint i = 1; i < queue_sets && self->n_lanes < MAX_LANES; i++)
+        gst_ocl_shader_lane_open(self, self->ocl);
+
+    if (multi_device) {
+        GPtrArray *contexts = gst_ocl_context_new_devices(
+            gst_ocl_shader_cl_device_type(device_type), cpu_split,
+            self->ocl);
+
+        for (guint i = 0; i < contexts->len; i++) {
+            if (self->n_lanes == MAX_LANES) {
+                GST_INFO_OBJECT(self, "%u more devices left idle, the ring "
+                                "holds %d frames", contexts->len - i,
+                                MAX_IN_FLIGHT);
+                break;
+            }
+            gst_ocl_shader_lane_open(self, g_ptr_array_index(contexts, i));
+        }
+        g_ptr_array_unref(contexts);
+    }
+
+    if (self->n_lanes > 0 && depth <= self->n_lanes)
+        GST_WARNING_OBJECT(self, "in-flight-depth %u keeps some of the %u "
+                           "lanes idle, raise it above %u",
+                           depth, self->n_lanes + 1, self->n_lanes);
+}
+
+static void
+gst_ocl_shader_lanes_close(GstOCLShader *self)
+{
+    guint n_lanes;
+
+    GST_OBJECT_LOCK(self);
+    n_lanes = self->n_lanes;
+    self->n_lanes = 0;
+    GST_OBJECT_UNLOCK(self);
+
+    for (guint i = 0; i < n_lanes; i++) {
+        GstOCLShaderLane *lane = &self->lanes[i];
+
+        GST_INFO_OBJECT(self, "Lane %u on '%s': %" G_GUINT64_FORMAT
+                        " frames", i + 1, lane->ocl->device_name,
+                        self->loads[i + 1].frames);
+        gst_ocl_shader_lane_close(lane);
+    }
+}
+
+/*
+ * Give lane the kernels of the running program, once per program. The
+ * build that made the program built it in the lane's context too, so
+ * this only looks it up and creates the kernels; it never compiles on
+ * the streaming thread. FALSE while lane cannot run it, the frames then
+ * stay on the element's queues and the lookup is retried.
+ */
+static gboolean
+gst_ocl_shader_lane_sync(GstOCLShader *self, GstOCLShaderLane *lane)
+{
+    cl_program program;
+    gchar *log = NULL;
+
+    if (lane->generation == self->program_generation)
+        return lane->program != NULL;
+
+    if (!self->program || !self->program_source) {
+        gst_ocl_shader_lane_release_program(lane);
+        lane->generation = self->program_generation;
+        return FALSE;
+    }
+
+    program = gst_ocl_context_lookup_program(lane->ocl, self->program_source,
+                                             self->program_options);
+    if (!program) {
+        GST_LOG_OBJECT(self, "No program on '%s' yet, the lane sits out",
+                       lane->ocl->device_name);
+        return FALSE;
+    }
+
+    gst_ocl_shader_lane_release_program(lane);
+    lane->generation = self->program_generation;
+    lane->program = program;
+
+    for (guint i = 0; i < self->stages->len; i++) {
+        const GstOCLShaderStage *src =
+            &g_array_index(self->stages, GstOCLShaderStage, i);
+        GstOCLShaderStage stage = { NULL };
+
+        stage.name = g_strdup(src->name);
+        stage.ops = g_strdup(src->ops);
+        stage.n_ops = src->n_ops;
+        stage.vec_name = g_strdup(src->vec_name);
+        stage.vec_bytes = src->vec_bytes;
+        stage.v_name = g_strdup(src->v_name);
+        /* Tuned work-group sizes only hold on the element's device */
+        if (lane->ocl == self->ocl)
+            memcpy(stage.local, src->local, sizeof(stage.local));
+        g_array_append_val(lane->stages, stage);
+    }
+
+    gst_ocl_shader_create_kernels(self, lane->program, lane->stages,
+                                  lane->ocl->device_name, &log);
+    if (log) {
+        GST_WARNING_OBJECT(self, "%s, the lane sits out", log);
+        g_free(log);
+        gst_ocl_shader_lane_release_program(lane);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/*
+ * Make sure the buffer of slot index in lane holds size bytes. The frames
+ * lane still runs in its other slots are finished before their buffers
+ * are replaced.
+ */
+static cl_int
+gst_ocl_shader_lane_ensure_buffer(GstOCLShaderLane *lane, guint index,
+                                  size_t size)
+{
+    cl_int err = CL_SUCCESS;
+
+    if (size != lane->buf_size) {
+        clFinish(lane->upload_queue);
+        clFinish(lane->queue);
+        clFinish(lane->download_queue);
+        gst_ocl_shader_lane_release_buffers(lane);
+        lane->buf_size = size;
+    }
+
+    if (!lane->bufs[index])
+        lane->bufs[index] = clCreateBuffer(lane->ocl->context,
+                                           CL_MEM_READ_WRITE, size, NULL, &err);
+
+    return err;
+}
+
+/*
+ * Lane of the frame mapped in slot: the one expected to finish it first,
+ * from the frames it is still running and its average frame time. Lanes
+ * not measured yet get a frame to be measured. As frames leave in order,
+ * a lane much slower than the others stops getting frames once its one
+ * frame would hold back more than the ring lets the others run ahead.
+ */
+static guint
+gst_ocl_shader_pick_lane(GstOCLShader *self, GstOCLShaderSlot *slot)
+{
+    const GstVideoInfo *layout = &slot->in_frame.info;
+    guint running[MAX_LANES + 1] = { 0 };
+    gboolean ready[MAX_LANES + 1] = { TRUE };
+    gdouble best_cost = G_MAXDOUBLE;
+    guint best = 0;
+
+    if (self->n_lanes == 0)
+        return 0;
+
+    /* Only the element's launch falls back from a specialized program */
+    if (self->spec_width &&
+        (GST_VIDEO_INFO_WIDTH(layout) != self->spec_width ||
+         GST_VIDEO_INFO_HEIGHT(layout) != self->spec_height ||
+         GST_VIDEO_INFO_PLANE_STRIDE(layout, 0) != self->spec_stride))
+        return 0;
+
+    for (guint i = 0; i < self->n_lanes; i++)
+        ready[i + 1] = gst_ocl_shader_lane_sync(self, &self->lanes[i]);
+
+    for (GList *l = self->pending.head; l; l = l->next) {
+        GstOCLShaderSlot *other = l->data;
+
+        if (!gst_ocl_shader_event_done(other->read_evt))
+            running[other->lane]++;
+    }
+
+    GST_OBJECT_LOCK(self);
+    for (guint i = 0; i <= self->n_lanes; i++) {
+        const GstOCLShaderLoad *load = &self->loads[i];
+        /* Running frames also count by themselves, idle lanes win ties */
+        gdouble cost = (running[i] + 1) * (load->frames ? load->avg_us : 0.0) +
+                       running[i];
+
+        if (ready[i] && cost < best_cost) {
+            best_cost = cost;
+            best = i;
+        }
+    }
+    GST_OBJECT_UNLOCK(self);
+
+    if (best && gst_ocl_shader_lane_ensure_buffer(&self->lanes[best - 1],
+                    slot - self->slots, GST_VIDEO_INFO_SIZE(layout)) !=
+                CL_SUCCESS) {
+        GST_WARNING_OBJECT(self, "No buffer on '%s', frame stays on '%s'",
+                           self->lanes[best - 1].ocl->device_name,
+                           self->ocl->device_name);
+        best = 0;
+    }
+
+    return best;
+}
+
+/*
+ * Give the lanes their kernels and buffers at the negotiated resolution
+ * and warm them up as gst_ocl_shader_prewarm() does the element's queue,
+ * when frames will take the asynchronous copy path the lanes serve.
+ */
+static void
+gst_ocl_shader_lanes_prewarm(GstOCLShader *self, const GstVideoInfo *info)
+{
+    size_t size = GST_VIDEO_INFO_SIZE(info);
+
+    if (self->ring_depth < 2 || self->in_ocl || self->out_ocl)
+        return;
+
+    for (guint i = 0; i < self->n_lanes; i++) {
+        GstOCLShaderLane *lane = &self->lanes[i];
+        gint64 start = g_get_monotonic_time();
+        cl_int err = CL_SUCCESS;
+        cl_mem buf;
+
+        if (!gst_ocl_shader_lane_sync(self, lane))
+            continue;
+
+        for (guint s = 0; s < self->ring_depth && err == CL_SUCCESS; s++)
+            err = gst_ocl_shader_lane_ensure_buffer(lane, s, size);
+        if (err != CL_SUCCESS) {
+            GST_WARNING_OBJECT(self, "No buffers on '%s' (%d)",
+                               lane->ocl->device_name, err);
+            continue;
+        }
+
+        buf = clCreateBuffer(lane->ocl->context, CL_MEM_READ_WRITE,
+                             size, NULL, &err);
+        if (err != CL_SUCCESS)
+            continue;
+
+        for (int n = 0; n < STARTUP_WARMUP_LAUNCHES && err == CL_SUCCESS; n++)
+            err = gst_ocl_shader_run_stages(self, lane->ocl, lane->queue,
+                                            lane->stages, &lane->conv, buf,
+                                            info, 0, NULL, NULL, NULL);
+        clFinish(lane->queue);
+        clReleaseMemObject(buf);
+
+        if (err != CL_SUCCESS)
+            GST_WARNING_OBJECT(self, "Warm-up launch on '%s' failed (%d)",
+                               lane->ocl->device_name, err);
+        else
+            GST_INFO_OBJECT(self, "Lane %u warmed up in %" G_GINT64_FORMAT
+                            " us", i + 1, g_get_monotonic_time() - start);
+    }
+}
+
+/* ================= ASYNCHRONOUS PIPELINE ================= */
+
+/* Frames are kept in flight only when more than one slot is configured. */
+static gboolean
+gst_ocl_shader_is_async(GstOCLShader *self)
+{
+    /* OpenCL memory is already asynchronous through its events */
+    return self->cl_ready && self->ring_depth > 1 &&
+           !self->in_ocl && !self->out_ocl &&
+           !gst_base_transform_is_passthrough(GST_BASE_TRANSFORM(self));
+}
+
+/* TRUE when the readback of a slot has already finished. */
+static gboolean
+gst_ocl_shader_slot_done(GstOCLShaderSlot *slot)
+{
+    return gst_ocl_shader_event_done(slot->read_evt);
+}
+
+/* Wait for a slot to finish, unmap its frames and return the output buffer. */
+static GstBuffer *
+gst_ocl_shader_retire(GstOCLShader *self, GstOCLShaderSlot *slot)
+{
+    GstBuffer *outbuf = slot->outbuf;
+    cl_int err;
+
+    if (slot->read_evt) {
+        err = clWaitForEvents(1, &slot->read_evt);
+        if (err != CL_SUCCESS)
+            GST_ERROR_OBJECT(self, "clWaitForEvents failed (%d)", err);
+        else
+            gst_ocl_shader_add_slot_timing(self, slot);
+    }
+
+    gst_ocl_shader_release_events(slot);
+    slot->lane = 0;
+
+    gst_video_frame_unmap(&slot->out_frame);
+    if (slot->inbuf) {
+        gst_video_frame_unmap(&slot->in_frame);
+        gst_buffer_unref(slot->inbuf);
+        slot->inbuf = NULL;
+    }
+    slot->outbuf = NULL;
+
+    return outbuf;
+}
+
+/* Push every frame still in flight downstream, oldest first. */
+static GstFlowReturn
+gst_ocl_shader_drain(GstOCLShader *self)
+{
+    GstOCLShaderSlot *slot;
+    GstFlowReturn ret = GST_FLOW_OK;
+
+    while ((slot = g_queue_pop_head(&self->pending))) {
+        GstBuffer *outbuf = gst_ocl_shader_retire(self, slot);
+
+        if (ret == GST_FLOW_OK)
+            ret = gst_pad_push(GST_BASE_TRANSFORM_SRC_PAD(self), outbuf);
+        else
+            gst_buffer_unref(outbuf);
+    }
+
+    return ret;
+}
+
+/* Drop every frame still in flight. */
+static void
+gst_ocl_shader_flush(GstOCLShader *self)
+{
+    GstOCLShaderSlot *slot;
+
+    while ((slot = g_queue_pop_head(&self->pending)))
+        gst_buffer_unref(gst_ocl_shader_retire(self, slot));
+
+    gst_ocl_shader_collect_timings(self, TRUE);
+}
+
+/* Map a new input frame and start its upload/kernel/readback. */
+static GstFlowReturn
+gst_ocl_shader_submit(GstOCLShader *self, GstBuffer *inbuf)
+{
+    GstBaseTransform *trans = GST_BASE_TRANSFORM(self);
+    GstVideoFilter *filter = GST_VIDEO_FILTER(self);
+    GstOCLShaderSlot *slot = gst_ocl_shader_next_slot(self);
+    GstBuffer *outbuf = NULL;
+    GstFlowReturn ret;
+    cl_int err;
+
+    ret = GST_BASE_TRANSFORM_GET_CLASS(trans)->prepare_output_buffer(
+              trans, inbuf, &outbuf);
+    if (ret != GST_FLOW_OK || !outbuf) {
+        gst_buffer_unref(inbuf);
+        return ret;
+    }
+
+    if (outbuf == inbuf) {
+        if (!gst_video_frame_map(&slot->out_frame, &filter->out_info,
+                                 outbuf, GST_MAP_READWRITE))
+            goto map_failed;
+        slot->in_frame = slot->out_frame;
+    } else {
+        if (!gst_video_frame_map(&slot->in_frame, &filter->in_info,
+                                 inbuf, GST_MAP_READ))
+            goto map_failed;
+        if (!gst_video_frame_map(&slot->out_frame, &filter->out_info,
+                                 outbuf, GST_MAP_WRITE)) {
+            gst_video_frame_unmap(&slot->in_frame);
+            goto map_failed;
+        }
+        slot->inbuf = inbuf;
+    }
+    slot->outbuf = outbuf;
+
+    /* Every plane goes through the device, differently padded pools too */
+    if (gst_ocl_shader_ensure_buffers(self, GST_VIDEO_FRAME_SIZE(&slot->in_frame))
+        != GST_FLOW_OK)
+        goto error;
+
+    /* Frame boundary: a reloaded program reaches the lanes from here */
+    gst_ocl_shader_apply_reload(self);
+    slot->lane = gst_ocl_shader_pick_lane(self, slot);
+
+    err = gst_ocl_shader_enqueue(self, slot, &slot->in_frame, &slot->out_frame);
+    CHECK_CL(err, "enqueue frame");
+
+    self->frame_count++;
+    self->copy_frames++;
+    g_queue_push_tail(&self->pending, slot);
+
+    GST_LOG_OBJECT(self, "frame=%" G_GUINT64_FORMAT " lane=%u in flight=%u",
+                   self->frame_count, slot->lane,
+                   g_queue_get_length(&self->pending));
+
+    return GST_FLOW_OK;
+
+map_failed:
+    GST_ERROR_OBJECT(self, "Failed to map frame");
+    if (outbuf != inbuf)
+        gst_buffer_unref(inbuf);
+    gst_buffer_unref(outbuf);
+    slot->outbuf = NULL;
+    return GST_FLOW_ERROR;
+
+error:
+    GST_ERROR_OBJECT(self, "OpenCL execution failed");
+    /* Nothing may touch the mapped frames once they are released */
+    clFinish(self->upload_queue);
+    clFinish(self->queue);
+    clFinish(self->download_queue);
+    if (slot->lane) {
+        GstOCLShaderLane *lane = &self->lanes[slot->lane - 1];
+
+        clFinish(lane->upload_queue);
+        clFinish(lane->queue);
+        clFinish(lane->download_queue);
+    }
+    gst_buffer_unref(gst_ocl_shader_retire(self, slot));
+    return GST_FLOW_ERROR;
+}
+
+/*
+ * Keep up to in-flight-depth frames on the device. The frame queued by
+ * submit_input_buffer is enqueued without waiting; the oldest frame is
+ * returned once it has finished, or when the ring is full.
+ */
+static GstFlowReturn
+gst_ocl_shader_generate_output(GstBaseTransform *trans, GstBuffer **outbuf)
+{
+    GstOCLShader *self = (GstOCLShader *)trans;
+    GstBuffer *inbuf = trans->queued_buf;
+    GstOCLShaderSlot *slot;
+    GstFlowReturn ret;
+
+    *outbuf = NULL;
+
+    if (!gst_ocl_shader_is_async(self)) {
+        ret = gst_ocl_shader_drain(self);
+        if (ret != GST_FLOW_OK)
+            return ret;
+
+        return GST_BASE_TRANSFORM_CLASS(gst_ocl_shader_parent_class)->
+            generate_output(trans, outbuf);
+    }
+
+    if (inbuf) {
+        trans->queued_buf = NULL;
+
+        /* Ring full: the slot we are about to reuse holds the oldest frame */
+        if (g_queue_get_length(&self->pending) >= self->ring_depth)
+            *outbuf = gst_ocl_shader_retire(self,
+                                            g_queue_pop_head(&self->pending));
+
+        ret = gst_ocl_shader_submit(self, inbuf);
+        if (ret != GST_FLOW_OK) {
+            if (*outbuf) {
+                gst_buffer_unref(*outbuf);
+                *outbuf = NULL;
+            }
+            return ret;
+        }
+    }
+
+    if (!*outbuf) {
+        slot = g_queue_peek_head(&self->pending);
+        if (slot && gst_ocl_shader_slot_done(slot))
+            *outbuf = gst_ocl_shader_retire(self,
+                                            g_queue_pop_head(&self->pending));
+    }
+
+    return GST_FLOW_OK;
+}
+
+static gboolean
+gst_ocl_shader_sink_event(GstBaseTransform *trans, GstEvent *event)
+{
+    GstOCLShader *self = (GstOCLShader *)trans;
+
+    switch (GST_EVENT_TYPE(event)) {
+    case GST_EVENT_EOS:
+    case GST_EVENT_CAPS:
+    case GST_EVENT_SEGMENT:
+    case GST_EVENT_GAP:
+        /* Frames in flight belong before this event */
+        gst_ocl_shader_drain(self);
+        break;
+
+    case GST_EVENT_FLUSH_STOP:
+        gst_ocl_shader_flush(self);
+        break;
+
+    default:
+        break;
+    }
+
+    return GST_BASE_TRANSFORM_CLASS(gst_ocl_shader_parent_class)->
+        sink_event(trans, event);
+}
+
+/*
+ * The ring keeps the depth it starts with, a new in-flight-depth takes
+ * effect on the next start.
+ */
+static gboolean
+gst_ocl_shader_start(GstBaseTransform *trans)
+{
+    GstOCLShader *self = (GstOCLShader *)trans;
+
+    GST_OBJECT_LOCK(self);
+    self->ring_depth = self->in_flight_depth;
+    GST_OBJECT_UNLOCK(self);
+
+    return TRUE;
+}
+
+static gboolean
+gst_ocl_shader_stop(GstBaseTransform *trans)
+{
+    GstOCLShader *self = (GstOCLShader *)trans;
+
+    gst_ocl_shader_take_warmup(self, TRUE);
+    gst_ocl_shader_flush(self);
+
+    return TRUE;
+}
+
+/* Extra latency introduced by the frames held in flight. */
+static GstClockTime
+gst_ocl_shader_get_latency(GstOCLShader *self)
+{
+    GstVideoInfo *info = &GST_VIDEO_FILTER(self)->in_info;
+
+    if (self->ring_depth <= 1)
+        return 0;
+
+    if (GST_VIDEO_INFO_FPS_N(info) <= 0) {
+        GST_WARNING_OBJECT(self, "Unknown framerate, cannot report latency");
+        return 0;
+    }
+
+    return gst_util_uint64_scale_int(GST_SECOND * (self->ring_depth - 1),
+                                     GST_VIDEO_INFO_FPS_D(info),
+                                     GST_VIDEO_INFO_FPS_N(info));
+}
+
+static gboolean
+gst_ocl_shader_query(GstBaseTransform *trans, GstPadDirection direction,
+                     GstQuery *query)
+{
+    GstOCLShader *self = (GstOCLShader *)trans;
+    GstOCLContext *ocl;
+    gboolean res;
+
+    if (GST_QUERY_TYPE(query) == GST_QUERY_CONTEXT) {
+        ocl = gst_ocl_shader_get_context(self);
+        res = gst_ocl_context_handle_query(GST_ELEMENT(self), query, ocl);
+        if (ocl)
+            gst_ocl_context_unref(ocl);
+        if (res)
+            return TRUE;
+    }
+
+    res = GST_BASE_TRANSFORM_CLASS(gst_ocl_shader_parent_class)->
+              query(trans, direction, query);
+
+    if (res && direction == GST_PAD_SRC &&
+        GST_QUERY_TYPE(query) == GST_QUERY_LATENCY) {
+        GstClockTime min, max, latency;
+        gboolean live;
+
+        gst_query_parse_latency(query, &live, &min, &max);
+        latency = gst_ocl_shader_get_latency(self);
+
+        GST_DEBUG_OBJECT(self, "Adding %" GST_TIME_FORMAT " in-flight latency",
+                         GST_TIME_ARGS(latency));
+
+        min += latency;
+        if (GST_CLOCK_TIME_IS_VALID(max))
+            max += latency;
+        gst_query_set_latency(query, live, min, max);
+    }
+
+    return res;
+}
+
+/*
+ * A property the program is built from changed: rebuilt in the background
+ * with hot-reload, else re-init on the next set_info.
+ */
+static void
+gst_ocl_shader_rebuild(GstOCLShader *self)
+{
+    if (!gst_ocl_shader_schedule_reload(self))
+        self->cl_ready = FALSE;
+}
+
+static void
+gst_ocl_shader_set_property(GObject *object,
+                               guint prop_id,
+                               const GValue *value,
+                               GParamSpec *pspec)
+{
+    GstOCLShader *self = (GstOCLShader *)object;
+
+    switch (prop_id) {
+        case PROP_KERNEL_FILE:
+            GST_OBJECT_LOCK(self);
+            g_free(self->kernel_file);
+            self->kernel_file = g_value_dup_string(value);
+            self->build_cookie++;
+            GST_OBJECT_UNLOCK(self);
+
+            GST_INFO_OBJECT(self,
+                "kernel-file set to: %s",
+                self->kernel_file ? self->kernel_file : "(null)");
+
+            gst_ocl_shader_rebuild(self);
+            break;
+
+        case PROP_KERNEL_FUNC:
+            GST_OBJECT_LOCK(self);
+            g_free(self->kernel_func);
+            self->kernel_func = g_value_dup_string(value);
+            self->build_cookie++;
+            GST_OBJECT_UNLOCK(self);
+
+            GST_INFO_OBJECT(self,
+                "kernel-func set to: %s",
+                self->kernel_func ? self->kernel_func : "(null)");
+
+            gst_ocl_shader_rebuild(self);
+            break;
+
+        case PROP_KERNEL_CHAIN:
+            GST_OBJECT_LOCK(self);
+            g_free(self->kernel_chain);
+            self->kernel_chain = g_value_dup_string(value);
+            self->build_cookie++;
+            GST_OBJECT_UNLOCK(self);
+
+            GST_INFO_OBJECT(self,
+                "kernel-chain set to: %s",
+                self->kernel_chain ? self->kernel_chain : "(null)");
+
+            gst_ocl_shader_rebuild(self);
+            break;
+
+        case PROP_FUSE:
+            GST_OBJECT_LOCK(self);
+            self->fuse = g_value_get_boolean(value);
+            self->build_cookie++;
+            GST_OBJECT_UNLOCK(self);
+            break;
+
+        case PROP_VECTOR_BYTES:
+            GST_OBJECT_LOCK(self);
+            /* Whole vload16 vectors */
+            self->vector_bytes = g_value_get_uint(value) / 16 * 16;
+            self->build_cookie++;
+            GST_OBJECT_UNLOCK(self);
+            break;
+
+        case PROP_IN_PLACE:
+            self->in_place = g_value_get_boolean(value);
+            gst_base_transform_set_in_place(GST_BASE_TRANSFORM(self),
+                                            self->in_place &&
+                                            self->in_ocl == self->out_ocl);
+            break;
+
+        case PROP_ZERO_COPY:
+            self->zero_copy = g_value_get_boolean(value);
+            break;
+
+        case PROP_CACHE_DIR:
+            GST_OBJECT_LOCK(self);
+            g_free(self->cache_dir);
+            self->cache_dir = g_value_dup_string(value);
+            GST_OBJECT_UNLOCK(self);
+            break;
+
+        case PROP_STATS_INTERVAL:
+            GST_OBJECT_LOCK(self);
+            self->stats_interval = g_value_get_uint(value);
+            GST_OBJECT_UNLOCK(self);
+            break;
+
+        case PROP_AUTOTUNE:
+            self->autotune = g_value_get_boolean(value);
+            break;
+
+        /* Taps are rebuilt by the next frame of a separable stage */
+        case PROP_RADIUS:
+            GST_OBJECT_LOCK(self);
+            self->radius = g_value_get_uint(value);
+            GST_OBJECT_UNLOCK(self);
+            break;
+
+        case PROP_SIGMA:
+            GST_OBJECT_LOCK(self);
+            self->sigma = g_value_get_double(value);
+            GST_OBJECT_UNLOCK(self);
+            break;
+
+        case PROP_AMOUNT:
+            GST_OBJECT_LOCK(self);
+            self->amount = g_value_get_double(value);
+            GST_OBJECT_UNLOCK(self);
+            break;
+
+        case PROP_HOT_RELOAD:
+            self->hot_reload = g_value_get_boolean(value);
+            if (!self->hot_reload)
+                gst_ocl_shader_stop_reload(self);
+            else if (self->cl_ready)
+                gst_ocl_shader_start_reload(self);
+            break;
+
+        case PROP_STARTUP_POLICY:
+            self->startup_policy = g_value_get_enum(value);
+            break;
+
+        case PROP_BUILD_OPTIONS:
+            GST_OBJECT_LOCK(self);
+            g_free(self->build_options);
+            self->build_options = g_value_dup_string(value);
+            self->build_cookie++;
+            GST_OBJECT_UNLOCK(self);
+
+            gst_ocl_shader_rebuild(self);
+            break;
+
+        case PROP_SPECIALIZE:
+            self->specialize = g_value_get_boolean(value);
+            break;
+
+        case PROP_DEVICE_TYPE:
+            GST_OBJECT_LOCK(self);
+            self->device_type = g_value_get_enum(value);
+            GST_OBJECT_UNLOCK(self);
+            break;
+
+        case PROP_MULTI_DEVICE:
+            GST_OBJECT_LOCK(self);
+            self->multi_device = g_value_get_boolean(value);
+            GST_OBJECT_UNLOCK(self);
+            break;
+
+        case PROP_CPU_SPLIT:
+            GST_OBJECT_LOCK(self);
+            self->cpu_split = g_value_get_uint(value);
+            GST_OBJECT_UNLOCK(self);
+            break;
+
+        case PROP_QUEUES:
+            GST_OBJECT_LOCK(self);
+            self->queue_sets = g_value_get_uint(value);
+            GST_OBJECT_UNLOCK(self);
+            break;
+
+        /* Picked up by the next launch, no rebuild */
+        case PROP_KERNEL_ARGS: {
+            const GstStructure *args = gst_value_get_structure(value);
+
+            GST_OBJECT_LOCK(self);
+            if (self->kernel_args)
+                gst_structure_free(self->kernel_args);
+            self->kernel_args = args ? gst_structure_copy(args) : NULL;
+            self->args_cookie++;
+            GST_OBJECT_UNLOCK(self);
+            break;
+        }
+
+        case PROP_IN_FLIGHT_DEPTH:
+            GST_OBJECT_LOCK(self);
+            self->in_flight_depth = g_value_get_uint(value);
+            GST_OBJECT_UNLOCK(self);
+            gst_element_post_message(GST_ELEMENT(self),
+                gst_message_new_latency(GST_OBJECT(self)));
+            break;
+
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
+            break;
+    }
+}
 
-    if (self->queue) {
-        clReleaseCommandQueue(self->queue);
-        self->queue = NULL;
+static void
+gst_ocl_shader_get_property(GObject *object,
+                               guint prop_id,
+                               GValue *value,
+                               GParamSpec *pspec)
+{
+    GstOCLShader *self = (GstOCLShader *)object;
+
+    switch (prop_id) {
+    case PROP_KERNEL_FILE:
+        g_value_set_string(value, self->kernel_file);
+        break;
+
+    case PROP_KERNEL_FUNC:
+        g_value_set_string(value, self->kernel_func);
+        break;
+
+    case PROP_KERNEL_CHAIN:
+        g_value_set_string(value, self->kernel_chain);
+        break;
+
+    case PROP_FUSE:
+        g_value_set_boolean(value, self->fuse);
+        break;
+
+    case PROP_VECTOR_BYTES:
+        g_value_set_uint(value, self->vector_bytes);
+        break;
+
+    case PROP_CHAIN_REPORT:
+        GST_OBJECT_LOCK(self);
+        g_value_set_string(value, self->chain_report);
+        GST_OBJECT_UNLOCK(self);
+        break;
+
+    case PROP_IN_PLACE:
+        g_value_set_boolean(value, self->in_place);
+        break;
+
+    case PROP_ZERO_COPY:
+        g_value_set_boolean(value, self->zero_copy);
+        break;
+
+    case PROP_ZERO_COPY_FRAMES:
+        g_value_set_uint64(value, self->zero_copy_frames);
+        break;
+
+    case PROP_COPY_FRAMES:
+        g_value_set_uint64(value, self->copy_frames);
+        break;
+
+    case PROP_DEVICE_FRAMES:
+        g_value_set_uint64(value, self->device_frames);
+        break;
+
+    case PROP_IN_FLIGHT_DEPTH:
+        GST_OBJECT_LOCK(self);
+        g_value_set_uint(value, self->in_flight_depth);
+        GST_OBJECT_UNLOCK(self);
+        break;
+
+    case PROP_CACHE_DIR:
+        GST_OBJECT_LOCK(self);
+        g_value_set_string(value, self->cache_dir);
+        GST_OBJECT_UNLOCK(self);
+        break;
+
+    case PROP_CACHE_HITS:
+        g_value_set_uint64(value, self->ocl ? self->ocl->cache_stats.hits : 0);
+        break;
+
+    case PROP_CACHE_MISSES:
+        g_value_set_uint64(value, self->ocl ? self->ocl->cache_stats.misses : 0);
+        break;
+
+    case PROP_STATS:
+        g_value_take_boxed(value, gst_ocl_shader_get_stats(self));
+        break;
+
+    case PROP_STATS_INTERVAL:
+        g_value_set_uint(value, self->stats_interval);
+        break;
+
+    case PROP_AUTOTUNE:
+        g_value_set_boolean(value, self->autotune);
+        break;
+
+    case PROP_RADIUS:
+        GST_OBJECT_LOCK(self);
+        g_value_set_uint(value, self->radius);
+        GST_OBJECT_UNLOCK(self);
+        break;
+
+    case PROP_SIGMA:
+        GST_OBJECT_LOCK(self);
+        g_value_set_double(value, self->sigma);
+        GST_OBJECT_UNLOCK(self);
+        break;
+
+    case PROP_AMOUNT:
+        GST_OBJECT_LOCK(self);
+        g_value_set_double(value, self->amount);
+        GST_OBJECT_UNLOCK(self);
+        break;
+
+    case PROP_HOT_RELOAD:
+        g_value_set_boolean(value, self->hot_reload);
+        break;
+
+    case PROP_STARTUP_POLICY:
+        g_value_set_enum(value, self->startup_policy);
+        break;
+
+    case PROP_BUILD_OPTIONS:
+        GST_OBJECT_LOCK(self);
+        g_value_set_string(value, self->build_options);
+        GST_OBJECT_UNLOCK(self);
+        break;
+
+    case PROP_SPECIALIZE:
+        g_value_set_boolean(value, self->specialize);
+        break;
+
+    case PROP_DEVICE_TYPE:
+        GST_OBJECT_LOCK(self);
+        g_value_set_enum(value, self->device_type);
+        GST_OBJECT_UNLOCK(self);
+        break;
+
+    case PROP_HOST_FRAMES:
+        g_value_set_uint64(value, self->host_frames);
+        break;
+
+    case PROP_MULTI_DEVICE:
+        GST_OBJECT_LOCK(self);
+        g_value_set_boolean(value, self->multi_device);
+        GST_OBJECT_UNLOCK(self);
+        break;
+
+    case PROP_CPU_SPLIT:
+        GST_OBJECT_LOCK(self);
+        g_value_set_uint(value, self->cpu_split);
+        GST_OBJECT_UNLOCK(self);
+        break;
+
+    case PROP_QUEUES:
+        GST_OBJECT_LOCK(self);
+        g_value_set_uint(value, self->queue_sets);
+        GST_OBJECT_UNLOCK(self);
+        break;
+
+    case PROP_KERNEL_ARGS:
+        GST_OBJECT_LOCK(self);
+        gst_value_set_structure(value, self->kernel_args);
+        GST_OBJECT_UNLOCK(self);
+        break;
+
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
+        break;
+    }
+}
+
+static GstStateChangeReturn
+gst_ocl_shader_change_state(GstElement *element, GstStateChange transition)
+{
+    GstOCLShader *self = (GstOCLShader *)element;
+    GstStateChangeReturn ret;
+
+    switch (transition) {
+    case GST_STATE_CHANGE_NULL_TO_READY:
+        /* Share the context early so neighbours can pick it up, and have
+         * the program built before the caps arrive */
+        self->startup_time = g_get_monotonic_time();
+        gst_ocl_shader_start_startup(self);
+        break;
+    case GST_STATE_CHANGE_READY_TO_PAUSED:
+        gst_ocl_shader_reset_stats(self);
+        break;
+    default:
+        break;
     }
 
-    if (self->context) {
-        clReleaseContext(self->context);
-        self->context = NULL;
+    ret = GST_ELEMENT_CLASS(gst_ocl_shader_parent_class)->
+              change_state(element, transition);
+    if (ret == GST_STATE_CHANGE_FAILURE)
+        return ret;
+
+    switch (transition) {
+    case GST_STATE_CHANGE_READY_TO_NULL:
+        gst_ocl_shader_close(self);
+        break;
+    default:
+        break;
     }
 
+    return ret;
+}
+
+static void
+gst_ocl_shader_set_context(GstElement *element, GstContext *context)
+{
+    GstOCLShader *self = (GstOCLShader *)element;
+
+    gst_ocl_context_handle_set_context(element, context, &self->ocl);
+
+    GST_ELEMENT_CLASS(gst_ocl_shader_parent_class)->
+        set_context(element, context);
+}
+
+static void
+gst_ocl_shader_finalize(GObject *object)
+{
+    GstOCLShader *self = (GstOCLShader *)object;
+
+    GST_DEBUG_OBJECT(self, "Finalizing OpenCL filter");
+
+    /* Frames still in flight */
+    gst_ocl_shader_flush(self);
+
+    /* Release OpenCL kernel/program/queues and the shared context */
+    gst_ocl_shader_close(self);
+
     /* Free GObject properties */
     g_clear_pointer(&self->kernel_file, g_free);
     g_clear_pointer(&self->kernel_func, g_free);
+    g_clear_pointer(&self->kernel_chain, g_free);
+    g_clear_pointer(&self->chain_report, g_free);
+    g_clear_pointer(&self->stages, g_array_unref);
+    g_clear_pointer(&self->cache_dir, g_free);
+    g_clear_pointer(&self->kernel_args, gst_structure_free);
+    g_clear_pointer(&self->build_options, g_free);
+    g_clear_pointer(&self->spec, g_free);
+    gst_ocl_shader_stop_reload(self);
+    g_mutex_clear(&self->reload_lock);
+    g_mutex_clear(&self->startup_lock);
+    g_cond_clear(&self->startup_cond);
 
     /* Chain up to parent class */
     G_OBJECT_CLASS(gst_ocl_shader_parent_class)->finalize(object);
@@ -459,13 +5069,60 @@ gst_ocl_shader_init(GstOCLShader *self)
     self->buf_size = 0;
     self->kernel_file = NULL;
     self->kernel_func = NULL;
+    self->kernel_chain = NULL;
+    self->fuse = DEFAULT_FUSE;
+    self->vector_bytes = DEFAULT_VECTOR_BYTES;
+    self->chain_report = NULL;
 
-    for (int i = 0; i < NUM_BUFFERS; i++) {
-        self->ybuf[i] = NULL;
-        self->write_evt[i] = NULL;
-        self->kernel_evt[i] = NULL;
-        self->read_evt[i] = NULL;
-    }
+    self->stages = gst_ocl_shader_stages_new();
+    self->cache_dir = NULL;
+    self->in_place = DEFAULT_IN_PLACE;
+    self->zero_copy = DEFAULT_ZERO_COPY;
+    self->zero_copy_frames = 0;
+    self->copy_frames = 0;
+    self->device_frames = 0;
+
+    gst_base_transform_set_in_place(GST_BASE_TRANSFORM(self), self->in_place);
+
+    self->in_flight_depth = DEFAULT_IN_FLIGHT_DEPTH;
+    self->ring_depth = DEFAULT_IN_FLIGHT_DEPTH;
+    g_queue_init(&self->pending);
+
+    self->stats_interval = DEFAULT_STATS_INTERVAL;
+    self->autotune = DEFAULT_AUTOTUNE;
+    self->radius = DEFAULT_RADIUS;
+    self->sigma = DEFAULT_SIGMA;
+    self->amount = DEFAULT_AMOUNT;
+    self->kernel_args = NULL;
+    self->args_cookie = 1;
+    self->hot_reload = DEFAULT_HOT_RELOAD;
+    g_mutex_init(&self->reload_lock);
+    self->startup_policy = DEFAULT_STARTUP_POLICY;
+    self->build_cookie = 0;
+    self->startup_pending = FALSE;
+    g_mutex_init(&self->startup_lock);
+    g_cond_init(&self->startup_cond);
+    self->build_options = NULL;
+    self->specialize = DEFAULT_SPECIALIZE;
+    self->spec = NULL;
+    self->program_spec = NULL;
+    g_queue_init(&self->variants);
+    self->device_type = DEFAULT_DEVICE_TYPE;
+    self->host_running = FALSE;
+    self->host_ready = FALSE;
+    self->host_frames = 0;
+    self->multi_device = DEFAULT_MULTI_DEVICE;
+    self->cpu_split = DEFAULT_CPU_SPLIT;
+    self->queue_sets = DEFAULT_QUEUES;
+    self->n_lanes = 0;
+    self->program_generation = 0;
+    self->tune_pending = FALSE;
+    g_queue_init(&self->timings);
+    for (int i = 0; i < GST_OCL_SHADER_N_STATS; i++)
+        ocl_stat_reset(&self->stats[i]);
+
+    for (int i = 0; i < MAX_IN_FLIGHT; i++)
+        memset(&self->slots[i], 0, sizeof(GstOCLShaderSlot));
 }
 
 /* Class initialization */
@@ -473,6 +5130,7 @@ static void
 gst_ocl_shader_class_init(GstOCLShaderClass *klass)
 {
     GstElementClass *eclass = GST_ELEMENT_CLASS(klass);
+    GstBaseTransformClass *bclass = GST_BASE_TRANSFORM_CLASS(klass);
     GstVideoFilterClass *vclass = GST_VIDEO_FILTER_CLASS(klass);
     GObjectClass *gclass = G_OBJECT_CLASS(klass);
 
@@ -480,11 +5138,67 @@ gst_ocl_shader_class_init(GstOCLShaderClass *klass)
                             "oscaroclshader", 0,
                             "OpenCL NV12 Shader");
 
+    /* Logged through GST_TRACERS="log" / the GST_TRACER category */
+    tr_frame = gst_tracer_record_new("ocl-frame.class",
+        "element", GST_TYPE_STRUCTURE, gst_structure_new("scope",
+            "type", G_TYPE_GTYPE, G_TYPE_STRING,
+            "related-to", GST_TYPE_TRACER_VALUE_SCOPE,
+            GST_TRACER_VALUE_SCOPE_ELEMENT,
+            NULL),
+        "upload", GST_TYPE_STRUCTURE, gst_structure_new("value",
+            "type", G_TYPE_GTYPE, G_TYPE_DOUBLE,
+            "description", G_TYPE_STRING, "Upload time in us",
+            NULL),
+        "kernel", GST_TYPE_STRUCTURE, gst_structure_new("value",
+            "type", G_TYPE_GTYPE, G_TYPE_DOUBLE,
+            "description", G_TYPE_STRING, "Kernel chain time in us",
+            NULL),
+        "download", GST_TYPE_STRUCTURE, gst_structure_new("value",
+            "type", G_TYPE_GTYPE, G_TYPE_DOUBLE,
+            "description", G_TYPE_STRING, "Readback time in us",
+            NULL),
+        "queue-wait", GST_TYPE_STRUCTURE, gst_structure_new("value",
+            "type", G_TYPE_GTYPE, G_TYPE_DOUBLE,
+            "description", G_TYPE_STRING,
+            "Time from data ready on the device to kernel start in us",
+            NULL),
+        "total", GST_TYPE_STRUCTURE, gst_structure_new("value",
+            "type", G_TYPE_GTYPE, G_TYPE_DOUBLE,
+            "description", G_TYPE_STRING, "Device time of the frame in us",
+            NULL),
+        NULL);
+    GST_OBJECT_FLAG_SET(tr_frame, GST_OBJECT_FLAG_MAY_BE_LEAKED);
+
     /* BaseTransform virtual functions */
     gclass->finalize = gst_ocl_shader_finalize;
+    eclass->change_state = GST_DEBUG_FUNCPTR(gst_ocl_shader_change_state);
+    eclass->set_context = GST_DEBUG_FUNCPTR(gst_ocl_shader_set_context);
     vclass->set_info = GST_DEBUG_FUNCPTR(gst_ocl_shader_set_info);
     vclass->transform_frame =
         GST_DEBUG_FUNCPTR(gst_ocl_shader_transform_frame);
+    vclass->transform_frame_ip =
+        GST_DEBUG_FUNCPTR(gst_ocl_shader_transform_frame_ip);
+
+    /* OpenCL memory skips the frame mapping of GstVideoFilter */
+    bclass->transform = GST_DEBUG_FUNCPTR(gst_ocl_shader_transform);
+    bclass->transform_ip = GST_DEBUG_FUNCPTR(gst_ocl_shader_transform_ip);
+    bclass->transform_caps = GST_DEBUG_FUNCPTR(gst_ocl_shader_transform_caps);
+    bclass->decide_allocation =
+        GST_DEBUG_FUNCPTR(gst_ocl_shader_decide_allocation);
+    bclass->propose_allocation =
+        GST_DEBUG_FUNCPTR(gst_ocl_shader_propose_allocation);
+
+    /* Bypass must not even map the frame */
+    bclass->transform_ip_on_passthrough = FALSE;
+
+    /* Asynchronous in-flight pipeline */
+    bclass->generate_output = GST_DEBUG_FUNCPTR(gst_ocl_shader_generate_output);
+    bclass->sink_event = GST_DEBUG_FUNCPTR(gst_ocl_shader_sink_event);
+    bclass->start = GST_DEBUG_FUNCPTR(gst_ocl_shader_start);
+    bclass->stop = GST_DEBUG_FUNCPTR(gst_ocl_shader_stop);
+    bclass->before_transform =
+        GST_DEBUG_FUNCPTR(gst_ocl_shader_before_transform);
+    bclass->query = GST_DEBUG_FUNCPTR(gst_ocl_shader_query);
 
     /* Add pad templates */
     gst_element_class_add_pad_template(
@@ -497,7 +5211,7 @@ gst_ocl_shader_class_init(GstOCLShaderClass *klass)
         eclass,
         "OpenCL NV12 Shader",
         "Filter/Video",
-        "Applies OpenCL processing on NV12 video",
+        "Applies OpenCL processing on NV12, I420, P010, RGBA and BGRx video",
         "eInfochips-Leica");
 
     gclass->set_property = gst_ocl_shader_set_property;
@@ -525,6 +5239,354 @@ gst_ocl_shader_class_init(GstOCLShaderClass *klass)
             NULL, /* default */
             G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
 
+    g_object_class_install_property(
+        gclass,
+        PROP_KERNEL_CHAIN,
+        g_param_spec_string(
+            "kernel-chain",
+            "OpenCL kernel chain",
+            "Comma separated kernel functions run in order on one upload, "
+            "e.g. \"nv12_invert_left,nv12_bright_left\". "
+            "Overrides kernel-func when set.",
+            NULL, /* default */
+            G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property(
+        gclass,
+        PROP_FUSE,
+        g_param_spec_boolean(
+            "fuse",
+            "Fuse point-wise kernels",
+            "Fuse consecutive point-wise kernels of the chain (kernels K "
+            "with a uchar K_px() function) into one generated kernel, or "
+            "into the vertical pass of a luma filter right before them, so "
+            "the frame is read and written once.",
+            DEFAULT_FUSE,
+            G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property(
+        gclass,
+        PROP_VECTOR_BYTES,
+        g_param_spec_uint(
+            "vector-bytes",
+            "Bytes per work-item",
+            "Luma bytes each work-item of a vectorized stage handles with "
+            "vload16/vstore16 (rounded down to a multiple of 16, 0 disables). "
+            "Stages whose kernels K all have a uchar16 K_px16() function use "
+            "it when the row stride is 16-byte aligned.",
+            0, 64, DEFAULT_VECTOR_BYTES,
+            G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property(
+        gclass,
+        PROP_CHAIN_REPORT,
+        g_param_spec_string(
+            "chain-report",
+            "Kernel chain report",
+            "Stages of the negotiated chain, which kernels were fused and "
+            "the memory traffic saved per frame.",
+            NULL,
+            G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property(
+        gclass,
+        PROP_IN_PLACE,
+        g_param_spec_boolean(
+            "in-place",
+            "In-place processing",
+            "Process the input buffer in place instead of copying "
+            "it into a new output buffer first.",
+            DEFAULT_IN_PLACE,
+            G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property(
+        gclass,
+        PROP_ZERO_COPY,
+        g_param_spec_boolean(
+            "zero-copy",
+            "Zero-copy",
+            "Wrap the frame memory with CL_MEM_USE_HOST_PTR when the device "
+            "shares host memory and the plane is suitably aligned. "
+            "Falls back to upload/readback otherwise.",
+            DEFAULT_ZERO_COPY,
+            G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property(
+        gclass,
+        PROP_ZERO_COPY_FRAMES,
+        g_param_spec_uint64(
+            "zero-copy-frames",
+            "Zero-copy frames",
+            "Number of frames processed directly in the frame memory.",
+            0, G_MAXUINT64, 0,
+            G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property(
+        gclass,
+        PROP_COPY_FRAMES,
+        g_param_spec_uint64(
+            "copy-frames",
+            "Copy frames",
+            "Number of frames processed through upload/readback.",
+            0, G_MAXUINT64, 0,
+            G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property(
+        gclass,
+        PROP_DEVICE_FRAMES,
+        g_param_spec_uint64(
+            "device-frames",
+            "Device frames",
+            "Number of frames processed in OpenCL memory (memory:OpenCL).",
+            0, G_MAXUINT64, 0,
+            G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property(
+        gclass,
+        PROP_IN_FLIGHT_DEPTH,
+        g_param_spec_uint(
+            "in-flight-depth",
+            "In-flight depth",
+            "Number of frames kept on the device at once. With more than one, "
+            "the upload of a frame overlaps the kernel and readback of the "
+            "previous ones, adding (depth - 1) frames of latency. Taken "
+            "when the element starts, READY->PAUSED.",
+            1, MAX_IN_FLIGHT, DEFAULT_IN_FLIGHT_DEPTH,
+            G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS |
+            GST_PARAM_MUTABLE_READY));
+
+    g_object_class_install_property(
+        gclass,
+        PROP_CACHE_DIR,
+        g_param_spec_string(
+            "cache-dir",
+            "Program cache directory",
+            "Directory for cached OpenCL program binaries. If not set, "
+            "$OCL_CACHE_DIR or ~/.cache/oscaroclshader is used; "
+            "an empty string disables the cache.",
+            NULL, /* default */
+            G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property(
+        gclass,
+        PROP_CACHE_HITS,
+        g_param_spec_uint64(
+            "cache-hits",
+            "Program cache hits",
+            "Number of programs loaded from the binary cache.",
+            0, G_MAXUINT64, 0,
+            G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property(
+        gclass,
+        PROP_CACHE_MISSES,
+        g_param_spec_uint64(
+            "cache-misses",
+            "Program cache misses",
+            "Number of programs compiled from source.",
+            0, G_MAXUINT64, 0,
+            G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property(
+        gclass,
+        PROP_STATS,
+        g_param_spec_boxed(
+            "stats",
+            "GPU timing statistics",
+            "\"ocl-stats\" structure with min/avg/p99 in microseconds of the "
+            "upload, kernel, download, queue-wait and total device time "
+            "per frame, whether frames are transfer or compute bound, and "
+            "a \"devices\" array with the frames, average device time and "
+            "frames per second of every device and queue set.",
+            GST_TYPE_STRUCTURE,
+            G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property(
+        gclass,
+        PROP_STATS_INTERVAL,
+        g_param_spec_uint(
+            "stats-interval",
+            "Statistics interval",
+            "Post the stats structure as an element message every N "
+            "frames. 0 disables the messages.",
+            0, G_MAXUINT, DEFAULT_STATS_INTERVAL,
+            G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property(
+        gclass,
+        PROP_AUTOTUNE,
+        g_param_spec_boolean(
+            "autotune",
+            "Autotune work-group size",
+            "On the first frame at a resolution, benchmark candidate "
+            "work-group sizes for each kernel and use the fastest, padding "
+            "the global size. Results are kept per device, kernel and "
+            "resolution in worksize.tbl in the cache directory.",
+            DEFAULT_AUTOTUNE,
+            G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property(
+        gclass,
+        PROP_RADIUS,
+        g_param_spec_uint(
+            "radius",
+            "Filter radius",
+            "Radius in pixels of the separable filters of the chain (kernel "
+            "pairs K_h/K_v such as luma_gaussian in convolve.cl), the apron "
+            "each work-group loads into local memory. Sobel uses 1.",
+            1, OCL_CONV_MAX_RADIUS, DEFAULT_RADIUS,
+            G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property(
+        gclass,
+        PROP_SIGMA,
+        g_param_spec_double(
+            "sigma",
+            "Gaussian sigma",
+            "Standard deviation of the Gaussian and unsharp filters, "
+            "0 for radius / 2.",
+            0.0, 100.0, DEFAULT_SIGMA,
+            G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property(
+        gclass,
+        PROP_AMOUNT,
+        g_param_spec_double(
+            "amount",
+            "Unsharp amount",
+            "Strength of the unsharp mask: out = in + amount * (in - blur).",
+            0.0, 10.0, DEFAULT_AMOUNT,
+            G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property(
+        gclass,
+        PROP_KERNEL_ARGS,
+        g_param_spec_boxed(
+            "kernel-args",
+            "Kernel arguments",
+            "Values of the scalar kernel arguments, by argument name, e.g. "
+            "\"args, value=40\". The frame, width, height, stride, "
+            "total_pixels, format and per-plane offsetN/strideN arguments "
+            "are bound automatically. Changes apply from the next frame "
+            "without a rebuild.",
+            GST_TYPE_STRUCTURE,
+            G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property(
+        gclass,
+        PROP_HOT_RELOAD,
+        g_param_spec_boolean(
+            "hot-reload",
+            "Hot reload",
+            "Watch kernel-file and rebuild the chain in the background when "
+            "it or kernel-file/func/chain change. Frames keep running the "
+            "current kernels until the new ones are ready; a failed build is "
+            "posted as a warning and the current kernels stay.",
+            DEFAULT_HOT_RELOAD,
+            G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property(
+        gclass,
+        PROP_STARTUP_POLICY,
+        g_param_spec_enum(
+            "startup-policy",
+            "Startup policy",
+            "OpenCL is initialised and the program built on a background "
+            "thread from NULL->READY. block makes the first frame wait for "
+            "it; bypass passes frames through unprocessed until it is ready. "
+            "Buffers and warm-up launches at the negotiated resolution run "
+            "before the first processed frame either way.",
+            GST_TYPE_OCL_SHADER_STARTUP_POLICY, DEFAULT_STARTUP_POLICY,
+            G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property(
+        gclass,
+        PROP_BUILD_OPTIONS,
+        g_param_spec_string(
+            "build-options",
+            "Build options",
+            "Extra options for clBuildProgram, e.g. "
+            "\"-cl-fast-relaxed-math -DTHRESHOLD=40\".",
+            NULL,
+            G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property(
+        gclass,
+        PROP_SPECIALIZE,
+        g_param_spec_boolean(
+            "specialize",
+            "Specialize for the caps",
+            "Build a variant of the program for the negotiated geometry, "
+            "with -DWIDTH, -DHEIGHT, -DSTRIDE and " SPECIALIZE_FLAGS ", in "
+            "the background while the generic program runs. The programs of "
+            "the last few geometries are kept for renegotiations.",
+            DEFAULT_SPECIALIZE,
+            G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property(
+        gclass,
+        PROP_DEVICE_TYPE,
+        g_param_spec_enum(
+            "device-type",
+            "Device type",
+            "OpenCL device to run on, taken from READY. Without one, chains "
+            "of the built-in kernels of nv12_half_left.cl run on the host "
+            "with SSE2/AVX2 on all cores instead of passing frames through.",
+            GST_TYPE_OCL_SHADER_DEVICE_TYPE, DEFAULT_DEVICE_TYPE,
+            G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS |
+            GST_PARAM_MUTABLE_READY));
+
+    g_object_class_install_property(
+        gclass,
+        PROP_HOST_FRAMES,
+        g_param_spec_uint64(
+            "host-frames",
+            "Host frames",
+            "Frames processed by the host engine",
+            0, G_MAXUINT64, 0,
+            G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property(
+        gclass,
+        PROP_MULTI_DEVICE,
+        g_param_spec_boolean(
+            "multi-device",
+            "Multiple devices",
+            "Also run frames on every other OpenCL device of device-type, "
+            "on all platforms (e.g. an iGPU next to a dGPU). Each frame runs "
+            "whole on the device expected to finish it first and frames "
+            "leave in order. Needs in-flight-depth above the number of "
+            "devices and system memory caps. Taken from READY.",
+            DEFAULT_MULTI_DEVICE,
+            G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS |
+            GST_PARAM_MUTABLE_READY));
+
+    g_object_class_install_property(
+        gclass,
+        PROP_CPU_SPLIT,
+        g_param_spec_uint(
+            "cpu-split",
+            "CPU split",
+            "With multi-device, partition the CPU devices other than the "
+            "element's into sub-devices of this many compute units, each "
+            "running frames of its own. 0 uses CPUs whole. Taken from READY.",
+            0, 1024, DEFAULT_CPU_SPLIT,
+            G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS |
+            GST_PARAM_MUTABLE_READY));
+
+    g_object_class_install_property(
+        gclass,
+        PROP_QUEUES,
+        g_param_spec_uint(
+            "queues",
+            "Queue sets",
+            "Sets of upload/kernel/download queues on the element's device, "
+            "frames on different sets overlap. Needs in-flight-depth above "
+            "it. Taken from READY.",
+            1, MAX_IN_FLIGHT, DEFAULT_QUEUES,
+            G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS |
+            GST_PARAM_MUTABLE_READY));
+
 }
 
 /* Plugin entry point */
@@ -534,7 +5596,15 @@ plugin_init(GstPlugin *plugin)
     return gst_element_register(plugin,
                                 "oscaroclshader",
                                 GST_RANK_NONE,
-                                GST_TYPE_OCL_SHADER);
+                                GST_TYPE_OCL_SHADER) &&
+           gst_element_register(plugin,
+                                "oscaroclremap",
+                                GST_RANK_NONE,
+                                GST_TYPE_OCL_REMAP) &&
+           gst_element_register(plugin,
+                                "oscaroclstitch",
+                                GST_RANK_NONE,
+                                GST_TYPE_OCL_STITCH);
 }
 
 /* Define plugin */
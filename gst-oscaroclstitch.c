@@ -0,0 +1,1043 @@
+/*
+ * gst-oscaroclstitch.c
+ *
+ * N-camera panorama GstVideoAggregator on the camera models of common.h
+ * Accepts GRAY8 and UYVY video/x-raw, the interpolate() layouts of common.h
+ *
+ * Every sink pad is a fisheye camera with its model, intrinsics and
+ * orientation. The aggregator base class hands over the frames of all
+ * cameras for each output timestamp. Per-camera weight maps and panorama
+ * LUTs are computed once per caps (or camera change) and stay on the
+ * device; frames are then uploaded side by side and blended by one kernel
+ * launch. Built into the oscaroclshader plugin, with gst-oscaroclremap.c
+ * and gstoclcontext.c; links gstbase for GstAggregator.
+ *
+ */
+
+#define CL_TARGET_OPENCL_VERSION 300 // Targets OpenCL 3.0
+
+#include <gst/gst.h>
+#include <gst/video/video.h>
+#include <gst/video/gstvideoaggregator.h>
+#include <CL/cl.h>
+#include <math.h>
+#include <string.h>
+
+#include "gst-oscaroclremap.h"
+#include "gst-oscaroclstitch.h"
+#include "gstoclcontext.h"
+
+/* Debug category for GstOCLStitch logging. */
+GST_DEBUG_CATEGORY_STATIC(gst_ocl_stitch_debug);
+#define GST_CAT_DEFAULT gst_ocl_stitch_debug
+
+/* Cameras are bits of the blend kernel's mask */
+#define STITCH_MAX_CAMERAS 32
+/* Side of the square work-groups, smaller where the kernel needs it */
+#define STITCH_LOCAL 16
+
+/* ================= PAD ================= */
+
+typedef struct _GstOCLStitchPad {
+    GstVideoAggregatorPad parent;
+
+    /* Properties, under the object lock */
+    GstOCLRemapCamera camera;
+    gdouble yaw;   /* degrees, positive to the right */
+    gdouble pitch; /* degrees, positive up */
+    gdouble roll;  /* degrees, positive clockwise */
+    gboolean dirty; /* weights and LUT to recompute */
+} GstOCLStitchPad;
+
+typedef struct _GstOCLStitchPadClass {
+    GstVideoAggregatorPadClass parent_class;
+} GstOCLStitchPadClass;
+
+enum {
+    PROP_PAD_0,
+    PROP_PAD_YAW,
+    PROP_PAD_PITCH,
+    PROP_PAD_ROLL,
+    PROP_PAD_CAMERA, /* GST_OCL_REMAP_CAMERA_N_PROPS camera properties */
+};
+
+G_DEFINE_TYPE(GstOCLStitchPad, gst_ocl_stitch_pad,
+              GST_TYPE_VIDEO_AGGREGATOR_PAD)
+
+static void
+gst_ocl_stitch_pad_set_property(GObject *object,
+                                guint prop_id,
+                                const GValue *value,
+                                GParamSpec *pspec)
+{
+    GstOCLStitchPad *pad = (GstOCLStitchPad *)object;
+
+    GST_OBJECT_LOCK(pad);
+    switch (prop_id) {
+        case PROP_PAD_YAW:
+            pad->yaw = g_value_get_double(value);
+            break;
+        case PROP_PAD_PITCH:
+            pad->pitch = g_value_get_double(value);
+            break;
+        case PROP_PAD_ROLL:
+            pad->roll = g_value_get_double(value);
+            break;
+        default:
+            if (prop_id >= PROP_PAD_CAMERA &&
+                gst_ocl_remap_camera_set(&pad->camera,
+                                         prop_id - PROP_PAD_CAMERA, value))
+                break;
+            GST_OBJECT_UNLOCK(pad);
+            G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
+            return;
+    }
+    /* Recomputed with the next output frame */
+    pad->dirty = TRUE;
+    GST_OBJECT_UNLOCK(pad);
+}
+
+static void
+gst_ocl_stitch_pad_get_property(GObject *object,
+                                guint prop_id,
+                                GValue *value,
+                                GParamSpec *pspec)
+{
+    GstOCLStitchPad *pad = (GstOCLStitchPad *)object;
+
+    GST_OBJECT_LOCK(pad);
+    switch (prop_id) {
+        case PROP_PAD_YAW:
+            g_value_set_double(value, pad->yaw);
+            break;
+        case PROP_PAD_PITCH:
+            g_value_set_double(value, pad->pitch);
+            break;
+        case PROP_PAD_ROLL:
+            g_value_set_double(value, pad->roll);
+            break;
+        default:
+            if (prop_id >= PROP_PAD_CAMERA &&
+                gst_ocl_remap_camera_get(&pad->camera,
+                                         prop_id - PROP_PAD_CAMERA, value))
+                break;
+            G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
+            break;
+    }
+    GST_OBJECT_UNLOCK(pad);
+}
+
+static void
+gst_ocl_stitch_pad_init(GstOCLStitchPad *pad)
+{
+    gst_ocl_remap_camera_init(&pad->camera);
+    pad->yaw = 0.0;
+    pad->pitch = 0.0;
+    pad->roll = 0.0;
+    pad->dirty = TRUE;
+}
+
+static void
+gst_ocl_stitch_pad_class_init(GstOCLStitchPadClass *klass)
+{
+    GObjectClass *gclass = G_OBJECT_CLASS(klass);
+
+    gclass->set_property = gst_ocl_stitch_pad_set_property;
+    gclass->get_property = gst_ocl_stitch_pad_get_property;
+
+    g_object_class_install_property(
+        gclass,
+        PROP_PAD_YAW,
+        g_param_spec_double(
+            "yaw",
+            "Yaw",
+            "Heading of the camera in the panorama in degrees, "
+            "positive to the right",
+            -360.0, 360.0, 0.0,
+            G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property(
+        gclass,
+        PROP_PAD_PITCH,
+        g_param_spec_double(
+            "pitch",
+            "Pitch",
+            "Elevation of the camera in degrees, positive up",
+            -180.0, 180.0, 0.0,
+            G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property(
+        gclass,
+        PROP_PAD_ROLL,
+        g_param_spec_double(
+            "roll",
+            "Roll",
+            "Rotation of the camera about its axis in degrees",
+            -360.0, 360.0, 0.0,
+            G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    gst_ocl_remap_camera_install(gclass, PROP_PAD_CAMERA);
+}
+
+/* ================= OBJECT ================= */
+
+typedef struct _GstOCLStitch {
+    GstVideoAggregator parent;
+
+    /* OpenCL objects */
+    GstOCLContext *ocl;
+    cl_command_queue queue;
+    cl_program program; /* of the first camera, for stitch_blend */
+    cl_kernel blend_kernel;
+    size_t blend_local[2];
+    cl_mem frames;  /* frame_pixels per camera, tightly packed */
+    cl_mem weights; /* float per source pixel and camera */
+    cl_mem luts;    /* float2 per panorama pixel and camera */
+    cl_mem dst;     /* panorama, laid out as the output caps */
+
+    /* Geometry the buffers were set up for */
+    gpointer cameras[STITCH_MAX_CAMERAS]; /* pads, for identity only */
+    guint n_cameras;
+    gint src_width;
+    gint src_height;
+    gint frame_pixels;
+    guint bpp;
+    GstVideoInfo out_info;
+
+    gboolean cl_ready;
+    guint64 frame_count;
+
+    /* Properties, under the object lock */
+    gchar *kernel_file;
+    gchar *cache_dir;
+    gboolean dirty;
+} GstOCLStitch;
+
+typedef struct _GstOCLStitchClass {
+    GstVideoAggregatorClass parent_class;
+} GstOCLStitchClass;
+
+enum {
+    PROP_0,
+    PROP_KERNEL_FILE,
+    PROP_CACHE_DIR,
+};
+
+#define DEFAULT_KERNEL_FILE "stitch.cl"
+
+G_DEFINE_TYPE(GstOCLStitch, gst_ocl_stitch, GST_TYPE_VIDEO_AGGREGATOR)
+
+/* The layouts of common.h's interpolate(), in system memory */
+#define OCL_STITCH_CAPS \
+    "video/x-raw, " \
+    "format = (string) { GRAY8, UYVY }, " \
+    "width = (int) [ 2, MAX ], " \
+    "height = (int) [ 2, MAX ], " \
+    "framerate = (fraction) [ 0/1, MAX ]"
+
+static GstStaticPadTemplate sink_template =
+GST_STATIC_PAD_TEMPLATE(
+    "sink_%u",
+    GST_PAD_SINK,
+    GST_PAD_REQUEST,
+    GST_STATIC_CAPS(OCL_STITCH_CAPS)
+);
+
+static GstStaticPadTemplate src_template =
+GST_STATIC_PAD_TEMPLATE(
+    "src",
+    GST_PAD_SRC,
+    GST_PAD_ALWAYS,
+    GST_STATIC_CAPS(OCL_STITCH_CAPS)
+);
+
+/* ================= HELPERS ================= */
+
+#define CHECK_CL(err, msg) \
+    if ((err) != CL_SUCCESS) { \
+        GST_ERROR_OBJECT(self, "%s failed (%d)", msg, err); \
+        goto error; \
+    }
+
+static void
+gst_ocl_stitch_matmul(gdouble a[3][3], gdouble b[3][3], gdouble out[3][3])
+{
+    for (int i = 0; i < 3; i++)
+        for (int j = 0; j < 3; j++)
+            out[i][j] = a[i][0] * b[0][j] + a[i][1] * b[1][j] +
+                        a[i][2] * b[2][j];
+}
+
+/*
+ * Rows of the rotation from the panorama to a camera turned by yaw, pitch
+ * and roll degrees, in the camera frame of common.h (x right, y down, z
+ * forward).
+ */
+static void
+gst_ocl_stitch_rotation(gdouble yaw, gdouble pitch, gdouble roll,
+                        cl_float4 rows[3])
+{
+    gdouble y = yaw * G_PI / 180.0;
+    gdouble p = pitch * G_PI / 180.0;
+    gdouble r = roll * G_PI / 180.0;
+    gdouble ry[3][3] = {
+        { cos(y), 0.0, sin(y) }, { 0.0, 1.0, 0.0 }, { -sin(y), 0.0, cos(y) },
+    };
+    gdouble rx[3][3] = {
+        { 1.0, 0.0, 0.0 }, { 0.0, cos(p), -sin(p) }, { 0.0, sin(p), cos(p) },
+    };
+    gdouble rz[3][3] = {
+        { cos(r), -sin(r), 0.0 }, { sin(r), cos(r), 0.0 }, { 0.0, 0.0, 1.0 },
+    };
+    gdouble t[3][3], c[3][3];
+
+    /* Camera to panorama, its inverse is the transpose */
+    gst_ocl_stitch_matmul(ry, rx, t);
+    gst_ocl_stitch_matmul(t, rz, c);
+
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++)
+            rows[i].s[j] = c[j][i];
+        rows[i].s[3] = 0.0f;
+    }
+}
+
+/*
+ * The largest square work-group of side up to STITCH_LOCAL that kernel
+ * runs with on the device.
+ */
+static void
+gst_ocl_stitch_local(GstOCLStitch *self, cl_kernel kernel, size_t local[2])
+{
+    size_t max = 0, side = STITCH_LOCAL;
+
+    if (clGetKernelWorkGroupInfo(kernel, self->ocl->device,
+                                 CL_KERNEL_WORK_GROUP_SIZE, sizeof(max),
+                                 &max, NULL) != CL_SUCCESS)
+        max = 1;
+    while (side > 1 && side * side > max)
+        side /= 2;
+
+    local[0] = local[1] = side;
+}
+
+/* n rounded up to a multiple of local. */
+static size_t
+gst_ocl_stitch_global(gint n, size_t local)
+{
+    return ((size_t)n + local - 1) / local * local;
+}
+
+static void
+gst_ocl_stitch_release(GstOCLStitch *self)
+{
+    if (self->blend_kernel) {
+        clReleaseKernel(self->blend_kernel);
+        self->blend_kernel = NULL;
+    }
+
+    if (self->program) {
+        clReleaseProgram(self->program);
+        self->program = NULL;
+    }
+
+    if (self->frames) {
+        clReleaseMemObject(self->frames);
+        self->frames = NULL;
+    }
+
+    if (self->weights) {
+        clReleaseMemObject(self->weights);
+        self->weights = NULL;
+    }
+
+    if (self->luts) {
+        clReleaseMemObject(self->luts);
+        self->luts = NULL;
+    }
+
+    if (self->dst) {
+        clReleaseMemObject(self->dst);
+        self->dst = NULL;
+    }
+
+    self->n_cameras = 0;
+    self->cl_ready = FALSE;
+}
+
+/* Acquire the shared OpenCL context and this element's queue. */
+static gboolean
+gst_ocl_stitch_open(GstOCLStitch *self)
+{
+    cl_int err;
+
+    if (self->queue)
+        return TRUE;
+
+    if (!gst_ocl_context_ensure(GST_ELEMENT(self), CL_DEVICE_TYPE_ALL,
+                                &self->ocl)) {
+        GST_ELEMENT_ERROR(self, RESOURCE, NOT_FOUND,
+                          ("No OpenCL device available"), (NULL));
+        return FALSE;
+    }
+
+    GST_INFO_OBJECT(self, "Using OpenCL context %p on %s '%s'", self->ocl,
+                    gst_ocl_device_type_name(self->ocl->device_type),
+                    self->ocl->device_name);
+
+    self->queue = gst_ocl_context_create_queue(self->ocl, &err);
+    CHECK_CL(err, "clCreateCommandQueueWithProperties");
+
+    return TRUE;
+
+error:
+    return FALSE;
+}
+
+static void
+gst_ocl_stitch_close(GstOCLStitch *self)
+{
+    gst_ocl_stitch_release(self);
+
+    if (self->queue) {
+        clReleaseCommandQueue(self->queue);
+        self->queue = NULL;
+    }
+
+    if (self->ocl) {
+        gst_ocl_context_unref(self->ocl);
+        self->ocl = NULL;
+    }
+}
+
+/* ================= SETUP ================= */
+
+/* Sink pads with negotiated caps, in pad order: the cameras. Referenced. */
+static GList *
+gst_ocl_stitch_cameras(GstOCLStitch *self)
+{
+    GList *pads = NULL;
+
+    GST_OBJECT_LOCK(self);
+    for (GList *l = GST_ELEMENT(self)->sinkpads; l; l = l->next) {
+        GstVideoAggregatorPad *pad = l->data;
+
+        if (pad->info.finfo &&
+            GST_VIDEO_INFO_FORMAT(&pad->info) != GST_VIDEO_FORMAT_UNKNOWN)
+            pads = g_list_prepend(pads, gst_object_ref(pad));
+    }
+    GST_OBJECT_UNLOCK(self);
+
+    return g_list_reverse(pads);
+}
+
+/* Whether the cameras or the output changed since the last setup. */
+static gboolean
+gst_ocl_stitch_changed(GstOCLStitch *self, GList *pads,
+                       const GstVideoInfo *info)
+{
+    gboolean changed;
+    guint c = 0;
+
+    GST_OBJECT_LOCK(self);
+    changed = self->dirty;
+    GST_OBJECT_UNLOCK(self);
+
+    changed |= !self->cl_ready ||
+               g_list_length(pads) != self->n_cameras ||
+               GST_VIDEO_INFO_FORMAT(info) !=
+                   GST_VIDEO_INFO_FORMAT(&self->out_info) ||
+               GST_VIDEO_INFO_WIDTH(info) != GST_VIDEO_INFO_WIDTH(&self->out_info) ||
+               GST_VIDEO_INFO_HEIGHT(info) != GST_VIDEO_INFO_HEIGHT(&self->out_info);
+
+    for (GList *l = pads; l && !changed; l = l->next, c++) {
+        GstOCLStitchPad *pad = l->data;
+        const GstVideoInfo *in = &GST_VIDEO_AGGREGATOR_PAD(pad)->info;
+
+        GST_OBJECT_LOCK(pad);
+        changed = pad->dirty;
+        GST_OBJECT_UNLOCK(pad);
+
+        changed |= self->cameras[c] != (gpointer)pad ||
+                   GST_VIDEO_INFO_WIDTH(in) != self->src_width ||
+                   GST_VIDEO_INFO_HEIGHT(in) != self->src_height;
+    }
+
+    return changed;
+}
+
+/*
+ * Build the program of camera c (pad) and fill its weight map and LUT.
+ * The program of the first camera is kept for stitch_blend.
+ */
+static gboolean
+gst_ocl_stitch_setup_camera(GstOCLStitch *self, guint c, GstOCLStitchPad *pad,
+                            const gchar *source, const gchar *cache_dir)
+{
+    gint width = GST_VIDEO_INFO_WIDTH(&self->out_info);
+    gint height = GST_VIDEO_INFO_HEIGHT(&self->out_info);
+    GString *options = g_string_new("-cl-mad-enable");
+    GstOCLRemapCamera camera;
+    gdouble yaw, pitch, roll;
+    cl_program program = NULL;
+    cl_kernel weights_kernel = NULL, lut_kernel = NULL;
+    cl_float4 rows[3];
+    cl_int cam = c;
+    gchar *build_log = NULL;
+    gboolean ok = FALSE;
+    cl_int err;
+
+    GST_OBJECT_LOCK(pad);
+    camera = pad->camera;
+    yaw = pad->yaw;
+    pitch = pad->pitch;
+    roll = pad->roll;
+    pad->dirty = FALSE;
+    GST_OBJECT_UNLOCK(pad);
+
+    gst_ocl_remap_camera_options(options, &camera, self->src_width,
+                                 self->src_height);
+    if (self->bpp == 2)
+        g_string_append(options, " -DYUV");
+    gst_ocl_stitch_rotation(yaw, pitch, roll, rows);
+
+    program = gst_ocl_context_get_program(self->ocl, source, options->str,
+                                          cache_dir, &build_log, &err);
+    if (!program) {
+        GST_ELEMENT_ERROR(self, LIBRARY, INIT, ("OpenCL build failed"),
+                          ("%s: error %d (%s):\n%s", GST_PAD_NAME(pad), err,
+                           options->str, build_log ? build_log : ""));
+        goto out;
+    }
+
+    size_t local[2], global[2];
+
+    weights_kernel = clCreateKernel(program, "stitch_weights", &err);
+    CHECK_CL(err, "clCreateKernel(stitch_weights)");
+
+    err = clSetKernelArg(weights_kernel, 0, sizeof(cl_mem), &self->weights);
+    if (err == CL_SUCCESS)
+        err = clSetKernelArg(weights_kernel, 1, sizeof(cl_int),
+                             &self->frame_pixels);
+    if (err == CL_SUCCESS)
+        err = clSetKernelArg(weights_kernel, 2, sizeof(cl_int), &cam);
+    CHECK_CL(err, "clSetKernelArg(stitch_weights)");
+
+    gst_ocl_stitch_local(self, weights_kernel, local);
+    global[0] = gst_ocl_stitch_global(self->src_width, local[0]);
+    global[1] = gst_ocl_stitch_global(self->src_height, local[1]);
+
+    err = clEnqueueNDRangeKernel(self->queue, weights_kernel, 2, NULL,
+                                 global, local, 0, NULL, NULL);
+    CHECK_CL(err, "clEnqueueNDRangeKernel(stitch_weights)");
+
+    lut_kernel = clCreateKernel(program, "stitch_lut", &err);
+    CHECK_CL(err, "clCreateKernel(stitch_lut)");
+
+    err = clSetKernelArg(lut_kernel, 0, sizeof(cl_mem), &self->luts);
+    if (err == CL_SUCCESS)
+        err = clSetKernelArg(lut_kernel, 1, sizeof(cl_int), &width);
+    if (err == CL_SUCCESS)
+        err = clSetKernelArg(lut_kernel, 2, sizeof(cl_int), &height);
+    if (err == CL_SUCCESS)
+        err = clSetKernelArg(lut_kernel, 3, sizeof(cl_int), &cam);
+    for (int i = 0; i < 3 && err == CL_SUCCESS; i++)
+        err = clSetKernelArg(lut_kernel, 4 + i, sizeof(cl_float4), &rows[i]);
+    CHECK_CL(err, "clSetKernelArg(stitch_lut)");
+
+    gst_ocl_stitch_local(self, lut_kernel, local);
+    global[0] = gst_ocl_stitch_global(width, local[0]);
+    global[1] = gst_ocl_stitch_global(height, local[1]);
+
+    err = clEnqueueNDRangeKernel(self->queue, lut_kernel, 2, NULL,
+                                 global, local, 0, NULL, NULL);
+    CHECK_CL(err, "clEnqueueNDRangeKernel(stitch_lut)");
+
+    if (c == 0) {
+        self->blend_kernel = clCreateKernel(program, "stitch_blend", &err);
+        CHECK_CL(err, "clCreateKernel(stitch_blend)");
+        gst_ocl_stitch_local(self, self->blend_kernel, self->blend_local);
+        self->program = program;
+        program = NULL;
+    }
+
+    GST_INFO_OBJECT(self, "Camera %u (%s): %s fu=%.2f fv=%.2f u0=%.2f "
+                    "v0=%.2f, yaw=%.1f pitch=%.1f roll=%.1f", c,
+                    GST_PAD_NAME(pad),
+                    camera.model == GST_OCL_REMAP_MODEL_DOUBLE_SPHERE
+                        ? "double-sphere" : "extended-unified",
+                    camera.k.fu, camera.k.fv, camera.k.u0, camera.k.v0,
+                    yaw, pitch, roll);
+
+    ok = TRUE;
+    goto out;
+
+error:
+    GST_ELEMENT_ERROR(self, LIBRARY, INIT,
+                      ("OpenCL setup of camera %s failed", GST_PAD_NAME(pad)),
+                      ("error %d", err));
+out:
+    /* Enqueued kernels are kept alive by the queue */
+    if (weights_kernel)
+        clReleaseKernel(weights_kernel);
+    if (lut_kernel)
+        clReleaseKernel(lut_kernel);
+    if (program)
+        clReleaseProgram(program);
+    g_string_free(options, TRUE);
+    g_free(build_log);
+
+    return ok;
+}
+
+/*
+ * Allocate the device buffers for the cameras (pads) and the output info,
+ * then compute the weight maps and LUTs of every camera. Posts an error
+ * message on failure.
+ */
+static gboolean
+gst_ocl_stitch_setup(GstOCLStitch *self, GList *pads, const GstVideoInfo *info)
+{
+    guint n = g_list_length(pads);
+    gchar *kernel_file, *cache_dir, *source = NULL, *log = NULL;
+    gchar default_dir[4096];
+    const cl_float zero = 0.0f;
+    guint c = 0;
+    cl_int err;
+
+    gst_ocl_stitch_release(self);
+
+    if (n == 0 || n > STITCH_MAX_CAMERAS) {
+        GST_ELEMENT_ERROR(self, STREAM, FORMAT, (NULL),
+                          ("%u cameras, between 1 and %d supported", n,
+                           STITCH_MAX_CAMERAS));
+        return FALSE;
+    }
+
+    self->out_info = *info;
+    self->src_width = GST_VIDEO_AGGREGATOR_PAD(pads->data)->info.width;
+    self->src_height = GST_VIDEO_AGGREGATOR_PAD(pads->data)->info.height;
+    self->bpp = GST_VIDEO_INFO_FORMAT(info) == GST_VIDEO_FORMAT_UYVY ? 2 : 1;
+    /* A row and a pixel pair of padding for the bilinear reads at the
+     * clamped last row and column */
+    self->frame_pixels = (self->src_height + 1) * self->src_width + 2;
+
+    /* common.h bakes the frame size into the program, and the packed
+     * frames are blended in the output format */
+    for (GList *l = pads; l; l = l->next) {
+        const GstVideoInfo *in = &GST_VIDEO_AGGREGATOR_PAD(l->data)->info;
+
+        if (GST_VIDEO_INFO_FORMAT(in) != GST_VIDEO_INFO_FORMAT(info) ||
+            GST_VIDEO_INFO_WIDTH(in) != self->src_width ||
+            GST_VIDEO_INFO_HEIGHT(in) != self->src_height) {
+            GST_ELEMENT_ERROR(self, STREAM, FORMAT, (NULL),
+                              ("%s: cameras need the output format and one "
+                               "size (%dx%d)", GST_PAD_NAME(l->data),
+                               self->src_width, self->src_height));
+            return FALSE;
+        }
+    }
+
+    if (!gst_ocl_stitch_open(self))
+        return FALSE;
+
+    GST_OBJECT_LOCK(self);
+    kernel_file = g_strdup(self->kernel_file);
+    /* NULL cache-dir means the default location, "" disables the cache */
+    cache_dir = g_strdup(self->cache_dir
+                         ? self->cache_dir
+                         : ocl_cache_default_dir(default_dir,
+                                                 sizeof(default_dir)));
+    self->dirty = FALSE;
+    GST_OBJECT_UNLOCK(self);
+
+    source = kernel_file ? gst_ocl_remap_load_source(kernel_file, &log) : NULL;
+    if (!source) {
+        GST_ELEMENT_ERROR(self, RESOURCE, NOT_FOUND,
+                          ("Cannot load the stitch kernels"),
+                          ("%s", log ? log : "kernel-file not set"));
+        goto fail;
+    }
+
+    self->frames = clCreateBuffer(self->ocl->context, CL_MEM_READ_ONLY,
+                                  (size_t)n * self->frame_pixels * self->bpp,
+                                  NULL, &err);
+    CHECK_CL(err, "clCreateBuffer(frames)");
+    self->weights = clCreateBuffer(self->ocl->context, CL_MEM_READ_WRITE,
+                                   (size_t)n * self->frame_pixels *
+                                   sizeof(cl_float), NULL, &err);
+    CHECK_CL(err, "clCreateBuffer(weights)");
+    self->luts = clCreateBuffer(self->ocl->context, CL_MEM_READ_WRITE,
+                                (size_t)n * GST_VIDEO_INFO_WIDTH(info) *
+                                GST_VIDEO_INFO_HEIGHT(info) * sizeof(cl_float2),
+                                NULL, &err);
+    CHECK_CL(err, "clCreateBuffer(luts)");
+    self->dst = clCreateBuffer(self->ocl->context, CL_MEM_WRITE_ONLY,
+                               GST_VIDEO_INFO_SIZE(info), NULL, &err);
+    CHECK_CL(err, "clCreateBuffer(dst)");
+
+    /* The padding is read with a zero bilinear factor, keep it finite */
+    err = clEnqueueFillBuffer(self->queue, self->weights, &zero, sizeof(zero),
+                              0, (size_t)n * self->frame_pixels *
+                              sizeof(cl_float), 0, NULL, NULL);
+    CHECK_CL(err, "clEnqueueFillBuffer(weights)");
+
+    for (GList *l = pads; l; l = l->next, c++) {
+        if (!gst_ocl_stitch_setup_camera(self, c, l->data, source, cache_dir))
+            goto fail;
+        self->cameras[c] = l->data;
+    }
+
+    err = clFinish(self->queue);
+    CHECK_CL(err, "clFinish");
+
+    self->n_cameras = n;
+    self->cl_ready = TRUE;
+
+    GST_INFO_OBJECT(self, "Stitching %u cameras of %dx%d into %dx%d %s", n,
+                    self->src_width, self->src_height,
+                    GST_VIDEO_INFO_WIDTH(info), GST_VIDEO_INFO_HEIGHT(info),
+                    GST_VIDEO_INFO_NAME(info));
+
+    g_free(source);
+    g_free(log);
+    g_free(kernel_file);
+    g_free(cache_dir);
+
+    return TRUE;
+
+error:
+    GST_ELEMENT_ERROR(self, LIBRARY, INIT, ("OpenCL setup failed"),
+                      ("error %d", err));
+fail:
+    gst_ocl_stitch_release(self);
+    g_free(source);
+    g_free(log);
+    g_free(kernel_file);
+    g_free(cache_dir);
+
+    return FALSE;
+}
+
+/* ================= AGGREGATE ================= */
+
+/* Copy the frame of camera c into its slot of the packed frames. */
+static cl_int
+gst_ocl_stitch_upload(GstOCLStitch *self, guint c, GstVideoFrame *frame)
+{
+    size_t row_bytes = (size_t)self->src_width * self->bpp;
+    size_t buffer_origin[3] = { (size_t)c * self->frame_pixels * self->bpp, 0, 0 };
+    size_t host_origin[3] = { 0, 0, 0 };
+    size_t region[3] = { row_bytes, (size_t)self->src_height, 1 };
+
+    return clEnqueueWriteBufferRect(self->queue, self->frames, CL_FALSE,
+                                    buffer_origin, host_origin, region,
+                                    row_bytes, 0,
+                                    GST_VIDEO_FRAME_PLANE_STRIDE(frame, 0), 0,
+                                    GST_VIDEO_FRAME_PLANE_DATA(frame, 0),
+                                    0, NULL, NULL);
+}
+
+static GstFlowReturn
+gst_ocl_stitch_aggregate_frames(GstVideoAggregator *vagg, GstBuffer *outbuf)
+{
+    GstOCLStitch *self = (GstOCLStitch *)vagg;
+    const GstVideoInfo *info = &vagg->info;
+    GList *pads = gst_ocl_stitch_cameras(self);
+    GstVideoFrame out;
+    gboolean mapped = FALSE;
+    cl_uint mask = 0;
+    guint c = 0;
+    cl_int err = CL_SUCCESS;
+
+    if (gst_ocl_stitch_changed(self, pads, info) &&
+        !gst_ocl_stitch_setup(self, pads, info)) {
+        g_list_free_full(pads, gst_object_unref);
+        return GST_FLOW_ERROR;
+    }
+
+    /* Cameras without a buffer for this output time are left out */
+    for (GList *l = pads; l; l = l->next, c++) {
+        GstVideoFrame *frame =
+            gst_video_aggregator_pad_get_prepared_frame(l->data);
+
+        if (!frame)
+            continue;
+
+        err = gst_ocl_stitch_upload(self, c, frame);
+        CHECK_CL(err, "clEnqueueWriteBufferRect");
+        mask |= 1u << c;
+    }
+
+    gint width = GST_VIDEO_INFO_WIDTH(info);
+    gint height = GST_VIDEO_INFO_HEIGHT(info);
+    gint stride = GST_VIDEO_INFO_PLANE_STRIDE(info, 0);
+    cl_int n_cameras = self->n_cameras;
+    /* A UYVY work-item writes a macro-pixel */
+    size_t global[2] = {
+        gst_ocl_stitch_global((width + self->bpp - 1) / self->bpp,
+                              self->blend_local[0]),
+        gst_ocl_stitch_global(height, self->blend_local[1]),
+    };
+
+    err = clSetKernelArg(self->blend_kernel, 0, sizeof(cl_mem), &self->frames);
+    if (err == CL_SUCCESS)
+        err = clSetKernelArg(self->blend_kernel, 1, sizeof(cl_mem),
+                             &self->weights);
+    if (err == CL_SUCCESS)
+        err = clSetKernelArg(self->blend_kernel, 2, sizeof(cl_mem), &self->luts);
+    if (err == CL_SUCCESS)
+        err = clSetKernelArg(self->blend_kernel, 3, sizeof(cl_int),
+                             &self->frame_pixels);
+    if (err == CL_SUCCESS)
+        err = clSetKernelArg(self->blend_kernel, 4, sizeof(cl_int), &n_cameras);
+    if (err == CL_SUCCESS)
+        err = clSetKernelArg(self->blend_kernel, 5, sizeof(cl_uint), &mask);
+    if (err == CL_SUCCESS)
+        err = clSetKernelArg(self->blend_kernel, 6, sizeof(cl_mem), &self->dst);
+    if (err == CL_SUCCESS)
+        err = clSetKernelArg(self->blend_kernel, 7, sizeof(cl_int), &width);
+    if (err == CL_SUCCESS)
+        err = clSetKernelArg(self->blend_kernel, 8, sizeof(cl_int), &height);
+    if (err == CL_SUCCESS)
+        err = clSetKernelArg(self->blend_kernel, 9, sizeof(cl_int), &stride);
+    CHECK_CL(err, "clSetKernelArg(stitch_blend)");
+
+    err = clEnqueueNDRangeKernel(self->queue, self->blend_kernel, 2, NULL,
+                                 global, self->blend_local, 0, NULL, NULL);
+    CHECK_CL(err, "clEnqueueNDRangeKernel(stitch_blend)");
+
+    if (!gst_video_frame_map(&out, info, outbuf, GST_MAP_WRITE)) {
+        GST_ERROR_OBJECT(self, "Failed to map the output buffer");
+        goto error;
+    }
+    mapped = TRUE;
+
+    size_t buffer_origin[3] = { 0, 0, 0 };
+    size_t host_origin[3] = { 0, 0, 0 };
+    size_t region[3] = {
+        (size_t)GST_ROUND_UP_N(width, self->bpp) * self->bpp,
+        (size_t)height, 1
+    };
+
+    err = clEnqueueReadBufferRect(self->queue, self->dst, CL_TRUE,
+                                  buffer_origin, host_origin, region,
+                                  stride, 0,
+                                  GST_VIDEO_FRAME_PLANE_STRIDE(&out, 0), 0,
+                                  GST_VIDEO_FRAME_PLANE_DATA(&out, 0),
+                                  0, NULL, NULL);
+    CHECK_CL(err, "clEnqueueReadBufferRect");
+
+    gst_video_frame_unmap(&out);
+    g_list_free_full(pads, gst_object_unref);
+    self->frame_count++;
+
+    return GST_FLOW_OK;
+
+error:
+    /* The input frames are unmapped after return */
+    clFinish(self->queue);
+    if (mapped)
+        gst_video_frame_unmap(&out);
+    g_list_free_full(pads, gst_object_unref);
+
+    return GST_FLOW_ERROR;
+}
+
+/* ================= GOBJECT ================= */
+
+static void
+gst_ocl_stitch_set_property(GObject *object,
+                            guint prop_id,
+                            const GValue *value,
+                            GParamSpec *pspec)
+{
+    GstOCLStitch *self = (GstOCLStitch *)object;
+
+    GST_OBJECT_LOCK(self);
+    switch (prop_id) {
+        case PROP_KERNEL_FILE:
+            g_free(self->kernel_file);
+            self->kernel_file = g_value_dup_string(value);
+            break;
+        case PROP_CACHE_DIR:
+            g_free(self->cache_dir);
+            self->cache_dir = g_value_dup_string(value);
+            break;
+        default:
+            GST_OBJECT_UNLOCK(self);
+            G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
+            return;
+    }
+    /* Rebuilt with the next output frame */
+    self->dirty = TRUE;
+    GST_OBJECT_UNLOCK(self);
+}
+
+static void
+gst_ocl_stitch_get_property(GObject *object,
+                            guint prop_id,
+                            GValue *value,
+                            GParamSpec *pspec)
+{
+    GstOCLStitch *self = (GstOCLStitch *)object;
+
+    GST_OBJECT_LOCK(self);
+    switch (prop_id) {
+        case PROP_KERNEL_FILE:
+            g_value_set_string(value, self->kernel_file);
+            break;
+        case PROP_CACHE_DIR:
+            g_value_set_string(value, self->cache_dir);
+            break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
+            break;
+    }
+    GST_OBJECT_UNLOCK(self);
+}
+
+static GstStateChangeReturn
+gst_ocl_stitch_change_state(GstElement *element, GstStateChange transition)
+{
+    GstOCLStitch *self = (GstOCLStitch *)element;
+    GstStateChangeReturn ret;
+
+    ret = GST_ELEMENT_CLASS(gst_ocl_stitch_parent_class)->
+              change_state(element, transition);
+    if (ret == GST_STATE_CHANGE_FAILURE)
+        return ret;
+
+    switch (transition) {
+    case GST_STATE_CHANGE_READY_TO_NULL:
+        gst_ocl_stitch_close(self);
+        break;
+    default:
+        break;
+    }
+
+    return ret;
+}
+
+static void
+gst_ocl_stitch_set_context(GstElement *element, GstContext *context)
+{
+    GstOCLStitch *self = (GstOCLStitch *)element;
+
+    gst_ocl_context_handle_set_context(element, context, &self->ocl);
+
+    GST_ELEMENT_CLASS(gst_ocl_stitch_parent_class)->
+        set_context(element, context);
+}
+
+static gboolean
+gst_ocl_stitch_src_query(GstAggregator *agg, GstQuery *query)
+{
+    GstOCLStitch *self = (GstOCLStitch *)agg;
+
+    if (gst_ocl_context_handle_query(GST_ELEMENT(self), query, self->ocl))
+        return TRUE;
+
+    return GST_AGGREGATOR_CLASS(gst_ocl_stitch_parent_class)->
+               src_query(agg, query);
+}
+
+static gboolean
+gst_ocl_stitch_sink_query(GstAggregator *agg, GstAggregatorPad *pad,
+                          GstQuery *query)
+{
+    GstOCLStitch *self = (GstOCLStitch *)agg;
+
+    if (gst_ocl_context_handle_query(GST_ELEMENT(self), query, self->ocl))
+        return TRUE;
+
+    return GST_AGGREGATOR_CLASS(gst_ocl_stitch_parent_class)->
+               sink_query(agg, pad, query);
+}
+
+static void
+gst_ocl_stitch_finalize(GObject *object)
+{
+    GstOCLStitch *self = (GstOCLStitch *)object;
+
+    GST_DEBUG_OBJECT(self, "Finalizing after %" G_GUINT64_FORMAT " frames",
+                     self->frame_count);
+
+    gst_ocl_stitch_close(self);
+
+    g_clear_pointer(&self->kernel_file, g_free);
+    g_clear_pointer(&self->cache_dir, g_free);
+
+    G_OBJECT_CLASS(gst_ocl_stitch_parent_class)->finalize(object);
+}
+
+/* Instance initialization */
+static void
+gst_ocl_stitch_init(GstOCLStitch *self)
+{
+    self->kernel_file = g_strdup(DEFAULT_KERNEL_FILE);
+    self->cache_dir = NULL;
+    self->dirty = FALSE;
+    self->cl_ready = FALSE;
+    self->n_cameras = 0;
+    self->frame_count = 0;
+    gst_video_info_init(&self->out_info);
+}
+
+/* Class initialization */
+static void
+gst_ocl_stitch_class_init(GstOCLStitchClass *klass)
+{
+    GstElementClass *eclass = GST_ELEMENT_CLASS(klass);
+    GstAggregatorClass *aclass = GST_AGGREGATOR_CLASS(klass);
+    GstVideoAggregatorClass *vclass = GST_VIDEO_AGGREGATOR_CLASS(klass);
+    GObjectClass *gclass = G_OBJECT_CLASS(klass);
+
+    GST_DEBUG_CATEGORY_INIT(gst_ocl_stitch_debug,
+                            "oscaroclstitch", 0,
+                            "OpenCL fisheye stitching");
+
+    gclass->set_property = gst_ocl_stitch_set_property;
+    gclass->get_property = gst_ocl_stitch_get_property;
+    gclass->finalize = gst_ocl_stitch_finalize;
+    eclass->change_state = GST_DEBUG_FUNCPTR(gst_ocl_stitch_change_state);
+    eclass->set_context = GST_DEBUG_FUNCPTR(gst_ocl_stitch_set_context);
+    aclass->src_query = GST_DEBUG_FUNCPTR(gst_ocl_stitch_src_query);
+    aclass->sink_query = GST_DEBUG_FUNCPTR(gst_ocl_stitch_sink_query);
+    vclass->aggregate_frames =
+        GST_DEBUG_FUNCPTR(gst_ocl_stitch_aggregate_frames);
+
+    gst_element_class_add_static_pad_template_with_gtype(
+        eclass, &sink_template, GST_TYPE_OCL_STITCH_PAD);
+    gst_element_class_add_static_pad_template_with_gtype(
+        eclass, &src_template, GST_TYPE_AGGREGATOR_PAD);
+
+    gst_element_class_set_static_metadata(
+        eclass,
+        "OpenCL fisheye stitcher",
+        "Filter/Editor/Video/Compositor",
+        "Blends double-sphere or extended unified fisheye GRAY8/UYVY "
+        "cameras into an equirectangular panorama with OpenCL",
+        "eInfochips-Leica");
+
+    g_object_class_install_property(
+        gclass,
+        PROP_KERNEL_FILE,
+        g_param_spec_string(
+            "kernel-file",
+            "OpenCL kernel file",
+            "Path to stitch.cl; common.h is read from the same directory.",
+            DEFAULT_KERNEL_FILE,
+            G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property(
+        gclass,
+        PROP_CACHE_DIR,
+        g_param_spec_string(
+            "cache-dir",
+            "Program binary cache directory",
+            "Directory of the OpenCL program binary cache. NULL uses the "
+            "default location, an empty string disables the cache.",
+            NULL,
+            G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+/*
+ * oscaroclstitch: blends N fisheye cameras (one request pad each, with the
+ * camera properties of oscaroclremap and an orientation) into an
+ * equirectangular panorama with OpenCL. Registered by the oscaroclshader
+ * plugin.
+ */
+#define GST_TYPE_OCL_STITCH (gst_ocl_stitch_get_type())
+#define GST_TYPE_OCL_STITCH_PAD (gst_ocl_stitch_pad_get_type())
+
+GType gst_ocl_stitch_get_type(void);
+GType gst_ocl_stitch_pad_get_type(void);
+
+G_END_DECLS
@@ -0,0 +1,611 @@
+/*
+ * gstoclcontext.c
+ *
+ * Process-wide, reference counted OpenCL context shared between
+ * OpenCL elements through GstContext.
+ *
+ */
+
+#include "gstoclcontext.h"
+
+#include <string.h>
+
+/* Debug category for shared context logging. */
+GST_DEBUG_CATEGORY_STATIC(gst_ocl_context_debug);
+#define GST_CAT_DEFAULT gst_ocl_context_debug
+
+/* OpenCL queue with profiling enabled. */
+static const cl_queue_properties queue_props[] = {
+    CL_QUEUE_PROPERTIES,
+    CL_QUEUE_PROFILING_ENABLE,
+    0
+};
+
+G_DEFINE_BOXED_TYPE(GstOCLContext, gst_ocl_context,
+                    gst_ocl_context_ref, gst_ocl_context_unref)
+
+/* One process-wide context per requested device type: any, GPU, CPU,
+ * accelerator */
+#define N_DEFAULT_CONTEXTS 4
+
+G_LOCK_DEFINE_STATIC(default_context);
+static GstOCLContext *default_context[N_DEFAULT_CONTEXTS];
+
+static void
+gst_ocl_context_init_debug(void)
+{
+    static gsize done = 0;
+
+    if (g_once_init_enter(&done)) {
+        GST_DEBUG_CATEGORY_INIT(gst_ocl_context_debug,
+                                "oclcontext", 0,
+                                "Shared OpenCL context");
+        g_once_init_leave(&done, 1);
+    }
+}
+
+/* Pick the first device of type of any platform, a GPU first for ALL. */
+static cl_int
+gst_ocl_context_pick_device(cl_device_type type, cl_platform_id *platform,
+                            cl_device_id *device)
+{
+    cl_platform_id platforms[16];
+    cl_uint num_platforms = 0;
+    cl_int err;
+
+    if (type == CL_DEVICE_TYPE_ALL &&
+        gst_ocl_context_pick_device(CL_DEVICE_TYPE_GPU, platform,
+                                    device) == CL_SUCCESS)
+        return CL_SUCCESS;
+
+    err = clGetPlatformIDs(G_N_ELEMENTS(platforms), platforms, &num_platforms);
+    if (err != CL_SUCCESS)
+        return err;
+
+    err = CL_DEVICE_NOT_FOUND;
+    for (cl_uint i = 0; i < num_platforms; i++) {
+        err = clGetDeviceIDs(platforms[i], type, 1, device, NULL);
+        if (err == CL_SUCCESS) {
+            *platform = platforms[i];
+            break;
+        }
+    }
+
+    return err;
+}
+
+static void
+gst_ocl_context_free(GstOCLContext *ctx)
+{
+    GST_INFO("Releasing OpenCL context %p (programs built=%lu loaded=%lu "
+             "reused=%" G_GUINT64_FORMAT ")", ctx, ctx->cache_stats.misses,
+             ctx->cache_stats.hits, ctx->program_reuses);
+
+    g_hash_table_destroy(ctx->programs);
+    g_mutex_clear(&ctx->lock);
+
+    if (ctx->context)
+        clReleaseContext(ctx->context);
+    if (ctx->sub_device)
+        clReleaseDevice(ctx->device);
+
+    g_free(ctx->device_name);
+    g_free(ctx);
+}
+
+/*
+ * Create a context on device of platform. A sub-device is owned by the
+ * context, released with it or on failure.
+ */
+static GstOCLContext *
+gst_ocl_context_new_on(cl_platform_id platform, cl_device_id device,
+                       gboolean sub_device)
+{
+    GstOCLContext *ctx = g_new0(GstOCLContext, 1);
+    char name[256] = "";
+    cl_bool unified = CL_FALSE;
+    cl_uint align_bits = 0;
+    cl_int err;
+
+    ctx->refcount = 1;
+    g_mutex_init(&ctx->lock);
+    ctx->programs = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                          (GDestroyNotify)clReleaseProgram);
+    ctx->platform = platform;
+    ctx->device = device;
+    ctx->sub_device = sub_device;
+
+    clGetDeviceInfo(ctx->device, CL_DEVICE_TYPE,
+                    sizeof(ctx->device_type), &ctx->device_type, NULL);
+    clGetDeviceInfo(ctx->device, CL_DEVICE_NAME, sizeof(name), name, NULL);
+    ctx->device_name = g_strdup(name);
+
+    /* Zero-copy needs host-visible device memory and an aligned host pointer */
+    clGetDeviceInfo(ctx->device, CL_DEVICE_HOST_UNIFIED_MEMORY,
+                    sizeof(unified), &unified, NULL);
+    clGetDeviceInfo(ctx->device, CL_DEVICE_MEM_BASE_ADDR_ALIGN,
+                    sizeof(align_bits), &align_bits, NULL);
+    ctx->host_unified = unified ? TRUE : FALSE;
+    ctx->mem_align = MAX(align_bits / 8, ZERO_COPY_SIZE_ALIGN);
+
+    ctx->context = clCreateContext(NULL, 1, &ctx->device,
+                                   NULL, NULL, &err);
+    if (err != CL_SUCCESS) {
+        GST_WARNING("clCreateContext failed (%d)", err);
+        goto error;
+    }
+
+    GST_INFO("Created OpenCL context %p on '%s' host-unified=%d base-align=%u",
+             ctx, ctx->device_name, ctx->host_unified, ctx->mem_align);
+
+    return ctx;
+
+error:
+    /* Not published yet, and the caller may hold the default lock */
+    gst_ocl_context_free(ctx);
+    return NULL;
+}
+
+/* Create a new context on the first device of type. */
+static GstOCLContext *
+gst_ocl_context_new(cl_device_type type)
+{
+    cl_platform_id platform;
+    cl_device_id device;
+    cl_int err;
+
+    err = gst_ocl_context_pick_device(type, &platform, &device);
+    if (err != CL_SUCCESS) {
+        GST_WARNING("No OpenCL %s device found (%d)",
+                    gst_ocl_device_type_name(type), err);
+        return NULL;
+    }
+
+    return gst_ocl_context_new_on(platform, device, FALSE);
+}
+
+/*
+ * Partition a CPU device into sub-devices of units compute units.
+ * Returns how many were created in *subs, 0 if the device cannot be split.
+ */
+static cl_uint
+gst_ocl_context_split(cl_device_id device, guint units, cl_device_id **subs)
+{
+    const cl_device_partition_property props[] = {
+        CL_DEVICE_PARTITION_EQUALLY, (cl_device_partition_property)units, 0
+    };
+    cl_uint n = 0;
+    cl_int err;
+
+    err = clCreateSubDevices(device, props, 0, NULL, &n);
+    if (err != CL_SUCCESS || n < 2) {
+        GST_DEBUG("No sub-devices of %u compute units (%d, %u)", units, err, n);
+        return 0;
+    }
+
+    *subs = g_new(cl_device_id, n);
+    err = clCreateSubDevices(device, props, n, *subs, NULL);
+    if (err != CL_SUCCESS) {
+        GST_WARNING("clCreateSubDevices failed (%d)", err);
+        g_clear_pointer(subs, g_free);
+        return 0;
+    }
+
+    return n;
+}
+
+/* Append contexts on the devices of type of every platform to contexts. */
+static void
+gst_ocl_context_add_devices(GPtrArray *contexts, cl_device_type type,
+                            guint cpu_units, const GstOCLContext *skip)
+{
+    cl_platform_id platforms[16];
+    cl_uint num_platforms = 0;
+
+    if (clGetPlatformIDs(G_N_ELEMENTS(platforms), platforms,
+                         &num_platforms) != CL_SUCCESS)
+        return;
+
+    for (cl_uint i = 0; i < num_platforms; i++) {
+        cl_device_id *devices;
+        cl_uint n = 0;
+
+        if (clGetDeviceIDs(platforms[i], type, 0, NULL, &n) != CL_SUCCESS ||
+            n == 0)
+            continue;
+
+        devices = g_new(cl_device_id, n);
+        if (clGetDeviceIDs(platforms[i], type, n, devices, NULL) != CL_SUCCESS)
+            n = 0;
+
+        for (cl_uint d = 0; d < n; d++) {
+            cl_device_type dtype = 0;
+            cl_device_id *subs = NULL;
+            cl_uint n_subs = 0;
+            GstOCLContext *ctx;
+
+            /* skip's device is used whole, by its context */
+            if (skip && devices[d] == skip->device)
+                continue;
+
+            clGetDeviceInfo(devices[d], CL_DEVICE_TYPE, sizeof(dtype),
+                            &dtype, NULL);
+            if ((dtype & CL_DEVICE_TYPE_CPU) && cpu_units)
+                n_subs = gst_ocl_context_split(devices[d], cpu_units, &subs);
+
+            for (cl_uint s = 0; s < n_subs; s++) {
+                ctx = gst_ocl_context_new_on(platforms[i], subs[s], TRUE);
+                if (!ctx)
+                    continue;
+
+                gchar *name = g_strdup_printf("%s [%u/%u]", ctx->device_name,
+                                              s + 1, n_subs);
+                g_free(ctx->device_name);
+                ctx->device_name = name;
+                g_ptr_array_add(contexts, ctx);
+            }
+            g_free(subs);
+
+            if (n_subs > 0)
+                continue;
+
+            ctx = gst_ocl_context_new_on(platforms[i], devices[d], FALSE);
+            if (ctx)
+                g_ptr_array_add(contexts, ctx);
+        }
+
+        g_free(devices);
+    }
+}
+
+GPtrArray *
+gst_ocl_context_new_devices(cl_device_type type, guint cpu_units,
+                            const GstOCLContext *skip)
+{
+    static const cl_device_type order[] = {
+        CL_DEVICE_TYPE_GPU, CL_DEVICE_TYPE_CPU, CL_DEVICE_TYPE_ACCELERATOR
+    };
+    GPtrArray *contexts =
+        g_ptr_array_new_with_free_func((GDestroyNotify)gst_ocl_context_unref);
+
+    gst_ocl_context_init_debug();
+
+    /* GPUs first, as for the default context */
+    for (guint i = 0; i < G_N_ELEMENTS(order); i++) {
+        if (type & order[i])
+            gst_ocl_context_add_devices(contexts, order[i], cpu_units, skip);
+    }
+
+    return contexts;
+}
+
+GstOCLContext *
+gst_ocl_context_ref(GstOCLContext *ctx)
+{
+    g_atomic_int_inc(&ctx->refcount);
+    return ctx;
+}
+
+void
+gst_ocl_context_unref(GstOCLContext *ctx)
+{
+    /* The default pointer is weak, drop it together with the last ref */
+    G_LOCK(default_context);
+    if (!g_atomic_int_dec_and_test(&ctx->refcount)) {
+        G_UNLOCK(default_context);
+        return;
+    }
+    for (guint i = 0; i < N_DEFAULT_CONTEXTS; i++)
+        if (default_context[i] == ctx)
+            default_context[i] = NULL;
+    G_UNLOCK(default_context);
+
+    gst_ocl_context_free(ctx);
+}
+
+const gchar *
+gst_ocl_device_type_name(cl_device_type type)
+{
+    if (type == CL_DEVICE_TYPE_ALL)
+        return "any";
+    if (type & CL_DEVICE_TYPE_GPU)
+        return "GPU";
+    if (type & CL_DEVICE_TYPE_CPU)
+        return "CPU";
+    if (type & CL_DEVICE_TYPE_ACCELERATOR)
+        return "accelerator";
+
+    return "unknown";
+}
+
+GstOCLContext *
+gst_ocl_context_get_default(cl_device_type type)
+{
+    GstOCLContext *ctx;
+    guint i, slot;
+
+    gst_ocl_context_init_debug();
+
+    if (type == CL_DEVICE_TYPE_ALL)
+        slot = 0;
+    else if (type & CL_DEVICE_TYPE_GPU)
+        slot = 1;
+    else if (type & CL_DEVICE_TYPE_CPU)
+        slot = 2;
+    else if (type & CL_DEVICE_TYPE_ACCELERATOR)
+        slot = 3;
+    else
+        slot = 0;
+
+    G_LOCK(default_context);
+    /* Any shared context on a matching device will do, e.g. the "any"
+     * context when it landed on a GPU serves GPU requests too */
+    for (i = 0; i < N_DEFAULT_CONTEXTS; i++) {
+        ctx = default_context[(slot + i) % N_DEFAULT_CONTEXTS];
+        if (ctx && (ctx->device_type & type)) {
+            gst_ocl_context_ref(ctx);
+            G_UNLOCK(default_context);
+            return ctx;
+        }
+    }
+    ctx = gst_ocl_context_new(type);
+    if (!default_context[slot])
+        default_context[slot] = ctx;
+    G_UNLOCK(default_context);
+
+    return ctx;
+}
+
+cl_command_queue
+gst_ocl_context_create_queue(GstOCLContext *ctx, cl_int *err)
+{
+    return clCreateCommandQueueWithProperties(ctx->context, ctx->device,
+                                              queue_props, err);
+}
+
+/* Key of source/options in the programs of a context. */
+static gchar *
+gst_ocl_context_program_key(const gchar *source, const gchar *options)
+{
+    return g_strdup_printf("%016llx-%016llx",
+                           ocl_cache_hash(0xcbf29ce484222325ULL, source),
+                           ocl_cache_hash(0xcbf29ce484222325ULL, options));
+}
+
+cl_program
+gst_ocl_context_lookup_program(GstOCLContext *ctx, const gchar *source,
+                               const gchar *options)
+{
+    cl_program program;
+    gchar *key = gst_ocl_context_program_key(source, options);
+
+    /* A build holds the lock, do not wait for it */
+    if (!g_mutex_trylock(&ctx->lock)) {
+        g_free(key);
+        return NULL;
+    }
+    program = g_hash_table_lookup(ctx->programs, key);
+    if (program) {
+        ctx->program_reuses++;
+        clRetainProgram(program);
+    }
+    g_mutex_unlock(&ctx->lock);
+    g_free(key);
+
+    return program;
+}
+
+cl_program
+gst_ocl_context_get_program(GstOCLContext *ctx,
+                            const gchar *source,
+                            const gchar *options,
+                            const gchar *cache_dir,
+                            gchar **build_log,
+                            cl_int *err)
+{
+    cl_program program;
+    gchar *key;
+    char log[4096];
+
+    key = gst_ocl_context_program_key(source, options);
+
+    /* Held while building so concurrent users wait and then reuse */
+    g_mutex_lock(&ctx->lock);
+
+    program = g_hash_table_lookup(ctx->programs, key);
+    if (program) {
+        ctx->program_reuses++;
+        clRetainProgram(program);
+        g_mutex_unlock(&ctx->lock);
+        g_free(key);
+        *err = CL_SUCCESS;
+        return program;
+    }
+
+    program = ocl_cache_build_program(ctx->context, ctx->device,
+                                      source, options, cache_dir,
+                                      &ctx->cache_stats,
+                                      log, sizeof(log), err);
+    if (program) {
+        clRetainProgram(program);
+        g_hash_table_insert(ctx->programs, key, program);
+    } else {
+        if (build_log)
+            *build_log = g_strdup(log);
+        g_free(key);
+    }
+
+    g_mutex_unlock(&ctx->lock);
+
+    return program;
+}
+
+/* ================= GstContext sharing ================= */
+
+static GstContext *
+gst_ocl_context_to_gst(GstOCLContext *ctx)
+{
+    GstContext *context = gst_context_new(GST_OCL_CONTEXT_TYPE, TRUE);
+    GstStructure *s = gst_context_writable_structure(context);
+
+    gst_structure_set(s, "context", GST_TYPE_OCL_CONTEXT, ctx, NULL);
+    return context;
+}
+
+static gboolean
+gst_ocl_context_from_gst(GstContext *context, GstOCLContext **ctx)
+{
+    const GstStructure *s;
+    GstOCLContext *found = NULL;
+
+    if (g_strcmp0(gst_context_get_context_type(context),
+                  GST_OCL_CONTEXT_TYPE) != 0)
+        return FALSE;
+
+    s = gst_context_get_structure(context);
+    if (!gst_structure_get(s, "context", GST_TYPE_OCL_CONTEXT, &found, NULL) ||
+        !found)
+        return FALSE;
+
+    if (*ctx)
+        gst_ocl_context_unref(*ctx);
+    *ctx = found;
+    return TRUE;
+}
+
+static gboolean
+gst_ocl_context_pad_query(const GValue *item, GValue *value, gpointer user_data)
+{
+    GstPad *pad = g_value_get_object(item);
+    GstQuery *query = user_data;
+
+    if (gst_pad_peer_query(pad, query)) {
+        g_value_set_boolean(value, TRUE);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* Run query on the peers of the pads of one direction. */
+static gboolean
+gst_ocl_context_run_query(GstElement *element, GstQuery *query,
+                          GstPadDirection direction)
+{
+    GstIterator *it;
+    GValue res = G_VALUE_INIT;
+
+    g_value_init(&res, G_TYPE_BOOLEAN);
+    g_value_set_boolean(&res, FALSE);
+
+    it = direction == GST_PAD_SRC ? gst_element_iterate_src_pads(element)
+                                  : gst_element_iterate_sink_pads(element);
+
+    while (gst_iterator_fold(it, gst_ocl_context_pad_query, &res, query) ==
+           GST_ITERATOR_RESYNC)
+        gst_iterator_resync(it);
+
+    gst_iterator_free(it);
+
+    return g_value_get_boolean(&res);
+}
+
+gboolean
+gst_ocl_context_ensure(GstElement *element, cl_device_type type,
+                       GstOCLContext **ctx)
+{
+    GstQuery *query;
+    GstContext *context = NULL;
+
+    gst_ocl_context_init_debug();
+
+    if (*ctx)
+        return TRUE;
+
+    /* 1. Downstream, then upstream neighbours */
+    query = gst_query_new_context(GST_OCL_CONTEXT_TYPE);
+    if (gst_ocl_context_run_query(element, query, GST_PAD_SRC) ||
+        gst_ocl_context_run_query(element, query, GST_PAD_SINK)) {
+        gst_query_parse_context(query, &context);
+        if (context) {
+            gst_ocl_context_from_gst(context, ctx);
+            GST_DEBUG_OBJECT(element, "Got OpenCL context %p from neighbour", *ctx);
+        }
+    }
+    gst_query_unref(query);
+
+    if (*ctx && !((*ctx)->device_type & type)) {
+        GST_DEBUG_OBJECT(element, "Neighbour context is on a %s device, "
+                         "not using it", gst_ocl_device_type_name((*ctx)->device_type));
+        gst_ocl_context_unref(*ctx);
+        *ctx = NULL;
+    }
+
+    if (*ctx)
+        return TRUE;
+
+    /* 2. Ask the application; it answers through set_context */
+    gst_element_post_message(element,
+        gst_message_new_need_context(GST_OBJECT(element), GST_OCL_CONTEXT_TYPE));
+
+    GST_OBJECT_LOCK(element);
+    if (*ctx && ((*ctx)->device_type & type)) {
+        GST_OBJECT_UNLOCK(element);
+        GST_DEBUG_OBJECT(element, "Got OpenCL context %p from application", *ctx);
+        return TRUE;
+    }
+    if (*ctx) {
+        GST_DEBUG_OBJECT(element, "Application context is on a %s device, "
+                         "not using it", gst_ocl_device_type_name((*ctx)->device_type));
+        gst_ocl_context_unref(*ctx);
+        *ctx = NULL;
+    }
+    GST_OBJECT_UNLOCK(element);
+
+    /* 3. Use the process-wide context and tell everybody about it */
+    *ctx = gst_ocl_context_get_default(type);
+    if (!*ctx)
+        return FALSE;
+
+    GST_DEBUG_OBJECT(element, "Using process-wide OpenCL context %p", *ctx);
+
+    context = gst_ocl_context_to_gst(*ctx);
+    gst_element_set_context(element, context);
+    gst_element_post_message(element,
+        gst_message_new_have_context(GST_OBJECT(element), context));
+
+    return TRUE;
+}
+
+void
+gst_ocl_context_handle_set_context(GstElement *element, GstContext *context,
+                                   GstOCLContext **ctx)
+{
+    GST_OBJECT_LOCK(element);
+    /* Keep the context in use, resources were created on it */
+    if (!*ctx)
+        gst_ocl_context_from_gst(context, ctx);
+    GST_OBJECT_UNLOCK(element);
+}
+
+gboolean
+gst_ocl_context_handle_query(GstElement *element, GstQuery *query,
+                             GstOCLContext *ctx)
+{
+    const gchar *type;
+    GstContext *context;
+
+    if (GST_QUERY_TYPE(query) != GST_QUERY_CONTEXT || !ctx)
+        return FALSE;
+
+    gst_query_parse_context_type(query, &type);
+    if (g_strcmp0(type, GST_OCL_CONTEXT_TYPE) != 0)
+        return FALSE;
+
+    context = gst_ocl_context_to_gst(ctx);
+    gst_query_set_context(query, context);
+    gst_context_unref(context);
+
+    GST_DEBUG_OBJECT(element, "Answered context query with %p", ctx);
+    return TRUE;
+}
@@ -0,0 +1,116 @@
+#pragma once
+
+#ifndef CL_TARGET_OPENCL_VERSION
+#define CL_TARGET_OPENCL_VERSION 300 // Targets OpenCL 3.0
+#endif
+
+#include <gst/gst.h>
+#include <CL/cl.h>
+
+#include "ocl_program_cache.h"
+
+G_BEGIN_DECLS
+
+/* GstContext type used to share a GstOCLContext between elements. */
+#define GST_OCL_CONTEXT_TYPE "gst.ocl.context"
+
+/* CL_MEM_USE_HOST_PTR buffers must cover whole cache lines to stay zero-copy. */
+#define ZERO_COPY_SIZE_ALIGN 64
+
+#define GST_TYPE_OCL_CONTEXT (gst_ocl_context_get_type())
+
+/*
+ * Reference counted OpenCL device/context shared by every OpenCL element of
+ * a pipeline (and, by default, of the process). Built programs are kept in
+ * an in-memory table so elements and renegotiations reuse them.
+ */
+typedef struct _GstOCLContext {
+    gint refcount;
+
+    cl_platform_id platform;
+    cl_device_id device;
+    cl_context context;
+    gchar *device_name;
+    gboolean sub_device; /* device is a partition owned by the context */
+
+    /* Zero-copy capabilities of the device */
+    gboolean host_unified;
+    guint mem_align;
+
+    /* Built programs, keyed by source and build options */
+    cl_device_type device_type;
+    GMutex lock;
+    GHashTable *programs;
+    ocl_cache_stats cache_stats;
+    guint64 program_reuses;
+} GstOCLContext;
+
+GType gst_ocl_context_get_type(void);
+
+GstOCLContext *gst_ocl_context_ref(GstOCLContext *ctx);
+void gst_ocl_context_unref(GstOCLContext *ctx);
+
+/*
+ * Process-wide context, created on first use on a device of type (a GPU
+ * first for CL_DEVICE_TYPE_ALL). One is kept per device type, a shared
+ * context on a device of type is reused. Returns a new reference, NULL if
+ * no device qualifies.
+ */
+GstOCLContext *gst_ocl_context_get_default(cl_device_type type);
+
+/*
+ * New contexts of their own on every device of type of every platform but
+ * skip's (optional), GPUs first. With cpu_units, the other CPU devices are
+ * partitioned into sub-devices of cpu_units compute units with a context
+ * each; devices that cannot be split are taken whole. Returns an
+ * array owning the references, empty when no other device qualifies.
+ */
+GPtrArray *gst_ocl_context_new_devices(cl_device_type type, guint cpu_units,
+                                       const GstOCLContext *skip);
+
+/* "GPU", "CPU", ... for log messages. */
+const gchar *gst_ocl_device_type_name(cl_device_type type);
+
+/* Create an in-order profiling queue on the shared device. */
+cl_command_queue gst_ocl_context_create_queue(GstOCLContext *ctx, cl_int *err);
+
+/*
+ * Return a built program for source/options, retained for the caller.
+ * Programs are built once per context and, through the on-disk binary
+ * cache in cache_dir, once per device/driver.
+ */
+cl_program gst_ocl_context_get_program(GstOCLContext *ctx,
+                                       const gchar *source,
+                                       const gchar *options,
+                                       const gchar *cache_dir,
+                                       gchar **build_log,
+                                       cl_int *err);
+
+/*
+ * The program of source/options already built in ctx, retained for the
+ * caller, without building it or waiting for a build. NULL otherwise.
+ */
+cl_program gst_ocl_context_lookup_program(GstOCLContext *ctx,
+                                          const gchar *source,
+                                          const gchar *options);
+
+/* ================= GstContext sharing ================= */
+
+/*
+ * Make sure *ctx is set: ask neighbouring elements and the application
+ * (need-context), else use the process-wide context and announce it
+ * (have-context). Contexts on a device not of type are ignored.
+ */
+gboolean gst_ocl_context_ensure(GstElement *element, cl_device_type type,
+                                GstOCLContext **ctx);
+
+/* set_context handler: take the context if none is set yet. */
+void gst_ocl_context_handle_set_context(GstElement *element,
+                                        GstContext *context,
+                                        GstOCLContext **ctx);
+
+/* Answer a GST_QUERY_CONTEXT with ctx. */
+gboolean gst_ocl_context_handle_query(GstElement *element, GstQuery *query,
+                                      GstOCLContext *ctx);
+
+G_END_DECLS
@@ -0,0 +1,309 @@
+/*
+ * gstoclmemory.c
+ *
+ * GstAllocator and buffer pool whose memory is an OpenCL cl_mem, so chained
+ * OpenCL elements pass device buffers without host copies.
+ *
+ */
+
+#include "gstoclmemory.h"
+
+#include <gst/video/gstvideopool.h>
+
+/* Debug category for OpenCL memory logging. */
+GST_DEBUG_CATEGORY_STATIC(gst_ocl_memory_debug);
+#define GST_CAT_DEFAULT gst_ocl_memory_debug
+
+G_DEFINE_TYPE_WITH_CODE(GstOCLAllocator, gst_ocl_allocator, GST_TYPE_ALLOCATOR,
+    GST_DEBUG_CATEGORY_INIT(gst_ocl_memory_debug, "oclmemory", 0,
+                            "OpenCL memory"))
+
+/* ================= MEMORY ================= */
+
+static GstMemory *
+gst_ocl_allocator_alloc(GstAllocator *allocator, gsize size,
+                        GstAllocationParams *params)
+{
+    GstOCLAllocator *self = (GstOCLAllocator *)allocator;
+    GstOCLMemory *mem;
+    gsize maxsize = size + params->prefix + params->padding;
+    cl_int err;
+
+    mem = g_new0(GstOCLMemory, 1);
+
+    /* Host-allocatable so maps at the edge of the OpenCL section are cheap */
+    mem->buffer = clCreateBuffer(self->ctx->context,
+                                 CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR,
+                                 maxsize, NULL, &err);
+    if (err != CL_SUCCESS) {
+        GST_ERROR_OBJECT(self, "clCreateBuffer(%" G_GSIZE_FORMAT ") failed (%d)",
+                         maxsize, err);
+        g_free(mem);
+        return NULL;
+    }
+
+    /* Sub-memories would need sub-buffers, copy instead */
+    gst_memory_init(GST_MEMORY_CAST(mem),
+                    params->flags | GST_MEMORY_FLAG_NO_SHARE,
+                    allocator, NULL, maxsize, params->align,
+                    params->prefix, size);
+
+    mem->ctx = gst_ocl_context_ref(self->ctx);
+    g_mutex_init(&mem->lock);
+
+    GST_LOG_OBJECT(self, "Allocated %p cl_mem=%p size=%" G_GSIZE_FORMAT,
+                   mem, mem->buffer, maxsize);
+
+    return GST_MEMORY_CAST(mem);
+}
+
+static void
+gst_ocl_allocator_free(GstAllocator *allocator, GstMemory *memory)
+{
+    GstOCLMemory *mem = (GstOCLMemory *)memory;
+
+    if (mem->last_evt)
+        clReleaseEvent(mem->last_evt);
+    clReleaseMemObject(mem->buffer);
+    gst_ocl_context_unref(mem->ctx);
+    g_mutex_clear(&mem->lock);
+    g_free(mem);
+}
+
+static gpointer
+gst_ocl_memory_map(GstMemory *memory, gsize maxsize, GstMapFlags flags)
+{
+    GstOCLMemory *mem = (GstOCLMemory *)memory;
+    GstOCLAllocator *allocator = (GstOCLAllocator *)memory->allocator;
+    cl_map_flags cl_flags = 0;
+    cl_int err;
+
+    if (flags & GST_MAP_READ)
+        cl_flags |= CL_MAP_READ;
+    if (flags & GST_MAP_WRITE)
+        cl_flags |= CL_MAP_WRITE;
+
+    g_mutex_lock(&mem->lock);
+
+    if (mem->map_count > 0) {
+        /* Already mapped; only compatible access can share the mapping */
+        if ((flags & GST_MAP_WRITE) && !(mem->map_flags & GST_MAP_WRITE)) {
+            g_mutex_unlock(&mem->lock);
+            return NULL;
+        }
+        mem->map_count++;
+        g_mutex_unlock(&mem->lock);
+        return mem->mapped;
+    }
+
+    /* Blocking map waits for pending device work on the memory */
+    mem->mapped = clEnqueueMapBuffer(allocator->queue, mem->buffer, CL_TRUE,
+                                     cl_flags, 0, mem->mem.maxsize,
+                                     mem->last_evt ? 1 : 0,
+                                     mem->last_evt ? &mem->last_evt : NULL,
+                                     NULL, &err);
+    if (err != CL_SUCCESS) {
+        GST_ERROR("clEnqueueMapBuffer failed (%d)", err);
+        mem->mapped = NULL;
+        g_mutex_unlock(&mem->lock);
+        return NULL;
+    }
+
+    mem->map_count = 1;
+    mem->map_flags = flags;
+    g_mutex_unlock(&mem->lock);
+
+    GST_LOG("Mapped cl_mem=%p to %p", mem->buffer, mem->mapped);
+
+    return mem->mapped;
+}
+
+static void
+gst_ocl_memory_unmap(GstMemory *memory)
+{
+    GstOCLMemory *mem = (GstOCLMemory *)memory;
+    GstOCLAllocator *allocator = (GstOCLAllocator *)memory->allocator;
+    cl_event unmap_evt = NULL;
+    cl_int err;
+
+    g_mutex_lock(&mem->lock);
+
+    if (--mem->map_count > 0) {
+        g_mutex_unlock(&mem->lock);
+        return;
+    }
+
+    err = clEnqueueUnmapMemObject(allocator->queue, mem->buffer, mem->mapped,
+                                  0, NULL, &unmap_evt);
+    if (err != CL_SUCCESS) {
+        GST_ERROR("clEnqueueUnmapMemObject failed (%d)", err);
+    } else {
+        /* Later device users must see the host writes: they wait on the unmap */
+        if (mem->last_evt)
+            clReleaseEvent(mem->last_evt);
+        mem->last_evt = unmap_evt;
+        clFlush(allocator->queue);
+    }
+
+    mem->mapped = NULL;
+    g_mutex_unlock(&mem->lock);
+}
+
+static GstMemory *
+gst_ocl_memory_share(GstMemory *memory, gssize offset, gssize size)
+{
+    /* Never called, memory is allocated with GST_MEMORY_FLAG_NO_SHARE */
+    return NULL;
+}
+
+gboolean
+gst_is_ocl_memory(GstMemory *mem)
+{
+    return mem != NULL && gst_memory_is_type(mem, GST_OCL_MEMORY_TYPE);
+}
+
+GstOCLMemory *
+gst_ocl_buffer_peek_memory(GstBuffer *buf, GstOCLContext *ctx)
+{
+    GstMemory *mem;
+
+    if (!buf || !ctx || gst_buffer_n_memory(buf) != 1)
+        return NULL;
+
+    mem = gst_buffer_peek_memory(buf, 0);
+    if (!gst_is_ocl_memory(mem))
+        return NULL;
+
+    if (((GstOCLMemory *)mem)->ctx->context != ctx->context)
+        return NULL;
+
+    return (GstOCLMemory *)mem;
+}
+
+void
+gst_ocl_memory_set_event(GstOCLMemory *mem, cl_event evt)
+{
+    g_mutex_lock(&mem->lock);
+    if (evt)
+        clRetainEvent(evt);
+    if (mem->last_evt)
+        clReleaseEvent(mem->last_evt);
+    mem->last_evt = evt;
+    g_mutex_unlock(&mem->lock);
+}
+
+cl_event
+gst_ocl_memory_get_event(GstOCLMemory *mem)
+{
+    cl_event evt;
+
+    g_mutex_lock(&mem->lock);
+    evt = mem->last_evt;
+    if (evt)
+        clRetainEvent(evt);
+    g_mutex_unlock(&mem->lock);
+
+    return evt;
+}
+
+/* ================= ALLOCATOR ================= */
+
+static void
+gst_ocl_allocator_finalize(GObject *object)
+{
+    GstOCLAllocator *self = (GstOCLAllocator *)object;
+
+    if (self->queue)
+        clReleaseCommandQueue(self->queue);
+    if (self->ctx)
+        gst_ocl_context_unref(self->ctx);
+
+    G_OBJECT_CLASS(gst_ocl_allocator_parent_class)->finalize(object);
+}
+
+static void
+gst_ocl_allocator_class_init(GstOCLAllocatorClass *klass)
+{
+    GstAllocatorClass *aclass = GST_ALLOCATOR_CLASS(klass);
+    GObjectClass *gclass = G_OBJECT_CLASS(klass);
+
+    aclass->alloc = gst_ocl_allocator_alloc;
+    aclass->free = gst_ocl_allocator_free;
+    gclass->finalize = gst_ocl_allocator_finalize;
+}
+
+static void
+gst_ocl_allocator_init(GstOCLAllocator *self)
+{
+    GstAllocator *alloc = GST_ALLOCATOR_CAST(self);
+
+    alloc->mem_type = GST_OCL_MEMORY_TYPE;
+    alloc->mem_map = gst_ocl_memory_map;
+    alloc->mem_unmap = gst_ocl_memory_unmap;
+    alloc->mem_share = gst_ocl_memory_share;
+
+    GST_OBJECT_FLAG_SET(self, GST_ALLOCATOR_FLAG_CUSTOM_ALLOC);
+}
+
+GstAllocator *
+gst_ocl_allocator_new(GstOCLContext *ctx)
+{
+    GstOCLAllocator *self;
+    cl_int err;
+
+    self = g_object_new(GST_TYPE_OCL_ALLOCATOR, NULL);
+    gst_object_ref_sink(self);
+
+    self->ctx = gst_ocl_context_ref(ctx);
+    self->queue = gst_ocl_context_create_queue(ctx, &err);
+    if (err != CL_SUCCESS) {
+        GST_ERROR_OBJECT(self, "Failed to create map queue (%d)", err);
+        gst_object_unref(self);
+        return NULL;
+    }
+
+    return GST_ALLOCATOR_CAST(self);
+}
+
+/* ================= BUFFER POOL ================= */
+
+GstBufferPool *
+gst_ocl_buffer_pool_new(GstOCLContext *ctx, GstCaps *caps,
+                        guint size, guint min, guint max)
+{
+    GstBufferPool *pool;
+    GstStructure *config;
+    GstAllocator *allocator;
+
+    allocator = gst_ocl_allocator_new(ctx);
+    if (!allocator)
+        return NULL;
+
+    pool = gst_video_buffer_pool_new();
+    config = gst_buffer_pool_get_config(pool);
+    gst_buffer_pool_config_set_params(config, caps, size, min, max);
+    gst_buffer_pool_config_set_allocator(config, allocator, NULL);
+    gst_buffer_pool_config_add_option(config, GST_BUFFER_POOL_OPTION_VIDEO_META);
+    gst_object_unref(allocator);
+
+    if (!gst_buffer_pool_set_config(pool, config)) {
+        GST_WARNING("Failed to configure OpenCL buffer pool");
+        gst_object_unref(pool);
+        return NULL;
+    }
+
+    return pool;
+}
+
+gboolean
+gst_ocl_caps_has_feature(const GstCaps *caps)
+{
+    GstCapsFeatures *features;
+
+    if (!caps || gst_caps_get_size(caps) == 0)
+        return FALSE;
+
+    features = gst_caps_get_features(caps, 0);
+    return features &&
+           gst_caps_features_contains(features, GST_CAPS_FEATURE_MEMORY_OPENCL);
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <gst/gst.h>
+#include <gst/video/video.h>
+
+#include "gstoclcontext.h"
+
+G_BEGIN_DECLS
+
+/* Caps feature of buffers whose memory lives in an OpenCL cl_mem. */
+#define GST_CAPS_FEATURE_MEMORY_OPENCL "memory:OpenCL"
+
+#define GST_OCL_MEMORY_TYPE "OpenCLMemory"
+
+#define GST_TYPE_OCL_ALLOCATOR (gst_ocl_allocator_get_type())
+
+/*
+ * GstMemory backed by a cl_mem of a shared GstOCLContext. Every device
+ * command touching the memory waits on last_evt and replaces it with its
+ * own event, so users on different queues of the context stay ordered.
+ * Mapping to the host waits on it too.
+ */
+typedef struct _GstOCLMemory {
+    GstMemory mem;
+
+    GstOCLContext *ctx;
+    cl_mem buffer;
+
+    GMutex lock;
+    cl_event last_evt;
+    gpointer mapped;
+    guint map_count;
+    GstMapFlags map_flags;
+} GstOCLMemory;
+
+/* Allocator handing out GstOCLMemory on one context. */
+typedef struct _GstOCLAllocator {
+    GstAllocator parent;
+
+    GstOCLContext *ctx;
+    cl_command_queue queue; /* map/unmap */
+} GstOCLAllocator;
+
+typedef struct _GstOCLAllocatorClass {
+    GstAllocatorClass parent_class;
+} GstOCLAllocatorClass;
+
+GType gst_ocl_allocator_get_type(void);
+
+GstAllocator *gst_ocl_allocator_new(GstOCLContext *ctx);
+
+gboolean gst_is_ocl_memory(GstMemory *mem);
+
+/*
+ * The OpenCL memory of buf if it is made of a single GstOCLMemory
+ * allocated on ctx, else NULL.
+ */
+GstOCLMemory *gst_ocl_buffer_peek_memory(GstBuffer *buf, GstOCLContext *ctx);
+
+/* Record evt as the last device command touching mem. */
+void gst_ocl_memory_set_event(GstOCLMemory *mem, cl_event evt);
+
+/*
+ * Event of the last device command touching mem, retained for the caller,
+ * or NULL when the memory is idle.
+ */
+cl_event gst_ocl_memory_get_event(GstOCLMemory *mem);
+
+/* GstVideoBufferPool allocating GstOCLMemory, configured for caps. */
+GstBufferPool *gst_ocl_buffer_pool_new(GstOCLContext *ctx, GstCaps *caps,
+                                       guint size, guint min, guint max);
+
+/* TRUE if the first structure of caps has the memory:OpenCL feature. */
+gboolean gst_ocl_caps_has_feature(const GstCaps *caps);
+
+G_END_DECLS
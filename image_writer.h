@@ -0,0 +1,348 @@
+#pragma once
+
+/*
+ * image_writer.h
+ *
+ * RGBA image output as PPM, PNG or JPEG, picked from the file extension.
+ *
+ * Alpha is stripped in bulk (SSSE3 shuffles when the CPU has them) and PPM data is
+ * written in large blocks; PNG and JPEG let the encoder skip the alpha byte.
+ * image_writer runs the encoding on background threads behind a bounded
+ * queue, so producers only wait when the disk falls behind by more than the
+ * queue depth.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <png.h>
+#include <jpeglib.h>
+#include "jpeg_decoder.h" /* jpeg_error */
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define IMAGE_WRITER_X86 1
+#endif
+
+#define IMAGE_PPM_BLOCK   (1 << 20) /* bytes per PPM fwrite */
+#define IMAGE_JPEG_QUALITY 90
+
+static void rgba_to_rgb_c(unsigned char *dst, const unsigned char *src,
+                          size_t pixels)
+{
+    for (size_t i = 0; i < pixels; i++) {
+        dst[i*3+0] = src[i*4+0];
+        dst[i*3+1] = src[i*4+1];
+        dst[i*3+2] = src[i*4+2];
+    }
+}
+
+#ifdef IMAGE_WRITER_X86
+__attribute__((target("ssse3")))
+static void rgba_to_rgb_ssse3(unsigned char *dst, const unsigned char *src,
+                              size_t pixels)
+{
+    const __m128i shuffle = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10,
+                                          12, 13, 14, -1, -1, -1, -1);
+    size_t i = 0;
+
+    /* 4 pixels per step; the 16-byte store runs 4 bytes ahead */
+    for (; i + 6 <= pixels; i += 4) {
+        __m128i px = _mm_loadu_si128((const __m128i *)(src + i * 4));
+
+        _mm_storeu_si128((__m128i *)(dst + i * 3), _mm_shuffle_epi8(px, shuffle));
+    }
+
+    rgba_to_rgb_c(dst + i * 3, src + i * 4, pixels - i);
+}
+#endif
+
+/* RGBA -> RGB for pixels pixels, with the widest shuffle the CPU runs. */
+static void rgba_to_rgb(unsigned char *dst, const unsigned char *src, size_t pixels)
+{
+#ifdef IMAGE_WRITER_X86
+    if (__builtin_cpu_supports("ssse3")) {
+        rgba_to_rgb_ssse3(dst, src, pixels);
+        return;
+    }
+#endif
+    rgba_to_rgb_c(dst, src, pixels);
+}
+
+static int write_ppm(const char *filename, const unsigned char *rgba,
+                     int width, int height)
+{
+    size_t row_bytes = (size_t)width * 3;
+    int rows = IMAGE_PPM_BLOCK / row_bytes > 0 ? IMAGE_PPM_BLOCK / row_bytes : 1;
+    unsigned char *block;
+    FILE *fp;
+    int ret = 0;
+
+    fp = fopen(filename, "wb");
+    if (!fp)
+        return -1;
+
+    block = malloc(row_bytes * rows);
+    if (!block) {
+        fclose(fp);
+        return -1;
+    }
+
+    fprintf(fp, "P6\n%d %d\n255\n", width, height);
+
+    for (int y = 0; y < height && ret == 0; y += rows) {
+        int n = height - y < rows ? height - y : rows;
+
+        rgba_to_rgb(block, rgba + (size_t)y * width * 4, (size_t)n * width);
+        if (fwrite(block, row_bytes, n, fp) != (size_t)n)
+            ret = -1;
+    }
+
+    free(block);
+    if (fclose(fp) != 0)
+        ret = -1;
+
+    return ret;
+}
+
+static int write_png(const char *filename, const unsigned char *rgba,
+                     int width, int height)
+{
+    png_structp png;
+    png_infop info;
+    FILE *fp;
+
+    fp = fopen(filename, "wb");
+    if (!fp)
+        return -1;
+
+    png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    info = png ? png_create_info_struct(png) : NULL;
+    if (!info || setjmp(png_jmpbuf(png))) {
+        png_destroy_write_struct(&png, &info);
+        fclose(fp);
+        return -1;
+    }
+
+    png_init_io(png, fp);
+    /* Throughput over size */
+    png_set_compression_level(png, 1);
+    png_set_filter(png, 0, PNG_FILTER_SUB);
+
+    png_set_IHDR(png, info, width, height, 8, PNG_COLOR_TYPE_RGB,
+                 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+                 PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(png, info);
+
+    /* Rows are RGBA, libpng drops the alpha byte */
+    png_set_filler(png, 0, PNG_FILLER_AFTER);
+
+    for (int y = 0; y < height; y++)
+        png_write_row(png, (png_const_bytep)(rgba + (size_t)y * width * 4));
+
+    png_write_end(png, NULL);
+    png_destroy_write_struct(&png, &info);
+
+    return fclose(fp) == 0 ? 0 : -1;
+}
+
+static int write_jpeg(const char *filename, const unsigned char *rgba,
+                      int width, int height)
+{
+    struct jpeg_compress_struct cinfo;
+    jpeg_error jerr;
+    unsigned char *rgb = NULL;
+    FILE *fp;
+
+    fp = fopen(filename, "wb");
+    if (!fp)
+        return -1;
+
+#ifndef JCS_EXTENSIONS
+    rgb = malloc((size_t)width * 3);
+#endif
+
+    /* Errors return here instead of exiting from the writer thread */
+    cinfo.err = jpeg_std_error(&jerr.mgr);
+    jerr.mgr.error_exit = jpeg_error_exit;
+    if (setjmp(jerr.jmp)) {
+        jpeg_destroy_compress(&cinfo);
+        free(rgb);
+        fclose(fp);
+        return -1;
+    }
+
+    jpeg_create_compress(&cinfo);
+    jpeg_stdio_dest(&cinfo, fp);
+
+    cinfo.image_width = width;
+    cinfo.image_height = height;
+#ifdef JCS_EXTENSIONS
+    /* libjpeg-turbo reads RGBA rows and ignores the X byte */
+    cinfo.input_components = 4;
+    cinfo.in_color_space = JCS_EXT_RGBX;
+#else
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+#endif
+
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, IMAGE_JPEG_QUALITY, TRUE);
+    jpeg_start_compress(&cinfo, TRUE);
+
+    while (cinfo.next_scanline < cinfo.image_height) {
+        JSAMPROW row = (JSAMPROW)(rgba + (size_t)cinfo.next_scanline * width * 4);
+
+        if (rgb) {
+            rgba_to_rgb(rgb, row, width);
+            row = rgb;
+        }
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    free(rgb);
+
+    return fclose(fp) == 0 ? 0 : -1;
+}
+
+/* Write rgba to filename as .png, .jpg/.jpeg, or PPM otherwise. */
+static int image_write(const char *filename, const unsigned char *rgba,
+                       int width, int height)
+{
+    const char *ext = strrchr(filename, '.');
+
+    if (ext && strcasecmp(ext, ".png") == 0)
+        return write_png(filename, rgba, width, height);
+    if (ext && (strcasecmp(ext, ".jpg") == 0 || strcasecmp(ext, ".jpeg") == 0))
+        return write_jpeg(filename, rgba, width, height);
+
+    return write_ppm(filename, rgba, width, height);
+}
+
+/* ================= ASYNC WRITER ================= */
+
+typedef struct {
+    char *path;
+    unsigned char *rgba;
+    int width;
+    int height;
+} image_job;
+
+/* Writer threads draining a bounded queue of images. */
+typedef struct {
+    pthread_t *threads;
+    int n_threads;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    image_job *jobs;
+    int capacity;
+    int head;
+    int count;
+    int closing;
+
+    unsigned long written;
+    unsigned long failed;
+} image_writer;
+
+static void *image_writer_thread(void *data)
+{
+    image_writer *w = data;
+
+    for (;;) {
+        image_job job;
+        int ret;
+
+        pthread_mutex_lock(&w->lock);
+        while (w->count == 0 && !w->closing)
+            pthread_cond_wait(&w->cond, &w->lock);
+        if (w->count == 0) {
+            pthread_mutex_unlock(&w->lock);
+            break;
+        }
+        job = w->jobs[w->head];
+        w->head = (w->head + 1) % w->capacity;
+        w->count--;
+        pthread_cond_broadcast(&w->cond);
+        pthread_mutex_unlock(&w->lock);
+
+        ret = image_write(job.path, job.rgba, job.width, job.height);
+        if (ret != 0)
+            fprintf(stderr, "Failed to write %s\n", job.path);
+
+        pthread_mutex_lock(&w->lock);
+        if (ret == 0)
+            w->written++;
+        else
+            w->failed++;
+        pthread_mutex_unlock(&w->lock);
+
+        free(job.path);
+        free(job.rgba);
+    }
+
+    return NULL;
+}
+
+static int image_writer_start(image_writer *w, int n_threads, int depth)
+{
+    memset(w, 0, sizeof(*w));
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->cond, NULL);
+
+    w->capacity = depth > 0 ? depth : 1;
+    w->jobs = calloc(w->capacity, sizeof(image_job));
+    w->threads = calloc(n_threads, sizeof(pthread_t));
+
+    for (int i = 0; i < n_threads; i++) {
+        if (pthread_create(&w->threads[i], NULL, image_writer_thread, w) != 0)
+            break;
+        w->n_threads++;
+    }
+
+    return w->n_threads > 0 ? 0 : -1;
+}
+
+/*
+ * Queue rgba (malloc'ed, the writer frees it) for writing to path. Blocks
+ * while the queue is full.
+ */
+static void image_writer_submit(image_writer *w, const char *path,
+                                unsigned char *rgba, int width, int height)
+{
+    pthread_mutex_lock(&w->lock);
+    while (w->count == w->capacity)
+        pthread_cond_wait(&w->cond, &w->lock);
+
+    image_job *job = &w->jobs[(w->head + w->count) % w->capacity];
+    job->path = strdup(path);
+    job->rgba = rgba;
+    job->width = width;
+    job->height = height;
+    w->count++;
+
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+}
+
+/* Write the queued images, stop the threads. Returns the failure count. */
+static unsigned long image_writer_finish(image_writer *w)
+{
+    pthread_mutex_lock(&w->lock);
+    w->closing = 1;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+
+    for (int i = 0; i < w->n_threads; i++)
+        pthread_join(w->threads[i], NULL);
+
+    free(w->threads);
+    free(w->jobs);
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->cond);
+
+    return w->failed;
+}
@@ -1,8 +1,67 @@
+/*
+ * Point-wise luma ops. A kernel K with a matching
+ *     uchar K_px(uchar v, int x, int y, int width, int height)
+ * can be fused with its point-wise neighbours in a kernel-chain. If it
+ * also has the vector form
+ *     uchar16 K_px16(uchar16 v, int x, int y, int width, int height)
+ * for the 16 bytes of row y starting at column x, the element runs it
+ * with vload16/vstore16, several vectors per work-item.
+ *
+ * A build specialized for the caps defines WIDTH, HEIGHT and STRIDE; the
+ * kernels then use the constants instead of their arguments.
+ */
+
+/* Lanes of the 16 columns from x that lie in the left half. */
+char16 nv12_left_mask(int x, int width)
+{
+    int16 cols = (int16)(x) + (int16)(0, 1, 2, 3, 4, 5, 6, 7,
+                                      8, 9, 10, 11, 12, 13, 14, 15);
+
+    return convert_char16(cols < (int16)(width / 2));
+}
+
+uchar nv12_half_left_px(uchar v, int x, int y, int width, int height)
+{
+    return x < width / 2 ? (uchar)(v >> 1) : v;
+}
+
+uchar16 nv12_half_left_px16(uchar16 v, int x, int y, int width, int height)
+{
+    return select(v, v >> (uchar16)(1), nv12_left_mask(x, width));
+}
+
+uchar nv12_invert_left_px(uchar v, int x, int y, int width, int height)
+{
+    return x < width / 2 ? (uchar)(255 - v) : v;
+}
+
+uchar16 nv12_invert_left_px16(uchar16 v, int x, int y, int width, int height)
+{
+    return select(v, (uchar16)(255) - v, nv12_left_mask(x, width));
+}
+
+uchar nv12_bright_left_px(uchar v, int x, int y, int width, int height)
+{
+    int val = v + 40;
+
+    return x < width / 2 ? (uchar)(val > 255 ? 255 : val) : v;
+}
+
+uchar16 nv12_bright_left_px16(uchar16 v, int x, int y, int width, int height)
+{
+    return select(v, add_sat(v, (uchar16)(40)), nv12_left_mask(x, width));
+}
+
 __kernel void nv12_half_left(__global uchar *y,
                              int width,
                              int height,
                              int stride)
 {
+#ifdef WIDTH
+    width = WIDTH;
+    height = HEIGHT;
+    stride = STRIDE;
+#endif
     int x = get_global_id(0);
     int yid = get_global_id(1);
 
@@ -11,8 +70,7 @@ __kernel void nv12_half_left(__global uchar *y,
 
     int off = yid * stride + x;
 
-    if (x < width / 2)
-        y[off] = y[off] >> 1;
+    y[off] = nv12_half_left_px(y[off], x, yid, width, height);
 }
 
 __kernel void nv12_invert_left(__global uchar *y,
@@ -20,6 +78,11 @@ __kernel void nv12_invert_left(__global uchar *y,
                               int height,
                               int stride)
 {
+#ifdef WIDTH
+    width = WIDTH;
+    height = HEIGHT;
+    stride = STRIDE;
+#endif
     int x   = get_global_id(0);
     int yid = get_global_id(1);
 
@@ -28,8 +91,7 @@ __kernel void nv12_invert_left(__global uchar *y,
 
     int off = yid * stride + x;
 
-    if (x < width / 2)
-        y[off] = (uchar)(255 - y[off]);
+    y[off] = nv12_invert_left_px(y[off], x, yid, width, height);
 }
 
 __kernel void nv12_bright_left(__global uchar *y,
@@ -37,6 +99,11 @@ __kernel void nv12_bright_left(__global uchar *y,
                                int height,
                                int stride)
 {
+#ifdef WIDTH
+    width = WIDTH;
+    height = HEIGHT;
+    stride = STRIDE;
+#endif
     int x   = get_global_id(0);
     int yid = get_global_id(1);
 
@@ -45,8 +112,5 @@ __kernel void nv12_bright_left(__global uchar *y,
 
     int off = yid * stride + x;
 
-    if (x < width / 2) {
-        int val = y[off] + 40;
-        y[off] = (uchar)(val > 255 ? 255 : val);
-    }
+    y[off] = nv12_bright_left_px(y[off], x, yid, width, height);
 }
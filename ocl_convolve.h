@@ -0,0 +1,142 @@
+#pragma once
+
+/*
+ * ocl_convolve.h
+ *
+ * Host side of the separable neighbourhood filters of convolve.cl: the
+ * Gaussian taps, the kernel arguments shared by the K_h and K_v passes
+ * and their launch on square work-groups of up to OCL_CONV_LOCAL, as
+ * large as both kernels run with on the device (see ocl_conv_local()),
+ * the size the __local tile is allocated for.
+ */
+
+#include <CL/cl.h>
+#include <math.h>
+
+#define OCL_CONV_LOCAL      16
+#define OCL_CONV_MAX_RADIUS 16
+
+/*
+ * Side of the work-groups of the passes h and v: the largest power of two
+ * up to OCL_CONV_LOCAL whose square both run with on their device.
+ */
+static size_t ocl_conv_local(cl_kernel h, cl_kernel v)
+{
+    cl_kernel kernels[2] = { h, v };
+    size_t side = OCL_CONV_LOCAL;
+
+    for (int i = 0; i < 2; i++) {
+        cl_program program;
+        cl_device_id device;
+        size_t max = 1, items[3] = { 1, 1, 1 };
+
+        /* Programs are built for a single device */
+        if (clGetKernelInfo(kernels[i], CL_KERNEL_PROGRAM, sizeof(program),
+                            &program, NULL) == CL_SUCCESS &&
+            clGetProgramInfo(program, CL_PROGRAM_DEVICES, sizeof(device),
+                             &device, NULL) == CL_SUCCESS) {
+            clGetKernelWorkGroupInfo(kernels[i], device,
+                                     CL_KERNEL_WORK_GROUP_SIZE, sizeof(max),
+                                     &max, NULL);
+            clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_ITEM_SIZES,
+                            sizeof(items), items, NULL);
+        }
+
+        while (side > 1 &&
+               (side * side > max || side > items[0] || side > items[1]))
+            side /= 2;
+    }
+
+    return side;
+}
+
+/*
+ * Bytes of the __local tile of a pass on local x local work-groups, float4
+ * elements with the apron.
+ */
+static size_t ocl_conv_tile_bytes(int radius, size_t local)
+{
+    return (local + 2 * radius) * local * sizeof(cl_float4);
+}
+
+/*
+ * Normalised Gaussian taps w[0 .. 2 * radius] of standard deviation sigma;
+ * sigma <= 0 picks radius / 2.
+ */
+static void ocl_conv_weights(int radius, double sigma, float *w)
+{
+    double sum = 0.0;
+
+    if (sigma <= 0.0)
+        sigma = radius > 0 ? radius / 2.0 : 1.0;
+
+    for (int k = -radius; k <= radius; k++) {
+        w[k + radius] = exp(-(k * k) / (2.0 * sigma * sigma));
+        sum += w[k + radius];
+    }
+
+    for (int k = 0; k <= 2 * radius; k++)
+        w[k] /= sum;
+}
+
+/* Read-only buffer with the taps of ocl_conv_weights(). */
+static cl_mem ocl_conv_create_weights(cl_context context, int radius,
+                                      double sigma, cl_int *err)
+{
+    float w[2 * OCL_CONV_MAX_RADIUS + 1];
+
+    ocl_conv_weights(radius, sigma, w);
+
+    return clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                          (2 * radius + 1) * sizeof(float), w, err);
+}
+
+/* Set the arguments common to both passes of a filter run on local. */
+static cl_int ocl_conv_set_args(cl_kernel kernel, cl_mem *img, cl_mem *tmp,
+                                int width, int height, int stride,
+                                int radius, cl_mem *weights, float amount,
+                                size_t local)
+{
+    cl_int err;
+
+    if ((err = clSetKernelArg(kernel, 0, sizeof(cl_mem), img)) != CL_SUCCESS ||
+        (err = clSetKernelArg(kernel, 1, sizeof(cl_mem), tmp)) != CL_SUCCESS ||
+        (err = clSetKernelArg(kernel, 2, sizeof(int), &width)) != CL_SUCCESS ||
+        (err = clSetKernelArg(kernel, 3, sizeof(int), &height)) != CL_SUCCESS ||
+        (err = clSetKernelArg(kernel, 4, sizeof(int), &stride)) != CL_SUCCESS ||
+        (err = clSetKernelArg(kernel, 5, sizeof(int), &radius)) != CL_SUCCESS ||
+        (err = clSetKernelArg(kernel, 6, sizeof(cl_mem), weights)) != CL_SUCCESS ||
+        (err = clSetKernelArg(kernel, 7, ocl_conv_tile_bytes(radius, local),
+                              NULL)) != CL_SUCCESS)
+        return err;
+
+    return clSetKernelArg(kernel, 8, sizeof(float), &amount);
+}
+
+/*
+ * Enqueue the horizontal then the vertical pass over width x height on
+ * side x side work-groups, the first waiting on wait. h_evt and v_evt
+ * (both optional) are the events of the passes. The arguments of both
+ * kernels must be set for side.
+ */
+static cl_int ocl_conv_enqueue(cl_command_queue queue, cl_kernel h, cl_kernel v,
+                               size_t side, int width, int height,
+                               cl_uint n_wait, const cl_event *wait,
+                               cl_event *h_evt, cl_event *v_evt)
+{
+    size_t local[2] = { side, side };
+    size_t global[2] = {
+        ((size_t)width + side - 1) / side * side,
+        ((size_t)height + side - 1) / side * side,
+    };
+    cl_int err;
+
+    err = clEnqueueNDRangeKernel(queue, h, 2, NULL, global, local,
+                                 n_wait, wait, h_evt);
+    if (err != CL_SUCCESS)
+        return err;
+
+    /* In-order queue, the vertical pass follows */
+    return clEnqueueNDRangeKernel(queue, v, 2, NULL, global, local,
+                                  0, NULL, v_evt);
+}
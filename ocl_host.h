@@ -0,0 +1,379 @@
+#pragma once
+
+/*
+ * ocl_host.h
+ *
+ * Host engine for the shipped point-wise kernels, for machines without a
+ * suitable OpenCL device: the luma ops of nv12_half_left.cl and the RGBA
+ * ops of devide_by_two.cl, looked up by kernel name.
+ *
+ * Most ops are byte-wise (shift, xor, saturating add on some bytes of each
+ * pixel) and run 16 or 32 bytes at a time with SSE2 or AVX2, picked at run
+ * time. The rows of an image are split into bands handed to a pool of
+ * threads; a band applies the whole chain row by row while the row is in
+ * cache.
+ */
+
+#include <pthread.h>
+#include <stddef.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define OCL_HOST_X86 1
+#endif
+
+#define OCL_HOST_MAX_THREADS 64
+#define OCL_HOST_MAX_OPS     16
+#define OCL_HOST_BAND_ROWS   16 /* rows per unit of work */
+
+/*
+ * A point-wise op. Byte-wise ops compute
+ *     t = min(((shift ? p >> 1 : p) ^ xor_mask) + add, 255)
+ * for the bytes of each 4-byte group selected by lanes (bit i = byte i)
+ * and keep the others; row ops mix the channels of a pixel. With
+ * left_half only the first width / 2 pixels of a row change.
+ */
+typedef struct {
+    const char *name;
+    int bpp;               /* bytes per pixel: 1 luma, 4 RGBA */
+    int left_half;
+    int shift;
+    unsigned char xor_mask;
+    unsigned char add;
+    int add_value;         /* add is the kernel's value argument */
+    unsigned char lanes;
+    void (*row)(unsigned char *row, int n);
+} ocl_host_op;
+
+/* Ops applied in order to every row. */
+typedef struct {
+    ocl_host_op ops[OCL_HOST_MAX_OPS];
+    int n_ops;
+    int bpp;
+} ocl_host_chain;
+
+typedef void (*ocl_host_bytes_fn)(const ocl_host_op *op, unsigned char *p,
+                                  size_t n);
+
+/* grayscale: the weights of the kernel, truncated. */
+static void ocl_host_grayscale(unsigned char *p, int n)
+{
+    for (int i = 0; i < n; i++, p += 4)
+        p[0] = p[1] = p[2] = (unsigned char)(0.299f * p[0] + 0.587f * p[1] +
+                                             0.114f * p[2]);
+}
+
+/* left_half_grayscale: mean of the channels. */
+static void ocl_host_mean_gray(unsigned char *p, int n)
+{
+    for (int i = 0; i < n; i++, p += 4)
+        p[0] = p[1] = p[2] = (unsigned char)((p[0] + p[1] + p[2]) / 3);
+}
+
+static const ocl_host_op ocl_host_ops[] = {
+    /* nv12_half_left.cl */
+    { .name = "nv12_half_left", .bpp = 1, .left_half = 1, .shift = 1,
+      .lanes = 0xf },
+    { .name = "nv12_invert_left", .bpp = 1, .left_half = 1, .xor_mask = 0xff,
+      .lanes = 0xf },
+    { .name = "nv12_bright_left", .bpp = 1, .left_half = 1, .add = 40,
+      .lanes = 0xf },
+
+    /* devide_by_two.cl, alpha untouched */
+    { .name = "devide_by_two", .bpp = 4, .left_half = 1, .shift = 1,
+      .lanes = 0x7 },
+    { .name = "devide_by_two_v16", .bpp = 4, .left_half = 1, .shift = 1,
+      .lanes = 0x7 },
+    { .name = "increase_brightness", .bpp = 4, .add_value = 1, .lanes = 0x7 },
+    { .name = "invert_colors", .bpp = 4, .xor_mask = 0xff, .lanes = 0x7 },
+    { .name = "grayscale", .bpp = 4, .row = ocl_host_grayscale },
+    { .name = "left_half_grayscale", .bpp = 4, .left_half = 1,
+      .row = ocl_host_mean_gray },
+    { .name = "left_half_grayscale_v16", .bpp = 4, .left_half = 1,
+      .row = ocl_host_mean_gray },
+};
+
+/* Byte mask of the lanes of op in a 32-bit group, little endian. */
+static unsigned int ocl_host_lane_mask(const ocl_host_op *op)
+{
+    unsigned int mask = 0;
+
+    for (int i = 0; i < 4; i++)
+        if (op->lanes & (1 << i))
+            mask |= 0xffu << (8 * i);
+
+    return mask;
+}
+
+/* n bytes from the start of a 4-byte group. */
+static void ocl_host_bytes_c(const ocl_host_op *op, unsigned char *p, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        int v = p[i];
+
+        if (!(op->lanes & (1 << (i & 3))))
+            continue;
+
+        if (op->shift)
+            v >>= 1;
+        v = (v ^ op->xor_mask) + op->add;
+        p[i] = v > 255 ? 255 : v;
+    }
+}
+
+#if defined(OCL_HOST_X86) && defined(__SSE2__)
+static void ocl_host_bytes_sse2(const ocl_host_op *op, unsigned char *p,
+                                size_t n)
+{
+    const __m128i lanes = _mm_set1_epi32((int)ocl_host_lane_mask(op));
+    const __m128i low7 = _mm_set1_epi8(0x7f);
+    const __m128i x = _mm_set1_epi8((char)op->xor_mask);
+    const __m128i a = _mm_set1_epi8((char)op->add);
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        __m128i t = v;
+
+        /* No byte shift: shift words, clear what crossed from the next byte */
+        if (op->shift)
+            t = _mm_and_si128(_mm_srli_epi16(t, 1), low7);
+        t = _mm_adds_epu8(_mm_xor_si128(t, x), a);
+        t = _mm_or_si128(_mm_and_si128(lanes, t), _mm_andnot_si128(lanes, v));
+        _mm_storeu_si128((__m128i *)(p + i), t);
+    }
+
+    ocl_host_bytes_c(op, p + i, n - i);
+}
+#endif
+
+#ifdef OCL_HOST_X86
+__attribute__((target("avx2")))
+static void ocl_host_bytes_avx2(const ocl_host_op *op, unsigned char *p,
+                                size_t n)
+{
+    const __m256i lanes = _mm256_set1_epi32((int)ocl_host_lane_mask(op));
+    const __m256i low7 = _mm256_set1_epi8(0x7f);
+    const __m256i x = _mm256_set1_epi8((char)op->xor_mask);
+    const __m256i a = _mm256_set1_epi8((char)op->add);
+    size_t i = 0;
+
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+        __m256i t = v;
+
+        if (op->shift)
+            t = _mm256_and_si256(_mm256_srli_epi16(t, 1), low7);
+        t = _mm256_adds_epu8(_mm256_xor_si256(t, x), a);
+        t = _mm256_blendv_epi8(v, t, lanes);
+        _mm256_storeu_si256((__m256i *)(p + i), t);
+    }
+
+    ocl_host_bytes_c(op, p + i, n - i);
+}
+#endif
+
+/* Widest byte-wise implementation the CPU runs, and its name. */
+static ocl_host_bytes_fn ocl_host_select(const char **isa)
+{
+#ifdef OCL_HOST_X86
+    if (__builtin_cpu_supports("avx2")) {
+        *isa = "avx2";
+        return ocl_host_bytes_avx2;
+    }
+#endif
+#if defined(OCL_HOST_X86) && defined(__SSE2__)
+    *isa = "sse2";
+    return ocl_host_bytes_sse2;
+#else
+    *isa = "c";
+    return ocl_host_bytes_c;
+#endif
+}
+
+static void ocl_host_chain_init(ocl_host_chain *chain)
+{
+    memset(chain, 0, sizeof(*chain));
+}
+
+/*
+ * Append the op of kernel name, value being its value argument if it has
+ * one. Returns -1 if there is no such op or it has another pixel size
+ * than the chain.
+ */
+static int ocl_host_chain_add(ocl_host_chain *chain, const char *name,
+                              int value)
+{
+    if (chain->n_ops == OCL_HOST_MAX_OPS)
+        return -1;
+
+    for (size_t i = 0; i < sizeof(ocl_host_ops) / sizeof(ocl_host_ops[0]); i++) {
+        ocl_host_op op = ocl_host_ops[i];
+
+        if (strcmp(op.name, name) != 0)
+            continue;
+        if (chain->n_ops && op.bpp != chain->bpp)
+            return -1;
+
+        if (op.add_value)
+            op.add = value < 0 ? 0 : value > 255 ? 255 : value;
+
+        chain->bpp = op.bpp;
+        chain->ops[chain->n_ops++] = op;
+        return 0;
+    }
+
+    return -1;
+}
+
+/* Set the value argument of the ops of chain that have one. */
+static inline void ocl_host_chain_set_value(ocl_host_chain *chain, int value)
+{
+    for (int i = 0; i < chain->n_ops; i++)
+        if (chain->ops[i].add_value)
+            chain->ops[i].add = value < 0 ? 0 : value > 255 ? 255 : value;
+}
+
+/* Rows [y0, y1) of an image of width pixels, rows stride bytes apart. */
+static void ocl_host_rows(const ocl_host_chain *chain, ocl_host_bytes_fn bytes,
+                          unsigned char *data, int width, size_t stride,
+                          int y0, int y1)
+{
+    for (int y = y0; y < y1; y++) {
+        unsigned char *row = data + (size_t)y * stride;
+
+        for (int i = 0; i < chain->n_ops; i++) {
+            const ocl_host_op *op = &chain->ops[i];
+            int n = op->left_half ? width / 2 : width;
+
+            if (op->row)
+                op->row(row, n);
+            else
+                bytes(op, row, (size_t)n * op->bpp);
+        }
+    }
+}
+
+/* ================= THREAD POOL ================= */
+
+/* Threads running the bands of one image at a time with the caller. */
+typedef struct {
+    pthread_t threads[OCL_HOST_MAX_THREADS];
+    int n_threads;
+    ocl_host_bytes_fn bytes;
+    const char *isa;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;      /* a new image, or stopping */
+    pthread_cond_t done_cond; /* a thread left the image */
+    unsigned long job;
+    int stopping;
+    int busy;
+
+    const ocl_host_chain *chain;
+    unsigned char *data;
+    int width;
+    int height;
+    size_t stride;
+    int next_row;
+} ocl_host_pool;
+
+/* Run bands of the current image until none is left, lock held. */
+static void ocl_host_pool_work(ocl_host_pool *p)
+{
+    while (p->next_row < p->height) {
+        int y0 = p->next_row;
+        int y1 = y0 + OCL_HOST_BAND_ROWS < p->height ? y0 + OCL_HOST_BAND_ROWS
+                                                     : p->height;
+
+        p->next_row = y1;
+        pthread_mutex_unlock(&p->lock);
+
+        ocl_host_rows(p->chain, p->bytes, p->data, p->width, p->stride, y0, y1);
+
+        pthread_mutex_lock(&p->lock);
+    }
+}
+
+static void *ocl_host_pool_thread(void *data)
+{
+    ocl_host_pool *p = data;
+    unsigned long seen = 0;
+
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+        while (p->job == seen && !p->stopping)
+            pthread_cond_wait(&p->cond, &p->lock);
+        if (p->stopping)
+            break;
+
+        seen = p->job;
+        p->busy++;
+        ocl_host_pool_work(p);
+        if (--p->busy == 0)
+            pthread_cond_broadcast(&p->done_cond);
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    return NULL;
+}
+
+/* Start n_threads - 1 threads, the caller being the last one. */
+static int ocl_host_pool_start(ocl_host_pool *p, int n_threads)
+{
+    memset(p, 0, sizeof(*p));
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+    pthread_cond_init(&p->done_cond, NULL);
+    p->bytes = ocl_host_select(&p->isa);
+
+    if (n_threads > OCL_HOST_MAX_THREADS)
+        n_threads = OCL_HOST_MAX_THREADS;
+
+    for (int i = 0; i < n_threads - 1; i++) {
+        if (pthread_create(&p->threads[i], NULL, ocl_host_pool_thread, p) != 0)
+            break;
+        p->n_threads++;
+    }
+
+    return 0;
+}
+
+static void ocl_host_pool_stop(ocl_host_pool *p)
+{
+    pthread_mutex_lock(&p->lock);
+    p->stopping = 1;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+
+    for (int i = 0; i < p->n_threads; i++)
+        pthread_join(p->threads[i], NULL);
+
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->cond);
+    pthread_cond_destroy(&p->done_cond);
+    p->n_threads = 0;
+}
+
+/* Apply chain to the image in place and return when it is done. */
+static void ocl_host_run(ocl_host_pool *p, const ocl_host_chain *chain,
+                         unsigned char *data, int width, int height,
+                         size_t stride)
+{
+    pthread_mutex_lock(&p->lock);
+    p->chain = chain;
+    p->data = data;
+    p->width = width;
+    p->height = height;
+    p->stride = stride;
+    p->next_row = 0;
+    p->job++;
+    pthread_cond_broadcast(&p->cond);
+
+    ocl_host_pool_work(p);
+
+    /* Threads still on their last band */
+    while (p->busy > 0)
+        pthread_cond_wait(&p->done_cond, &p->lock);
+    pthread_mutex_unlock(&p->lock);
+}
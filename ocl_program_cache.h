@@ -0,0 +1,429 @@
+#pragma once
+
+/*
+ * ocl_program_cache.h
+ *
+ * Persistent on-disk cache of OpenCL program binaries.
+ *
+ * Entries are keyed by a hash of the kernel source, the build options, the
+ * device name, the driver version and the platform version, so a driver
+ * upgrade or a source edit simply misses and rebuilds. Each entry is written
+ * to a temporary file and renamed into place; entries that fail to load or
+ * build are deleted and rebuilt from source.
+ */
+
+#include <CL/cl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define OCL_CACHE_MAGIC   "OCLBIN01"
+#define OCL_CACHE_SUFFIX  ".clbin"
+
+/* Hit/miss counters of a cache user. */
+typedef struct {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long stores;
+    unsigned long invalidations;
+} ocl_cache_stats;
+
+/* On-disk header in front of the program binary. */
+typedef struct {
+    char magic[8];
+    unsigned long long key;
+    unsigned long long check;
+    unsigned long long size;
+} ocl_cache_header;
+
+/* FNV-1a over a NUL terminated string, including the terminator. */
+static inline unsigned long long ocl_cache_hash(unsigned long long h,
+                                                const char *s)
+{
+    if (!s)
+        s = "";
+
+    do {
+        h ^= (unsigned char)*s;
+        h *= 0x100000001b3ULL;
+    } while (*s++);
+
+    return h;
+}
+
+/*
+ * Cache directory: $OCL_CACHE_DIR, else $XDG_CACHE_HOME/oscaroclshader,
+ * else $HOME/.cache/oscaroclshader, written into dir. Returns dir, or NULL
+ * if none can be derived.
+ */
+static inline const char *ocl_cache_default_dir(char *dir, size_t size)
+{
+    const char *env;
+
+    if ((env = getenv("OCL_CACHE_DIR")) && *env)
+        snprintf(dir, size, "%s", env);
+    else if ((env = getenv("XDG_CACHE_HOME")) && *env)
+        snprintf(dir, size, "%s/oscaroclshader", env);
+    else if ((env = getenv("HOME")) && *env)
+        snprintf(dir, size, "%s/.cache/oscaroclshader", env);
+    else
+        return NULL;
+
+    return dir;
+}
+
+/* mkdir -p */
+static inline int ocl_cache_mkdir(const char *path)
+{
+    char tmp[4096];
+    size_t len = strlen(path);
+
+    if (len == 0 || len >= sizeof(tmp))
+        return -1;
+
+    memcpy(tmp, path, len + 1);
+
+    for (char *p = tmp + 1; *p; p++) {
+        if (*p != '/')
+            continue;
+        *p = '\0';
+        if (mkdir(tmp, 0755) != 0 && errno != EEXIST)
+            return -1;
+        *p = '/';
+    }
+
+    if (mkdir(tmp, 0755) != 0 && errno != EEXIST)
+        return -1;
+
+    return 0;
+}
+
+/* Compute the key and check hashes of a program for a device. */
+static inline void ocl_cache_key(cl_device_id device, const char *source,
+                                 const char *options,
+                                 unsigned long long *key,
+                                 unsigned long long *check)
+{
+    char device_name[256] = "";
+    char driver[256] = "";
+    char platform_version[256] = "";
+    cl_platform_id platform = NULL;
+    unsigned long long h;
+
+    clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(device_name), device_name, NULL);
+    clGetDeviceInfo(device, CL_DRIVER_VERSION, sizeof(driver), driver, NULL);
+    if (clGetDeviceInfo(device, CL_DEVICE_PLATFORM, sizeof(platform),
+                        &platform, NULL) == CL_SUCCESS)
+        clGetPlatformInfo(platform, CL_PLATFORM_VERSION,
+                          sizeof(platform_version), platform_version, NULL);
+
+    h = 0xcbf29ce484222325ULL;
+    h = ocl_cache_hash(h, source);
+    h = ocl_cache_hash(h, options);
+    h = ocl_cache_hash(h, device_name);
+    h = ocl_cache_hash(h, driver);
+    h = ocl_cache_hash(h, platform_version);
+    *key = h;
+
+    /* Second hash with another seed and order guards against collisions */
+    h = 0x84222325cbf29ce4ULL;
+    h = ocl_cache_hash(h, platform_version);
+    h = ocl_cache_hash(h, driver);
+    h = ocl_cache_hash(h, device_name);
+    h = ocl_cache_hash(h, options);
+    h = ocl_cache_hash(h, source);
+    *check = h;
+}
+
+/* Path of entry key in cache_dir. -1 if it does not fit in size. */
+static inline int ocl_cache_path(char *path, size_t size,
+                                 const char *cache_dir,
+                                 unsigned long long key)
+{
+    int n = snprintf(path, size, "%s/%016llx" OCL_CACHE_SUFFIX,
+                     cache_dir, key);
+
+    return n < 0 || (size_t)n >= size ? -1 : 0;
+}
+
+/* Load a cached binary. Returns a malloc'ed buffer, or NULL on miss. */
+static inline unsigned char *ocl_cache_load(const char *path,
+                                            unsigned long long key,
+                                            unsigned long long check,
+                                            size_t *size, int *corrupt)
+{
+    ocl_cache_header hdr;
+    unsigned char *bin;
+    FILE *fp = fopen(path, "rb");
+
+    *corrupt = 0;
+    if (!fp)
+        return NULL;
+
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+        memcmp(hdr.magic, OCL_CACHE_MAGIC, sizeof(hdr.magic)) != 0 ||
+        hdr.key != key || hdr.check != check || hdr.size == 0) {
+        fclose(fp);
+        *corrupt = 1;
+        return NULL;
+    }
+
+    bin = malloc(hdr.size);
+    if (!bin || fread(bin, 1, hdr.size, fp) != hdr.size) {
+        free(bin);
+        fclose(fp);
+        *corrupt = 1;
+        return NULL;
+    }
+
+    fclose(fp);
+    *size = hdr.size;
+    return bin;
+}
+
+/* Write the binary of a built program, atomically replacing any entry. */
+static inline int ocl_cache_store(const char *path, cl_program program,
+                                  unsigned long long key,
+                                  unsigned long long check)
+{
+    ocl_cache_header hdr;
+    char tmp[4200];
+    size_t size = 0;
+    unsigned char *bin;
+    FILE *fp;
+    int fd, ok;
+
+    if (clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES,
+                         sizeof(size), &size, NULL) != CL_SUCCESS || size == 0)
+        return -1;
+
+    bin = malloc(size);
+    if (!bin)
+        return -1;
+
+    if (clGetProgramInfo(program, CL_PROGRAM_BINARIES,
+                         sizeof(bin), &bin, NULL) != CL_SUCCESS) {
+        free(bin);
+        return -1;
+    }
+
+    memcpy(hdr.magic, OCL_CACHE_MAGIC, sizeof(hdr.magic));
+    hdr.key = key;
+    hdr.check = check;
+    hdr.size = size;
+
+    /* Unique per writer, so concurrent stores of one key never collide */
+    snprintf(tmp, sizeof(tmp), "%s.tmp.XXXXXX", path);
+    fd = mkstemp(tmp);
+    if (fd < 0) {
+        free(bin);
+        return -1;
+    }
+    fp = fdopen(fd, "wb");
+    if (!fp) {
+        close(fd);
+        unlink(tmp);
+        free(bin);
+        return -1;
+    }
+
+    ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1 &&
+         fwrite(bin, 1, size, fp) == size;
+    ok = (fclose(fp) == 0) && ok;
+    free(bin);
+
+    if (!ok || rename(tmp, path) != 0) {
+        unlink(tmp);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Copy the build log of program into log. */
+static inline void ocl_cache_build_log(cl_program program,
+                                       cl_device_id device,
+                                       char *log, size_t log_size)
+{
+    if (!log || log_size == 0)
+        return;
+
+    log[0] = '\0';
+    clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG,
+                          log_size, log, NULL);
+    log[log_size - 1] = '\0';
+}
+
+/*
+ * Whether the kernels of program report the names of their arguments,
+ * which the spec only guarantees for programs built from source.
+ */
+static inline int ocl_cache_has_arg_info(cl_program program)
+{
+    cl_kernel *kernels;
+    cl_uint n = 0;
+    int ok = 1;
+
+    if (clCreateKernelsInProgram(program, 0, NULL, &n) != CL_SUCCESS || n == 0)
+        return 1;
+
+    kernels = malloc(n * sizeof(*kernels));
+    if (!kernels ||
+        clCreateKernelsInProgram(program, n, kernels, NULL) != CL_SUCCESS) {
+        free(kernels);
+        return 1;
+    }
+
+    for (cl_uint i = 0; i < n; i++) {
+        cl_uint n_args = 0;
+        char name[256];
+
+        if (ok && clGetKernelInfo(kernels[i], CL_KERNEL_NUM_ARGS,
+                                  sizeof(n_args), &n_args, NULL) == CL_SUCCESS &&
+            n_args > 0 &&
+            clGetKernelArgInfo(kernels[i], 0, CL_KERNEL_ARG_NAME,
+                               sizeof(name), name, NULL) != CL_SUCCESS)
+            ok = 0;
+        clReleaseKernel(kernels[i]);
+    }
+    free(kernels);
+
+    return ok;
+}
+
+/*
+ * Build source for device, reusing a cached binary from cache_dir when
+ * one matches. With -cl-kernel-arg-info in options a binary whose
+ * kernels lost their argument info is not used. A NULL or empty cache_dir disables the cache. On a build
+ * error NULL is returned, *errcode is set and the build log is copied
+ * into log.
+ */
+static inline cl_program ocl_cache_build_program(cl_context context,
+                                                 cl_device_id device,
+                                                 const char *source,
+                                                 const char *options,
+                                                 const char *cache_dir,
+                                                 ocl_cache_stats *stats,
+                                                 char *log, size_t log_size,
+                                                 cl_int *errcode)
+{
+    unsigned long long key = 0, check = 0;
+    char path[4096];
+    cl_program program;
+    cl_int err, status;
+    int use_cache = cache_dir && *cache_dir;
+    int store = 1;
+
+    if (log && log_size)
+        log[0] = '\0';
+
+    if (use_cache) {
+        ocl_cache_key(device, source, options, &key, &check);
+
+        /* An over-long cache directory is a miss, never stored */
+        if (ocl_cache_path(path, sizeof(path), cache_dir, key) != 0) {
+            if (stats)
+                stats->misses++;
+            use_cache = 0;
+        }
+    }
+
+    if (use_cache) {
+        unsigned char *bin;
+        size_t size = 0;
+        int corrupt;
+
+        bin = ocl_cache_load(path, key, check, &size, &corrupt);
+        if (bin) {
+            program = clCreateProgramWithBinary(context, 1, &device, &size,
+                                                (const unsigned char **)&bin,
+                                                &status, &err);
+            free(bin);
+
+            if (err == CL_SUCCESS && status == CL_SUCCESS) {
+                err = clBuildProgram(program, 1, &device, options, NULL, NULL);
+                if (err == CL_SUCCESS &&
+                    options && strstr(options, "-cl-kernel-arg-info") &&
+                    !ocl_cache_has_arg_info(program)) {
+                    /* The runtime keeps no argument info in binaries:
+                     * build from source, storing would not help */
+                    clReleaseProgram(program);
+                    program = NULL;
+                    store = 0;
+                } else if (err == CL_SUCCESS) {
+                    if (stats)
+                        stats->hits++;
+                    *errcode = CL_SUCCESS;
+                    return program;
+                }
+            }
+
+            /* Rejected by the runtime: drop the entry and rebuild */
+            if (program)
+                clReleaseProgram(program);
+            corrupt = store;
+        }
+
+        if (corrupt) {
+            unlink(path);
+            if (stats)
+                stats->invalidations++;
+        }
+
+        if (stats)
+            stats->misses++;
+    }
+
+    program = clCreateProgramWithSource(context, 1, &source, NULL, &err);
+    if (err != CL_SUCCESS) {
+        *errcode = err;
+        return NULL;
+    }
+
+    err = clBuildProgram(program, 1, &device, options, NULL, NULL);
+    if (err != CL_SUCCESS) {
+        ocl_cache_build_log(program, device, log, log_size);
+        clReleaseProgram(program);
+        *errcode = err;
+        return NULL;
+    }
+
+    if (use_cache && store && ocl_cache_mkdir(cache_dir) == 0 &&
+        ocl_cache_store(path, program, key, check) == 0 && stats)
+        stats->stores++;
+
+    *errcode = CL_SUCCESS;
+    return program;
+}
+
+/* Remove every cache entry in cache_dir. Returns the number removed. */
+static inline int ocl_cache_clear(const char *cache_dir)
+{
+    char path[4096];
+    struct dirent *ent;
+    size_t suffix = strlen(OCL_CACHE_SUFFIX);
+    int removed = 0;
+    DIR *dir = opendir(cache_dir);
+
+    if (!dir)
+        return 0;
+
+    while ((ent = readdir(dir))) {
+        size_t len = strlen(ent->d_name);
+
+        if (len <= suffix ||
+            strcmp(ent->d_name + len - suffix, OCL_CACHE_SUFFIX) != 0)
+            continue;
+
+        snprintf(path, sizeof(path), "%s/%s", cache_dir, ent->d_name);
+        if (unlink(path) == 0)
+            removed++;
+    }
+
+    closedir(dir);
+    return removed;
+}
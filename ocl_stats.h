@@ -0,0 +1,108 @@
+#pragma once
+
+/*
+ * ocl_stats.h
+ *
+ * Running timing statistics fed from OpenCL profiling events.
+ *
+ * Every statistic keeps min/max/average over all samples and the last
+ * OCL_STATS_WINDOW samples for percentiles. Times are in microseconds.
+ */
+
+#include <CL/cl.h>
+#include <float.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define OCL_STATS_WINDOW 1024
+
+typedef struct {
+    unsigned long long count;
+    double min;
+    double max;
+    double sum;
+
+    /* Ring of the most recent samples */
+    double window[OCL_STATS_WINDOW];
+    unsigned int n_window;
+    unsigned int pos;
+} ocl_stat;
+
+static inline void ocl_stat_reset(ocl_stat *stat)
+{
+    memset(stat, 0, sizeof(*stat));
+    stat->min = DBL_MAX;
+}
+
+static inline void ocl_stat_add(ocl_stat *stat, double us)
+{
+    stat->count++;
+    stat->sum += us;
+    if (us < stat->min)
+        stat->min = us;
+    if (us > stat->max)
+        stat->max = us;
+
+    stat->window[stat->pos] = us;
+    stat->pos = (stat->pos + 1) % OCL_STATS_WINDOW;
+    if (stat->n_window < OCL_STATS_WINDOW)
+        stat->n_window++;
+}
+
+static inline double ocl_stat_min(const ocl_stat *stat)
+{
+    return stat->count ? stat->min : 0.0;
+}
+
+static inline double ocl_stat_avg(const ocl_stat *stat)
+{
+    return stat->count ? stat->sum / stat->count : 0.0;
+}
+
+static inline int ocl_stat_cmp(const void *a, const void *b)
+{
+    double da = *(const double *)a, db = *(const double *)b;
+
+    return (da > db) - (da < db);
+}
+
+/* p-th percentile (0..100) of the recent samples, nearest rank. */
+static inline double ocl_stat_percentile(const ocl_stat *stat, double p)
+{
+    double sorted[OCL_STATS_WINDOW];
+    unsigned int rank;
+
+    if (stat->n_window == 0)
+        return 0.0;
+
+    memcpy(sorted, stat->window, stat->n_window * sizeof(double));
+    qsort(sorted, stat->n_window, sizeof(double), ocl_stat_cmp);
+
+    rank = (unsigned int)(p / 100.0 * stat->n_window + 0.5);
+    if (rank > 0)
+        rank--;
+    if (rank >= stat->n_window)
+        rank = stat->n_window - 1;
+
+    return sorted[rank];
+}
+
+/* Profiling timestamp of evt in ns, 0 if unavailable. */
+static inline cl_ulong ocl_event_time(cl_event evt, cl_profiling_info info)
+{
+    cl_ulong t = 0;
+
+    if (!evt || clGetEventProfilingInfo(evt, info, sizeof(t), &t, NULL) != CL_SUCCESS)
+        return 0;
+
+    return t;
+}
+
+/* Microseconds between two profiling timestamps, negative if unknown. */
+static inline double ocl_event_interval_us(cl_ulong from, cl_ulong to)
+{
+    if (!from || !to || to < from)
+        return -1.0;
+
+    return (to - from) / 1000.0;
+}
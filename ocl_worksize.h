@@ -0,0 +1,272 @@
+#pragma once
+
+/*
+ * ocl_worksize.h
+ *
+ * Work-group size autotuning with a persistent per-device table.
+ *
+ * Candidate local sizes are benchmarked with profiling events and the
+ * fastest is kept in OCL_WS_TABLE inside the cache directory, keyed by a
+ * hash of the device name, the driver version, the program source, the
+ * kernel and the global size, so later runs start tuned and an edited
+ * kernel is tuned again. Global sizes are padded to a multiple
+ * of the local size: tuned kernels must bounds-check their global id.
+ */
+
+#include <CL/cl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ocl_program_cache.h"
+
+#define OCL_WS_TABLE          "worksize.tbl"
+#define OCL_WS_MAX_CANDIDATES 48
+#define OCL_WS_REPS           3
+
+/* Key of a kernel of the program source at a global size on a device. */
+static unsigned long long ocl_ws_key(cl_device_id device, const char *source,
+                                     const char *kernel_id,
+                                     cl_uint dims, const size_t *global)
+{
+    char device_name[256] = "";
+    char driver[256] = "";
+    char size[64];
+    unsigned long long h = 0xcbf29ce484222325ULL;
+
+    clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(device_name), device_name, NULL);
+    clGetDeviceInfo(device, CL_DRIVER_VERSION, sizeof(driver), driver, NULL);
+    snprintf(size, sizeof(size), "%ux%zux%zu", dims, global[0],
+             dims > 1 ? global[1] : (size_t)1);
+
+    h = ocl_cache_hash(h, device_name);
+    h = ocl_cache_hash(h, driver);
+    h = ocl_cache_hash(h, source);
+    h = ocl_cache_hash(h, kernel_id);
+    h = ocl_cache_hash(h, size);
+
+    return h;
+}
+
+/* Round global up to a multiple of local; local[0] == 0 means no padding. */
+static void ocl_ws_pad_global(cl_uint dims, const size_t *global,
+                              const size_t *local, size_t *padded)
+{
+    for (cl_uint i = 0; i < dims; i++) {
+        if (local[0] == 0 || local[i] == 0)
+            padded[i] = global[i];
+        else
+            padded[i] = (global[i] + local[i] - 1) / local[i] * local[i];
+    }
+}
+
+/*
+ * Candidate local sizes for kernel, multiples of its preferred work-group
+ * size multiple within the device limits. The first candidate {0, 0}
+ * leaves the choice to the driver. Returns the number of candidates.
+ */
+static int ocl_ws_candidates(cl_kernel kernel, cl_device_id device, cl_uint dims,
+                             size_t out[][2], int max)
+{
+    static const size_t xs[] = { 8, 16, 32, 64, 128, 256, 512, 1024 };
+    static const size_t ys[] = { 1, 2, 4, 8, 16, 32 };
+    size_t max_wg = 0, multiple = 1;
+    size_t max_items[3] = { 0, 0, 0 };
+    int n = 0;
+
+    clGetKernelWorkGroupInfo(kernel, device, CL_KERNEL_WORK_GROUP_SIZE,
+                             sizeof(max_wg), &max_wg, NULL);
+    clGetKernelWorkGroupInfo(kernel, device,
+                             CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE,
+                             sizeof(multiple), &multiple, NULL);
+    clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_ITEM_SIZES,
+                    sizeof(max_items), max_items, NULL);
+    if (multiple == 0)
+        multiple = 1;
+
+    out[n][0] = 0;
+    out[n][1] = 0;
+    n++;
+
+    for (size_t i = 0; i < sizeof(xs) / sizeof(xs[0]); i++) {
+        for (size_t j = 0; j < (dims > 1 ? sizeof(ys) / sizeof(ys[0]) : 1); j++) {
+            size_t lx = xs[i], ly = dims > 1 ? ys[j] : 1;
+
+            if (n >= max)
+                return n;
+            if (lx * ly > max_wg || (lx * ly) % multiple != 0)
+                continue;
+            if ((max_items[0] && lx > max_items[0]) ||
+                (dims > 1 && max_items[1] && ly > max_items[1]))
+                continue;
+
+            out[n][0] = lx;
+            out[n][1] = ly;
+            n++;
+        }
+    }
+
+    return n;
+}
+
+/*
+ * Best of reps runs of kernel with the given local size (NULL when
+ * local[0] == 0), in microseconds. The queue must have profiling enabled.
+ * Returns a negative value if the launch is rejected.
+ */
+static double ocl_ws_time_kernel(cl_command_queue queue, cl_kernel kernel,
+                                 cl_uint dims, const size_t *global,
+                                 const size_t *local, int reps)
+{
+    size_t padded[3];
+    double best = -1.0;
+
+    ocl_ws_pad_global(dims, global, local, padded);
+
+    /* Warm-up run, also rejects invalid sizes */
+    if (clEnqueueNDRangeKernel(queue, kernel, dims, NULL, padded,
+                               local[0] ? local : NULL,
+                               0, NULL, NULL) != CL_SUCCESS ||
+        clFinish(queue) != CL_SUCCESS)
+        return -1.0;
+
+    for (int r = 0; r < reps; r++) {
+        cl_event evt;
+        cl_ulong start = 0, end = 0;
+
+        if (clEnqueueNDRangeKernel(queue, kernel, dims, NULL, padded,
+                                   local[0] ? local : NULL,
+                                   0, NULL, &evt) != CL_SUCCESS)
+            return -1.0;
+
+        clWaitForEvents(1, &evt);
+        clGetEventProfilingInfo(evt, CL_PROFILING_COMMAND_START,
+                                sizeof(start), &start, NULL);
+        clGetEventProfilingInfo(evt, CL_PROFILING_COMMAND_END,
+                                sizeof(end), &end, NULL);
+        clReleaseEvent(evt);
+
+        if (end > start && (best < 0 || (end - start) / 1000.0 < best))
+            best = (end - start) / 1000.0;
+    }
+
+    return best;
+}
+
+/*
+ * Benchmark every candidate of kernel, whose arguments must be set, and
+ * store the fastest local size in local. Returns the number of candidates
+ * that ran, 0 if none did (local is then {0, 0}).
+ */
+static int ocl_ws_tune(cl_command_queue queue, cl_kernel kernel,
+                       cl_device_id device, cl_uint dims, const size_t *global,
+                       size_t local[2], double *best_us)
+{
+    size_t candidates[OCL_WS_MAX_CANDIDATES][2];
+    int n, ran = 0;
+    double best = -1.0;
+
+    local[0] = local[1] = 0;
+
+    n = ocl_ws_candidates(kernel, device, dims, candidates, OCL_WS_MAX_CANDIDATES);
+
+    for (int i = 0; i < n; i++) {
+        double us = ocl_ws_time_kernel(queue, kernel, dims, global,
+                                       candidates[i], OCL_WS_REPS);
+        if (us < 0)
+            continue;
+
+        ran++;
+        if (best < 0 || us < best) {
+            best = us;
+            local[0] = candidates[i][0];
+            local[1] = candidates[i][1];
+        }
+    }
+
+    if (best_us)
+        *best_us = best;
+
+    return ran;
+}
+
+/* Look key up in the table of cache_dir. Returns 0 and fills local on hit. */
+static int ocl_ws_lookup(const char *cache_dir, unsigned long long key,
+                         size_t local[2])
+{
+    char path[4096], line[1024];
+    FILE *fp;
+    int found = -1;
+
+    if (!cache_dir || !*cache_dir)
+        return -1;
+
+    snprintf(path, sizeof(path), "%s/" OCL_WS_TABLE, cache_dir);
+    fp = fopen(path, "r");
+    if (!fp)
+        return -1;
+
+    while (found != 0 && fgets(line, sizeof(line), fp)) {
+        unsigned long long k;
+        size_t lx, ly;
+
+        if (line[0] == '#')
+            continue;
+        if (sscanf(line, "%llx %zu %zu", &k, &lx, &ly) == 3 && k == key) {
+            local[0] = lx;
+            local[1] = ly;
+            found = 0;
+        }
+    }
+
+    fclose(fp);
+    return found;
+}
+
+/*
+ * Record the tuned local size of key, replacing any previous entry.
+ * desc is a human readable comment kept on the line.
+ */
+static int ocl_ws_store(const char *cache_dir, unsigned long long key,
+                        const size_t local[2], double us, const char *desc)
+{
+    char path[4096], tmp[4200], line[1024];
+    FILE *in, *out;
+    int ok;
+
+    if (!cache_dir || !*cache_dir || ocl_cache_mkdir(cache_dir) != 0)
+        return -1;
+
+    snprintf(path, sizeof(path), "%s/" OCL_WS_TABLE, cache_dir);
+    snprintf(tmp, sizeof(tmp), "%s.tmp.%ld", path, (long)getpid());
+
+    out = fopen(tmp, "w");
+    if (!out)
+        return -1;
+
+    fprintf(out, "# key local-x local-y best-us description\n");
+
+    /* Copy the other entries */
+    in = fopen(path, "r");
+    if (in) {
+        while (fgets(line, sizeof(line), in)) {
+            unsigned long long k;
+
+            if (line[0] == '#' || (sscanf(line, "%llx", &k) == 1 && k == key))
+                continue;
+            fputs(line, out);
+        }
+        fclose(in);
+    }
+
+    fprintf(out, "%016llx %zu %zu %.1f %s\n", key, local[0], local[1], us,
+            desc ? desc : "");
+
+    ok = fclose(out) == 0;
+    if (!ok || rename(tmp, path) != 0) {
+        unlink(tmp);
+        return -1;
+    }
+
+    return 0;
+}
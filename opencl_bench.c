@@ -0,0 +1,592 @@
+/*
+ * opencl_bench.c
+ *
+ * Micro-benchmark of the kernels in devide_by_two.cl, nv12_half_left.cl and
+ * invert.cl at 720p, 1080p, 4K and 8K on one OpenCL device (a CPU ICD such
+ * as PoCL works). For every kernel and size it reports the upload, kernel
+ * and download times from profiling events, MPix/s and the effective
+ * bandwidth, as JSON. With --baseline the kernel times are compared against
+ * the entries of the same device in an earlier result file and regressions
+ * fail the run.
+ *
+ * Build: make opencl_bench
+ */
+
+#include <CL/cl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "load_shader_file.h"
+#include "ocl_program_cache.h"
+#include "ocl_stats.h"
+
+#define BENCH_DEFAULT_ITERATIONS 20
+#define BENCH_DEFAULT_TOLERANCE  10.0 /* percent */
+
+/* Argument layout of a kernel, which also fixes its NDRange. */
+typedef enum {
+    ARGS_RGBA_WIDTH_TOTAL,  /* (uchar4 *img, int width, int total), 1D */
+    ARGS_RGBA_TOTAL_VALUE,  /* (uchar4 *img, int total, uchar value), 1D */
+    ARGS_RGBA_TOTAL,        /* (uchar4 *img, int total), 1D */
+    ARGS_RGBA_ROWS,         /* (uchar *img, int width, int height), 4 px/item */
+    ARGS_RGBA_IN_OUT,       /* (uchar4 *in, uchar4 *out, int width, int height) */
+    ARGS_LUMA,              /* (uchar *y, int width, int height, int stride) */
+} bench_args;
+
+typedef struct {
+    const char *name;
+    bench_args args;
+} bench_kernel;
+
+typedef struct {
+    const char *file;
+    const bench_kernel *kernels;
+} bench_file;
+
+static const bench_kernel rgba_kernels[] = {
+    { "devide_by_two",           ARGS_RGBA_WIDTH_TOTAL },
+    { "increase_brightness",     ARGS_RGBA_TOTAL_VALUE },
+    { "grayscale",               ARGS_RGBA_TOTAL },
+    { "invert_colors",           ARGS_RGBA_TOTAL },
+    { "left_half_grayscale",     ARGS_RGBA_WIDTH_TOTAL },
+    { "devide_by_two_v16",       ARGS_RGBA_ROWS },
+    { "left_half_grayscale_v16", ARGS_RGBA_ROWS },
+    { NULL }
+};
+
+static const bench_kernel nv12_kernels[] = {
+    { "nv12_half_left",   ARGS_LUMA },
+    { "nv12_invert_left", ARGS_LUMA },
+    { "nv12_bright_left", ARGS_LUMA },
+    { NULL }
+};
+
+static const bench_kernel invert_kernels[] = {
+    { "invert_image", ARGS_RGBA_IN_OUT },
+    { NULL }
+};
+
+static const bench_file bench_files[] = {
+    { "devide_by_two.cl",  rgba_kernels },
+    { "nv12_half_left.cl", nv12_kernels },
+    { "invert.cl",         invert_kernels },
+};
+
+typedef struct {
+    const char *name;
+    int width;
+    int height;
+} bench_size;
+
+static const bench_size bench_sizes[] = {
+    { "720p",  1280,  720 },
+    { "1080p", 1920, 1080 },
+    { "4k",    3840, 2160 },
+    { "8k",    7680, 4320 },
+};
+
+#define N_ELEMENTS(a) (sizeof(a) / sizeof((a)[0]))
+
+/* One kernel at one size. Times in microseconds. */
+typedef struct {
+    const char *file;
+    const char *kernel;
+    const char *size;
+    int width;
+    int height;
+    double upload_us;
+    double kernel_us;     /* median */
+    double kernel_min_us;
+    double kernel_p99_us;
+    double download_us;
+    double mpix_s;
+    double gbps;
+    double baseline_us;   /* < 0 without a baseline entry */
+    int regression;
+} bench_result;
+
+typedef struct {
+    cl_device_type device_type;
+    const char *sizes;    /* comma separated names, NULL for all */
+    int iterations;
+    const char *out;
+    const char *baseline;
+    double tolerance;
+    const char *kernel_dir;
+} bench_options;
+
+static void usage(const char *prog)
+{
+    printf("Usage: %s [options]\n"
+           "  --device cpu|gpu|all   device type (default: all, first found)\n"
+           "  --sizes LIST           comma separated of 720p,1080p,4k,8k\n"
+           "  --iterations N         timed kernel runs (default %d)\n"
+           "  --kernel-dir DIR       directory of the .cl files (default .)\n"
+           "  --out FILE             write the JSON there instead of stdout\n"
+           "  --baseline FILE        compare with an earlier JSON result\n"
+           "                         of the same device\n"
+           "  --tolerance PCT        allowed slowdown (default %.0f%%)\n",
+           prog, BENCH_DEFAULT_ITERATIONS, BENCH_DEFAULT_TOLERANCE);
+}
+
+static int size_selected(const bench_options *opt, const char *name)
+{
+    const char *p = opt->sizes;
+    size_t len = strlen(name);
+
+    if (!p)
+        return 1;
+
+    while (*p) {
+        if (strncmp(p, name, len) == 0 && (p[len] == ',' || p[len] == '\0'))
+            return 1;
+        p = strchr(p, ',');
+        if (!p)
+            break;
+        p++;
+    }
+
+    return 0;
+}
+
+/* First device of type on any platform. */
+static cl_device_id find_device(cl_device_type type)
+{
+    cl_platform_id platforms[16];
+    cl_uint n_platforms = 0;
+
+    if (clGetPlatformIDs(16, platforms, &n_platforms) != CL_SUCCESS)
+        return NULL;
+
+    for (cl_uint i = 0; i < n_platforms && i < 16; i++) {
+        cl_device_id device;
+
+        if (clGetDeviceIDs(platforms[i], type, 1, &device, NULL) == CL_SUCCESS)
+            return device;
+    }
+
+    return NULL;
+}
+
+/* Deterministic frame content. */
+static void fill_frame(unsigned char *data, size_t size)
+{
+    for (size_t i = 0; i < size; i++)
+        data[i] = (unsigned char)(i * 7 + (i >> 12));
+}
+
+/*
+ * Kernel time of the baseline entry of device, kernel and size, read from
+ * a file written by this tool (one result object per line). Returns < 0
+ * if there is none.
+ */
+static double baseline_lookup(const char *path, const char *device,
+                              const char *kernel, const char *size)
+{
+    char line[2048], pattern_d[320], pattern_k[256], pattern_s[64];
+    double us = -1.0;
+    FILE *fp = fopen(path, "r");
+
+    if (!fp)
+        return -1.0;
+
+    snprintf(pattern_d, sizeof(pattern_d), "\"device\": \"%s\"", device);
+    snprintf(pattern_k, sizeof(pattern_k), "\"kernel\": \"%s\"", kernel);
+    snprintf(pattern_s, sizeof(pattern_s), "\"size\": \"%s\"", size);
+
+    while (fgets(line, sizeof(line), fp)) {
+        const char *p;
+
+        if (!strstr(line, pattern_d) || !strstr(line, pattern_k) ||
+            !strstr(line, pattern_s))
+            continue;
+
+        p = strstr(line, "\"kernel_us\": ");
+        if (p && sscanf(p + strlen("\"kernel_us\": "), "%lf", &us) == 1)
+            break;
+    }
+
+    fclose(fp);
+    return us;
+}
+
+/* Set the arguments of kernel for a frame and fill in its NDRange. */
+static cl_int set_args(cl_kernel kernel, bench_args args, cl_mem *in,
+                       cl_mem *out, int width, int height, int stride,
+                       cl_uint *dims, size_t global[2])
+{
+    int total = width * height;
+    cl_uchar value = 40;
+    cl_int err = CL_SUCCESS;
+
+    err |= clSetKernelArg(kernel, 0, sizeof(cl_mem), in);
+
+    switch (args) {
+    case ARGS_RGBA_WIDTH_TOTAL:
+        err |= clSetKernelArg(kernel, 1, sizeof(int), &width);
+        err |= clSetKernelArg(kernel, 2, sizeof(int), &total);
+        break;
+    case ARGS_RGBA_TOTAL_VALUE:
+        err |= clSetKernelArg(kernel, 1, sizeof(int), &total);
+        err |= clSetKernelArg(kernel, 2, sizeof(cl_uchar), &value);
+        break;
+    case ARGS_RGBA_TOTAL:
+        err |= clSetKernelArg(kernel, 1, sizeof(int), &total);
+        break;
+    case ARGS_RGBA_ROWS:
+        err |= clSetKernelArg(kernel, 1, sizeof(int), &width);
+        err |= clSetKernelArg(kernel, 2, sizeof(int), &height);
+        break;
+    case ARGS_RGBA_IN_OUT:
+        err |= clSetKernelArg(kernel, 1, sizeof(cl_mem), out);
+        err |= clSetKernelArg(kernel, 2, sizeof(int), &width);
+        err |= clSetKernelArg(kernel, 3, sizeof(int), &height);
+        break;
+    case ARGS_LUMA:
+        err |= clSetKernelArg(kernel, 1, sizeof(int), &width);
+        err |= clSetKernelArg(kernel, 2, sizeof(int), &height);
+        err |= clSetKernelArg(kernel, 3, sizeof(int), &stride);
+        break;
+    }
+
+    switch (args) {
+    case ARGS_RGBA_WIDTH_TOTAL:
+    case ARGS_RGBA_TOTAL_VALUE:
+    case ARGS_RGBA_TOTAL:
+        *dims = 1;
+        global[0] = total;
+        global[1] = 1;
+        break;
+    case ARGS_RGBA_ROWS:
+        *dims = 2;
+        global[0] = (width + 3) / 4;
+        global[1] = height;
+        break;
+    default:
+        *dims = 2;
+        global[0] = width;
+        global[1] = height;
+        break;
+    }
+
+    return err;
+}
+
+/* Duration of evt in microseconds, releasing it. */
+static double event_us(cl_event evt)
+{
+    double us;
+
+    clWaitForEvents(1, &evt);
+    us = ocl_event_interval_us(ocl_event_time(evt, CL_PROFILING_COMMAND_START),
+                               ocl_event_time(evt, CL_PROFILING_COMMAND_END));
+    clReleaseEvent(evt);
+
+    return us;
+}
+
+/*
+ * Upload a frame, run kernel iterations times and download the result.
+ * Returns 0 and fills res on success.
+ */
+static int run_one(cl_context context, cl_command_queue queue,
+                   cl_kernel kernel, bench_args args, int width, int height,
+                   int iterations, bench_result *res)
+{
+    int luma = args == ARGS_LUMA;
+    int stride = luma ? (width + 63) / 64 * 64 : width * 4;
+    /* NV12 frames carry the chroma plane, the kernels touch luma only */
+    size_t frame_size = luma ? (size_t)stride * height * 3 / 2
+                             : (size_t)stride * height;
+    size_t touched = luma ? (size_t)width * height : (size_t)width * height * 4;
+    unsigned char *host = malloc(frame_size);
+    cl_mem in = NULL, out = NULL;
+    cl_event evt;
+    cl_uint dims;
+    size_t global[2];
+    ocl_stat stat;
+    cl_int err;
+    int ret = -1;
+
+    if (!host)
+        return -1;
+    fill_frame(host, frame_size);
+    ocl_stat_reset(&stat);
+
+    in = clCreateBuffer(context, CL_MEM_READ_WRITE, frame_size, NULL, &err);
+    if (err != CL_SUCCESS)
+        goto out;
+    out = args == ARGS_RGBA_IN_OUT
+          ? clCreateBuffer(context, CL_MEM_READ_WRITE, frame_size, NULL, &err)
+          : NULL;
+    if (err != CL_SUCCESS)
+        goto out;
+
+    err = clEnqueueWriteBuffer(queue, in, CL_FALSE, 0, frame_size, host,
+                               0, NULL, &evt);
+    if (err != CL_SUCCESS)
+        goto out;
+    res->upload_us = event_us(evt);
+
+    err = set_args(kernel, args, &in, &out, width, height, stride, &dims, global);
+    if (err != CL_SUCCESS)
+        goto out;
+
+    /* Warm-up, also the first touch of the buffers on CPU devices */
+    err = clEnqueueNDRangeKernel(queue, kernel, dims, NULL, global, NULL,
+                                 0, NULL, NULL);
+    if (err != CL_SUCCESS || clFinish(queue) != CL_SUCCESS)
+        goto out;
+
+    for (int i = 0; i < iterations; i++) {
+        double us;
+
+        err = clEnqueueNDRangeKernel(queue, kernel, dims, NULL, global, NULL,
+                                     0, NULL, &evt);
+        if (err != CL_SUCCESS)
+            goto out;
+
+        us = event_us(evt);
+        if (us >= 0)
+            ocl_stat_add(&stat, us);
+    }
+
+    err = clEnqueueReadBuffer(queue, out ? out : in, CL_FALSE, 0, frame_size,
+                              host, 0, NULL, &evt);
+    if (err != CL_SUCCESS)
+        goto out;
+    res->download_us = event_us(evt);
+
+    res->kernel_us = ocl_stat_percentile(&stat, 50);
+    res->kernel_min_us = ocl_stat_min(&stat);
+    res->kernel_p99_us = ocl_stat_percentile(&stat, 99);
+
+    /* Effective bandwidth: every touched byte read once and written once */
+    if (res->kernel_us > 0) {
+        res->mpix_s = (double)width * height / res->kernel_us;
+        res->gbps = 2.0 * touched / (res->kernel_us * 1e3);
+    }
+    ret = 0;
+
+out:
+    if (err != CL_SUCCESS)
+        fprintf(stderr, "%s failed (%d)\n", res->kernel, err);
+    if (in)
+        clReleaseMemObject(in);
+    if (out)
+        clReleaseMemObject(out);
+    free(host);
+
+    return ret;
+}
+
+static void write_json(FILE *fp, cl_device_id device, int iterations,
+                       const bench_result *results, int n)
+{
+    char device_name[256] = "", driver[256] = "", version[256] = "";
+
+    clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(device_name), device_name, NULL);
+    clGetDeviceInfo(device, CL_DRIVER_VERSION, sizeof(driver), driver, NULL);
+    clGetDeviceInfo(device, CL_DEVICE_VERSION, sizeof(version), version, NULL);
+
+    fprintf(fp, "{\n");
+    fprintf(fp, "  \"device\": \"%s\",\n", device_name);
+    fprintf(fp, "  \"driver\": \"%s\",\n", driver);
+    fprintf(fp, "  \"version\": \"%s\",\n", version);
+    fprintf(fp, "  \"timestamp\": %ld,\n", (long)time(NULL));
+    fprintf(fp, "  \"iterations\": %d,\n", iterations);
+    fprintf(fp, "  \"results\": [\n");
+
+    /* One object per line, baseline_lookup() relies on it */
+    for (int i = 0; i < n; i++) {
+        const bench_result *r = &results[i];
+
+        fprintf(fp, "    {\"device\": \"%s\", \"file\": \"%s\", "
+                "\"kernel\": \"%s\", \"size\": \"%s\", "
+                "\"width\": %d, \"height\": %d, "
+                "\"upload_us\": %.1f, \"kernel_us\": %.1f, "
+                "\"kernel_min_us\": %.1f, \"kernel_p99_us\": %.1f, "
+                "\"download_us\": %.1f, \"transfer_ratio\": %.2f, "
+                "\"mpix_s\": %.1f, \"gbps\": %.2f",
+                device_name, r->file, r->kernel, r->size, r->width, r->height,
+                r->upload_us, r->kernel_us, r->kernel_min_us, r->kernel_p99_us,
+                r->download_us,
+                r->kernel_us > 0 ? (r->upload_us + r->download_us) / r->kernel_us : 0.0,
+                r->mpix_s, r->gbps);
+        if (r->baseline_us >= 0)
+            fprintf(fp, ", \"baseline_us\": %.1f, \"regression\": %s",
+                    r->baseline_us, r->regression ? "true" : "false");
+        fprintf(fp, "}%s\n", i + 1 < n ? "," : "");
+    }
+
+    fprintf(fp, "  ]\n}\n");
+}
+
+int main(int argc, char **argv)
+{
+    bench_options opt = {
+        CL_DEVICE_TYPE_ALL, NULL, BENCH_DEFAULT_ITERATIONS, NULL, NULL,
+        BENCH_DEFAULT_TOLERANCE, "."
+    };
+    bench_result *results;
+    int n_results = 0, regressions = 0, unmatched = 0;
+    char device_name[256] = "";
+    cl_device_id device;
+    cl_context context;
+    cl_command_queue queue;
+    cl_int err;
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *val = i + 1 < argc ? argv[i + 1] : NULL;
+
+        if (strcmp(arg, "--device") == 0 && val) {
+            opt.device_type = strcmp(val, "cpu") == 0 ? CL_DEVICE_TYPE_CPU :
+                              strcmp(val, "gpu") == 0 ? CL_DEVICE_TYPE_GPU :
+                                                        CL_DEVICE_TYPE_ALL;
+        } else if (strcmp(arg, "--sizes") == 0 && val) {
+            opt.sizes = val;
+        } else if (strcmp(arg, "--iterations") == 0 && val) {
+            opt.iterations = atoi(val) > 0 ? atoi(val) : 1;
+        } else if (strcmp(arg, "--kernel-dir") == 0 && val) {
+            opt.kernel_dir = val;
+        } else if (strcmp(arg, "--out") == 0 && val) {
+            opt.out = val;
+        } else if (strcmp(arg, "--baseline") == 0 && val) {
+            opt.baseline = val;
+        } else if (strcmp(arg, "--tolerance") == 0 && val) {
+            opt.tolerance = atof(val);
+        } else {
+            usage(argv[0]);
+            return -1;
+        }
+        i++;
+    }
+
+    /* 1. Device, context, profiling queue */
+    device = find_device(opt.device_type);
+    if (!device) {
+        fprintf(stderr, "No OpenCL device of the requested type\n");
+        return -1;
+    }
+    clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(device_name), device_name, NULL);
+
+    context = clCreateContext(NULL, 1, &device, NULL, NULL, &err);
+    if (err != CL_SUCCESS) {
+        fprintf(stderr, "clCreateContext failed: %d\n", err);
+        return -1;
+    }
+    queue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &err);
+    if (err != CL_SUCCESS) {
+        fprintf(stderr, "clCreateCommandQueue failed: %d\n", err);
+        return -1;
+    }
+
+    int n_kernels = 0;
+
+    for (size_t f = 0; f < N_ELEMENTS(bench_files); f++)
+        for (const bench_kernel *k = bench_files[f].kernels; k->name; k++)
+            n_kernels++;
+
+    results = calloc(n_kernels * N_ELEMENTS(bench_sizes), sizeof(bench_result));
+
+    /* 2. Every kernel of every file at every size */
+    for (size_t f = 0; f < N_ELEMENTS(bench_files); f++) {
+        char path[4096], log[16384], cache_dir[4096];
+        char *src;
+        cl_program program;
+
+        snprintf(path, sizeof(path), "%s/%s", opt.kernel_dir, bench_files[f].file);
+        src = load_file(path);
+        if (!src) {
+            fprintf(stderr, "Cannot read %s\n", path);
+            continue;
+        }
+
+        program = ocl_cache_build_program(context, device, src, NULL,
+                                          ocl_cache_default_dir(cache_dir,
+                                                                sizeof(cache_dir)),
+                                          NULL, log, sizeof(log), &err);
+        free(src);
+        if (!program) {
+            fprintf(stderr, "Build error in %s:\n%s\n", path, log);
+            continue;
+        }
+
+        for (const bench_kernel *k = bench_files[f].kernels; k->name; k++) {
+            cl_kernel kernel = clCreateKernel(program, k->name, &err);
+
+            if (err != CL_SUCCESS) {
+                fprintf(stderr, "No kernel %s in %s\n", k->name, path);
+                continue;
+            }
+
+            for (size_t s = 0; s < N_ELEMENTS(bench_sizes); s++) {
+                const bench_size *size = &bench_sizes[s];
+                bench_result *r = &results[n_results];
+
+                if (!size_selected(&opt, size->name))
+                    continue;
+
+                r->file = bench_files[f].file;
+                r->kernel = k->name;
+                r->size = size->name;
+                r->width = size->width;
+                r->height = size->height;
+                r->baseline_us = -1.0;
+
+                if (run_one(context, queue, kernel, k->args, size->width,
+                            size->height, opt.iterations, r) != 0)
+                    continue;
+
+                if (opt.baseline) {
+                    r->baseline_us = baseline_lookup(opt.baseline, device_name,
+                                                     k->name, size->name);
+                    r->regression = r->baseline_us > 0 &&
+                        r->kernel_us > r->baseline_us * (1.0 + opt.tolerance / 100.0);
+                    regressions += r->regression;
+                    unmatched += r->baseline_us < 0;
+                }
+
+                fprintf(stderr, "%-24s %-5s %9.1f us %8.1f MPix/s %6.2f GB/s "
+                        "transfer %9.1f us%s\n",
+                        r->kernel, r->size, r->kernel_us, r->mpix_s, r->gbps,
+                        r->upload_us + r->download_us,
+                        r->regression ? "  REGRESSION" : "");
+                n_results++;
+            }
+
+            clReleaseKernel(kernel);
+        }
+
+        clReleaseProgram(program);
+    }
+
+    /* 3. Report */
+    if (opt.out) {
+        FILE *fp = fopen(opt.out, "w");
+
+        if (!fp) {
+            fprintf(stderr, "Cannot write %s\n", opt.out);
+            return -1;
+        }
+        write_json(fp, device, opt.iterations, results, n_results);
+        fclose(fp);
+    } else {
+        write_json(stdout, device, opt.iterations, results, n_results);
+    }
+
+    if (unmatched)
+        fprintf(stderr, "%d result(s) without an entry for '%s' in %s, "
+                "not compared\n", unmatched, device_name, opt.baseline);
+    if (regressions)
+        fprintf(stderr, "%d regression(s) beyond %.0f%% of %s\n",
+                regressions, opt.tolerance, opt.baseline);
+
+    free(results);
+    clReleaseCommandQueue(queue);
+    clReleaseContext(context);
+
+    return regressions ? 2 : 0;
+}
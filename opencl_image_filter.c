@@ -1,60 +1,1147 @@
 #include <CL/cl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
 #include "load_shader_file.h"
 #include "jpeg_decoder.h"
+#include "image_writer.h"
+#include "ocl_convolve.h"
+#include "ocl_host.h"
+#include "ocl_program_cache.h"
+#include "ocl_worksize.h"
 
 /* function declarations */
 unsigned char *load_jpeg_rgba(const char *, int *, int *);
-void save_ppm(const char *, unsigned char *, int, int);
+unsigned char *load_jpeg_rgba_scaled(const char *, int, int *, int *);
 
 // #define WIDTH  1920
 // #define HEIGHT 1080
 // #define PIXELS (WIDTH * HEIGHT)
 
-int main(int argc, char **argv)
+/* The point-wise filter of devide_by_two.cl run on every image */
+#define FILTER_KERNEL "left_half_grayscale"
+
+#define BATCH_DEFAULT_THREADS 4
+#define BATCH_DEVICE_SLOTS    3 /* images in flight on the device */
+#define BATCH_QUEUE_DEPTH     8 /* images waiting for the device or the disk */
+#define BATCH_WRITER_THREADS  2
+
+/* The filter kernels: per-pixel, and the vload16 row variant. */
+typedef struct {
+    cl_kernel scalar;
+    cl_kernel vec;
+} filter_kernels;
+
+/*
+ * Set the arguments of the filter for an RGBA image in buf and fill in its
+ * NDRange: the row variant when rows are 16-byte aligned, else one
+ * work-item per pixel. Returns the kernel to launch.
+ */
+static cl_kernel filter_setup(const filter_kernels *k, cl_mem *buf,
+                              int width, int height,
+                              cl_uint *dims, size_t global[2])
+{
+    int vec = (width * 4) % 16 == 0;
+    cl_kernel kernel = vec ? k->vec : k->scalar;
+
+    clSetKernelArg(kernel, 0, sizeof(cl_mem), buf);
+    clSetKernelArg(kernel, 1, sizeof(int), &width);
+    clSetKernelArg(kernel, 2, sizeof(int), &((int){vec ? height : width * height}));
+    // clSetKernelArg(kernel, 2, sizeof(char), "10");
+
+    *dims = vec ? 2 : 1;
+    global[0] = vec ? (size_t)(width + 3) / 4 : (size_t)width * height;
+    global[1] = height;
+
+    return kernel;
+}
+
+/*
+ * Run the filter on the RGBA image in imgBuf, with the work-group size
+ * from the table or tuned on a scratch copy.
+ */
+static cl_int run_filter(cl_context context, cl_command_queue queue,
+                         cl_device_id device, const char *cache_dir,
+                         const char *source,
+                         const filter_kernels *kernels, cl_mem *imgBuf,
+                         int width, int height)
+{
+    cl_uint dims;
+    size_t global[2];
+    cl_kernel kernel = filter_setup(kernels, imgBuf, width, height,
+                                    &dims, global);
+    const char *kname = kernel == kernels->vec ? FILTER_KERNEL "_v16"
+                                               : FILTER_KERNEL;
+    printf("Kernel: %s\n", kname);
+
+    /* Work-group size: from the table, else tuned on a scratch copy */
+    size_t local[2] = { 0, 0 };
+    size_t padded[2];
+    unsigned long long ws_key = ocl_ws_key(device, source, kname, dims, global);
+
+    if (ocl_ws_lookup(cache_dir, ws_key, local) == 0) {
+        printf("Work-group size: %zux%zu (table)\n", local[0], local[1]);
+    } else {
+        cl_int err;
+        cl_mem scratch = clCreateBuffer(context, CL_MEM_READ_WRITE,
+                                        (size_t)width * height * 4, NULL, &err);
+        double us;
+
+        clSetKernelArg(kernel, 0, sizeof(cl_mem), &scratch);
+        if (err == CL_SUCCESS &&
+            ocl_ws_tune(queue, kernel, device, dims, global, local, &us) > 0) {
+            ocl_ws_store(cache_dir, ws_key, local, us, kname);
+            printf("Work-group size: %zux%zu (tuned, %.1f us)\n",
+                   local[0], local[1], us);
+        }
+        clSetKernelArg(kernel, 0, sizeof(cl_mem), imgBuf);
+        if (scratch)
+            clReleaseMemObject(scratch);
+    }
+
+    /* Run kernel, global padded to the work-group size */
+    ocl_ws_pad_global(dims, global, local, padded);
+
+    return clEnqueueNDRangeKernel(queue, kernel,
+                                  dims, NULL,
+                                  padded, local[0] ? local : NULL,
+                                  0, NULL, NULL);
+}
+
+/*
+ * Upload the raw 4:2:0 planes of jpeg and convert them to RGBA in imgBuf
+ * on the device. FILTER_KERNEL is fused into the conversion when
+ * devide_by_two.cl has its point-wise form FILTER_KERNEL_px(); *fused
+ * tells whether it was, else the caller still has to run it.
+ */
+static cl_int run_ycbcr(cl_context context, cl_command_queue queue,
+                        cl_device_id device, const char *cache_dir,
+                        jpeg_reader *jpeg, const jpeg_planes *planes,
+                        cl_mem *imgBuf, int width, int height, int *fused)
+{
+    char *filter_src = load_file("devide_by_two.cl");
+    char *ycbcr_src = load_file("ycbcr.cl");
+    char *src, log[4096], options[256] = "";
+    cl_program program = NULL;
+    cl_kernel kernel = NULL;
+    cl_mem planesBuf = NULL;
+    unsigned char *map;
+    int y_stride = planes->y_stride, c_stride = planes->c_stride;
+    int cb_offset = planes->cb_offset, cr_offset = planes->cr_offset;
+    size_t global[2] = { width, height };
+    cl_int err = CL_INVALID_VALUE;
+
+    if (!filter_src || !ycbcr_src) {
+        printf("Failed to load devide_by_two.cl/ycbcr.cl\n");
+        goto out;
+    }
+
+    /* The op comes from devide_by_two.cl, prepended to the conversion */
+    *fused = strstr(filter_src, "uchar4 " FILTER_KERNEL "_px(") != NULL;
+    if (*fused)
+        snprintf(options, sizeof(options), "-DFILTER_PX=%s_px", FILTER_KERNEL);
+
+    src = malloc(strlen(filter_src) + strlen(ycbcr_src) + 2);
+    sprintf(src, "%s\n%s", filter_src, ycbcr_src);
+    program = ocl_cache_build_program(context, device, src, options,
+                                      cache_dir, NULL, log, sizeof(log), &err);
+    free(src);
+    if (!program) {
+        printf("Build error:\n%s\n", log);
+        goto out;
+    }
+
+    kernel = clCreateKernel(program, "ycbcr420_to_rgba", &err);
+    if (err != CL_SUCCESS)
+        goto out;
+
+    /* 1.5 bytes per pixel are decoded straight into the upload mapping */
+    planesBuf = clCreateBuffer(context,
+                               CL_MEM_READ_ONLY | CL_MEM_ALLOC_HOST_PTR,
+                               planes->size, NULL, &err);
+    if (err != CL_SUCCESS)
+        goto out;
+
+    map = clEnqueueMapBuffer(queue, planesBuf, CL_TRUE,
+                             CL_MAP_WRITE_INVALIDATE_REGION,
+                             0, planes->size, 0, NULL, NULL, &err);
+    if (err != CL_SUCCESS)
+        goto out;
+    if (jpeg_reader_read_planes(jpeg, map, planes) != 0)
+        err = CL_INVALID_VALUE;
+    clEnqueueUnmapMemObject(queue, planesBuf, map, 0, NULL, NULL);
+    if (err != CL_SUCCESS)
+        goto out;
+
+    clSetKernelArg(kernel, 0, sizeof(cl_mem), &planesBuf);
+    clSetKernelArg(kernel, 1, sizeof(int), &y_stride);
+    clSetKernelArg(kernel, 2, sizeof(int), &c_stride);
+    clSetKernelArg(kernel, 3, sizeof(int), &cb_offset);
+    clSetKernelArg(kernel, 4, sizeof(int), &cr_offset);
+    clSetKernelArg(kernel, 5, sizeof(cl_mem), imgBuf);
+    clSetKernelArg(kernel, 6, sizeof(int), &width);
+    clSetKernelArg(kernel, 7, sizeof(int), &height);
+
+    err = clEnqueueNDRangeKernel(queue, kernel, 2, NULL, global, NULL,
+                                 0, NULL, NULL);
+    clFinish(queue);
+
+out:
+    if (planesBuf)
+        clReleaseMemObject(planesBuf);
+    if (kernel)
+        clReleaseKernel(kernel);
+    if (program)
+        clReleaseProgram(program);
+    free(filter_src);
+    free(ycbcr_src);
+
+    return err;
+}
+
+/* ================= NEIGHBOURHOOD FILTERS ================= */
+
+/* A separable filter rgba_<name> of convolve.cl, run after the filter. */
+typedef struct {
+    cl_program program;
+    cl_kernel h;
+    cl_kernel v;
+    cl_mem weights;
+    cl_mem tmp; /* float4 per pixel between the passes */
+    size_t tmp_size;
+    size_t local; /* work-group side, see ocl_conv_local() */
+    int radius;
+    float amount;
+} conv_filter;
+
+static void conv_close(conv_filter *c)
 {
-    if (argc < 3) {
-        printf("Usage: %s input.jpg output.ppm\n", argv[0]);
+    if (c->tmp)
+        clReleaseMemObject(c->tmp);
+    if (c->weights)
+        clReleaseMemObject(c->weights);
+    if (c->h)
+        clReleaseKernel(c->h);
+    if (c->v)
+        clReleaseKernel(c->v);
+    if (c->program)
+        clReleaseProgram(c->program);
+    memset(c, 0, sizeof(*c));
+}
+
+/* Build rgba_<name>_h/_v (gaussian, box, unsharp or sobel). */
+static int conv_open(conv_filter *c, cl_context context, cl_device_id device,
+                     const char *cache_dir, const char *name,
+                     int radius, double sigma, float amount)
+{
+    char *src = load_file("convolve.cl");
+    char kname[64], log[4096];
+    cl_int err = CL_INVALID_VALUE;
+
+    memset(c, 0, sizeof(*c));
+    c->radius = radius < 1 ? 1 : radius > OCL_CONV_MAX_RADIUS
+                                 ? OCL_CONV_MAX_RADIUS : radius;
+    c->amount = amount;
+
+    if (!src) {
+        printf("Failed to load convolve.cl\n");
+        return -1;
+    }
+
+    c->program = ocl_cache_build_program(context, device, src, NULL, cache_dir,
+                                         NULL, log, sizeof(log), &err);
+    free(src);
+    if (!c->program) {
+        printf("Build error:\n%s\n", log);
         return -1;
     }
 
+    snprintf(kname, sizeof(kname), "rgba_%s_h", name);
+    c->h = clCreateKernel(c->program, kname, &err);
+    if (err == CL_SUCCESS) {
+        snprintf(kname, sizeof(kname), "rgba_%s_v", name);
+        c->v = clCreateKernel(c->program, kname, &err);
+    }
+    if (err == CL_SUCCESS)
+        c->weights = ocl_conv_create_weights(context, c->radius, sigma, &err);
+    if (err != CL_SUCCESS) {
+        printf("No filter %s in convolve.cl (%d)\n", name, err);
+        conv_close(c);
+        return -1;
+    }
+    c->local = ocl_conv_local(c->h, c->v);
+
+    printf("Filter: rgba_%s, radius %d, %zux%zu work-groups\n", name,
+           c->radius, c->local, c->local);
+    return 0;
+}
+
+/*
+ * Enqueue both passes on the RGBA image in buf after wait; evt (optional)
+ * completes with the vertical pass.
+ */
+static cl_int conv_enqueue(conv_filter *c, cl_context context,
+                           cl_command_queue queue, cl_mem *buf,
+                           int width, int height,
+                           cl_uint n_wait, const cl_event *wait, cl_event *evt)
+{
+    size_t size = (size_t)width * height * sizeof(cl_float4);
+    cl_int err = CL_SUCCESS;
+
+    if (c->tmp_size < size) {
+        if (c->tmp)
+            clReleaseMemObject(c->tmp);
+        c->tmp = clCreateBuffer(context, CL_MEM_READ_WRITE, size, NULL, &err);
+        c->tmp_size = err == CL_SUCCESS ? size : 0;
+        if (err != CL_SUCCESS) {
+            c->tmp = NULL;
+            return err;
+        }
+    }
+
+    err = ocl_conv_set_args(c->h, buf, &c->tmp, width, height, width,
+                            c->radius, &c->weights, c->amount, c->local);
+    if (err == CL_SUCCESS)
+        err = ocl_conv_set_args(c->v, buf, &c->tmp, width, height, width,
+                                c->radius, &c->weights, c->amount, c->local);
+    if (err != CL_SUCCESS)
+        return err;
+
+    return ocl_conv_enqueue(queue, c->h, c->v, c->local, width, height,
+                            n_wait, wait, NULL, evt);
+}
+
+static double now_s(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* ================= HOST MODE ================= */
+
+/*
+ * Filter input into output with the host engine of ocl_host.h, for
+ * machines without a usable OpenCL device.
+ */
+static int run_host(const char *input, const char *output, int scale)
+{
+    ocl_host_chain chain;
+    ocl_host_pool pool;
+    unsigned char *image;
     int width, height;
-    unsigned char *image =
-        load_jpeg_rgba(argv[1], &width, &height);
+    double t0;
+
+    ocl_host_chain_init(&chain);
+    ocl_host_chain_add(&chain, FILTER_KERNEL, 0);
+
+    image = load_jpeg_rgba_scaled(input, scale, &width, &height);
+    if (!image) {
+        printf("Failed to load %s\n", input);
+        return -1;
+    }
+    printf("Image: %dx%d (1/%d)\n", width, height, scale > 1 ? scale : 1);
+
+    ocl_host_pool_start(&pool, (int)sysconf(_SC_NPROCESSORS_ONLN));
+
+    t0 = now_s();
+    ocl_host_run(&pool, &chain, image, width, height, (size_t)width * 4);
+    printf("Host filter: %.3f ms (%s, %d threads)\n",
+           (now_s() - t0) * 1e3, pool.isa, pool.n_threads + 1);
+
+    ocl_host_pool_stop(&pool);
 
-    size_t pixels = width * height;
-    
+    if (image_write(output, image, width, height) != 0) {
+        printf("Failed to write %s\n", output);
+        free(image);
+        return -1;
+    }
+
+    free(image);
+    return 0;
+}
+
+/* ================= TILED MODE ================= */
+
+#define TILE_SLOTS         3          /* strips in flight */
+#define TILE_DEFAULT_BYTES (64 << 20) /* strip size unless --tile-rows */
+
+/* Device buffer of a strip in flight and the download emptying it. */
+typedef struct {
+    cl_mem buf;
+    cl_event read_evt;
+} tile_slot;
+
+/*
+ * Filter in into out strip by strip, for images larger than a device
+ * allocation. Every strip carries halo rows above and below for
+ * neighbourhood kernels, such as conv when set, and only its own rows are
+ * read back. Uploads, kernels and downloads run on separate queues
+ * TILE_SLOTS strips deep, so device memory stays at TILE_SLOTS strips
+ * (plus the float4 intermediate of one strip for conv) whatever the
+ * image size.
+ */
+static int run_tiled(cl_context context, cl_command_queue queue,
+                     cl_device_id device, const filter_kernels *kernels,
+                     conv_filter *conv,
+                     const unsigned char *in, unsigned char *out,
+                     int width, int height, int tile_rows, int halo)
+{
+    size_t row_bytes = (size_t)width * 4;
+    /* conv's intermediate is the largest allocation, 4 floats per pixel */
+    size_t alloc_row = conv ? (size_t)width * sizeof(cl_float4) : row_bytes;
+    cl_ulong max_alloc = 0;
+    cl_command_queue upload = NULL, download = NULL;
+    tile_slot slots[TILE_SLOTS] = { 0 };
+    size_t slot_bytes;
+    int n_strips, ret = -1;
+    double start = now_s();
     cl_int err;
-    cl_uint num_platforms = 0;
-    cl_platform_id platform = NULL;
-    cl_device_id device = NULL;
+
+    clGetDeviceInfo(device, CL_DEVICE_MAX_MEM_ALLOC_SIZE,
+                    sizeof(max_alloc), &max_alloc, NULL);
+
+    if (tile_rows <= 0)
+        tile_rows = TILE_DEFAULT_BYTES / row_bytes;
+    /* A strip and its halo must fit one allocation */
+    if (max_alloc && (tile_rows + 2 * (size_t)halo) * alloc_row > max_alloc)
+        tile_rows = max_alloc / alloc_row - 2 * halo;
+    if (tile_rows < 1) {
+        printf("Rows of %d pixels do not fit a device allocation\n", width);
+        return -1;
+    }
+    if (tile_rows > height)
+        tile_rows = height;
+
+    n_strips = (height + tile_rows - 1) / tile_rows;
+    slot_bytes = (tile_rows + 2 * (size_t)halo) * row_bytes;
+    if (slot_bytes > (size_t)height * row_bytes)
+        slot_bytes = (size_t)height * row_bytes;
+
+    upload = clCreateCommandQueue(context, device, 0, &err);
+    if (err != CL_SUCCESS)
+        goto out;
+    download = clCreateCommandQueue(context, device, 0, &err);
+    if (err != CL_SUCCESS)
+        goto out;
+
+    for (int i = 0; i < TILE_SLOTS && i < n_strips; i++) {
+        slots[i].buf = clCreateBuffer(context, CL_MEM_READ_WRITE,
+                                      slot_bytes, NULL, &err);
+        if (err != CL_SUCCESS)
+            goto out;
+    }
+
+    printf("Tiled: %d strips of %d rows (halo %d), %d x %zu bytes on the device\n",
+           n_strips, tile_rows, halo, n_strips < TILE_SLOTS ? n_strips : TILE_SLOTS,
+           slot_bytes);
+
+    for (int s = 0; s < n_strips; s++) {
+        tile_slot *slot = &slots[s % TILE_SLOTS];
+        int y0 = s * tile_rows;
+        int y1 = y0 + tile_rows < height ? y0 + tile_rows : height;
+        int top = y0 - halo > 0 ? y0 - halo : 0;
+        int bottom = y1 + halo < height ? y1 + halo : height;
+        cl_event write_evt, kernel_evt;
+        cl_kernel kernel;
+        cl_uint dims;
+        size_t global[2];
+
+        /* Refill the buffer once its previous strip is downloaded */
+        err = clEnqueueWriteBuffer(upload, slot->buf, CL_FALSE, 0,
+                                   (bottom - top) * row_bytes,
+                                   in + top * row_bytes,
+                                   slot->read_evt ? 1 : 0,
+                                   slot->read_evt ? &slot->read_evt : NULL,
+                                   &write_evt);
+        if (slot->read_evt) {
+            clReleaseEvent(slot->read_evt);
+            slot->read_evt = NULL;
+        }
+        if (err != CL_SUCCESS)
+            goto out;
+
+        kernel = filter_setup(kernels, &slot->buf, width, bottom - top,
+                              &dims, global);
+        err = clEnqueueNDRangeKernel(queue, kernel, dims, NULL, global, NULL,
+                                     1, &write_evt, conv ? NULL : &kernel_evt);
+        clReleaseEvent(write_evt);
+        if (err == CL_SUCCESS && conv)
+            err = conv_enqueue(conv, context, queue, &slot->buf,
+                               width, bottom - top, 0, NULL, &kernel_evt);
+        if (err != CL_SUCCESS)
+            goto out;
+
+        /* Only the strip's own rows go back */
+        err = clEnqueueReadBuffer(download, slot->buf, CL_FALSE,
+                                  (y0 - top) * row_bytes,
+                                  (y1 - y0) * row_bytes,
+                                  out + y0 * row_bytes,
+                                  1, &kernel_evt, &slot->read_evt);
+        clReleaseEvent(kernel_evt);
+        if (err != CL_SUCCESS)
+            goto out;
+
+        clFlush(upload);
+        clFlush(queue);
+        clFlush(download);
+    }
+
+    err = clFinish(download);
+    if (err == CL_SUCCESS) {
+        printf("Tiled: %dx%d in %.1f ms\n", width, height,
+               (now_s() - start) * 1e3);
+        ret = 0;
+    }
+
+out:
+    if (err != CL_SUCCESS)
+        printf("Tiled processing failed: %d\n", err);
+    if (upload)
+        clFinish(upload);
+    if (download)
+        clFinish(download);
+    clFinish(queue);
+    for (int i = 0; i < TILE_SLOTS; i++) {
+        if (slots[i].read_evt)
+            clReleaseEvent(slots[i].read_evt);
+        if (slots[i].buf)
+            clReleaseMemObject(slots[i].buf);
+    }
+    if (upload)
+        clReleaseCommandQueue(upload);
+    if (download)
+        clReleaseCommandQueue(download);
+
+    return ret;
+}
+
+/* ================= BATCH MODE ================= */
+
+/* One still going through decode -> device -> encode. */
+typedef struct {
+    const char *in_path;
+    char *out_path;
+    cl_mem pinned;     /* decoded RGBA, host memory the upload DMAs from */
+    size_t pinned_size;
+    cl_event unmapped; /* the decode is visible to the device */
+    unsigned char *rgba; /* filtered RGBA read back for the writer */
+    int width;
+    int height;
+} batch_image;
+
+/* A pinned staging buffer waiting for the next decode. */
+typedef struct {
+    cl_mem buf;
+    size_t size;
+} batch_pinned;
+
+/* Bounded FIFO between pipeline stages, closed when its producers finish. */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    batch_image **items;
+    int capacity;
+    int head;
+    int count;
+    int producers;
+} batch_queue;
+
+static void batch_queue_init(batch_queue *q, int capacity, int producers)
+{
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->cond, NULL);
+    q->items = calloc(capacity, sizeof(batch_image *));
+    q->capacity = capacity;
+    q->head = 0;
+    q->count = 0;
+    q->producers = producers;
+}
+
+static void batch_queue_clear(batch_queue *q)
+{
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->cond);
+    free(q->items);
+}
+
+static void batch_queue_push(batch_queue *q, batch_image *img)
+{
+    pthread_mutex_lock(&q->lock);
+    while (q->count == q->capacity)
+        pthread_cond_wait(&q->cond, &q->lock);
+
+    q->items[(q->head + q->count) % q->capacity] = img;
+    q->count++;
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/* Next image, or NULL once every producer is done and the queue is empty. */
+static batch_image *batch_queue_pop(batch_queue *q)
+{
+    batch_image *img = NULL;
+
+    pthread_mutex_lock(&q->lock);
+    while (q->count == 0 && q->producers > 0)
+        pthread_cond_wait(&q->cond, &q->lock);
+
+    if (q->count > 0) {
+        img = q->items[q->head];
+        q->head = (q->head + 1) % q->capacity;
+        q->count--;
+        pthread_cond_broadcast(&q->cond);
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    return img;
+}
+
+static void batch_queue_producer_done(batch_queue *q)
+{
+    pthread_mutex_lock(&q->lock);
+    q->producers--;
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+}
+
+typedef struct {
+    char **inputs;
+    int n_inputs;
+    const char *out_dir;
+    int scale; /* JPEG DCT scaling denominator */
+
+    pthread_mutex_t lock;
+    int next;      /* next input to decode */
+    int failed;
+
+    const char *format; /* output extension */
+
     cl_context context;
-    cl_command_queue queue;
+    cl_command_queue map_queue; /* maps and unmaps of the decode workers */
+    batch_pinned *pinned;       /* free staging buffers, under lock */
+    int n_pinned;
+    int max_pinned;
 
-    err = clGetPlatformIDs(0, NULL, &num_platforms);
-    if (err != CL_SUCCESS || num_platforms == 0) {
-        printf("No OpenCL platforms found\n");
+    batch_queue decoded;
+    image_writer writer;
+} batch_ctx;
+
+static void batch_image_free(batch_image *img)
+{
+    if (img->unmapped)
+        clReleaseEvent(img->unmapped);
+    if (img->pinned)
+        clReleaseMemObject(img->pinned);
+    free(img->rgba);
+    free(img->out_path);
+    free(img);
+}
+
+/* A free staging buffer of at least size bytes, else a new one. */
+static cl_mem batch_pinned_get(batch_ctx *b, size_t size, size_t *buf_size)
+{
+    cl_mem buf = NULL;
+    cl_int err;
+
+    pthread_mutex_lock(&b->lock);
+    for (int i = 0; i < b->n_pinned; i++) {
+        if (b->pinned[i].size < size)
+            continue;
+        buf = b->pinned[i].buf;
+        *buf_size = b->pinned[i].size;
+        b->pinned[i] = b->pinned[--b->n_pinned];
+        break;
+    }
+    pthread_mutex_unlock(&b->lock);
+
+    if (buf)
+        return buf;
+
+    buf = clCreateBuffer(b->context, CL_MEM_READ_ONLY | CL_MEM_ALLOC_HOST_PTR,
+                         size, NULL, &err);
+    if (err != CL_SUCCESS)
+        return NULL;
+
+    *buf_size = size;
+    return buf;
+}
+
+/* Give the staging buffer of img, done uploading, to the next decode. */
+static void batch_pinned_put(batch_ctx *b, batch_image *img)
+{
+    pthread_mutex_lock(&b->lock);
+    if (b->n_pinned < b->max_pinned) {
+        b->pinned[b->n_pinned].buf = img->pinned;
+        b->pinned[b->n_pinned].size = img->pinned_size;
+        b->n_pinned++;
+        img->pinned = NULL;
+    }
+    pthread_mutex_unlock(&b->lock);
+}
+
+/* Count img as failed and drop it. */
+static void batch_fail(batch_ctx *b, batch_image *img)
+{
+    pthread_mutex_lock(&b->lock);
+    b->failed++;
+    pthread_mutex_unlock(&b->lock);
+
+    if (img)
+        batch_image_free(img);
+}
+
+/* Output path: out_dir/<input basename without extension>.<format> */
+static char *batch_out_path(const char *out_dir, const char *in_path,
+                            const char *format)
+{
+    const char *base = strrchr(in_path, '/');
+    const char *dot;
+    size_t len;
+    char *path;
+
+    base = base ? base + 1 : in_path;
+    dot = strrchr(base, '.');
+    len = dot ? (size_t)(dot - base) : strlen(base);
+
+    path = malloc(strlen(out_dir) + len + strlen(format) + 3);
+    sprintf(path, "%s/%.*s.%s", out_dir, (int)len, base, format);
+
+    return path;
+}
+
+/*
+ * Decode img straight into a staging buffer of host memory the device
+ * can DMA from, mapped for writing, so the upload needs no staging copy
+ * of a pageable image by the driver. Returns 0 on success.
+ */
+static int batch_decode(batch_ctx *b, batch_image *img)
+{
+    jpeg_reader r;
+    unsigned char *map;
+    size_t size;
+    cl_int err;
+
+    if (jpeg_reader_open(&r, img->in_path, b->scale) != 0)
+        return -1;
+
+    img->width = r.width;
+    img->height = r.height;
+    size = (size_t)r.width * r.height * 4;
+
+    img->pinned = batch_pinned_get(b, size, &img->pinned_size);
+    if (!img->pinned) {
+        jpeg_reader_close(&r);
         return -1;
     }
-    printf("clGetPlatformIDs Number of platforms: %d\n", num_platforms);
 
-    /* 1. Platform + device */
-    err = clGetPlatformIDs(1, &platform, NULL);
+    map = clEnqueueMapBuffer(b->map_queue, img->pinned, CL_TRUE,
+                             CL_MAP_WRITE_INVALIDATE_REGION, 0, size,
+                             0, NULL, NULL, &err);
     if (err != CL_SUCCESS) {
-        printf("clGetPlatformIDs failed: %d\n", err);
+        jpeg_reader_close(&r);
+        return -1;
+    }
+
+    /* The reader is closed either way */
+    if (jpeg_reader_read(&r, map, (size_t)r.width * 4) != 0)
+        err = CL_INVALID_VALUE;
+
+    if (clEnqueueUnmapMemObject(b->map_queue, img->pinned, map,
+                                0, NULL, &img->unmapped) != CL_SUCCESS)
+        err = CL_INVALID_VALUE;
+    clFlush(b->map_queue);
+
+    return err == CL_SUCCESS ? 0 : -1;
+}
+
+static void *batch_decode_worker(void *data)
+{
+    batch_ctx *b = data;
+
+    for (;;) {
+        batch_image *img;
+        int i;
+
+        pthread_mutex_lock(&b->lock);
+        i = b->next++;
+        pthread_mutex_unlock(&b->lock);
+
+        if (i >= b->n_inputs)
+            break;
+
+        img = calloc(1, sizeof(*img));
+        img->in_path = b->inputs[i];
+        if (batch_decode(b, img) != 0) {
+            printf("Failed to decode %s\n", img->in_path);
+            batch_fail(b, img);
+            continue;
+        }
+        img->out_path = batch_out_path(b->out_dir, img->in_path, b->format);
+
+        batch_queue_push(&b->decoded, img);
+    }
+
+    batch_queue_producer_done(&b->decoded);
+    return NULL;
+}
+
+static int batch_cmp(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/*
+ * Inputs of the batch: the .jpg/.jpeg files of a directory, sorted, or the
+ * paths listed one per line in a file.
+ */
+static char **batch_inputs(const char *src, int *n)
+{
+    char **inputs = NULL;
+    int cap = 0;
+    DIR *dir = opendir(src);
+
+    *n = 0;
+
+    if (dir) {
+        struct dirent *de;
+
+        while ((de = readdir(dir))) {
+            const char *ext = strrchr(de->d_name, '.');
+
+            if (!ext || (strcasecmp(ext, ".jpg") != 0 && strcasecmp(ext, ".jpeg") != 0))
+                continue;
+            if (*n == cap) {
+                cap = cap ? cap * 2 : 256;
+                inputs = realloc(inputs, cap * sizeof(char *));
+            }
+            inputs[*n] = malloc(strlen(src) + strlen(de->d_name) + 2);
+            sprintf(inputs[*n], "%s/%s", src, de->d_name);
+            (*n)++;
+        }
+        closedir(dir);
+        qsort(inputs, *n, sizeof(char *), batch_cmp);
+    } else {
+        char line[4096];
+        FILE *fp = fopen(src, "r");
+
+        if (!fp)
+            return NULL;
+
+        while (fgets(line, sizeof(line), fp)) {
+            line[strcspn(line, "\r\n")] = '\0';
+            if (!line[0] || line[0] == '#')
+                continue;
+            if (*n == cap) {
+                cap = cap ? cap * 2 : 256;
+                inputs = realloc(inputs, cap * sizeof(char *));
+            }
+            inputs[(*n)++] = strdup(line);
+        }
+        fclose(fp);
+    }
+
+    return inputs;
+}
+
+/* Device side of one image: upload, filter and read back for the writer. */
+typedef struct {
+    cl_mem buf;
+    size_t size;
+    batch_image *img;
+    cl_event done;
+} batch_slot;
+
+/* Wait for the image of slot and hand it to the writer. */
+static void batch_slot_finish(batch_ctx *b, batch_slot *slot)
+{
+    if (!slot->img)
+        return;
+
+    if (clWaitForEvents(1, &slot->done) != CL_SUCCESS) {
+        printf("Device failed on %s\n", slot->img->in_path);
+        batch_fail(b, slot->img);
+    } else {
+        /* The upload is done, the staging buffer takes the next decode */
+        batch_pinned_put(b, slot->img);
+
+        /* The writer takes over the pixels */
+        image_writer_submit(&b->writer, slot->img->out_path, slot->img->rgba,
+                            slot->img->width, slot->img->height);
+        slot->img->rgba = NULL;
+        batch_image_free(slot->img);
+    }
+
+    clReleaseEvent(slot->done);
+    slot->done = NULL;
+    slot->img = NULL;
+}
+
+/*
+ * Filter every image of src into out_dir with one context and program.
+ * Decode runs on n_threads workers, into pinned staging buffers recycled
+ * once uploaded, and encode on BATCH_WRITER_THREADS writer threads behind
+ * a bounded queue; the main thread keeps BATCH_DEVICE_SLOTS images on the
+ * in-order queue, so device transfers and kernels overlap with both.
+ */
+static int run_batch(cl_context context, cl_command_queue queue,
+                     const filter_kernels *kernels, const char *src,
+                     const char *out_dir, const char *format,
+                     int n_threads, int scale)
+{
+    batch_slot slots[BATCH_DEVICE_SLOTS] = { 0 };
+    pthread_t *decoders;
+    batch_ctx b = { 0 };
+    batch_image *img;
+    cl_device_id device;
+    int n = 0;
+    double start = now_s(), elapsed;
+    cl_int err;
+
+    b.inputs = batch_inputs(src, &b.n_inputs);
+    if (!b.inputs || b.n_inputs == 0) {
+        printf("No input images in %s\n", src);
+        return -1;
+    }
+    b.out_dir = out_dir;
+    b.scale = scale;
+    b.format = format;
+    if (ocl_cache_mkdir(out_dir) != 0) {
+        printf("Cannot create %s\n", out_dir);
         return -1;
     }
 
-    err = clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, 1, &device, NULL);
+    /* A queue of their own, so maps never wait behind the filter work */
+    b.context = context;
+    clGetCommandQueueInfo(queue, CL_QUEUE_DEVICE, sizeof(device), &device, NULL);
+    b.map_queue = clCreateCommandQueue(context, device, 0, &err);
     if (err != CL_SUCCESS) {
-        printf("clGetDeviceIDs failed: %d\n", err);
+        printf("clCreateCommandQueue failed: %d\n", err);
+        return -1;
+    }
+    b.max_pinned = n_threads + BATCH_QUEUE_DEPTH + BATCH_DEVICE_SLOTS;
+    b.pinned = calloc(b.max_pinned, sizeof(batch_pinned));
+
+    pthread_mutex_init(&b.lock, NULL);
+    batch_queue_init(&b.decoded, BATCH_QUEUE_DEPTH, n_threads);
+    if (image_writer_start(&b.writer, BATCH_WRITER_THREADS, BATCH_QUEUE_DEPTH) != 0) {
+        printf("Cannot start the writer threads\n");
+        return -1;
+    }
+
+    decoders = calloc(n_threads, sizeof(pthread_t));
+    for (int i = 0; i < n_threads; i++)
+        pthread_create(&decoders[i], NULL, batch_decode_worker, &b);
+
+    printf("Batch: %d images, %d decode threads\n", b.n_inputs, n_threads);
+
+    while ((img = batch_queue_pop(&b.decoded))) {
+        batch_slot *slot = &slots[n % BATCH_DEVICE_SLOTS];
+        size_t size = (size_t)img->width * img->height * 4;
+        cl_kernel kernel;
+        cl_uint dims;
+        size_t global[2];
+
+        /* Reuse the oldest slot once its image is back on the host */
+        batch_slot_finish(&b, slot);
+
+        if (slot->size < size) {
+            if (slot->buf)
+                clReleaseMemObject(slot->buf);
+            slot->buf = clCreateBuffer(context, CL_MEM_READ_WRITE, size, NULL, &err);
+            if (err != CL_SUCCESS) {
+                printf("clCreateBuffer(%zu) failed: %d\n", size, err);
+                slot->buf = NULL;
+                slot->size = 0;
+                batch_fail(&b, img);
+                continue;
+            }
+            slot->size = size;
+        }
+
+        img->rgba = malloc(size);
+        if (!img->rgba) {
+            batch_fail(&b, img);
+            continue;
+        }
+
+        /* The host image stays alive until the read completes */
+        kernel = filter_setup(kernels, &slot->buf, img->width, img->height,
+                              &dims, global);
+        err = clEnqueueCopyBuffer(queue, img->pinned, slot->buf, 0, 0, size,
+                                  1, &img->unmapped, NULL);
+        if (err == CL_SUCCESS)
+            err = clEnqueueNDRangeKernel(queue, kernel, dims, NULL, global,
+                                         NULL, 0, NULL, NULL);
+        if (err == CL_SUCCESS)
+            err = clEnqueueReadBuffer(queue, slot->buf, CL_FALSE, 0, size,
+                                      img->rgba, 0, NULL, &slot->done);
+        if (err != CL_SUCCESS) {
+            printf("Enqueue failed on %s: %d\n", img->in_path, err);
+            clFinish(queue);
+            batch_fail(&b, img);
+            continue;
+        }
+        clFlush(queue);
+
+        slot->img = img;
+        n++;
+    }
+
+    /* Drain the device in submission order */
+    for (int i = 0; i < BATCH_DEVICE_SLOTS; i++)
+        batch_slot_finish(&b, &slots[(n + i) % BATCH_DEVICE_SLOTS]);
+
+    for (int i = 0; i < n_threads; i++)
+        pthread_join(decoders[i], NULL);
+    b.failed += image_writer_finish(&b.writer);
+
+    elapsed = now_s() - start;
+    printf("Batch done: %d/%d images in %.2f s, %.1f images/s (%d failed)\n",
+           b.n_inputs - b.failed, b.n_inputs, elapsed,
+           (b.n_inputs - b.failed) / elapsed, b.failed);
+
+    for (int i = 0; i < BATCH_DEVICE_SLOTS; i++)
+        if (slots[i].buf)
+            clReleaseMemObject(slots[i].buf);
+    for (int i = 0; i < b.n_pinned; i++)
+        clReleaseMemObject(b.pinned[i].buf);
+    free(b.pinned);
+    clReleaseCommandQueue(b.map_queue);
+    for (int i = 0; i < b.n_inputs; i++)
+        free(b.inputs[i]);
+    free(b.inputs);
+    free(decoders);
+    batch_queue_clear(&b.decoded);
+    pthread_mutex_destroy(&b.lock);
+
+    return b.failed ? 1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+    /*
+     * --scale N decodes at 1/N (2, 4 or 8) in the DCT domain, --ycbcr
+     * uploads 4:2:0 planes and converts them on the device, --format
+     * picks the batch output (ppm, png or jpg), --tile-rows/--halo force
+     * strip processing (automatic above the device allocation limit),
+     * --conv runs a separable filter of convolve.cl after the filter,
+     * --device picks the OpenCL device type; host, or no device of any
+     * type, filters on the CPU without OpenCL.
+     */
+    int scale = 1, ycbcr = 0, tile_rows = 0, halo = 0, n_args = 1;
+    int radius = 2;
+    double sigma = 0.0, amount = 1.0;
+    const char *format = "ppm", *conv_name = NULL, *device_name = "gpu";
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--scale") == 0 && i + 1 < argc)
+            scale = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--ycbcr") == 0)
+            ycbcr = 1;
+        else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc)
+            format = argv[++i];
+        else if (strcmp(argv[i], "--tile-rows") == 0 && i + 1 < argc)
+            tile_rows = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--halo") == 0 && i + 1 < argc)
+            halo = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--conv") == 0 && i + 1 < argc)
+            conv_name = argv[++i];
+        else if (strcmp(argv[i], "--radius") == 0 && i + 1 < argc)
+            radius = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--sigma") == 0 && i + 1 < argc)
+            sigma = atof(argv[++i]);
+        else if (strcmp(argv[i], "--amount") == 0 && i + 1 < argc)
+            amount = atof(argv[++i]);
+        else if (strcmp(argv[i], "--device") == 0 && i + 1 < argc)
+            device_name = argv[++i];
+        else
+            argv[n_args++] = argv[i];
+    }
+    argc = n_args;
+
+    int batch = argc >= 4 && strcmp(argv[1], "--batch") == 0;
+    int n_threads = BATCH_DEFAULT_THREADS;
+    int known_format = strcmp(format, "ppm") == 0 ||
+                       strcmp(format, "png") == 0 ||
+                       strcmp(format, "jpg") == 0 ||
+                       strcmp(format, "jpeg") == 0;
+
+    if (!known_format)
+        printf("Unknown --format %s\n", format);
+    if (argc < 3 || (strcmp(argv[1], "--batch") == 0 && !batch) || !known_format) {
+        printf("Usage: %s [--scale 1|2|4|8] [--ycbcr] [--tile-rows N] [--halo N]\n"
+               "          [--device gpu|cpu|any|host]\n"
+               "          [--conv gaussian|box|unsharp|sobel [--radius N] [--sigma S] [--amount A]]\n"
+               "          input.jpg output.{ppm,png,jpg}\n"
+               "       %s [--scale 1|2|4|8] [--format ppm|png|jpg] --batch <dir|list.txt> <out-dir> [threads]\n",
+               argv[0], argv[0]);
         return -1;
     }
+    if (batch && argc >= 5 && atoi(argv[4]) > 0)
+        n_threads = atoi(argv[4]);
+
+    cl_int err;
+    cl_uint num_platforms = 0;
+    cl_platform_id platform = NULL;
+    cl_device_id device = NULL;
+    cl_device_type device_type = CL_DEVICE_TYPE_GPU;
+    cl_context context;
+    cl_command_queue queue;
+    int host = strcmp(device_name, "host") == 0;
+
+    if (strcmp(device_name, "cpu") == 0)
+        device_type = CL_DEVICE_TYPE_CPU;
+    else if (strcmp(device_name, "any") == 0)
+        device_type = CL_DEVICE_TYPE_ALL;
+
+    err = host ? CL_DEVICE_NOT_FOUND : clGetPlatformIDs(0, NULL, &num_platforms);
+    if (!host && (err != CL_SUCCESS || num_platforms == 0)) {
+        printf("No OpenCL platforms found\n");
+        host = 1;
+    }
+    if (!host)
+        printf("clGetPlatformIDs Number of platforms: %d\n", num_platforms);
+
+    /* 1. Platform + device, any type when there is no GPU */
+    if (!host) {
+        err = clGetPlatformIDs(1, &platform, NULL);
+        if (err != CL_SUCCESS) {
+            printf("clGetPlatformIDs failed: %d\n", err);
+            return -1;
+        }
+
+        err = clGetDeviceIDs(platform, device_type, 1, &device, NULL);
+        if (err != CL_SUCCESS && device_type == CL_DEVICE_TYPE_GPU) {
+            printf("No OpenCL GPU, trying any device\n");
+            err = clGetDeviceIDs(platform, CL_DEVICE_TYPE_ALL, 1, &device, NULL);
+        }
+        if (err != CL_SUCCESS) {
+            printf("clGetDeviceIDs failed: %d\n", err);
+            host = 1;
+        }
+    }
+
+    /* No OpenCL device: the point filter on the host */
+    if (host) {
+        if (batch || conv_name || ycbcr || tile_rows > 0) {
+            printf("--batch, --conv, --ycbcr and --tile-rows are not "
+                   "supported without OpenCL\n");
+            return -1;
+        }
+        printf("Filtering on the host\n");
+        return run_host(argv[1], argv[2], scale);
+    }
 
     /* 2. Context + queue */
     context = clCreateContext(NULL, 1, &device, NULL, NULL, &err);
-    queue   = clCreateCommandQueue(context, device, 0, &err);
+    queue   = clCreateCommandQueue(context, device,
+                                   CL_QUEUE_PROFILING_ENABLE, &err);
 
     /* 3. Load kernel from file */
     char *kernel_src = load_file("devide_by_two.cl");
@@ -63,72 +1150,187 @@ int main(int argc, char **argv)
         return -1;
     }
 
-    // /* 4. Input image (RGBA) */
+    /* 4. Build program (or load it from the binary cache) */
+    char log[4096];
+    ocl_cache_stats cache_stats = {0};
+    char cache_dir_buf[4096];
+    const char *cache_dir = ocl_cache_default_dir(cache_dir_buf,
+                                                  sizeof(cache_dir_buf));
+    cl_program program =
+        ocl_cache_build_program(context, device, kernel_src, NULL,
+                                cache_dir, &cache_stats,
+                                log, sizeof(log), &err);
+    if (!program) {
+        printf("Build error:\n%s\n", log);
+        return -1;
+    }
+    printf("Program cache: %s\n", cache_stats.hits ? "hit" : "miss");
+
+    /* 5. Kernels: per pixel, and the vload16 row variant */
+    filter_kernels kernels;
+
+    kernels.scalar = clCreateKernel(program, FILTER_KERNEL, &err);
+    kernels.vec = clCreateKernel(program, FILTER_KERNEL "_v16", &err);
+
+    if (batch) {
+        if (conv_name)
+            printf("--conv is not supported in batch mode, ignored\n");
+
+        int ret = run_batch(context, queue, &kernels, argv[2], argv[3],
+                            format, n_threads, scale);
+
+        clReleaseKernel(kernels.scalar);
+        clReleaseKernel(kernels.vec);
+        clReleaseProgram(program);
+        clReleaseCommandQueue(queue);
+        clReleaseContext(context);
+        free(kernel_src);
+
+        return ret;
+    }
+
+    /* 6. Input image header (RGBA output size) */
+    jpeg_reader jpeg;
+    if (jpeg_reader_open(&jpeg, argv[1], scale) != 0) {
+        printf("Failed to load %s\n", argv[1]);
+        return -1;
+    }
+
+    int width = jpeg.width, height = jpeg.height;
+    size_t pixels = (size_t)width * height;
+
     // unsigned char *image = malloc(PIXELS * 4);
     // for (int i = 0; i < PIXELS * 4; i++)
     //     image[i] = 200;   /* dummy gray image */
 
-    /* 5. OpenCL buffer */
+    /* Neighbourhood filter after the point filter */
+    conv_filter conv = { 0 };
+
+    if (conv_name && conv_open(&conv, context, device, cache_dir, conv_name,
+                               radius, sigma, amount) != 0)
+        return -1;
+    /* Strips need the filter's apron */
+    if (conv_name && halo < conv.radius)
+        halo = conv.radius;
+
+    /* Images over one device allocation are filtered in strips */
+    cl_ulong max_alloc = 0;
+    clGetDeviceInfo(device, CL_DEVICE_MAX_MEM_ALLOC_SIZE,
+                    sizeof(max_alloc), &max_alloc, NULL);
+
+    if (tile_rows > 0 || (max_alloc && pixels * 4 > max_alloc)) {
+        unsigned char *in = malloc(pixels * 4);
+        unsigned char *out = malloc(pixels * 4);
+        int ret = -1;
+
+        if (!in || !out || jpeg_reader_read(&jpeg, in, width * 4) != 0) {
+            printf("Failed to decode %s\n", argv[1]);
+            jpeg_reader_close(&jpeg);
+        } else if (run_tiled(context, queue, device, &kernels,
+                             conv_name ? &conv : NULL, in, out,
+                             width, height, tile_rows, halo) == 0) {
+            ret = image_write(argv[2], out, width, height);
+            if (ret != 0)
+                printf("Failed to write %s\n", argv[2]);
+        }
+
+        free(in);
+        free(out);
+        conv_close(&conv);
+        clReleaseKernel(kernels.scalar);
+        clReleaseKernel(kernels.vec);
+        clReleaseProgram(program);
+        clReleaseCommandQueue(queue);
+        clReleaseContext(context);
+        free(kernel_src);
+
+        return ret;
+    }
+
+    /* 4:2:0 input with --ycbcr: raw planes, converted on the device */
+    jpeg_planes planes;
+    int raw = ycbcr && jpeg_reader_raw_420(&jpeg, &planes) == 0;
+
+    if (ycbcr && !raw)
+        printf("Not a full size 4:2:0 JPEG, converting on the CPU\n");
+
+    /* 7. OpenCL buffer, the JPEG is decoded straight into its mapping */
     cl_mem imgBuf = clCreateBuffer(context,
-                                   CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+                                   CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR,
                                    pixels * 4,
-                                   image,
+                                   NULL,
                                    &err);
-
-    /* 6. Build program */
-    cl_program program =
-        clCreateProgramWithSource(context, 1,
-                                  (const char **)&kernel_src, NULL, &err);
-
-    err = clBuildProgram(program, 1, &device, NULL, NULL, NULL);
     if (err != CL_SUCCESS) {
-        char log[4096];
-        clGetProgramBuildInfo(program, device,
-                              CL_PROGRAM_BUILD_LOG,
-                              sizeof(log), log, NULL);
-        printf("Build error:\n%s\n", log);
+        printf("clCreateBuffer failed: %d\n", err);
         return -1;
     }
 
-    /* 7. Kernel */
-    size_t global = width * height;
+    unsigned char *image;
 
-    cl_kernel kernel = clCreateKernel(program, "left_half_grayscale", &err);
+    if (raw) {
+        int fused = 0;
 
-    clSetKernelArg(kernel, 0, sizeof(cl_mem), &imgBuf);
-    clSetKernelArg(kernel, 1, sizeof(int), &((int){width}));
-    clSetKernelArg(kernel, 2, sizeof(int), &global);
-    // clSetKernelArg(kernel, 2, sizeof(char), "10");
+        /* 8-9. Conversion, with the filter fused when it is point-wise */
+        printf("Image: %dx%d YCbCr 4:2:0, %zu bytes uploaded\n",
+               width, height, planes.size);
+        err = run_ycbcr(context, queue, device, cache_dir, &jpeg, &planes,
+                        &imgBuf, width, height, &fused);
+        if (err == CL_SUCCESS && !fused) {
+            printf("No %s_px(), filtering after the conversion\n", FILTER_KERNEL);
+            err = run_filter(context, queue, device, cache_dir, kernel_src,
+                             &kernels, &imgBuf, width, height);
+        }
+    } else {
+        image = clEnqueueMapBuffer(queue, imgBuf, CL_TRUE,
+                                   CL_MAP_WRITE_INVALIDATE_REGION,
+                                   0, pixels * 4, 0, NULL, NULL, &err);
+        if (err != CL_SUCCESS || jpeg_reader_read(&jpeg, image, width * 4) != 0) {
+            printf("Failed to decode %s\n", argv[1]);
+            return -1;
+        }
+        clEnqueueUnmapMemObject(queue, imgBuf, image, 0, NULL, NULL);
+        printf("Image: %dx%d (1/%d)\n", width, height, scale > 1 ? scale : 1);
 
-    /* 8. Run kernel */
-    
-    clEnqueueNDRangeKernel(queue, kernel,
-                           1, NULL,
-                           &global, NULL,
+        /* 8-9. Filter */
+        err = run_filter(context, queue, device, cache_dir, kernel_src,
+                         &kernels, &imgBuf, width, height);
+    }
+    if (err == CL_SUCCESS && conv_name)
+        err = conv_enqueue(&conv, context, queue, &imgBuf, width, height,
                            0, NULL, NULL);
+    if (err != CL_SUCCESS) {
+        printf("Filter failed: %d\n", err);
+        return -1;
+    }
 
     clFinish(queue);
 
-    /* 9. Read result */
-    clEnqueueReadBuffer(queue, imgBuf, CL_TRUE,
-                         0, pixels * 4,
-                         image, 0, NULL, NULL);
+    /* 10. Read result through a mapping */
+    image = clEnqueueMapBuffer(queue, imgBuf, CL_TRUE, CL_MAP_READ,
+                               0, pixels * 4, 0, NULL, NULL, &err);
+    if (err != CL_SUCCESS) {
+        printf("clEnqueueMapBuffer failed: %d\n", err);
+        return -1;
+    }
 
-    /* 10. Verify */
+    /* 11. Verify */
     // printf("Pixel[0]   R=%d\n", image[0]);               // left side
     // printf("Pixel[end] R=%d\n", image[(width-1)*4]);     // right side
 
-    save_ppm(argv[2], image, width, height);
+    if (image_write(argv[2], image, width, height) != 0)
+        printf("Failed to write %s\n", argv[2]);
 
-    /* 11. Cleanup */
+    /* 12. Cleanup */
+    clEnqueueUnmapMemObject(queue, imgBuf, image, 0, NULL, NULL);
+    clFinish(queue);
     clReleaseMemObject(imgBuf);
-    clReleaseKernel(kernel);
+    conv_close(&conv);
+    clReleaseKernel(kernels.scalar);
+    clReleaseKernel(kernels.vec);
     clReleaseProgram(program);
     clReleaseCommandQueue(queue);
     clReleaseContext(context);
-    free(image);
     free(kernel_src);
 
     return 0;
 }
-
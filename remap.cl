@@ -0,0 +1,115 @@
+/*
+ * Fisheye undistortion with the camera models of common.h, which the
+ * oscaroclremap element prepends to this file. The source camera model is
+ * a build option, its parameters are arguments of remap_lut (see
+ * common.h); the output is a pinhole camera of the source size.
+ *
+ * remap_lut runs once per caps and stores, for every output pixel, the
+ * source coordinate it samples, or -1 where the ray misses the source.
+ * remap_yuv420 runs every frame: a work-item gathers a 2x2 block of luma
+ * and the chroma sample of the block, bilinearly. chroma_step is 2 for
+ * the interleaved UV plane of NV12 (offset2 = offset1 + 1), 1 for I420.
+ */
+
+__kernel void remap_lut(__global float2 *lut,
+                        int width,
+                        int height,
+                        float4 out_params, /* (u0, v0, fu, fv) */
+                        float4 intrinsics, /* of the source camera */
+                        float4 model)
+{
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+
+    if (x >= width || y >= height)
+        return;
+
+    float3 ray = unproject(out_params, (float2)(x, y));
+    float2 src = camera_project(intrinsics, model, ray);
+
+    if (!(camera_kappa(model, ray) > 0.0f) || any(src < (float2)(0.0f)) ||
+        any(src > (float2)(width - 1, height - 1)))
+        src = (float2)(-1.0f);
+
+    lut[y * width + x] = src;
+}
+
+/* Bilinear sample at xy of a w x h plane, step bytes between samples. */
+float remap_sample(__global const uchar *p, int stride, int step,
+                   int w, int h, float2 xy)
+{
+    xy = clamp(xy, (float2)(0.0f), (float2)(w - 1, h - 1));
+
+    float2 f = floor(xy);
+    float2 a = xy - f;
+    int2 i = convert_int2(f);
+    int2 j = min(i + 1, (int2)(w - 1, h - 1));
+
+    float t = mix((float)p[i.y * stride + i.x * step],
+                  (float)p[i.y * stride + j.x * step], a.x);
+    float b = mix((float)p[j.y * stride + i.x * step],
+                  (float)p[j.y * stride + j.x * step], a.x);
+
+    return mix(t, b, a.y);
+}
+
+__kernel void remap_yuv420(__global const uchar *src,
+                           __global uchar *dst,
+                           __global const float2 *lut,
+                           int width,
+                           int height,
+                           int stride,
+                           int offset1,
+                           int stride1,
+                           int offset2,
+                           int stride2,
+                           int chroma_step)
+{
+    int cx = get_global_id(0);
+    int cy = get_global_id(1);
+    int cw = (width + 1) / 2;
+    int ch = (height + 1) / 2;
+    float2 sum = (float2)(0.0f);
+    int n = 0;
+
+    if (cx >= cw || cy >= ch)
+        return;
+
+    for (int dy = 0; dy < 2; dy++) {
+        for (int dx = 0; dx < 2; dx++) {
+            int x = 2 * cx + dx;
+            int y = 2 * cy + dy;
+            float2 s;
+
+            if (x >= width || y >= height)
+                continue;
+
+            s = lut[y * width + x];
+            if (s.x < 0.0f) {
+                dst[y * stride + x] = 16; /* black outside the source */
+                continue;
+            }
+
+            dst[y * stride + x] =
+                convert_uchar_sat_rte(remap_sample(src, stride, 1,
+                                                   width, height, s));
+            sum += s;
+            n++;
+        }
+    }
+
+    uchar u = 128, v = 128;
+
+    if (n) {
+        /* Chroma sample c sits at luma 2c + 0.5 */
+        float2 c = (sum / n - 0.5f) * 0.5f;
+
+        u = convert_uchar_sat_rte(remap_sample(src + offset1, stride1,
+                                               chroma_step, cw, ch, c));
+        v = convert_uchar_sat_rte(remap_sample(src + offset2, stride2,
+                                               chroma_step, cw, ch, c));
+    }
+
+    dst[offset1 + cy * stride1 + cx * chroma_step] = u;
+    dst[offset2 + cy * stride2 + cx * chroma_step] = v;
+}
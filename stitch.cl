@@ -0,0 +1,159 @@
+/*
+ * Equirectangular panorama of N fisheye cameras of one size and format,
+ * on the camera models of common.h, which the oscaroclstitch element
+ * prepends to this file. The program of each camera is built with its
+ * intrinsics (see common.h), with YUV defined for UYVY, else frames are
+ * GRAY8.
+ *
+ * Frames and weight maps of all cameras follow each other in one buffer
+ * each, frame_pixels apart, tightly packed (SRC_COLS pixels per row); the
+ * LUTs of the cameras follow each other, width x height float2 apart.
+ * stitch_weights and stitch_lut run once per caps or camera change, from
+ * the program of their camera. stitch_blend runs once per frame for all
+ * cameras; it only depends on the frame size, common to the programs.
+ */
+
+/*
+ * Weight of the source pixels: 1 at the optical center, down to 0 on the
+ * largest circle around it inside the frame, where fisheye images end.
+ */
+__kernel void stitch_weights(__global float *weights,
+                             int frame_pixels,
+                             int camera)
+{
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+
+    if (x >= SRC_COLS || y >= SRC_ROWS)
+        return;
+
+    float2 edge = min(OPTICAL_CENTER, MAX_SRC_COORDINATE - OPTICAL_CENTER);
+    float radius = max(min(edge.x, edge.y), 1.0f);
+    float d = distance((float2)(x, y), OPTICAL_CENTER);
+
+    weights[camera * frame_pixels + y * SRC_COLS + x] =
+        clamp(1.0f - d / radius, 0.0f, 1.0f);
+}
+
+/*
+ * Source coordinate of every panorama pixel in the camera, -1 where the
+ * camera does not see it. r0..r2 are the rows of the rotation from the
+ * panorama to the camera (x right, y down, z forward).
+ */
+__kernel void stitch_lut(__global float2 *luts,
+                         int width,
+                         int height,
+                         int camera,
+                         float4 r0,
+                         float4 r1,
+                         float4 r2)
+{
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+
+    if (x >= width || y >= height)
+        return;
+
+    float lon = ((x + 0.5f) / width - 0.5f) * 2.0f * M_PI_F;
+    float lat = (0.5f - (y + 0.5f) / height) * M_PI_F;
+    float3 dir = (float3)(cos(lat) * sin(lon), -sin(lat), cos(lat) * cos(lon));
+    float3 ray = (float3)(dot(r0.xyz, dir), dot(r1.xyz, dir), dot(r2.xyz, dir));
+    float2 src = project(ray);
+
+    if (!(kappa_(ray) > 0.0f) || any(src < (float2)(0.0f)) ||
+        any(src > MAX_SRC_COORDINATE))
+        src = (float2)(-1.0f);
+
+    luts[camera * width * height + y * width + x] = src;
+}
+
+#ifdef YUV
+/* (U, V, Y) of the camera at xy times the warped weight, and the weight. */
+float4 stitch_sample(__global uchar *frame, __global float *weights, float2 xy)
+{
+    if (xy.x < 0.0f)
+        return (float4)(0.0f);
+
+    float4 s = interpolate(frame, weights, xy);
+
+    return (float4)(s.xyz * s.w, s.w);
+}
+#else
+/* Value of the camera at xy times the warped weight, and the weight. */
+float2 stitch_sample(__global uchar *frame, __global float *weights, float2 xy)
+{
+    if (xy.x < 0.0f)
+        return (float2)(0.0f);
+
+    float2 s = interpolate(frame, weights, xy);
+
+    return (float2)(s.x * s.y, s.y);
+}
+#endif
+
+/* Cameras whose bit is clear in mask have no frame for this output. */
+__kernel void stitch_blend(__global uchar *frames,
+                           __global float *weights,
+                           __global const float2 *luts,
+                           int frame_pixels,
+                           int n_cameras,
+                           uint mask,
+                           __global uchar *dst,
+                           int width,
+                           int height,
+                           int stride)
+{
+    const float eps = 1e-6f;
+#ifdef YUV
+    /* One UYVY macro-pixel: two luma samples, one chroma pair */
+    int x = get_global_id(0) * 2;
+    int y = get_global_id(1);
+
+    if (x >= width || y >= height)
+        return;
+
+    float4 a0 = (float4)(0.0f);
+    float4 a1 = (float4)(0.0f);
+
+    for (int c = 0; c < n_cameras; c++) {
+        __global uchar *frame = frames + (size_t)c * frame_pixels * 2;
+        __global float *w = weights + (size_t)c * frame_pixels;
+        __global const float2 *lut = luts + ((size_t)c * height + y) * width + x;
+
+        if (!(mask & (1u << c)))
+            continue;
+
+        a0 += stitch_sample(frame, w, lut[0]);
+        if (x + 1 < width)
+            a1 += stitch_sample(frame, w, lut[1]);
+    }
+
+    __global uchar *p = dst + y * stride + x * 2;
+    float wsum = a0.w + a1.w;
+    float2 uv = wsum > eps ? (a0.xy + a1.xy) / wsum : (float2)(128.0f);
+
+    p[0] = convert_uchar_sat_rte(uv.x);
+    p[1] = a0.w > eps ? convert_uchar_sat_rte(a0.z / a0.w) : 16;
+    p[2] = convert_uchar_sat_rte(uv.y);
+    p[3] = a1.w > eps ? convert_uchar_sat_rte(a1.z / a1.w) : 16;
+#else
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+
+    if (x >= width || y >= height)
+        return;
+
+    float2 a = (float2)(0.0f);
+
+    for (int c = 0; c < n_cameras; c++) {
+        if (!(mask & (1u << c)))
+            continue;
+
+        a += stitch_sample(frames + (size_t)c * frame_pixels,
+                           weights + (size_t)c * frame_pixels,
+                           luts[((size_t)c * height + y) * width + x]);
+    }
+
+    dst[y * stride + x] = a.y > eps ? convert_uchar_sat_rte(a.x / a.y) : 0;
+#endif
+}
@@ -0,0 +1,66 @@
+/*
+ * JPEG YCbCr 4:2:0 planes to RGBA, the upsampling and colour conversion
+ * libjpeg would otherwise do on the CPU.
+ *
+ * planes holds Y (y_stride bytes per row), then Cb and Cr at cb_offset and
+ * cr_offset (c_stride bytes per row, half height). Chroma is upsampled with
+ * the same triangle filter as libjpeg's fancy upsampling, and converted
+ * with the JFIF equations. Build with -DFILTER_PX=K_px to apply a
+ * point-wise op of devide_by_two.cl (prepended to this source) to every
+ * pixel before it is stored.
+ */
+
+#ifndef FILTER_PX
+#define FILTER_PX(p, x, y, width) (p)
+#endif
+
+float ycbcr_chroma(__global const uchar *plane, int c_stride,
+                   float cx, float cy, int cw, int ch)
+{
+    cx = clamp(cx, 0.0f, (float)(cw - 1));
+    cy = clamp(cy, 0.0f, (float)(ch - 1));
+
+    int x0 = (int)cx, y0 = (int)cy;
+    int x1 = min(x0 + 1, cw - 1), y1 = min(y0 + 1, ch - 1);
+    float ax = cx - x0, ay = cy - y0;
+
+    float top = mix((float)plane[y0 * c_stride + x0],
+                    (float)plane[y0 * c_stride + x1], ax);
+    float bot = mix((float)plane[y1 * c_stride + x0],
+                    (float)plane[y1 * c_stride + x1], ax);
+
+    return mix(top, bot, ay);
+}
+
+__kernel void ycbcr420_to_rgba(__global const uchar *planes,
+                               int y_stride,
+                               int c_stride,
+                               int cb_offset,
+                               int cr_offset,
+                               __global uchar4 *rgba,
+                               int width,
+                               int height)
+{
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+
+    if (x >= width || y >= height)
+        return;
+
+    int cw = (width + 1) / 2, ch = (height + 1) / 2;
+
+    /* Chroma samples sit between two luma columns and rows */
+    float cx = (x + 0.5f) * 0.5f - 0.5f;
+    float cy = (y + 0.5f) * 0.5f - 0.5f;
+
+    float Y  = planes[y * y_stride + x];
+    float cb = ycbcr_chroma(planes + cb_offset, c_stride, cx, cy, cw, ch) - 128.0f;
+    float cr = ycbcr_chroma(planes + cr_offset, c_stride, cx, cy, cw, ch) - 128.0f;
+
+    uchar4 p = (uchar4)(convert_uchar_sat_rte(Y + 1.402f * cr),
+                        convert_uchar_sat_rte(Y - 0.344136f * cb - 0.714136f * cr),
+                        convert_uchar_sat_rte(Y + 1.772f * cb),
+                        255);
+
+    rgba[y * width + x] = FILTER_PX(p, x, y, width);
+}